@@ -2,10 +2,321 @@ import tkinter as tk
 from tkinter import ttk, messagebox, filedialog
 import sqlite3
 import csv
-from datetime import datetime
+from datetime import date, datetime, timezone
 import os
 from PIL import Image, ImageTk  # For icons if needed
 
+# Numbered schema changes, shared with the console program
+# (kernel/hospital_billing.c, migrations[]). PRAGMA user_version holds the
+# number of the last one applied, and either program may upgrade a
+# database: keep the two lists identical and only ever append.
+MIGRATIONS = [
+    (1, "baseline schema", """
+        CREATE TABLE IF NOT EXISTS users (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            username TEXT UNIQUE NOT NULL,
+            password TEXT NOT NULL,
+            role TEXT DEFAULT 'staff',
+            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+        );
+        
+        CREATE TABLE IF NOT EXISTS patients (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            name TEXT NOT NULL COLLATE NOCASE,
+            age INTEGER,
+            gender TEXT,
+            contact TEXT,
+            address TEXT,
+            disease TEXT,
+            admission_date DATE DEFAULT CURRENT_DATE,
+            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+        );
+        
+        CREATE TABLE IF NOT EXISTS bills (
+            bill_no INTEGER PRIMARY KEY AUTOINCREMENT,
+            patient_id INTEGER,
+            patient_name TEXT,
+            bill_date DATE DEFAULT CURRENT_DATE,
+            room_charges REAL DEFAULT 0,
+            doctor_fees REAL DEFAULT 0,
+            medicine_charges REAL DEFAULT 0,
+            lab_charges REAL DEFAULT 0,
+            other_charges REAL DEFAULT 0,
+            total_amount REAL DEFAULT 0,
+            amount_paid REAL DEFAULT 0,
+            balance_due REAL DEFAULT 0,
+            payment_status TEXT DEFAULT 'Pending',
+            payment_method TEXT,
+            FOREIGN KEY (patient_id) REFERENCES patients(id) ON DELETE CASCADE
+        );
+        
+        CREATE TABLE IF NOT EXISTS payments (
+            payment_id INTEGER PRIMARY KEY AUTOINCREMENT,
+            bill_no INTEGER,
+            amount REAL,
+            payment_date TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+            payment_method TEXT,
+            FOREIGN KEY (bill_no) REFERENCES bills(bill_no) ON DELETE CASCADE
+        );
+        
+        CREATE TABLE IF NOT EXISTS bill_items (
+            item_id INTEGER PRIMARY KEY AUTOINCREMENT,
+            bill_no INTEGER NOT NULL,
+            code TEXT NOT NULL,
+            description TEXT,
+            category TEXT DEFAULT 'Other',
+            quantity INTEGER DEFAULT 1,
+            unit_price REAL DEFAULT 0,
+            line_total REAL DEFAULT 0,
+            FOREIGN KEY (bill_no) REFERENCES bills(bill_no) ON DELETE CASCADE
+        );
+        
+        CREATE INDEX IF NOT EXISTS idx_bill_items_bill ON bill_items(bill_no);
+        
+        CREATE TABLE IF NOT EXISTS charge_master (
+            code TEXT PRIMARY KEY,
+            description TEXT NOT NULL,
+            price REAL NOT NULL DEFAULT 0,
+            category TEXT DEFAULT 'Other'
+        );
+        
+        CREATE TABLE IF NOT EXISTS charge_master_meta (
+            id INTEGER PRIMARY KEY CHECK (id = 1),
+            revision INTEGER NOT NULL DEFAULT 0
+        );
+        INSERT OR IGNORE INTO charge_master_meta (id, revision) VALUES (1, 0);
+        
+        CREATE TRIGGER IF NOT EXISTS trg_charge_master_ins AFTER INSERT ON charge_master
+        BEGIN UPDATE charge_master_meta SET revision = revision + 1 WHERE id = 1; END;
+        CREATE TRIGGER IF NOT EXISTS trg_charge_master_upd AFTER UPDATE ON charge_master
+        BEGIN UPDATE charge_master_meta SET revision = revision + 1 WHERE id = 1; END;
+        CREATE TRIGGER IF NOT EXISTS trg_charge_master_del AFTER DELETE ON charge_master
+        BEGIN UPDATE charge_master_meta SET revision = revision + 1 WHERE id = 1; END;
+        
+        CREATE TABLE IF NOT EXISTS schema_migrations (
+            version INTEGER PRIMARY KEY,
+            description TEXT,
+            applied_by TEXT,
+            applied_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+        );
+        
+        INSERT OR IGNORE INTO users (username, password, role)
+        VALUES ('admin', 'admin123', 'admin'),
+               ('staff', 'staff123', 'staff');
+    """),
+    
+    # Databases created before migrations differ by front end: the console
+    # program's users table has no created_at and the GUI's patients.name is
+    # case sensitive. Rebuild both tables in the shared form, keeping ids,
+    # rows and AUTOINCREMENT counters.
+    (2, "align users and patients between console and GUI", """
+        CREATE TEMP TABLE saved_sequence AS
+            SELECT name, seq FROM sqlite_sequence WHERE name IN ('users', 'patients');
+        
+        CREATE TABLE users_new (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            username TEXT UNIQUE NOT NULL,
+            password TEXT NOT NULL,
+            role TEXT DEFAULT 'staff',
+            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+        );
+        -- created_at resolves to the old column when it exists and to the
+        -- fallback's otherwise
+        INSERT INTO users_new (id, username, password, role, created_at)
+            SELECT u.id, u.username, u.password, u.role,
+                   (SELECT created_at FROM users AS old WHERE old.id = u.id)
+            FROM (SELECT CURRENT_TIMESTAMP AS created_at) AS fallback, users AS u;
+        DROP TABLE users;
+        ALTER TABLE users_new RENAME TO users;
+        
+        CREATE TABLE patients_new (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            name TEXT NOT NULL COLLATE NOCASE,
+            age INTEGER,
+            gender TEXT,
+            contact TEXT,
+            address TEXT,
+            disease TEXT,
+            admission_date DATE DEFAULT CURRENT_DATE,
+            created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+        );
+        INSERT INTO patients_new (id, name, age, gender, contact, address, disease, admission_date, created_at)
+            SELECT id, name, age, gender, contact, address, disease, admission_date, created_at FROM patients;
+        DROP TABLE patients;
+        ALTER TABLE patients_new RENAME TO patients;
+        
+        DELETE FROM sqlite_sequence WHERE name IN (SELECT name FROM temp.saved_sequence);
+        INSERT INTO sqlite_sequence (name, seq) SELECT name, seq FROM temp.saved_sequence;
+        DROP TABLE temp.saved_sequence;
+    """),
+    
+    # Dates become integer Julian day numbers and timestamps Unix seconds
+    # (both UTC, like CURRENT_DATE/CURRENT_TIMESTAMP before them), so date
+    # filters compare integers and resolve as range scans on the new
+    # indexes. Text only appears where dates are entered or displayed.
+    (3, "store dates as Julian day numbers and timestamps as Unix seconds", """
+        CREATE TEMP TABLE saved_sequence AS
+            SELECT name, seq FROM sqlite_sequence WHERE name IN ('patients', 'bills', 'payments');
+        
+        CREATE TABLE patients_new (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            name TEXT NOT NULL COLLATE NOCASE,
+            age INTEGER,
+            gender TEXT,
+            contact TEXT,
+            address TEXT,
+            disease TEXT,
+            admission_date INTEGER DEFAULT (CAST(julianday('now') + 0.5 AS INTEGER)),
+            created_at INTEGER DEFAULT (CAST(strftime('%s', 'now') AS INTEGER))
+        );
+        INSERT INTO patients_new (id, name, age, gender, contact, address, disease, admission_date, created_at)
+            SELECT id, name, age, gender, contact, address, disease,
+                   CAST(julianday(admission_date) + 0.5 AS INTEGER),
+                   CAST(strftime('%s', created_at) AS INTEGER) FROM patients;
+        DROP TABLE patients;
+        ALTER TABLE patients_new RENAME TO patients;
+        
+        CREATE TABLE bills_new (
+            bill_no INTEGER PRIMARY KEY AUTOINCREMENT,
+            patient_id INTEGER,
+            patient_name TEXT,
+            bill_date INTEGER DEFAULT (CAST(julianday('now') + 0.5 AS INTEGER)),
+            room_charges REAL DEFAULT 0,
+            doctor_fees REAL DEFAULT 0,
+            medicine_charges REAL DEFAULT 0,
+            lab_charges REAL DEFAULT 0,
+            other_charges REAL DEFAULT 0,
+            total_amount REAL DEFAULT 0,
+            amount_paid REAL DEFAULT 0,
+            balance_due REAL DEFAULT 0,
+            payment_status TEXT DEFAULT 'Pending',
+            payment_method TEXT,
+            FOREIGN KEY (patient_id) REFERENCES patients(id) ON DELETE CASCADE
+        );
+        INSERT INTO bills_new SELECT bill_no, patient_id, patient_name,
+            CAST(julianday(bill_date) + 0.5 AS INTEGER), room_charges, doctor_fees,
+            medicine_charges, lab_charges, other_charges, total_amount, amount_paid,
+            balance_due, payment_status, payment_method FROM bills;
+        DROP TABLE bills;
+        ALTER TABLE bills_new RENAME TO bills;
+        
+        CREATE TABLE payments_new (
+            payment_id INTEGER PRIMARY KEY AUTOINCREMENT,
+            bill_no INTEGER,
+            amount REAL,
+            payment_date INTEGER DEFAULT (CAST(strftime('%s', 'now') AS INTEGER)),
+            payment_method TEXT,
+            FOREIGN KEY (bill_no) REFERENCES bills(bill_no) ON DELETE CASCADE
+        );
+        INSERT INTO payments_new SELECT payment_id, bill_no, amount,
+            CAST(strftime('%s', payment_date) AS INTEGER), payment_method FROM payments;
+        DROP TABLE payments;
+        ALTER TABLE payments_new RENAME TO payments;
+        
+        CREATE INDEX idx_patients_admission ON patients(admission_date);
+        CREATE INDEX idx_bills_date ON bills(bill_date);
+        CREATE INDEX idx_payments_date ON payments(payment_date);
+        
+        DELETE FROM sqlite_sequence WHERE name IN (SELECT name FROM temp.saved_sequence);
+        INSERT INTO sqlite_sequence (name, seq) SELECT name, seq FROM temp.saved_sequence;
+        DROP TABLE temp.saved_sequence;
+    """),
+    
+    # Covering index over open bills only, in patient order, for the aging
+    # report; paid bills drop out of it as their balance reaches zero
+    (4, "index open balances by patient", """
+        CREATE INDEX idx_bills_open ON bills(patient_id, bill_date, balance_due)
+            WHERE balance_due > 0;
+    """),
+    
+    # Persisted t-digest / HyperLogLog sketches for the statistics screen and
+    # the last bill and patient id already folded into them
+    (5, "add statistics sketches", """
+        CREATE TABLE stat_sketches (
+            name TEXT PRIMARY KEY,
+            data BLOB NOT NULL,
+            updated_at INTEGER DEFAULT (CAST(strftime('%s', 'now') AS INTEGER))
+        );
+        CREATE TABLE stat_watermarks (
+            source TEXT PRIMARY KEY,
+            last_id INTEGER NOT NULL DEFAULT 0
+        );
+    """),
+    
+    # Discharge day (Julian day number, NULL while in house) for the census
+    (6, "add patient discharge dates", """
+        ALTER TABLE patients ADD COLUMN discharge_date INTEGER;
+        CREATE INDEX idx_patients_discharge ON patients(discharge_date);
+    """),
+    
+    # Per-patient history in date order and payments by bill, so the
+    # statement run reads a patient range with one ordered scan
+    (7, "index bills by patient and payments by bill", """
+        CREATE INDEX idx_bills_patient ON bills(patient_id, bill_date);
+        CREATE INDEX idx_payments_bill ON payments(bill_no);
+    """),
+]
+
+SCHEMA_VERSION = len(MIGRATIONS)
+
+
+def split_sql(script):
+    """Split a script into single statements; trigger bodies contain ';'
+    so pieces are joined until sqlite3 reports a complete statement"""
+    statements, current = [], ""
+    for piece in script.split(";"):
+        current += piece + ";"
+        if sqlite3.complete_statement(current):
+            if current.strip(" \n;"):
+                statements.append(current.strip())
+            current = ""
+    return statements
+
+
+# Dates are stored as Julian day numbers and timestamps as Unix seconds
+# (UTC); these convert at the edges, where values are entered or shown.
+JULIAN_DAY_OFFSET = 1721425  # Julian day number minus date.toordinal()
+
+DATE_COLUMNS = {'admission_date', 'bill_date', 'discharge_date'}
+PATIENT_LIST_COLUMNS = ('id', 'name', 'age', 'gender', 'contact', 'admission_date')
+TIMESTAMP_COLUMNS = {'created_at', 'payment_date'}
+
+
+def to_julian_day(value):
+    """Julian day number for a date or 'YYYY-MM-DD' (ValueError if invalid)"""
+    if isinstance(value, str):
+        value = datetime.strptime(value, '%Y-%m-%d').date()
+    return value.toordinal() + JULIAN_DAY_OFFSET
+
+
+def today_utc():
+    """Today's date in UTC, the day julianday('now') and the C side use"""
+    return datetime.now(timezone.utc).date()
+
+
+def format_day(day):
+    """'YYYY-MM-DD' for a stored Julian day number"""
+    if day is None:
+        return ''
+    return date.fromordinal(day - JULIAN_DAY_OFFSET).isoformat()
+
+
+def format_timestamp(seconds):
+    """'YYYY-MM-DD HH:MM:SS' (UTC) for stored Unix seconds"""
+    if seconds is None:
+        return ''
+    return datetime.fromtimestamp(seconds, timezone.utc).strftime('%Y-%m-%d %H:%M:%S')
+
+
+def format_dates(column_names, rows):
+    """Rows with their stored date and timestamp columns shown as text"""
+    converters = [format_day if name in DATE_COLUMNS else
+                  format_timestamp if name in TIMESTAMP_COLUMNS else None
+                  for name in column_names]
+    return [tuple(convert(value) if convert else value
+                  for convert, value in zip(converters, row))
+            for row in rows]
+
 class HospitalBillingSystem:
     def __init__(self, root):
         self.root = root
@@ -64,74 +375,55 @@ class HospitalBillingSystem:
     def init_database(self):
         """Initialize SQLite database"""
         self.conn = sqlite3.connect('hospital.db', check_same_thread=False)
-        self.conn.execute("PRAGMA foreign_keys = ON")
         self.conn.execute("PRAGMA encoding = 'UTF-8'")
         self.cursor = self.conn.cursor()
         
-        # Create tables
-        self.cursor.execute('''
-            CREATE TABLE IF NOT EXISTS users (
-                id INTEGER PRIMARY KEY AUTOINCREMENT,
-                username TEXT UNIQUE NOT NULL,
-                password TEXT NOT NULL,
-                role TEXT DEFAULT 'staff',
-                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
-            )
-        ''')
-        
-        self.cursor.execute('''
-            CREATE TABLE IF NOT EXISTS patients (
-                id INTEGER PRIMARY KEY AUTOINCREMENT,
-                name TEXT NOT NULL,
-                age INTEGER,
-                gender TEXT,
-                contact TEXT,
-                address TEXT,
-                disease TEXT,
-                admission_date DATE DEFAULT CURRENT_DATE,
-                created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
-            )
-        ''')
-        
-        self.cursor.execute('''
-            CREATE TABLE IF NOT EXISTS bills (
-                bill_no INTEGER PRIMARY KEY AUTOINCREMENT,
-                patient_id INTEGER,
-                patient_name TEXT,
-                bill_date DATE DEFAULT CURRENT_DATE,
-                room_charges REAL DEFAULT 0,
-                doctor_fees REAL DEFAULT 0,
-                medicine_charges REAL DEFAULT 0,
-                lab_charges REAL DEFAULT 0,
-                other_charges REAL DEFAULT 0,
-                total_amount REAL DEFAULT 0,
-                amount_paid REAL DEFAULT 0,
-                balance_due REAL DEFAULT 0,
-                payment_status TEXT DEFAULT 'Pending',
-                payment_method TEXT,
-                FOREIGN KEY (patient_id) REFERENCES patients(id) ON DELETE CASCADE
-            )
-        ''')
-        
-        self.cursor.execute('''
-            CREATE TABLE IF NOT EXISTS payments (
-                payment_id INTEGER PRIMARY KEY AUTOINCREMENT,
-                bill_no INTEGER,
-                amount REAL,
-                payment_date TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-                payment_method TEXT,
-                FOREIGN KEY (bill_no) REFERENCES bills(bill_no) ON DELETE CASCADE
-            )
-        ''')
+        # Create or upgrade tables; a current database runs no DDL at all
+        try:
+            self.run_migrations()
+        except sqlite3.Error as e:
+            messagebox.showerror("Database Error", f"Schema upgrade failed: {e}")
+        self.conn.execute("PRAGMA foreign_keys = ON")
         
-        # Insert default users if not exists
-        self.cursor.execute('''
-            INSERT OR IGNORE INTO users (username, password, role) 
-            VALUES ('admin', 'admin123', 'admin'),
-                   ('staff', 'staff123', 'staff')
-        ''')
+        # Optional in-memory copy of the database that report screens read
+        # from, so heavy report queries do not hold read locks while
+        # cashiers are writing. Enable with HOSPITAL_REPORT_REPLICA=1.
+        self.report_conn = None
+        self.report_state = None
+        if os.environ.get('HOSPITAL_REPORT_REPLICA') == '1':
+            self.report_conn = sqlite3.connect(':memory:', check_same_thread=False)
+    
+    def run_migrations(self):
+        """Bring the database up to SCHEMA_VERSION. Pending migrations run in
+        one IMMEDIATE transaction; the version is read again once the write
+        lock is held in case the console program upgraded it meanwhile."""
+        version = self.conn.execute("PRAGMA user_version").fetchone()[0]
+        if version >= SCHEMA_VERSION:
+            return
         
-        self.conn.commit()
+        isolation_level = self.conn.isolation_level
+        self.conn.isolation_level = None  # transaction is managed here
+        self.conn.execute("PRAGMA foreign_keys = OFF")
+        try:
+            self.conn.execute("BEGIN IMMEDIATE")
+            version = self.conn.execute("PRAGMA user_version").fetchone()[0]
+            for number, description, script in MIGRATIONS:
+                if number <= version:
+                    continue
+                for statement in split_sql(script):
+                    self.conn.execute(statement)
+                self.conn.execute(
+                    "INSERT OR REPLACE INTO schema_migrations (version, description, applied_by) "
+                    "VALUES (?, ?, 'gui')", (number, description))
+                self.conn.execute(f"PRAGMA user_version = {number}")
+            self.conn.execute("COMMIT")
+        except sqlite3.Error:
+            if self.conn.in_transaction:
+                self.conn.execute("ROLLBACK")
+            raise
+        finally:
+            self.conn.execute("PRAGMA foreign_keys = ON")
+            self.conn.isolation_level = isolation_level
     
     def execute_query(self, query, params=()):
         """Execute SQL query safely"""
@@ -161,6 +453,40 @@ class HospitalBillingSystem:
             messagebox.showerror("Database Error", str(e))
             return None
     
+    def report_cursor(self):
+        """Cursor for read-only report queries: the in-memory replica,
+        re-copied with the backup API whenever this connection has written
+        (total_changes) or another one has committed (data_version), or the
+        live database when the replica is disabled"""
+        if self.report_conn is None:
+            return self.cursor
+        data_version = self.conn.execute("PRAGMA data_version").fetchone()[0]
+        state = (id(self.conn), data_version, self.conn.total_changes)
+        if state != self.report_state:
+            self.conn.backup(self.report_conn)
+            self.report_state = state
+        return self.report_conn.cursor()
+    
+    def fetch_report_all(self, query, params=()):
+        """Fetch all results of a report query"""
+        try:
+            cursor = self.report_cursor()
+            cursor.execute(query, params)
+            return cursor.fetchall()
+        except sqlite3.Error as e:
+            messagebox.showerror("Database Error", str(e))
+            return []
+    
+    def fetch_report_one(self, query, params=()):
+        """Fetch a single row of a report query"""
+        try:
+            cursor = self.report_cursor()
+            cursor.execute(query, params)
+            return cursor.fetchone()
+        except sqlite3.Error as e:
+            messagebox.showerror("Database Error", str(e))
+            return None
+    
     # ==================== AUTHENTICATION ====================
     
     def show_login_screen(self):
@@ -352,7 +678,7 @@ class HospitalBillingSystem:
                 self.patient_vars[field] = var
         
         # Set default date
-        self.patient_vars['admission_date'].set(datetime.now().strftime('%Y-%m-%d'))
+        self.patient_vars['admission_date'].set(today_utc().isoformat())
         
         # Buttons
         btn_frame = tk.Frame(form_frame, bg='white')
@@ -389,6 +715,12 @@ class HospitalBillingSystem:
                 messagebox.showwarning("Validation Error", "Age must be a number")
                 return
             
+            try:
+                admission_day = to_julian_day(admission_date or today_utc())
+            except ValueError:
+                messagebox.showwarning("Validation Error", "Admission date must be YYYY-MM-DD")
+                return
+            
             # Insert into database
             query = '''
                 INSERT INTO patients (name, age, gender, contact, address, disease, admission_date)
@@ -396,7 +728,7 @@ class HospitalBillingSystem:
             '''
             
             if self.execute_query(query, (name, age or None, gender, contact, 
-                                         address, disease, admission_date or datetime.now().date())):
+                                         address, disease, admission_day)):
                 messagebox.showinfo("Success", "Patient added successfully!")
                 self.clear_patient_form()
         except Exception as e:
@@ -409,7 +741,7 @@ class HospitalBillingSystem:
                 widget.delete("1.0", tk.END)
             else:
                 widget.set("")
-        self.patient_vars['admission_date'].set(datetime.now().strftime('%Y-%m-%d'))
+        self.patient_vars['admission_date'].set(today_utc().isoformat())
     
     def show_view_patients(self):
         """Show all patients in a table"""
@@ -500,7 +832,7 @@ class HospitalBillingSystem:
         patients = self.fetch_all(query, params)
         
         # Insert data
-        for patient in patients:
+        for patient in format_dates(PATIENT_LIST_COLUMNS, patients):
             self.patients_tree.insert('', 'end', values=patient)
     
     def search_patients_table(self):
@@ -532,6 +864,7 @@ class HospitalBillingSystem:
             # Create form to show details
             fields = ["Name", "Age", "Gender", "Contact", "Address", "Disease", "Admission Date"]
             
+            patient = patient[:6] + (format_day(patient[6]),)
             for i, (field, value) in enumerate(zip(fields, patient)):
                 ttk.Label(details_window, text=f"{field}:", 
                          font=('Arial', 10, 'bold')).grid(row=i, column=0, 
@@ -637,7 +970,7 @@ class HospitalBillingSystem:
             return
         
         # Add results to tree
-        for result in results:
+        for result in format_dates(PATIENT_LIST_COLUMNS, results):
             self.search_tree.insert('', 'end', values=result)
     
     def show_update_patient(self):
@@ -1141,7 +1474,7 @@ class HospitalBillingSystem:
         
         # Add to treeview
         for bill in bills:
-            self.bills_tree.insert('', 'end', values=bill)
+            self.bills_tree.insert('', 'end', values=bill[:6] + (format_day(bill[6]),))
     
     def show_bill_details(self, event):
         """Show detailed bill view"""
@@ -1175,7 +1508,7 @@ class HospitalBillingSystem:
                 ("Bill Number:", bill[0]),
                 ("Patient ID:", bill[1]),
                 ("Patient Name:", bill[2]),
-                ("Bill Date:", bill[3]),
+                ("Bill Date:", format_day(bill[3])),
                 ("Room Charges:", f"${bill[4]:.2f}"),
                 ("Doctor Fees:", f"${bill[5]:.2f}"),
                 ("Medicine Charges:", f"${bill[6]:.2f}"),
@@ -1218,7 +1551,7 @@ class HospitalBillingSystem:
                 payment_tree.heading('Date', text='Date')
                 
                 for payment in payments:
-                    payment_tree.insert('', 'end', values=payment)
+                    payment_tree.insert('', 'end', values=payment[:3] + (format_timestamp(payment[3]),))
                 
                 payment_tree.pack(fill='both', expand=True, padx=10, pady=10)
             else:
@@ -1436,7 +1769,7 @@ class HospitalBillingSystem:
             FROM bills
         '''
         
-        result = self.fetch_one(query)
+        result = self.fetch_report_one(query)
         
         if not result:
             ttk.Label(report_window, text="No billing data available",
@@ -1472,7 +1805,7 @@ class HospitalBillingSystem:
             GROUP BY payment_status
         '''
         
-        status_results = self.fetch_all(status_query)
+        status_results = self.fetch_report_all(status_query)
         
         for status, count, amount in status_results:
             report_text += f"\n  {status}: {count} bills (${amount or 0:,.2f})"
@@ -1504,7 +1837,7 @@ class HospitalBillingSystem:
             ORDER BY balance_due DESC
         '''
         
-        bills = self.fetch_all(query)
+        bills = self.fetch_report_all(query)
         
         if not bills:
             ttk.Label(report_window, text="No outstanding payments",
@@ -1536,7 +1869,7 @@ class HospitalBillingSystem:
         # Add data
         total_outstanding = 0
         for bill in bills:
-            tree.insert('', 'end', values=bill)
+            tree.insert('', 'end', values=bill[:5] + (format_day(bill[5]),) + bill[6:])
             total_outstanding += bill[4]  # balance_due
         
         # Scrollbar
@@ -1574,7 +1907,7 @@ class HospitalBillingSystem:
             FROM patients
         '''
         
-        result = self.fetch_one(query)
+        result = self.fetch_report_one(query)
         
         if not result:
             ttk.Label(report_window, text="No patient data available",
@@ -1593,7 +1926,7 @@ class HospitalBillingSystem:
             LIMIT 10
         '''
         
-        disease_results = self.fetch_all(disease_query)
+        disease_results = self.fetch_report_all(disease_query)
         
         # Create report
         report_text = f"""
@@ -1633,20 +1966,27 @@ class HospitalBillingSystem:
         report_window.title("Revenue Report")
         report_window.geometry("600x500")
         
-        # Fetch monthly revenue
+        # Fetch daily revenue in index order and fold days into months here,
+        # so dates are converted once per day rather than once per bill
         query = '''
             SELECT 
-                strftime('%Y-%m', bill_date) as month,
+                bill_date,
                 COUNT(*) as bill_count,
                 SUM(total_amount) as total_revenue,
                 SUM(amount_paid) as collected,
                 SUM(balance_due) as outstanding
             FROM bills
-            GROUP BY strftime('%Y-%m', bill_date)
-            ORDER BY month DESC
+            GROUP BY bill_date
+            ORDER BY bill_date DESC
         '''
         
-        results = self.fetch_all(query)
+        months = {}
+        for day, *sums in self.fetch_report_all(query):
+            month = format_day(day)[:7] or None
+            totals = months.setdefault(month, [0, 0, 0, 0])
+            for i, value in enumerate(sums):
+                totals[i] += value or 0
+        results = [(month, *totals) for month, totals in months.items()]
         
         if not results:
             ttk.Label(report_window, text="No revenue data available",
@@ -1728,24 +2068,24 @@ class HospitalBillingSystem:
         dashboard_frame.pack(fill='both', expand=True, padx=20, pady=20)
         
         # Fetch statistics
-        patient_stats = self.fetch_one('''
+        patient_stats = self.fetch_report_one('''
             SELECT COUNT(*), AVG(age) FROM patients
         ''') or (0, 0)
         
-        billing_stats = self.fetch_one('''
+        billing_stats = self.fetch_report_one('''
             SELECT COUNT(*), SUM(total_amount), SUM(amount_paid), 
                    SUM(balance_due), AVG(total_amount)
             FROM bills
         ''') or (0, 0, 0, 0, 0)
         
-        recent_patients = self.fetch_all('''
+        recent_patients = self.fetch_report_all('''
             SELECT name, admission_date 
             FROM patients 
             ORDER BY admission_date DESC 
             LIMIT 5
         ''') or []
         
-        recent_bills = self.fetch_all('''
+        recent_bills = self.fetch_report_all('''
             SELECT bill_no, patient_name, total_amount 
             FROM bills 
             ORDER BY bill_date DESC 
@@ -1788,7 +2128,7 @@ class HospitalBillingSystem:
                                       bg='white', font=('Arial', 11, 'bold'))
         patients_frame.pack(side='left', fill='both', expand=True, padx=5)
         
-        for patient in recent_patients:
+        for patient in format_dates(('name', 'admission_date'), recent_patients):
             tk.Label(patients_frame, text=f"• {patient[0]} ({patient[1]})",
                     bg='white', font=('Arial', 9), anchor='w').pack(fill='x', padx=10, pady=2)
         
@@ -1918,7 +2258,7 @@ class HospitalBillingSystem:
             with open(filepath, 'w', newline='', encoding='utf-8') as f:
                 writer = csv.writer(f)
                 writer.writerow(column_names)  # Header
-                writer.writerows(data)         # Data
+                writer.writerows(format_dates(column_names, data))  # Data
             
             messagebox.showinfo("Export Successful", 
                               f"Data exported to:\n{filepath}\n\n{len(data)} records exported.")
@@ -1944,7 +2284,7 @@ class HospitalBillingSystem:
             {'='*50}
             
             Receipt No: {bill[0]}
-            Date:       {bill[3]}
+            Date:       {format_day(bill[3])}
             
             Patient:    {bill[2]}
             Patient ID: {bill[1]}
@@ -2000,6 +2340,8 @@ class HospitalBillingSystem:
         """Handle window closing"""
         if messagebox.askokcancel("Quit", "Do you want to quit?"):
             self.conn.close()
+            if self.report_conn is not None:
+                self.report_conn.close()
             self.root.destroy()
 
 # ==================== MAIN ENTRY POINT ====================
@@ -1,23 +1,511 @@
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <sqlite3.h>
 #include <time.h>
 #include <ctype.h>
 #include <termios.h>
 #include <unistd.h>
 #include <locale.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <math.h>
+#include <wchar.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Database connection. Thread-local so replay workers each drive the menu
+// functions through their own connection.
+__thread sqlite3* db = NULL;
+const char *db_path = "hospital.db";
+
+// Highest main menu option
+#define MENU_MAX_CHOICE 24
+
+// Dates are stored as Julian day numbers, timestamps as Unix seconds (UTC)
+#define JULIAN_DAY_UNIX_EPOCH 2440588       // Julian day number of 1970-01-01
+#define SECONDS_PER_DAY 86400
+
+// Charge categories an itemized line can roll up into. The order matches the
+// legacy charge columns on the bills table (room, doctor, medicine, lab, other).
+#define CATEGORY_COUNT 5
+static const char *charge_categories[CATEGORY_COUNT] = {
+    "Room", "Doctor", "Medicine", "Lab", "Other"
+};
+
+// One itemized charge line on a bill
+typedef struct {
+    char code[20];
+    char description[100];
+    int category;           // index into charge_categories
+    int quantity;
+    double unit_price;
+} BillItem;
+
+// Growable list of charge lines captured for a single bill
+typedef struct {
+    BillItem *items;
+    int count;
+    int capacity;
+} BillItemList;
+
+// Charge master entry: the catalog price for a service code
+typedef struct {
+    char code[20];
+    char description[100];
+    double price;
+    int category;           // index into charge_categories
+} ChargeEntry;
+
+// In-memory charge master. Entries live in a flat array; slots is an
+// open-addressing hash index (power-of-two size, -1 = empty) into entries.
+typedef struct {
+    ChargeEntry *entries;
+    int count;
+    int *slots;
+    int slot_count;
+    long long revision;     // charge_master_meta.revision the table was built from
+} ChargeMaster;
+
+ChargeMaster charge_master = {NULL, 0, NULL, 0, -1};
+
+// One field of a CSV record: points into the reader's buffer, unescaped
+// and NUL-terminated in place, valid until the next csv_next() call
+typedef struct {
+    char *text;
+    size_t length;
+} CsvField;
+
+#define CSV_MAX_FIELDS 32
+#define CSV_BUFFER_SIZE (256 * 1024)
+#define CSV_MAX_RECORD (4 * 1024 * 1024)
+
+// csv_next() results
+#define CSV_RECORD 1
+#define CSV_END 0
+#define CSV_ERROR -1
+#define CSV_TOO_LONG -2     // record over CSV_MAX_RECORD, skipped
+
+// Sets bit i of masks[i / 64] for every byte data[i] that is a quote,
+// comma or newline; length is a multiple of 64
+typedef void (*CsvClassifyFn)(const char *data, size_t length, uint64_t *masks);
+
+// Streaming CSV reader over a file descriptor. Each buffer load is
+// classified once into bitmasks of structural bytes; records are split by
+// walking the set bits, and fields are views into the buffer.
+typedef struct {
+    int fd;
+    char *buffer;
+    uint64_t *masks;        // one word per 64 buffer bytes
+    size_t capacity;
+    size_t start;           // first byte of the next record
+    size_t end;             // end of buffered data
+    int eof;
+    long long line_no;      // line the current record starts on (1-based)
+    long long next_line;
+    long long bytes;        // total bytes consumed
+    int field_count;        // fields in the record; only CSV_MAX_FIELDS are kept
+    CsvField fields[CSV_MAX_FIELDS];
+    CsvClassifyFn classify;
+} CsvReader;
+
+// Output collected in memory and written to a file descriptor in large
+// chunks, shared by the table renderer and the exporters
+typedef struct {
+    int fd;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;             // a write() failed; later output is discarded
+} OutputBuffer;
+
+#define OUTPUT_FLUSH_BYTES (64 * 1024)
+
+// Column of a rendered table listing
+typedef struct {
+    const char *title;
+    int max_width;          // cells wider than this are truncated with "…"
+    int align_right;        // numbers are right-aligned
+} TableColumn;
+
+#define TABLE_MAX_COLUMNS 12
+#define TABLE_SAMPLE_ROWS 200
+
+// Buffered table renderer. Column widths are taken from the first
+// TABLE_SAMPLE_ROWS rows; after that rows are formatted straight into the
+// output buffer, which is written out in large chunks. On a terminal the
+// output is paged.
+typedef struct {
+    const TableColumn *columns;
+    int column_count;
+    int widths[TABLE_MAX_COLUMNS];
+    char **sample;          // cell copies held until widths are known
+    int sample_count;
+    int widths_fixed;
+    OutputBuffer out;
+    FILE *file;             // stream the rows are written after (stdout or a report file)
+    long long rows;
+    int page_rows;          // 0 = no paging
+    int page_fill;
+    int stopped;            // user quit the pager; further rows are dropped
+} TableRenderer;
+
+// One numbered schema migration (see migrations[] and run_migrations)
+typedef struct {
+    int version;
+    const char *description;
+    const char *sql;
+} Migration;
+
+// Export file formats
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_NDJSON,          // one JSON object per line
+    EXPORT_JSON             // a single JSON array
+} ExportFormat;
+
+// How an exported column is typed in JSON output
+typedef enum {
+    FIELD_INTEGER,
+    FIELD_TEXT,
+    FIELD_MONEY,            // exact two-decimal number, rounded to whole cents
+    FIELD_DATE,             // "YYYY-MM-DD"
+    FIELD_TIMESTAMP         // ISO 8601 UTC, "YYYY-MM-DDTHH:MM:SSZ"
+} FieldKind;
+
+typedef struct {
+    const char *name;
+    FieldKind kind;
+} ExportField;
+
+// A table that can be exported and the typed columns written for it
+typedef struct {
+    const char *name;
+    const ExportField *fields;
+    int field_count;
+} ExportTable;
+
+// Columnar analytics snapshot of bills and payments. The file is laid out
+// to be memory-mapped: a header, a directory of columns, then each column
+// as a fixed-width array aligned to SNAPSHOT_ALIGN bytes, then a dictionary
+// section holding every distinct string once. All integers are native
+// endian; money is stored as integer cents.
+#define SNAPSHOT_MAGIC "HBSNAP1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ENDIAN_MARK 0x01020304u
+#define SNAPSHOT_ALIGN 64
+#define SNAPSHOT_NO_DATE INT32_MIN          // missing date in a DAYS column
+#define SNAPSHOT_NULL_STRING UINT32_MAX     // missing string in a STRING column
+
+typedef enum {
+    COLUMN_INT64,           // int64_t values
+    COLUMN_DAYS,            // int32_t days since 1970-01-01
+    COLUMN_STRING           // uint32_t dictionary ids
+} ColumnType;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_mark;
+    int64_t created_at;             // Unix time the snapshot was taken
+    uint64_t bill_rows;
+    uint64_t payment_rows;
+    uint32_t column_count;
+    uint32_t dictionary_count;
+    uint64_t dictionary_offset;     // uint32_t offsets[count + 1], then string bytes
+    uint64_t dictionary_length;
+    uint32_t dictionary_checksum;
+    uint32_t header_checksum;       // CRC-32 of this header (field zeroed) and the directory
+} SnapshotHeader;
+
+typedef struct {
+    char name[24];
+    uint32_t table;                 // 0 = bills, 1 = payments
+    uint32_t type;                  // ColumnType
+    uint64_t offset;
+    uint64_t length;                // bytes
+    uint32_t checksum;              // CRC-32 of the column data
+    uint32_t reserved;
+} SnapshotColumn;
+
+// A snapshot file mapped into memory and validated
+typedef struct {
+    const unsigned char *base;
+    size_t size;
+    const SnapshotHeader *header;
+    const SnapshotColumn *columns;
+    const uint32_t *dictionary_offsets;
+    const char *dictionary_text;
+} SnapshotReader;
+
+// A row changed through the live connection since the replica last synced
+typedef struct {
+    char table[32];
+    sqlite3_int64 rowid;
+} ReplicaChange;
 
-// Database connection
-sqlite3* db = NULL;
+// Past this many pending changes a full reload is cheaper than replaying them
+#define REPLICA_MAX_CHANGES 4096
+
+// Read-only in-memory copy of the database that reports run against
+// (--replica). Changes made through the live connection are collected by
+// an update hook and copied over row by row before each report; commits
+// from other processes show up as a new PRAGMA data_version and trigger a
+// full reload through the backup API.
+typedef struct {
+    sqlite3 *conn;
+    sqlite3 *source;        // live connection the update hook is installed on
+    long long data_version;
+    ReplicaChange *changes;
+    int change_count;
+    int change_capacity;
+    int reload;             // pending changes were dropped; copy everything
+    long long full_loads;
+    long long rows_applied;
+} ReportReplica;
+
+ReportReplica report_replica = {NULL, NULL, -1, NULL, 0, 0, 1, 0, 0};
+
+// Continuous WAL archiving (--archive DIR). Each archive generation is a
+// directory holding a base backup and numbered segment files; every commit
+// on the live connection appends the WAL frames it added to the current
+// segment as one timestamped record, so a copy of the database can be
+// rolled forward to any archived commit (--recover).
+typedef struct {
+    int active;
+    char dir[200];          // archive root
+    char generation[260];   // current generation directory
+    int wal_fd;
+    long long offset;       // WAL bytes archived so far; 0 = a new WAL is due
+    int salts_known;
+    uint32_t salt1, salt2;  // header salts of the WAL being archived
+    uint32_t page_size;
+    int segment_fd;
+    int segment_number;
+    long long segment_bytes;
+    unsigned char *buffer;
+    size_t capacity;
+    long long records;
+    long long frames;
+    int restart_due;        // our checkpoint absorbed the whole, fully archived WAL
+    unsigned int data_version;  // SQLITE_FCNTL_DATA_VERSION after that checkpoint
+} WalArchive;
+
+#define WAL_ARCHIVE_SEGMENT_BYTES (64LL * 1024 * 1024)
+#define WAL_ARCHIVE_CHECKPOINT_PAGES 1000
+
+WalArchive wal_archive = {0, "", "", -1, 0, 0, 0, 0, 0, -1, 0, 0, NULL, 0, 0, 0, 0, 0};
+
+// A cached column value. text holds the value as sqlite3_column_text
+// rendered it (NULL for SQL NULL); number holds its numeric value.
+typedef struct {
+    char *text;
+    double number;
+    sqlite3_int64 integer;
+} CachedValue;
+
+// The full result of one report query, kept in an LRU list
+typedef struct CachedResult {
+    char *key;              // SQL text followed by the bound parameters
+    unsigned int hash;
+    unsigned int tables;    // bit per table the query reads (see cache_table_bit)
+    int column_count;
+    int row_count;
+    CachedValue *values;    // row_count * column_count
+    size_t bytes;
+    struct CachedResult *prev;
+    struct CachedResult *next;
+} CachedResult;
+
+#define QUERY_CACHE_MAX_BYTES (4 * 1024 * 1024)
+#define QUERY_CACHE_MAX_TABLES 32
+
+// Report query results, keyed by query text and parameters. Entries are
+// dropped when the update hook sees a write to a table they read, when
+// another process commits (PRAGMA data_version), or when the size bound
+// pushes them out, oldest first.
+typedef struct {
+    CachedResult *head;     // most recently used
+    CachedResult *tail;
+    int entries;
+    size_t bytes;
+    sqlite3 *source;        // connection the update hook is installed on
+    long long data_version;
+    const char *table_names[QUERY_CACHE_MAX_TABLES];
+    int table_count;
+    long long hits;
+    long long misses;
+    long long invalidations;
+} QueryCache;
+
+QueryCache query_cache = {NULL, NULL, 0, 0, NULL, -1, {NULL}, 0, 0, 0, 0};
+
+// Memory budget (--memory-budget MB). SQLite's hard heap limit takes three
+// quarters of the budget and it starts recycling page cache at half; the
+// per-connection page cache, lookaside and the report cache are sized from
+// it, and the in-memory report replica is refused if it would not fit.
+typedef struct {
+    long long bytes;            // 0 = unlimited
+    long long hard_limit;
+    long long soft_limit;
+    long long cache_kib;        // PRAGMA cache_size = -cache_kib on each connection
+    size_t query_cache_bytes;
+} MemoryBudget;
+
+#define MEMORY_BUDGET_MIN_MB 8
+#define MEMORY_BUDGET_MAX_MB 65536
+#define BUDGET_LOOKASIDE_SLOT 512
+#define BUDGET_LOOKASIDE_SLOTS 32
+
+MemoryBudget memory_budget = {0, 0, 0, 0, QUERY_CACHE_MAX_BYTES};
+
+// Progress and cancellation for the menu option being run. A progress
+// handler on the connections shows how long the option's queries have been
+// running, stops them once the option's time budget (--time-budget) is used
+// up, and turns Ctrl-C into sqlite3_interrupt() on the statement in
+// progress instead of killing the program.
+typedef struct {
+    int active;                 // a menu option is running
+    sqlite3 *conn;              // its connection
+    double budget;              // seconds of query time allowed; 0 = none
+    double busy;                // query time used so far
+    double last_call;           // when the progress handler last ran
+    double last_shown;
+    double handled_at;          // Ctrl-C up to this time has been dealt with
+    volatile double interrupt_at;   // last Ctrl-C
+    long long rows;             // result rows produced
+    const char *unit;           // what rows counts ("rows", "pages")
+    int shown;                  // a progress line is on the terminal
+    int timed_out;
+    volatile sig_atomic_t idle; // waiting for input; the statement is paused
+} QueryWatch;
+
+#define QUERY_PROGRESS_OPS 10000    // VM instructions between handler calls
+#define QUERY_PROGRESS_DELAY 0.5    // seconds of query time before progress shows
+#define QUERY_IDLE_GAP 1.0          // a longer gap between calls is time outside SQLite
+
+QueryWatch query_watch = {0, NULL, 0, 0, 0, 0, 0, 0, 0, "rows", 0, 0, 0};
+
+// Query time allowed per main menu option, in seconds (0 = unlimited)
+double menu_time_budgets[MENU_MAX_CHOICE + 1];
+
+// Reports write_report() can produce; the first four follow the Financial
+// Report menu
+typedef enum {
+    REPORT_SUMMARY = 1,
+    REPORT_OUTSTANDING,
+    REPORT_AGING,
+    REPORT_CENSUS,
+    REPORT_STATISTICS
+} ReportType;
+
+static const char *report_titles[] = {
+    "", "Financial summary", "Outstanding payments", "Receivables aging",
+    "Daily census", "System statistics"
+};
+
+// A report with the answers to its prompts collected up front, so it can
+// be shown on screen or run as a background job
+typedef struct {
+    ReportType type;
+    int top_n;              // aging: debtors to list
+    long long first_day;    // census range (Julian days)
+    long long last_day;
+} ReportRequest;
+
+typedef enum { JOB_REPORT, JOB_EXPORT, JOB_SNAPSHOT, JOB_BACKUP } JobKind;
+typedef enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED } JobState;
+
+static const char *job_state_names[] = {"Queued", "Running", "Done", "Failed", "Cancelled"};
+
+// A background job. The menu fills in the request; the worker thread sets
+// the state, result and times under the queue lock.
+typedef struct Job {
+    int id;
+    JobKind kind;
+    char title[64];
+    ReportRequest report;           // JOB_REPORT
+    const ExportTable *table;       // JOB_EXPORT
+    ExportFormat format;
+    char output[256];               // file the job writes
+    JobState state;
+    char result[384];               // outcome, with room for the output path
+    double queued_at;
+    double started_at;
+    double finished_at;
+    int cancel;                     // the user asked to stop it
+    int seen;                       // looked at on the jobs screen since it finished
+    struct Job *next;
+} Job;
+
+// Reports, exports and backups queued from the menu run one at a time on a
+// worker thread with its own read-only connection, so the terminal keeps
+// serving payments meanwhile. Jobs stay listed for the session.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int started;
+    int stopping;
+    sqlite3 *conn;                  // the worker's connection, open only while jobs run
+    Job *head;                      // oldest first
+    Job *tail;
+    int next_id;
+} JobQueue;
+
+JobQueue job_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, NULL, NULL, NULL, 0};
+
+// Parameter bound to a cached query
+typedef struct {
+    int is_text;
+    sqlite3_int64 integer;
+    const char *text;
+} QueryParam;
+
+// Iterates over a cached result like sqlite3_step over a statement. A
+// result too big to cache keeps its statement: the rows captured before
+// the size bound was reached come first, then the rest straight from stmt.
+typedef struct {
+    CachedResult *result;
+    int owned;              // result was not cached; freed on close
+    int row;
+    sqlite3_stmt *stmt;     // still running, or NULL
+} CachedCursor;
+
+// Set while replay workers share the catalog; refreshes are skipped then
+int charge_master_frozen = 0;
+
+// One recorded menu operation: the option chosen and the inputs accepted
+// by get_choice/get_string/get_integer/get_double while it ran. Each input
+// is stored as a type character (c, s, i, f) followed by the value.
+typedef struct {
+    double offset;          // seconds since the recording started
+    int choice;
+    int input_count;
+    char **inputs;
+} TraceOp;
 
 // Function prototypes
 void init_database();
 void close_database();
+int run_migrations(sqlite3 *conn, const char *applied_by);
 int authenticate();
 void get_password(char *password, size_t size);
 void clear_screen();
 void display_main_menu();
+void dispatch_menu_choice(int choice);
 
 // Patient functions
 void add_patient();
@@ -33,8 +521,66 @@ void search_bill();
 void make_payment();
 void view_payment_history();
 void print_receipt();
+int save_receipt(sqlite3 *conn, long long bill_no, const char *path);
+void batch_print_receipts();
+void statement_run();
+long long reconcile_ledger_run(sqlite3 *conn, int threads, const char *repair_path, int apply);
+void reconcile_ledger();
+
+// Billing core: non-interactive operations shared by the menu screens and
+// the batch tools. Each takes the connection to use and returns an SQLite
+// result code (SQLITE_OK on success).
+int db_add_patient(sqlite3 *conn, const char *name, int age, const char *gender,
+                   const char *contact, const char *address, const char *disease,
+                   long long admission_day, long long *patient_id);
+int db_delete_patient(sqlite3 *conn, long long patient_id);
+int db_create_bill(sqlite3 *conn, long long patient_id, const char *patient_name,
+                   const BillItemList *items, double amount_paid,
+                   const char *payment_status, const char *payment_method,
+                   long long *bill_no);
+int db_post_payment(sqlite3 *conn, long long bill_no, double amount, const char *payment_method);
+
+// Itemized charge functions
+void bill_items_init(BillItemList *list);
+void bill_items_free(BillItemList *list);
+int bill_items_add(BillItemList *list, const BillItem *item);
+double bill_items_total(const BillItemList *list, double subtotals[CATEGORY_COUNT]);
+int insert_bill_items(sqlite3 *conn, long long bill_no, const BillItemList *list);
+int sync_bill_totals(sqlite3 *conn, long long bill_no);
+int print_bill_items(long long bill_no);
+int category_index(const char *name);
+
+// Charge master functions
+int load_charge_master(sqlite3 *conn);
+void refresh_charge_master(sqlite3 *conn);
+void free_charge_master();
+const ChargeEntry *lookup_charge(const char *code);
+void import_charge_master();
+
+// CSV reader
+int csv_open(CsvReader *reader, const char *path);
+int csv_next(CsvReader *reader);
+const char *csv_field(const CsvReader *reader, int i);
+void csv_record_text(const CsvReader *reader, char *buffer, size_t size);
+void csv_close(CsvReader *reader);
+int run_csv_bench(const char *path);
+
+// Remittance import and batch billing
+void import_remittances();
+void batch_billing_run();
 
 // Report functions
+void watch_database_changes(sqlite3 *conn);
+int cached_query(sqlite3 *conn, const char *sql, const QueryParam *params, int param_count, CachedCursor *cursor);
+int cursor_step(CachedCursor *cursor);
+const char *cursor_text(const CachedCursor *cursor, int column);
+double cursor_double(const CachedCursor *cursor, int column);
+sqlite3_int64 cursor_int64(const CachedCursor *cursor, int column);
+void cursor_close(CachedCursor *cursor);
+int replica_open(sqlite3 *source);
+void replica_close();
+sqlite3 *report_connection();
+void write_report(FILE *out, sqlite3 *conn, const ReportRequest *request);
 void generate_report();
 void view_statistics();
 
@@ -43,26 +589,316 @@ void backup_database();
 void restore_database();
 void export_data();
 
+// WAL archiving and point-in-time recovery
+int wal_archive_start(sqlite3 *conn, const char *dir);
+void wal_archive_reattach(sqlite3 *conn);
+void wal_archive_stop();
+int run_recovery(const char *dir, const char *until, const char *output);
+
+// Memory budget
+void memory_budget_set(long long megabytes);
+void memory_budget_apply();
+void memory_budget_connection(sqlite3 *conn);
+void print_memory_stats(FILE *out, sqlite3 *conn);
+void memory_statistics();
+
+// Query progress and cancellation
+int set_time_budget(const char *spec);
+void install_interrupt_handler();
+void query_watch_begin(int choice);
+void query_watch_end();
+void query_watch_attach(sqlite3 *conn);
+void query_watch_connection(sqlite3 *conn);
+char *query_watch_read(char *buffer, int size);
+void query_watch_clear_line();
+void query_watch_row();
+int query_watch_poll();
+
+// Background jobs
+int job_submit(const Job *request);
+int confirm_background();
+int jobs_pending();
+int jobs_unseen();
+void jobs_stop();
+void background_jobs();
+
 // Utility functions
 void print_header(const char *title);
 int get_choice(int min, int max);
 void get_string(const char *prompt, char *buffer, size_t size);
+int get_confirmation(const char *prompt);
 int get_integer(const char *prompt, int min, int max);
-float get_float(const char *prompt, float min, float max);
+long long get_id(const char *prompt, long long min);
+double get_double(const char *prompt, double min, double max);
+double now_seconds();
+
+// Dates
+int parse_date(const char *text, long long *julian_day);
+long long today_julian_day();
+void format_date(long long julian_day, char *buffer, size_t size);
+void format_timestamp(long long seconds, char *buffer, size_t size);
+int get_date_range(long long *first_day, long long *last_day);
+
+// Buffered output
+void output_init(OutputBuffer *out, int fd);
+char *output_reserve(OutputBuffer *out, size_t extra);
+void output_append(OutputBuffer *out, const char *text, size_t length);
+void output_flush(OutputBuffer *out);
+void output_free(OutputBuffer *out);
+
+// Table rendering
+void table_begin(TableRenderer *table, const TableColumn *columns, int column_count);
+void table_begin_file(TableRenderer *table, const TableColumn *columns, int column_count, FILE *file);
+void table_row(TableRenderer *table, const char **cells);
+void table_end(TableRenderer *table);
 
 // NEW: Security functions to prevent SQL injection
 void escape_string(char *dest, const char *src, size_t size);
 
-int main() {
+// Session recording and replay
+int open_trace(const char *path);
+void close_trace();
+void trace_begin(int choice);
+void trace_input(char type, const char *value);
+void trace_end();
+int run_replay(const char *trace_path, int threads, double rate, long long total_ops, double duration);
+
+// Data export
+const ExportTable *find_export_table(const char *name);
+int export_table(sqlite3 *conn, const ExportTable *table, ExportFormat format, OutputBuffer *out, long long *rows);
+int run_export(const char *table_name, const char *format_name, const char *output_path);
+
+// Analytics snapshot
+int write_snapshot(sqlite3 *conn, const char *path, long long *bill_rows, long long *payment_rows);
+int snapshot_open(SnapshotReader *reader, const char *path, char *error, size_t error_size);
+void snapshot_close(SnapshotReader *reader);
+int run_snapshot_report(const char *path);
+
+// Stress testing and ledger checks
+long long check_ledger_invariants(sqlite3 *conn, int max_examples);
+int run_stress(int threads, double duration, double interval, int patients, int busy_timeout);
+
+static void print_usage(const char *program) {
+    printf("Usage:\n");
+    printf("  %s [--db FILE] [--record TRACE]\n", program);
+    printf("  %s --db FILE --replay TRACE [--threads N] [--rate OPS_PER_SEC]\n", program);
+    printf("      [--ops N] [--duration SECONDS]\n");
+    printf("  %s --db FILE --stress [--threads N] [--duration SECONDS]\n", program);
+    printf("      [--interval SECONDS] [--patients N] [--busy-timeout MS]\n");
+    printf("  %s [--db FILE] [--replica]   run reports on an in-memory copy\n", program);
+    printf("  %s [--db FILE] --archive DIR  archive the WAL continuously while running\n", program);
+    printf("  %s --recover DIR --output FILE [--until \"YYYY-MM-DD HH:MM:SS\"]\n", program);
+    printf("  %s [--db FILE] --export patients|bills|payments\n", program);
+    printf("      [--format csv|ndjson|json] [--output FILE]\n");
+    printf("  %s [--db FILE] --snapshot FILE\n", program);
+    printf("  %s --snapshot-report FILE\n", program);
+    printf("  %s --csv-bench FILE          time the CSV tokenizer on FILE\n", program);
+    printf("  %s [--db FILE] --reconcile [--threads N] [--repair-sql FILE] [--apply]\n", program);
+    printf("Any mode also takes --memory-budget MB (%d-%d) to cap SQLite's heap and\n",
+           MEMORY_BUDGET_MIN_MB, MEMORY_BUDGET_MAX_MB);
+    printf("caches, and --memory-stats to print memory counters when it finishes\n");
+    printf("(on its own: open the database and print them).\n");
+    printf("Interactive sessions take --time-budget OPTION=SECONDS (repeatable; OPTION\n");
+    printf("is a main menu number or \"all\") to stop that option's queries after\n");
+    printf("SECONDS of query time. Ctrl-C cancels the running query.\n");
+}
+
+int main(int argc, char *argv[]) {
     // Set locale for proper character handling
     setlocale(LC_ALL, "en_US.UTF-8");
     
+    int db_given = 0;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    int threads = 4;
+    double rate = 0;
+    long long total_ops = 0;
+    double duration = 0;
+    int stress = 0;
+    double interval = 10;
+    int patients = 200;
+    int busy_timeout = 0;
+    const char *export_name = NULL;
+    const char *export_format = "ndjson";
+    const char *export_output = "-";
+    const char *snapshot_path = NULL;
+    const char *snapshot_report_path = NULL;
+    const char *csv_bench_path = NULL;
+    int reconcile = 0;
+    const char *repair_path = NULL;
+    int apply_repairs = 0;
+    int use_replica = 0;
+    const char *archive_dir = NULL;
+    const char *recover_dir = NULL;
+    const char *recover_until = NULL;
+    long long budget_mb = 0;
+    int memory_stats = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        int has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--db") == 0 && has_value) {
+            db_path = argv[++i];
+            db_given = 1;
+        } else if (strcmp(argv[i], "--record") == 0 && has_value) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && has_value) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && has_value) {
+            rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && has_value) {
+            total_ops = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && has_value) {
+            duration = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--replica") == 0) {
+            use_replica = 1;
+        } else if (strcmp(argv[i], "--stress") == 0) {
+            stress = 1;
+        } else if (strcmp(argv[i], "--interval") == 0 && has_value) {
+            interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--patients") == 0 && has_value) {
+            patients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--busy-timeout") == 0 && has_value) {
+            busy_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--export") == 0 && has_value) {
+            export_name = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && has_value) {
+            export_format = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && has_value) {
+            export_output = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && has_value) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-report") == 0 && has_value) {
+            snapshot_report_path = argv[++i];
+        } else if (strcmp(argv[i], "--csv-bench") == 0 && has_value) {
+            csv_bench_path = argv[++i];
+        } else if (strcmp(argv[i], "--archive") == 0 && has_value) {
+            archive_dir = argv[++i];
+        } else if (strcmp(argv[i], "--recover") == 0 && has_value) {
+            recover_dir = argv[++i];
+        } else if (strcmp(argv[i], "--until") == 0 && has_value) {
+            recover_until = argv[++i];
+        } else if (strcmp(argv[i], "--reconcile") == 0) {
+            reconcile = 1;
+        } else if (strcmp(argv[i], "--repair-sql") == 0 && has_value) {
+            repair_path = argv[++i];
+        } else if (strcmp(argv[i], "--apply") == 0) {
+            apply_repairs = 1;
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && has_value) {
+            budget_mb = atoll(argv[++i]);
+            if (budget_mb < MEMORY_BUDGET_MIN_MB || budget_mb > MEMORY_BUDGET_MAX_MB) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--memory-stats") == 0) {
+            memory_stats = 1;
+        } else if (strcmp(argv[i], "--time-budget") == 0 && has_value) {
+            if (!set_time_budget(argv[++i])) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    // The heap limits are set once SQLite is configured: replay installs its
+    // error log first and applies them itself
+    memory_budget_set(budget_mb);
+    if (replay_path) {
+        // Replay re-runs recorded writes, deletions included; it never
+        // falls back to the default database
+        if (!db_given) {
+            printf("--replay writes to the database; name a copy with --db FILE.\n");
+            return 1;
+        }
+        int rc = run_replay(replay_path, threads, rate, total_ops, duration);
+        if (memory_stats) print_memory_stats(stderr, NULL);
+        return rc;
+    }
+    memory_budget_apply();
+    
+    if (snapshot_report_path) {
+        return run_snapshot_report(snapshot_report_path);
+    }
+    if (csv_bench_path) {
+        return run_csv_bench(csv_bench_path);
+    }
+    if (recover_dir) {
+        if (strcmp(export_output, "-") == 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        int rc = run_recovery(recover_dir, recover_until, export_output);
+        if (memory_stats) print_memory_stats(stderr, NULL);
+        return rc;
+    }
+    if (snapshot_path) {
+        if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+            fprintf(stderr, "Cannot open database %s: %s\n", db_path, sqlite3_errmsg(db));
+            return 1;
+        }
+        memory_budget_connection(db);
+        long long bill_rows, payment_rows;
+        int rc = write_snapshot(db, snapshot_path, &bill_rows, &payment_rows);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Snapshot failed: %s\n", rc == SQLITE_IOERR ? "write error" : sqlite3_errmsg(db));
+        } else {
+            fprintf(stderr, "Wrote %lld bills and %lld payments to %s\n", bill_rows, payment_rows, snapshot_path);
+        }
+        if (memory_stats) print_memory_stats(stderr, db);
+        sqlite3_close(db);
+        return rc == SQLITE_OK ? 0 : 1;
+    }
+    if (export_name) {
+        int rc = run_export(export_name, export_format, export_output);
+        if (memory_stats) print_memory_stats(stderr, NULL);
+        return rc;
+    }
+    if (reconcile) {
+        // Migrations first, so the payments-by-bill index exists
+        init_database();
+        sqlite3_busy_timeout(db, 5000);
+        long long remaining = reconcile_ledger_run(db, threads, repair_path, apply_repairs);
+        if (memory_stats) print_memory_stats(stderr, db);
+        close_database();
+        return remaining == 0 ? 0 : 1;
+    }
+    if (stress) {
+        // The mix seeds fake patients and deletes real ones
+        if (!db_given) {
+            printf("--stress writes to the database; name a test database with --db FILE.\n");
+            return 1;
+        }
+        int rc = run_stress(threads, duration > 0 ? duration : 60, interval, patients, busy_timeout);
+        if (memory_stats) print_memory_stats(stderr, NULL);
+        return rc;
+    }
+    if (memory_stats) {
+        init_database();
+        print_memory_stats(stdout, db);
+        close_database();
+        return 0;
+    }
+    
     printf("\n========================================\n");
     printf("   HOSPITAL PATIENT BILLING SYSTEM\n");
     printf("========================================\n");
     
     // Initialize database
     init_database();
+    if (use_replica && !replica_open(db)) {
+        printf("Report replica unavailable; reports will read the live database.\n");
+    }
+    if (archive_dir && !wal_archive_start(db, archive_dir)) {
+        close_database();
+        return 1;
+    }
+    if (archive_dir) {
+        printf("Archiving WAL to %s\n", wal_archive.generation);
+    }
     
     // Authenticate user
     if (!authenticate()) {
@@ -70,59 +906,80 @@ int main() {
         return 1;
     }
     
+    if (record_path && !open_trace(record_path)) {
+        printf("Cannot open trace file: %s\n", record_path);
+        close_database();
+        return 1;
+    }
+    
     // Main program loop
+    install_interrupt_handler();
     int running = 1;
     while (running) {
         display_main_menu();
-        int choice = get_choice(0, 16);
-        
-        switch(choice) {
-            case 1: add_patient(); break;
-            case 2: view_patients(); break;
-            case 3: search_patient(); break;
-            case 4: update_patient(); break;
-            case 5: delete_patient(); break;
-            case 6: generate_bill(); break;
-            case 7: view_bills(); break;
-            case 8: search_bill(); break;
-            case 9: make_payment(); break;
-            case 10: view_payment_history(); break;
-            case 11: print_receipt(); break;
-            case 12: generate_report(); break;
-            case 13: view_statistics(); break;
-            case 14: backup_database(); break;
-            case 15: restore_database(); break;
-            case 16: export_data(); break;
-            case 0: 
-                printf("\nThank you for using Hospital Billing System!\n");
-                running = 0;
-                break;
+        int choice = get_choice(0, MENU_MAX_CHOICE);
+        
+        if (choice == 0) {
+            printf("\nThank you for using Hospital Billing System!\n");
+            running = 0;
+        } else {
+            trace_begin(choice);
+            query_watch_begin(choice);
+            dispatch_menu_choice(choice);
+            query_watch_end();
+            trace_end();
         }
     }
     
+    close_trace();
     close_database();
     return 0;
 }
 
+void dispatch_menu_choice(int choice) {
+    switch(choice) {
+        case 1: add_patient(); break;
+        case 2: view_patients(); break;
+        case 3: search_patient(); break;
+        case 4: update_patient(); break;
+        case 5: delete_patient(); break;
+        case 6: generate_bill(); break;
+        case 7: view_bills(); break;
+        case 8: search_bill(); break;
+        case 9: make_payment(); break;
+        case 10: view_payment_history(); break;
+        case 11: print_receipt(); break;
+        case 12: generate_report(); break;
+        case 13: view_statistics(); break;
+        case 14: backup_database(); break;
+        case 15: restore_database(); break;
+        case 16: export_data(); break;
+        case 17: import_charge_master(); break;
+        case 18: import_remittances(); break;
+        case 19: batch_billing_run(); break;
+        case 20: batch_print_receipts(); break;
+        case 21: statement_run(); break;
+        case 22: reconcile_ledger(); break;
+        case 23: memory_statistics(); break;
+        case 24: background_jobs(); break;
+    }
+}
+
 // ==================== DATABASE FUNCTIONS ====================
 
-void init_database() {
-    int rc = sqlite3_open("hospital.db", &db);
-    if (rc != SQLITE_OK) {
-        printf("Cannot open database: %s\n", sqlite3_errmsg(db));
-        exit(1);
-    }
-    
-    // Set UTF-8 encoding for the database
-    sqlite3_exec(db, "PRAGMA encoding = 'UTF-8';", 0, 0, 0);
-    
-    // Create tables
-    const char *sql = 
+// Numbered schema changes. PRAGMA user_version holds the number of the last
+// one applied, so a database that is already current skips all DDL at
+// startup. gui/hospital_gui.py carries the same list (MIGRATIONS) and
+// either program may upgrade a database: keep the two lists identical and
+// only ever append.
+static const Migration migrations[] = {
+    {1, "baseline schema",
         "CREATE TABLE IF NOT EXISTS users ("
         "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
         "    username TEXT UNIQUE NOT NULL,"
         "    password TEXT NOT NULL,"
-        "    role TEXT DEFAULT 'staff'"
+        "    role TEXT DEFAULT 'staff',"
+        "    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
         ");"
         
         "CREATE TABLE IF NOT EXISTS patients ("
@@ -162,28 +1019,309 @@ void init_database() {
         "    payment_date TIMESTAMP DEFAULT CURRENT_TIMESTAMP,"
         "    payment_method TEXT,"
         "    FOREIGN KEY (bill_no) REFERENCES bills(bill_no) ON DELETE CASCADE"
-        ");";
+        ");"
+        
+        "CREATE TABLE IF NOT EXISTS bill_items ("
+        "    item_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "    bill_no INTEGER NOT NULL,"
+        "    code TEXT NOT NULL,"
+        "    description TEXT,"
+        "    category TEXT DEFAULT 'Other',"
+        "    quantity INTEGER DEFAULT 1,"
+        "    unit_price REAL DEFAULT 0,"
+        "    line_total REAL DEFAULT 0,"
+        "    FOREIGN KEY (bill_no) REFERENCES bills(bill_no) ON DELETE CASCADE"
+        ");"
+        
+        "CREATE INDEX IF NOT EXISTS idx_bill_items_bill ON bill_items(bill_no);"
+        
+        "CREATE TABLE IF NOT EXISTS charge_master ("
+        "    code TEXT PRIMARY KEY,"
+        "    description TEXT NOT NULL,"
+        "    price REAL NOT NULL DEFAULT 0,"
+        "    category TEXT DEFAULT 'Other'"
+        ");"
+        
+        // Bumped on every catalog change so the in-memory table knows to rebuild
+        "CREATE TABLE IF NOT EXISTS charge_master_meta ("
+        "    id INTEGER PRIMARY KEY CHECK (id = 1),"
+        "    revision INTEGER NOT NULL DEFAULT 0"
+        ");"
+        "INSERT OR IGNORE INTO charge_master_meta (id, revision) VALUES (1, 0);"
+        
+        "CREATE TRIGGER IF NOT EXISTS trg_charge_master_ins AFTER INSERT ON charge_master "
+        "BEGIN UPDATE charge_master_meta SET revision = revision + 1 WHERE id = 1; END;"
+        "CREATE TRIGGER IF NOT EXISTS trg_charge_master_upd AFTER UPDATE ON charge_master "
+        "BEGIN UPDATE charge_master_meta SET revision = revision + 1 WHERE id = 1; END;"
+        "CREATE TRIGGER IF NOT EXISTS trg_charge_master_del AFTER DELETE ON charge_master "
+        "BEGIN UPDATE charge_master_meta SET revision = revision + 1 WHERE id = 1; END;"
+        
+        "CREATE TABLE IF NOT EXISTS schema_migrations ("
+        "    version INTEGER PRIMARY KEY,"
+        "    description TEXT,"
+        "    applied_by TEXT,"
+        "    applied_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
+        ");"
+        
+        "INSERT OR IGNORE INTO users (username, password, role) VALUES "
+        "('admin', 'admin123', 'admin'),"
+        "('staff', 'staff123', 'staff');"},
+    
+    // Databases created before migrations differ by front end: the console
+    // program's users table has no created_at and the GUI's patients.name
+    // is case sensitive. Rebuild both tables in the shared form, keeping
+    // ids, rows and AUTOINCREMENT counters.
+    {2, "align users and patients between console and GUI",
+        "CREATE TEMP TABLE saved_sequence AS "
+        "    SELECT name, seq FROM sqlite_sequence WHERE name IN ('users', 'patients');"
+        
+        "CREATE TABLE users_new ("
+        "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "    username TEXT UNIQUE NOT NULL,"
+        "    password TEXT NOT NULL,"
+        "    role TEXT DEFAULT 'staff',"
+        "    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
+        ");"
+        // created_at resolves to the old column when it exists and to the
+        // fallback's otherwise
+        "INSERT INTO users_new (id, username, password, role, created_at) "
+        "    SELECT u.id, u.username, u.password, u.role, "
+        "           (SELECT created_at FROM users AS old WHERE old.id = u.id) "
+        "    FROM (SELECT CURRENT_TIMESTAMP AS created_at) AS fallback, users AS u;"
+        "DROP TABLE users;"
+        "ALTER TABLE users_new RENAME TO users;"
+        
+        "CREATE TABLE patients_new ("
+        "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "    name TEXT NOT NULL COLLATE NOCASE,"
+        "    age INTEGER,"
+        "    gender TEXT,"
+        "    contact TEXT,"
+        "    address TEXT,"
+        "    disease TEXT,"
+        "    admission_date DATE DEFAULT CURRENT_DATE,"
+        "    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
+        ");"
+        "INSERT INTO patients_new (id, name, age, gender, contact, address, disease, admission_date, created_at) "
+        "    SELECT id, name, age, gender, contact, address, disease, admission_date, created_at FROM patients;"
+        "DROP TABLE patients;"
+        "ALTER TABLE patients_new RENAME TO patients;"
+        
+        "DELETE FROM sqlite_sequence WHERE name IN (SELECT name FROM temp.saved_sequence);"
+        "INSERT INTO sqlite_sequence (name, seq) SELECT name, seq FROM temp.saved_sequence;"
+        "DROP TABLE temp.saved_sequence;"},
+    
+    // Dates become integer Julian day numbers and timestamps Unix seconds
+    // (both UTC, like CURRENT_DATE/CURRENT_TIMESTAMP before them), so date
+    // filters compare integers and resolve as range scans on the new
+    // indexes. Text only appears where dates are entered or displayed.
+    {3, "store dates as Julian day numbers and timestamps as Unix seconds",
+        "CREATE TEMP TABLE saved_sequence AS "
+        "    SELECT name, seq FROM sqlite_sequence WHERE name IN ('patients', 'bills', 'payments');"
+        
+        "CREATE TABLE patients_new ("
+        "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "    name TEXT NOT NULL COLLATE NOCASE,"
+        "    age INTEGER,"
+        "    gender TEXT,"
+        "    contact TEXT,"
+        "    address TEXT,"
+        "    disease TEXT,"
+        "    admission_date INTEGER DEFAULT (CAST(julianday('now') + 0.5 AS INTEGER)),"
+        "    created_at INTEGER DEFAULT (CAST(strftime('%s', 'now') AS INTEGER))"
+        ");"
+        "INSERT INTO patients_new (id, name, age, gender, contact, address, disease, admission_date, created_at) "
+        "    SELECT id, name, age, gender, contact, address, disease, "
+        "           CAST(julianday(admission_date) + 0.5 AS INTEGER), "
+        "           CAST(strftime('%s', created_at) AS INTEGER) FROM patients;"
+        "DROP TABLE patients;"
+        "ALTER TABLE patients_new RENAME TO patients;"
+        
+        "CREATE TABLE bills_new ("
+        "    bill_no INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "    patient_id INTEGER,"
+        "    patient_name TEXT,"
+        "    bill_date INTEGER DEFAULT (CAST(julianday('now') + 0.5 AS INTEGER)),"
+        "    room_charges REAL DEFAULT 0,"
+        "    doctor_fees REAL DEFAULT 0,"
+        "    medicine_charges REAL DEFAULT 0,"
+        "    lab_charges REAL DEFAULT 0,"
+        "    other_charges REAL DEFAULT 0,"
+        "    total_amount REAL DEFAULT 0,"
+        "    amount_paid REAL DEFAULT 0,"
+        "    balance_due REAL DEFAULT 0,"
+        "    payment_status TEXT DEFAULT 'Pending',"
+        "    payment_method TEXT,"
+        "    FOREIGN KEY (patient_id) REFERENCES patients(id) ON DELETE CASCADE"
+        ");"
+        "INSERT INTO bills_new SELECT bill_no, patient_id, patient_name, "
+        "    CAST(julianday(bill_date) + 0.5 AS INTEGER), room_charges, doctor_fees, "
+        "    medicine_charges, lab_charges, other_charges, total_amount, amount_paid, "
+        "    balance_due, payment_status, payment_method FROM bills;"
+        "DROP TABLE bills;"
+        "ALTER TABLE bills_new RENAME TO bills;"
+        
+        "CREATE TABLE payments_new ("
+        "    payment_id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "    bill_no INTEGER,"
+        "    amount REAL,"
+        "    payment_date INTEGER DEFAULT (CAST(strftime('%s', 'now') AS INTEGER)),"
+        "    payment_method TEXT,"
+        "    FOREIGN KEY (bill_no) REFERENCES bills(bill_no) ON DELETE CASCADE"
+        ");"
+        "INSERT INTO payments_new SELECT payment_id, bill_no, amount, "
+        "    CAST(strftime('%s', payment_date) AS INTEGER), payment_method FROM payments;"
+        "DROP TABLE payments;"
+        "ALTER TABLE payments_new RENAME TO payments;"
+        
+        "CREATE INDEX idx_patients_admission ON patients(admission_date);"
+        "CREATE INDEX idx_bills_date ON bills(bill_date);"
+        "CREATE INDEX idx_payments_date ON payments(payment_date);"
+        
+        "DELETE FROM sqlite_sequence WHERE name IN (SELECT name FROM temp.saved_sequence);"
+        "INSERT INTO sqlite_sequence (name, seq) SELECT name, seq FROM temp.saved_sequence;"
+        "DROP TABLE temp.saved_sequence;"},
+    
+    // Covering index over open bills only, in patient order, for the aging
+    // report; paid bills drop out of it as their balance reaches zero
+    {4, "index open balances by patient",
+        "CREATE INDEX idx_bills_open ON bills(patient_id, bill_date, balance_due) "
+        "    WHERE balance_due > 0;"},
+    
+    // Persisted t-digest / HyperLogLog sketches for the statistics screen and
+    // the last bill and patient id already folded into them
+    {5, "add statistics sketches",
+        "CREATE TABLE stat_sketches ("
+        "    name TEXT PRIMARY KEY,"
+        "    data BLOB NOT NULL,"
+        "    updated_at INTEGER DEFAULT (CAST(strftime('%s', 'now') AS INTEGER))"
+        ");"
+        "CREATE TABLE stat_watermarks ("
+        "    source TEXT PRIMARY KEY,"
+        "    last_id INTEGER NOT NULL DEFAULT 0"
+        ");"},
+    
+    // Discharge day (Julian day number, NULL while in house) for the census
+    {6, "add patient discharge dates",
+        "ALTER TABLE patients ADD COLUMN discharge_date INTEGER;"
+        "CREATE INDEX idx_patients_discharge ON patients(discharge_date);"},
+    
+    // Per-patient history in date order and payments by bill, so the
+    // statement run reads a patient range with one ordered scan
+    {7, "index bills by patient and payments by bill",
+        "CREATE INDEX idx_bills_patient ON bills(patient_id, bill_date);"
+        "CREATE INDEX idx_payments_bill ON payments(bill_no);"}
+};
+
+#define SCHEMA_VERSION ((int)(sizeof(migrations) / sizeof(migrations[0])))
+
+static int schema_version(sqlite3 *conn) {
+    sqlite3_stmt *stmt;
+    int version = -1;
+    if (sqlite3_prepare_v2(conn, "PRAGMA user_version", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
+
+// Bring conn up to SCHEMA_VERSION. Pending migrations run in one
+// IMMEDIATE transaction, and the version is read again once the write lock
+// is held in case another program upgraded the database meanwhile. Foreign
+// keys are off while tables are rebuilt. Returns an SQLite result code.
+int run_migrations(sqlite3 *conn, const char *applied_by) {
+    int version = schema_version(conn);
+    if (version >= SCHEMA_VERSION) {
+        if (version > SCHEMA_VERSION) {
+            printf("Warning: database schema v%d is newer than this program (v%d).\n", version, SCHEMA_VERSION);
+        }
+        return SQLITE_OK;
+    }
+    
+    sqlite3_exec(conn, "PRAGMA foreign_keys = OFF;", 0, 0, 0);
+    int rc = sqlite3_exec(conn, "BEGIN IMMEDIATE", 0, 0, 0);
+    if (rc == SQLITE_OK) {
+        version = schema_version(conn);
+    }
     
     char *err_msg = 0;
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    for (int i = 0; rc == SQLITE_OK && i < SCHEMA_VERSION; i++) {
+        const Migration *migration = &migrations[i];
+        if (migration->version <= version) {
+            continue;
+        }
+        rc = sqlite3_exec(conn, migration->sql, 0, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            printf("Schema migration %d (%s) failed: %s\n", migration->version, migration->description, err_msg);
+            sqlite3_free(err_msg);
+            break;
+        }
+        
+        sqlite3_stmt *stmt;
+        rc = sqlite3_prepare_v2(conn, "INSERT OR REPLACE INTO schema_migrations (version, description, applied_by) "
+                                      "VALUES (?, ?, ?)", -1, &stmt, 0);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int(stmt, 1, migration->version);
+            sqlite3_bind_text(stmt, 2, migration->description, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, applied_by, -1, SQLITE_STATIC);
+            rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(conn);
+            sqlite3_finalize(stmt);
+        }
+        
+        char pragma[64];
+        snprintf(pragma, sizeof(pragma), "PRAGMA user_version = %d;", migration->version);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(conn, pragma, 0, 0, 0);
+        }
+        if (rc == SQLITE_OK) {
+            printf("Applied schema migration %d: %s\n", migration->version, migration->description);
+        }
+    }
+    
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(conn, "COMMIT", 0, 0, 0);
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_exec(conn, "ROLLBACK", 0, 0, 0);
+    }
+    sqlite3_exec(conn, "PRAGMA foreign_keys = ON;", 0, 0, 0);
+    return rc;
+}
+
+void init_database() {
+    int rc = sqlite3_open(db_path, &db);
+    if (rc != SQLITE_OK) {
+        printf("Cannot open database: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    memory_budget_connection(db);
+    
+    // Set UTF-8 encoding for the database
+    sqlite3_exec(db, "PRAGMA encoding = 'UTF-8';", 0, 0, 0);
+    
+    // Create or upgrade tables; a current database runs no DDL at all
+    rc = run_migrations(db, "console");
     if (rc != SQLITE_OK) {
-        printf("SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+        printf("SQL error: %s\n", sqlite3_errstr(rc));
     }
     
     // Enable foreign keys
     sqlite3_exec(db, "PRAGMA foreign_keys = ON;", 0, 0, 0);
     
-    // Insert default admin user if not exists
-    sql = "INSERT OR IGNORE INTO users (username, password, role) VALUES "
-          "('admin', 'admin123', 'admin'),"
-          "('staff', 'staff123', 'staff');";
-    sqlite3_exec(db, sql, 0, 0, 0);
+    // Build the in-memory price catalog
+    load_charge_master(db);
+    
+    // Keep the report replica and query cache in step with writes
+    watch_database_changes(db);
     
     printf("Database initialized successfully!\n");
 }
 
 void close_database() {
+    jobs_stop();
+    wal_archive_stop();
+    free_charge_master();
+    replica_close();
     if (db) {
         sqlite3_close(db);
     }
@@ -290,15 +1428,27 @@ void print_header(const char *title) {
     printf("════════════════════════════════════════════════════\n");
 }
 
+// While replaying, fetch the next recorded input of the given type into
+// *value and return 1; *value is NULL when the recording has no matching
+// input left and the caller should use a default. Returns 0 when not replaying.
+static int script_input(char type, const char **value);
+
 int get_choice(int min, int max) {
     int choice;
     char input[10];
     
+    const char *scripted;
+    if (script_input('c', &scripted)) {
+        return scripted ? atoi(scripted) : min;
+    }
+    
     while (1) {
         printf("\nEnter choice (%d-%d, 0 to exit): ", min, max);
-        if (fgets(input, sizeof(input), stdin) != NULL) {
+        if (query_watch_read(input, sizeof(input)) != NULL) {
             if (sscanf(input, "%d", &choice) == 1) {
                 if (choice == 0 || (choice >= min && choice <= max)) {
+                    snprintf(input, sizeof(input), "%d", choice);
+                    trace_input('c', input);
                     return choice;
                 }
             }
@@ -309,20 +1459,42 @@ int get_choice(int min, int max) {
 
 void get_string(const char *prompt, char *buffer, size_t size) {
     printf("%s", prompt);
-    if (fgets(buffer, size, stdin) != NULL) {
+    
+    const char *scripted;
+    if (script_input('s', &scripted)) {
+        snprintf(buffer, size, "%s", scripted ? scripted : "");
+        return;
+    }
+    
+    if (query_watch_read(buffer, size) != NULL) {
         buffer[strcspn(buffer, "\n")] = '\0';
+        trace_input('s', buffer);
     }
 }
 
+// Ask a y/n question; returns 1 only for an answer starting with y/Y
+int get_confirmation(const char *prompt) {
+    char answer[10] = "";
+    get_string(prompt, answer, sizeof(answer));
+    return answer[0] == 'y' || answer[0] == 'Y';
+}
+
 int get_integer(const char *prompt, int min, int max) {
     int value;
     char input[20];
     
+    const char *scripted;
+    if (script_input('i', &scripted)) {
+        return scripted ? atoi(scripted) : min;
+    }
+    
     while (1) {
         printf("%s", prompt);
-        if (fgets(input, sizeof(input), stdin) != NULL) {
+        if (query_watch_read(input, sizeof(input)) != NULL) {
             if (sscanf(input, "%d", &value) == 1) {
                 if (value >= min && value <= max) {
+                    snprintf(input, sizeof(input), "%d", value);
+                    trace_input('i', input);
                     return value;
                 }
             }
@@ -331,27 +1503,650 @@ int get_integer(const char *prompt, int min, int max) {
     }
 }
 
-float get_float(const char *prompt, float min, float max) {
-    float value;
-    char input[20];
+// Read a patient ID or bill number. Ids are 64-bit like the rowids they
+// name, so there is no upper limit short of INT64_MAX; min is 0 where 0
+// means "all". Traced as an 'i' input like get_integer.
+long long get_id(const char *prompt, long long min) {
+    long long value;
+    char input[32];
+    
+    const char *scripted;
+    if (script_input('i', &scripted)) {
+        return scripted ? atoll(scripted) : min;
+    }
     
     while (1) {
         printf("%s", prompt);
-        if (fgets(input, sizeof(input), stdin) != NULL) {
-            if (sscanf(input, "%f", &value) == 1) {
-                if (value >= min && value <= max) {
-                    return value;
-                }
+        if (query_watch_read(input, sizeof(input)) != NULL) {
+            char *end;
+            errno = 0;
+            value = strtoll(input, &end, 10);
+            while (isspace((unsigned char)*end)) end++;
+            if (end != input && *end == '\0' && errno == 0 && value >= min) {
+                snprintf(input, sizeof(input), "%lld", value);
+                trace_input('i', input);
+                return value;
             }
         }
-        printf("Please enter a number between %.2f and %.2f.\n", min, max);
+        printf("Please enter a number of at least %lld.\n", min);
     }
 }
 
-// ==================== MAIN MENU ====================
-
-void display_main_menu() {
-    clear_screen();
+double get_double(const char *prompt, double min, double max) {
+    double value;
+    char input[32];
+    
+    const char *scripted;
+    if (script_input('f', &scripted)) {
+        return scripted ? atof(scripted) : min;
+    }
+    
+    while (1) {
+        printf("%s", prompt);
+        if (query_watch_read(input, sizeof(input)) != NULL) {
+            if (sscanf(input, "%lf", &value) == 1) {
+                if (value >= min && value <= max) {
+                    snprintf(input, sizeof(input), "%.17g", value);
+                    trace_input('f', input);
+                    return value;
+                }
+            }
+        }
+        printf("Please enter a number between %.2f and %.2f.\n", min, max);
+    }
+}
+
+// Monotonic wall-clock time in seconds, for throughput figures
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ==================== DATES ====================
+
+// Days since 1970-01-01 for a proleptic Gregorian date
+static long long days_from_civil(int year, int month, int day) {
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    long long yoe = year - era * 400;
+    long long doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Civil date from days since 1970-01-01 (proleptic Gregorian)
+static void civil_from_days(long long days, int *year, int *month, int *day) {
+    int64_t z = (int64_t)days + 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+    *day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *year = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+// Parse "YYYY-MM-DD" into a Julian day number. Returns 1 for a valid
+// calendar date, 0 otherwise.
+int parse_date(const char *text, long long *julian_day) {
+    static const int month_days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int year, month, day, length = 0;
+    if (sscanf(text, "%4d-%2d-%2d%n", &year, &month, &day, &length) != 3 || text[length] != '\0' ||
+        year < 1 || month < 1 || month > 12 || day < 1) {
+        return 0;
+    }
+    int leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    if (day > month_days[month - 1] + (month == 2 && leap)) {
+        return 0;
+    }
+    *julian_day = days_from_civil(year, month, day) + JULIAN_DAY_UNIX_EPOCH;
+    return 1;
+}
+
+// Today's date in UTC as a Julian day number. Stored dates are UTC days
+// (the column defaults use julianday('now')), so a date entered as "today"
+// matches the defaults even near local midnight.
+long long today_julian_day() {
+    time_t t = time(NULL);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return days_from_civil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) + JULIAN_DAY_UNIX_EPOCH;
+}
+
+void format_date(long long julian_day, char *buffer, size_t size) {
+    int year, month, day;
+    civil_from_days(julian_day - JULIAN_DAY_UNIX_EPOCH, &year, &month, &day);
+    snprintf(buffer, size, "%04d-%02d-%02d", year, month, day);
+}
+
+// "YYYY-MM-DD HH:MM:SS" in UTC, the form CURRENT_TIMESTAMP used to store
+void format_timestamp(long long seconds, char *buffer, size_t size) {
+    long long days = seconds / SECONDS_PER_DAY;
+    long long rest = seconds % SECONDS_PER_DAY;
+    if (rest < 0) {
+        days--;
+        rest += SECONDS_PER_DAY;
+    }
+    int year, month, day;
+    civil_from_days(days, &year, &month, &day);
+    snprintf(buffer, size, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day,
+             (int)(rest / 3600), (int)(rest / 60 % 60), (int)(rest % 60));
+}
+
+// Offer to restrict a listing to a date range. Returns 0 to list everything,
+// or 1 with inclusive Julian day bounds in *first_day and *last_day; a blank
+// bound leaves that end open.
+int get_date_range(long long *first_day, long long *last_day) {
+    if (!get_confirmation("Filter by date range? (y/n): ")) {
+        return 0;
+    }
+    
+    char text[16];
+    *first_day = days_from_civil(1, 1, 1) + JULIAN_DAY_UNIX_EPOCH;
+    *last_day = days_from_civil(9999, 12, 31) + JULIAN_DAY_UNIX_EPOCH;
+    while (1) {
+        get_string("From date (YYYY-MM-DD, enter for earliest): ", text, sizeof(text));
+        if (text[0] == '\0' || parse_date(text, first_day)) break;
+        printf("Invalid date! Please use YYYY-MM-DD.\n");
+    }
+    while (1) {
+        get_string("To date (YYYY-MM-DD, enter for latest): ", text, sizeof(text));
+        if (text[0] == '\0' || parse_date(text, last_day)) break;
+        printf("Invalid date! Please use YYYY-MM-DD.\n");
+    }
+    return 1;
+}
+
+// ==================== TEXT WIDTH ====================
+
+// Decode one UTF-8 sequence starting at s. Stores the byte length in *len
+// and returns the code point (U+FFFD for malformed input).
+static unsigned int utf8_decode(const unsigned char *s, int *len) {
+    if (s[0] < 0x80) {
+        *len = 1;
+        return s[0];
+    }
+    int n = (s[0] & 0xE0) == 0xC0 ? 2 : (s[0] & 0xF0) == 0xE0 ? 3 : (s[0] & 0xF8) == 0xF0 ? 4 : 0;
+    if (n == 0) {
+        *len = 1;
+        return 0xFFFD;
+    }
+    unsigned int cp = s[0] & (0x7F >> n);
+    for (int i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            *len = i;
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    *len = n;
+    return cp;
+}
+
+// Terminal columns taken by a code point: 2 for wide (CJK) characters,
+// 0 for combining marks, and 1 for anything unprintable (shown as a space)
+static int codepoint_width(unsigned int cp) {
+    int width = wcwidth((wchar_t)cp);
+    return width < 0 ? 1 : width;
+}
+
+static int display_width(const char *text) {
+    int width = 0, len;
+    for (const unsigned char *p = (const unsigned char*)text; *p; p += len) {
+        width += codepoint_width(utf8_decode(p, &len));
+    }
+    return width;
+}
+
+// ==================== OUTPUT BUFFER ====================
+
+void output_init(OutputBuffer *out, int fd) {
+    memset(out, 0, sizeof(*out));
+    out->fd = fd;
+}
+
+// Make room for extra more bytes. Returns a pointer to the free space, or
+// NULL if the buffer cannot grow.
+char *output_reserve(OutputBuffer *out, size_t extra) {
+    if (out->length + extra > out->capacity) {
+        size_t capacity = out->capacity ? out->capacity : OUTPUT_FLUSH_BYTES * 2;
+        while (capacity < out->length + extra) {
+            capacity *= 2;
+        }
+        char *grown = realloc(out->data, capacity);
+        if (!grown) {
+            return NULL;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+    return out->data + out->length;
+}
+
+void output_append(OutputBuffer *out, const char *text, size_t length) {
+    char *dest = output_reserve(out, length);
+    if (dest) {
+        memcpy(dest, text, length);
+        out->length += length;
+    }
+}
+
+// Write the buffer out with as few write() calls as possible
+void output_flush(OutputBuffer *out) {
+    if (out->fd == STDOUT_FILENO) {
+        query_watch_clear_line();
+    }
+    size_t written = 0;
+    while (written < out->length && !out->failed) {
+        ssize_t n = write(out->fd, out->data + written, out->length - written);
+        if (n <= 0) {
+            out->failed = 1;
+            break;
+        }
+        written += n;
+    }
+    out->length = 0;
+}
+
+void output_free(OutputBuffer *out) {
+    free(out->data);
+    out->data = NULL;
+    out->length = out->capacity = 0;
+}
+
+// ==================== TABLE RENDERER ====================
+
+static void table_append(TableRenderer *table, const char *text, size_t length) {
+    output_append(&table->out, text, length);
+}
+
+// stdout is flushed first so earlier printf output stays in order
+static void table_flush(TableRenderer *table) {
+    fflush(table->file);
+    output_flush(&table->out);
+}
+
+// Append text fitted to exactly width terminal columns: truncated at a
+// character boundary with "…" if too wide, padded with spaces otherwise.
+// Control characters are rendered as spaces.
+static void table_append_cell(TableRenderer *table, const char *text, int width, int align_right) {
+    const unsigned char *p = (const unsigned char*)(text ? text : "");
+    int text_width = display_width((const char*)p);
+    int fits = text_width <= width;
+    int limit = fits ? width : width - 1;
+    
+    char cell[1024];
+    size_t out = 0;
+    int used = 0, len;
+    
+    while (*p && out + 8 < sizeof(cell)) {
+        unsigned int cp = utf8_decode(p, &len);
+        int w = codepoint_width(cp);
+        if (used + w > limit) {
+            break;
+        }
+        if (cp < 0x20 || cp == 0x7F) {
+            cell[out++] = ' ';
+        } else {
+            memcpy(cell + out, p, len);
+            out += len;
+        }
+        used += w;
+        p += len;
+    }
+    if (!fits && width > 0) {
+        memcpy(cell + out, "…", 3);
+        out += 3;
+        used++;
+    }
+    
+    char padding[256];
+    int pad = width - used;
+    if (pad > (int)sizeof(padding)) pad = sizeof(padding);
+    if (pad > 0) memset(padding, ' ', pad);
+    
+    if (align_right && pad > 0) table_append(table, padding, pad);
+    table_append(table, cell, out);
+    if (!align_right && pad > 0) table_append(table, padding, pad);
+}
+
+static void table_format_row(TableRenderer *table, const char **cells) {
+    for (int i = 0; i < table->column_count; i++) {
+        if (i > 0) {
+            table_append(table, " ", 1);
+        }
+        table_append_cell(table, cells[i], table->widths[i], table->columns[i].align_right);
+    }
+    table_append(table, "\n", 1);
+}
+
+// Show the pager prompt once a screenful has been written. Reads the reply
+// straight from stdin so it never ends up in a session trace.
+static void table_page_break(TableRenderer *table) {
+    if (table->page_rows == 0 || ++table->page_fill < table->page_rows) {
+        return;
+    }
+    table_flush(table);
+    table->page_fill = 0;
+    
+    printf("-- %lld rows shown -- Enter: next page, a: show all, q: stop listing ", table->rows);
+    fflush(stdout);
+    
+    char reply[16];
+    if (query_watch_read(reply, sizeof(reply)) == NULL || reply[0] == 'q' || reply[0] == 'Q') {
+        table->stopped = 1;
+    } else if (reply[0] == 'a' || reply[0] == 'A') {
+        table->page_rows = 0;
+    }
+}
+
+static void table_emit_header(TableRenderer *table) {
+    const char *titles[TABLE_MAX_COLUMNS];
+    int total = 0;
+    for (int i = 0; i < table->column_count; i++) {
+        titles[i] = table->columns[i].title;
+        total += table->widths[i] + (i > 0);
+    }
+    table_format_row(table, titles);
+    for (int i = 0; i < total; i++) {
+        table_append(table, "═", 3);
+    }
+    table_append(table, "\n", 1);
+}
+
+// Fix column widths from the sampled rows, then emit the header and the
+// sampled rows themselves
+static void table_fix_widths(TableRenderer *table) {
+    for (int i = 0; i < table->column_count; i++) {
+        int width = display_width(table->columns[i].title);
+        for (int r = 0; r < table->sample_count; r++) {
+            int w = display_width(table->sample[r * table->column_count + i]);
+            if (w > width) width = w;
+        }
+        if (table->columns[i].max_width > 0 && width > table->columns[i].max_width) {
+            width = table->columns[i].max_width;
+        }
+        table->widths[i] = width;
+    }
+    table->widths_fixed = 1;
+    
+    table_emit_header(table);
+    for (int r = 0; r < table->sample_count && !table->stopped; r++) {
+        table_format_row(table, (const char**)&table->sample[r * table->column_count]);
+        table_page_break(table);
+    }
+    for (int r = 0; r < table->sample_count * table->column_count; r++) {
+        free(table->sample[r]);
+    }
+    free(table->sample);
+    table->sample = NULL;
+}
+
+void table_begin(TableRenderer *table, const TableColumn *columns, int column_count) {
+    table_begin_file(table, columns, column_count, stdout);
+}
+
+// Render into file instead of stdout; the file's own buffered output is
+// flushed first so the two stay in order
+void table_begin_file(TableRenderer *table, const TableColumn *columns, int column_count, FILE *file) {
+    memset(table, 0, sizeof(*table));
+    table->columns = columns;
+    table->column_count = column_count < TABLE_MAX_COLUMNS ? column_count : TABLE_MAX_COLUMNS;
+    table->file = file;
+    fflush(file);
+    output_init(&table->out, fileno(file));
+    table->sample = malloc(TABLE_SAMPLE_ROWS * table->column_count * sizeof(char*));
+    
+    // Page only when a person is reading the output on a terminal
+    struct winsize ws;
+    if (isatty(table->out.fd) && isatty(STDIN_FILENO)) {
+        int rows = ioctl(table->out.fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 ? ws.ws_row : 24;
+        table->page_rows = rows > 8 ? rows - 4 : 4;
+    }
+}
+
+// Add one row of pre-formatted cells (NULL cells print as empty). Rows after
+// the user quits the pager are ignored, so callers can keep iterating to
+// finish their summary totals.
+void table_row(TableRenderer *table, const char **cells) {
+    if (table->stopped) {
+        return;
+    }
+    table->rows++;
+    query_watch_row();
+    
+    if (!table->widths_fixed) {
+        if (table->sample) {
+            for (int i = 0; i < table->column_count; i++) {
+                table->sample[table->sample_count * table->column_count + i] =
+                    strdup(cells[i] ? cells[i] : "");
+            }
+            if (++table->sample_count < TABLE_SAMPLE_ROWS) {
+                return;
+            }
+        }
+        table_fix_widths(table);
+        if (!table->sample_count) {
+            table_format_row(table, cells);
+            table_page_break(table);
+        }
+        return;
+    }
+    
+    table_format_row(table, cells);
+    if (table->out.length >= OUTPUT_FLUSH_BYTES) {
+        table_flush(table);
+    }
+    table_page_break(table);
+}
+
+// Flush remaining rows. An empty table prints nothing, not even a header,
+// so callers can print their own "nothing found" message.
+void table_end(TableRenderer *table) {
+    if (!table->widths_fixed && table->rows > 0) {
+        table_fix_widths(table);
+    }
+    free(table->sample);
+    table->sample = NULL;
+    table_flush(table);
+    output_free(&table->out);
+}
+
+// ==================== QUERY PROGRESS ====================
+
+// Parse OPTION=SECONDS for --time-budget; OPTION "all" sets every option
+int set_time_budget(const char *spec) {
+    const char *equals = strchr(spec, '=');
+    if (!equals) {
+        return 0;
+    }
+    char *end;
+    double seconds = strtod(equals + 1, &end);
+    if (*end != '\0' || end == equals + 1 || seconds < 0) {
+        return 0;
+    }
+    if (strncmp(spec, "all=", 4) == 0) {
+        for (int i = 1; i <= MENU_MAX_CHOICE; i++) {
+            menu_time_budgets[i] = seconds;
+        }
+        return 1;
+    }
+    int option = atoi(spec);
+    if (option < 1 || option > MENU_MAX_CHOICE) {
+        return 0;
+    }
+    menu_time_budgets[option] = seconds;
+    return 1;
+}
+
+// SIGINT while a menu option runs interrupts its connections. A second
+// Ctrl-C before the first has been acted on, or one at the main menu,
+// ends the program as before. At a prompt (such as the pager's) the
+// listing's statement is only paused, so it is left alone.
+static void query_interrupt_signal(int sig) {
+    QueryWatch *watch = &query_watch;
+    if (!watch->active || watch->interrupt_at > watch->handled_at) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+        return;
+    }
+    watch->interrupt_at = now_seconds();
+    if (watch->idle) {
+        return;
+    }
+    if (watch->conn) {
+        sqlite3_interrupt(watch->conn);
+    }
+    if (report_replica.conn) {
+        sqlite3_interrupt(report_replica.conn);
+    }
+}
+
+void install_interrupt_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = query_interrupt_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+}
+
+// Erase the progress line, if one is showing
+void query_watch_clear_line() {
+    QueryWatch *watch = &query_watch;
+    if (watch->shown) {
+        fprintf(stderr, "\r\033[K");
+        watch->shown = 0;
+    }
+}
+
+// Check the running option's query: called from the progress handler on
+// its connection and between steps of long non-SQL work. Returns 1 if the
+// work should stop (Ctrl-C, or the time budget is used up).
+int query_watch_poll() {
+    QueryWatch *watch = &query_watch;
+    double now = now_seconds();
+    double gap = now - watch->last_call;
+    int running = gap < QUERY_IDLE_GAP;     // same query as the last call
+    if (running) {
+        watch->busy += gap;
+    }
+    watch->last_call = now;
+    
+    if (watch->interrupt_at > watch->handled_at) {
+        watch->handled_at = watch->interrupt_at;
+        if (running) {
+            query_watch_clear_line();
+            fprintf(stderr, "Cancelled; output may be incomplete.\n");
+            return 1;
+        }
+    }
+    if (watch->budget > 0 && watch->busy > watch->budget) {
+        if (!watch->timed_out) {
+            query_watch_clear_line();
+            fprintf(stderr, "Stopped after %g s, this option's time budget; output may be incomplete.\n",
+                    watch->budget);
+        }
+        watch->timed_out = 1;
+        return 1;
+    }
+    if (watch->busy >= QUERY_PROGRESS_DELAY && now - watch->last_shown >= 0.25 && isatty(STDERR_FILENO)) {
+        fprintf(stderr, "\r  %lld %s, %.1f s (Ctrl-C to cancel)\033[K\r", watch->rows, watch->unit, watch->busy);
+        watch->shown = 1;
+        watch->last_shown = now;
+    }
+    return 0;
+}
+
+// The main connection's handler reports and times the query; worker
+// connections (arg NULL) only stop when the user presses Ctrl-C or the
+// option has been busy for longer than its budget since the last input.
+static int query_progress(void *arg) {
+    QueryWatch *watch = &query_watch;
+    if (arg) {
+        return query_watch_poll();
+    }
+    return watch->interrupt_at > watch->handled_at || watch->timed_out ||
+           (watch->budget > 0 && now_seconds() - watch->handled_at > watch->budget);
+}
+
+void query_watch_begin(int choice) {
+    QueryWatch *watch = &query_watch;
+    watch->budget = menu_time_budgets[choice];
+    watch->busy = 0;
+    watch->rows = 0;
+    watch->unit = "rows";
+    watch->timed_out = 0;
+    watch->last_call = watch->last_shown = 0;
+    watch->handled_at = now_seconds();
+    watch->active = 1;
+    query_watch_attach(db);
+    if (report_replica.conn) {
+        sqlite3_progress_handler(report_replica.conn, QUERY_PROGRESS_OPS, query_progress, watch);
+    }
+}
+
+void query_watch_end() {
+    QueryWatch *watch = &query_watch;
+    query_watch_clear_line();
+    query_watch_attach(NULL);
+    if (report_replica.conn) {
+        sqlite3_progress_handler(report_replica.conn, 0, NULL, NULL);
+    }
+    watch->active = 0;
+}
+
+// Point the watch at the option's connection (NULL while it is closed, as
+// during a restore)
+void query_watch_attach(sqlite3 *conn) {
+    QueryWatch *watch = &query_watch;
+    if (watch->conn && watch->conn != conn) {
+        sqlite3_progress_handler(watch->conn, 0, NULL, NULL);
+    }
+    watch->conn = conn;
+    if (conn && watch->active) {
+        sqlite3_progress_handler(conn, QUERY_PROGRESS_OPS, query_progress, watch);
+    }
+}
+
+// Let Ctrl-C and the time budget stop a worker thread's connection too
+void query_watch_connection(sqlite3 *conn) {
+    if (query_watch.active) {
+        sqlite3_progress_handler(conn, QUERY_PROGRESS_OPS, query_progress, NULL);
+    }
+}
+
+// Read a line of input for the running option: time spent waiting is not
+// query time, and a Ctrl-C pressed at the prompt is dropped
+char *query_watch_read(char *buffer, int size) {
+    QueryWatch *watch = &query_watch;
+    if (!watch->active) {
+        return fgets(buffer, size, stdin);
+    }
+    query_watch_clear_line();
+    watch->handled_at = now_seconds();
+    watch->idle = 1;
+    char *line = fgets(buffer, size, stdin);
+    watch->idle = 0;
+    watch->handled_at = now_seconds();
+    watch->last_call = 0;
+    return line;
+}
+
+// Count a result row for the option's progress line. db is per thread, so
+// rows produced on a background job's connection are left out.
+void query_watch_row() {
+    if (query_watch.active && db == query_watch.conn) {
+        query_watch.rows++;
+    }
+}
+
+// ==================== MAIN MENU ====================
+
+void display_main_menu() {
+    clear_screen();
     printf("\n════════════════════════════════════════════════════\n");
     printf("           HOSPITAL BILLING SYSTEM - MAIN MENU       \n");
     printf("════════════════════════════════════════════════════\n");
@@ -371,6 +2166,20 @@ void display_main_menu() {
     printf("   14. Backup Database\n");
     printf("   15. Restore Database\n");
     printf("   16. Export Data\n");
+    printf("   17. Load Charge Master Catalog\n");
+    printf("   18. Import Bank Remittances\n");
+    printf("   19. Batch Billing Run\n");
+    printf("   20. Batch Print Receipts\n");
+    printf("   21. Monthly Patient Statements\n");
+    printf("   22. Reconcile Ledger\n");
+    printf("   23. Memory Statistics\n");
+    printf("   24. Background Jobs\n");
+    
+    int pending = jobs_pending();
+    int finished = jobs_unseen();
+    if (pending > 0 || finished > 0) {
+        printf("\n   Background jobs: %d running or queued, %d finished (see 24)\n", pending, finished);
+    }
     printf("\n   0.  Exit\n");
 }
 
@@ -382,61 +2191,39 @@ void add_patient() {
     
     char name[100], gender[10], contact[20], address[200], disease[100];
     int age;
-    char admission_date[11];
+    char admission_date[16];
+    long long admission_day;
     
     get_string("Patient Name: ", name, sizeof(name));
     age = get_integer("Age: ", 1, 120);
     
-    printf("Gender (M/F/O): ");
-    fgets(gender, sizeof(gender), stdin);
-    gender[strcspn(gender, "\n")] = 0;
+    get_string("Gender (M/F/O): ", gender, sizeof(gender));
     
     get_string("Contact Number: ", contact, sizeof(contact));
     get_string("Address: ", address, sizeof(address));
     get_string("Disease/Diagnosis: ", disease, sizeof(disease));
     
-    printf("Admission Date (YYYY-MM-DD, enter for today): ");
-    fgets(admission_date, sizeof(admission_date), stdin);
-    admission_date[strcspn(admission_date, "\n")] = 0;
-    
-    if (strlen(admission_date) == 0) {
-        time_t t = time(NULL);
-        struct tm *tm = localtime(&t);
-        strftime(admission_date, sizeof(admission_date), "%Y-%m-%d", tm);
+    while (1) {
+        get_string("Admission Date (YYYY-MM-DD, enter for today): ", admission_date, sizeof(admission_date));
+        if (strlen(admission_date) == 0) {
+            admission_day = today_julian_day();
+            break;
+        }
+        if (parse_date(admission_date, &admission_day)) break;
+        printf("Invalid date! Please use YYYY-MM-DD.\n");
     }
     
-    // Use parameterized query to prevent SQL injection and handle UTF-8
-    const char *sql = "INSERT INTO patients (name, age, gender, contact, address, disease, admission_date) "
-                      "VALUES (?, ?, ?, ?, ?, ?, ?)";
-    sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    long long patient_id;
+    int rc = db_add_patient(db, name, age, gender, contact, address, disease,
+                            admission_day, &patient_id);
     
     if (rc != SQLITE_OK) {
-        printf("\n❌ Database error: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-    
-    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, age);
-    sqlite3_bind_text(stmt, 3, gender, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 4, contact, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 5, address, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 6, disease, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 7, admission_date, -1, SQLITE_STATIC);
-    
-    rc = sqlite3_step(stmt);
-    
-    if (rc != SQLITE_DONE) {
         printf("\n❌ Error adding patient: %s\n", sqlite3_errmsg(db));
     } else {
         printf("\n✅ Patient added successfully!\n");
-        printf("   Patient ID: %lld\n", sqlite3_last_insert_rowid(db));
+        printf("   Patient ID: %lld\n", patient_id);
     }
     
-    sqlite3_finalize(stmt);
-    
     printf("\nPress Enter to continue...");
     getchar();
 }
@@ -445,7 +2232,12 @@ void view_patients() {
     clear_screen();
     print_header("ALL PATIENTS");
     
-    const char *sql = "SELECT id, name, age, gender, contact, admission_date FROM patients ORDER BY name";
+    long long first_day, last_day;
+    int ranged = get_date_range(&first_day, &last_day);
+    const char *sql = ranged
+        ? "SELECT id, name, age, gender, contact, admission_date FROM patients "
+          "WHERE admission_date BETWEEN ? AND ? ORDER BY name"
+        : "SELECT id, name, age, gender, contact, admission_date FROM patients ORDER BY name";
     sqlite3_stmt *stmt;
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
@@ -454,26 +2246,38 @@ void view_patients() {
         getchar();
         return;
     }
+    if (ranged) {
+        sqlite3_bind_int64(stmt, 1, first_day);
+        sqlite3_bind_int64(stmt, 2, last_day);
+    }
     
-    printf("ID   Name                          Age Gender Contact       Admission\n");
-    printf("══════════════════════════════════════════════════════════════════════\n");
+    static const TableColumn columns[] = {
+        {"ID", 0, 1}, {"Name", 30, 0}, {"Age", 0, 1}, {"Gender", 6, 0},
+        {"Contact", 15, 0}, {"Admission", 12, 0}
+    };
+    TableRenderer table;
+    table_begin(&table, columns, 6);
     
     int count = 0;
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         count++;
-        int id = sqlite3_column_int(stmt, 0);
-        const unsigned char *name = sqlite3_column_text(stmt, 1);
-        int age = sqlite3_column_int(stmt, 2);
         const unsigned char *gender = sqlite3_column_text(stmt, 3);
         const unsigned char *contact = sqlite3_column_text(stmt, 4);
-        const unsigned char *admission_date = sqlite3_column_text(stmt, 5);
+        char admission_date[16] = "N/A";
+        if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
+            format_date(sqlite3_column_int64(stmt, 5), admission_date, sizeof(admission_date));
+        }
         
-        printf("%-4d %-30s %-3d %-6s %-12s %s\n", 
-               id, name ? (const char*)name : "N/A", 
-               age, gender ? (const char*)gender : "N/A", 
-               contact ? (const char*)contact : "N/A", 
-               admission_date ? (const char*)admission_date : "N/A");
+        const char *cells[6];
+        cells[0] = (const char*)sqlite3_column_text(stmt, 0);
+        cells[1] = (const char*)sqlite3_column_text(stmt, 1);
+        cells[2] = (const char*)sqlite3_column_text(stmt, 2);
+        cells[3] = gender ? (const char*)gender : "N/A";
+        cells[4] = contact ? (const char*)contact : "N/A";
+        cells[5] = admission_date;
+        table_row(&table, cells);
     }
+    table_end(&table);
     
     sqlite3_finalize(stmt);
     
@@ -500,9 +2304,7 @@ void search_patient() {
     int choice = get_choice(1, 3);
     char search_term[100];
     
-    printf("Enter search term: ");
-    fgets(search_term, sizeof(search_term), stdin);
-    search_term[strcspn(search_term, "\n")] = 0;
+    get_string("Enter search term: ", search_term, sizeof(search_term));
     
     const char *sql;
     sqlite3_stmt *stmt;
@@ -537,34 +2339,40 @@ void search_patient() {
             getchar();
             return;
         }
-        int id = atoi(search_term);
-        sqlite3_bind_int(stmt, 1, id);
+        sqlite3_bind_int64(stmt, 1, strtoll(search_term, NULL, 10));
     }
     
     printf("\nSearch Results:\n");
-    printf("════════════════════════════════════════════════════\n");
+    
+    static const TableColumn columns[] = {
+        {"ID", 0, 1}, {"Name", 30, 0}, {"Age", 0, 1}, {"Gender", 6, 0},
+        {"Contact", 15, 0}, {"Address", 30, 0}, {"Disease", 20, 0}, {"Admission", 12, 0},
+        {"Discharge", 12, 0}
+    };
+    TableRenderer table;
+    table_begin(&table, columns, 9);
     
     int found = 0;
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         found = 1;
-        int id = sqlite3_column_int(stmt, 0);
-        const unsigned char *name = sqlite3_column_text(stmt, 1);
-        int age = sqlite3_column_int(stmt, 2);
-        const unsigned char *gender = sqlite3_column_text(stmt, 3);
-        const unsigned char *contact = sqlite3_column_text(stmt, 4);
-        const unsigned char *address = sqlite3_column_text(stmt, 5);
-        const unsigned char *disease = sqlite3_column_text(stmt, 6);
-        const unsigned char *admission_date = sqlite3_column_text(stmt, 7);
-        
-        printf("\nPatient ID: %d\n", id);
-        printf("Name: %s\n", name ? (const char*)name : "N/A");
-        printf("Age: %d | Gender: %s\n", age, gender ? (const char*)gender : "N/A");
-        printf("Contact: %s\n", contact ? (const char*)contact : "N/A");
-        printf("Address: %s\n", address ? (const char*)address : "N/A");
-        printf("Disease: %s\n", disease ? (const char*)disease : "N/A");
-        printf("Admission Date: %s\n", admission_date ? (const char*)admission_date : "N/A");
-        printf("────────────────────────────────────────────────\n");
+        const char *cells[9];
+        for (int i = 0; i < 7; i++) {
+            const unsigned char *text = sqlite3_column_text(stmt, i);
+            cells[i] = text ? (const char*)text : "N/A";
+        }
+        char admission_date[16] = "N/A";
+        if (sqlite3_column_type(stmt, 7) != SQLITE_NULL) {
+            format_date(sqlite3_column_int64(stmt, 7), admission_date, sizeof(admission_date));
+        }
+        cells[7] = admission_date;
+        char discharge_date[16] = "-";
+        if (sqlite3_column_type(stmt, 9) != SQLITE_NULL) {
+            format_date(sqlite3_column_int64(stmt, 9), discharge_date, sizeof(discharge_date));
+        }
+        cells[8] = discharge_date;
+        table_row(&table, cells);
     }
+    table_end(&table);
     
     sqlite3_finalize(stmt);
     
@@ -580,13 +2388,14 @@ void update_patient() {
     clear_screen();
     print_header("UPDATE PATIENT");
     
-    int patient_id = get_integer("Enter Patient ID to update: ", 1, 99999);
+    long long patient_id = get_id("Enter Patient ID to update: ", 1);
     
     // First, get current patient info
     const char *sql = "SELECT * FROM patients WHERE id = ?";
     sqlite3_stmt *stmt;
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
+        sqlite3_bind_int64(stmt, 1, patient_id) != SQLITE_OK ||
         sqlite3_step(stmt) != SQLITE_ROW) {
         printf("Patient not found!\n");
         sqlite3_finalize(stmt);
@@ -601,8 +2410,12 @@ void update_patient() {
     const unsigned char *current_contact = sqlite3_column_text(stmt, 4);
     const unsigned char *current_address = sqlite3_column_text(stmt, 5);
     const unsigned char *current_disease = sqlite3_column_text(stmt, 6);
-    
-    sqlite3_finalize(stmt);
+    int has_admission = sqlite3_column_type(stmt, 7) != SQLITE_NULL;
+    long long admission_day = sqlite3_column_int64(stmt, 7);
+    int has_discharge = sqlite3_column_type(stmt, 9) != SQLITE_NULL;
+    long long discharge_day = sqlite3_column_int64(stmt, 9);
+    char current_discharge[16] = "";
+    if (has_discharge) format_date(discharge_day, current_discharge, sizeof(current_discharge));
     
     printf("\nCurrent Information:\n");
     printf("Name: %s\n", current_name ? (const char*)current_name : "N/A");
@@ -611,6 +2424,7 @@ void update_patient() {
     printf("Contact: %s\n", current_contact ? (const char*)current_contact : "N/A");
     printf("Address: %s\n", current_address ? (const char*)current_address : "N/A");
     printf("Disease: %s\n", current_disease ? (const char*)current_disease : "N/A");
+    printf("Discharged: %s\n", has_discharge ? current_discharge : "No (in house)");
     
     printf("\nEnter new information (press Enter to keep current):\n");
     
@@ -619,38 +2433,55 @@ void update_patient() {
     char input[100];
     
     printf("Name [%s]: ", current_name ? (const char*)current_name : "");
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0;
+    get_string("", input, sizeof(input));
     strcpy(name, strlen(input) > 0 ? input : (current_name ? (const char*)current_name : ""));
     
     printf("Age [%d]: ", current_age);
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0;
+    get_string("", input, sizeof(input));
     age = strlen(input) > 0 ? atoi(input) : current_age;
     
     printf("Gender [%s]: ", current_gender ? (const char*)current_gender : "");
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0;
+    get_string("", input, sizeof(input));
     strcpy(gender, strlen(input) > 0 ? input : (current_gender ? (const char*)current_gender : ""));
     
     printf("Contact [%s]: ", current_contact ? (const char*)current_contact : "");
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0;
+    get_string("", input, sizeof(input));
     strcpy(contact, strlen(input) > 0 ? input : (current_contact ? (const char*)current_contact : ""));
     
     printf("Address [%s]: ", current_address ? (const char*)current_address : "");
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0;
+    get_string("", input, sizeof(input));
     strcpy(address, strlen(input) > 0 ? input : (current_address ? (const char*)current_address : ""));
     
     printf("Disease [%s]: ", current_disease ? (const char*)current_disease : "");
-    fgets(input, sizeof(input), stdin);
-    input[strcspn(input, "\n")] = 0;
+    get_string("", input, sizeof(input));
     strcpy(disease, strlen(input) > 0 ? input : (current_disease ? (const char*)current_disease : ""));
     
+    while (1) {
+        printf("Discharge Date (YYYY-MM-DD, '-' to clear) [%s]: ", current_discharge);
+        get_string("", input, sizeof(input));
+        if (strlen(input) == 0) break;
+        if (strcmp(input, "-") == 0) {
+            has_discharge = 0;
+            break;
+        }
+        long long day;
+        if (!parse_date(input, &day)) {
+            printf("Invalid date! Please use YYYY-MM-DD.\n");
+        } else if (has_admission && day < admission_day) {
+            printf("Discharge cannot be before admission!\n");
+        } else {
+            has_discharge = 1;
+            discharge_day = day;
+            break;
+        }
+    }
+    
+    // The current_* column pointers are only valid until here
+    sqlite3_finalize(stmt);
+    
     // Update database using parameterized query
     sql = "UPDATE patients SET name = ?, age = ?, gender = ?, "
-          "contact = ?, address = ?, disease = ? WHERE id = ?";
+          "contact = ?, address = ?, disease = ?, discharge_date = ? WHERE id = ?";
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
         printf("Database error: %s\n", sqlite3_errmsg(db));
@@ -665,7 +2496,12 @@ void update_patient() {
     sqlite3_bind_text(stmt, 4, contact, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 5, address, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 6, disease, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 7, patient_id);
+    if (has_discharge) {
+        sqlite3_bind_int64(stmt, 7, discharge_day);
+    } else {
+        sqlite3_bind_null(stmt, 7);
+    }
+    sqlite3_bind_int64(stmt, 8, patient_id);
     
     int rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
@@ -684,13 +2520,14 @@ void delete_patient() {
     clear_screen();
     print_header("DELETE PATIENT");
     
-    int patient_id = get_integer("Enter Patient ID to delete: ", 1, 99999);
+    long long patient_id = get_id("Enter Patient ID to delete: ", 1);
     
     // Check if patient exists
     const char *sql = "SELECT name FROM patients WHERE id = ?";
     sqlite3_stmt *stmt;
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
+        sqlite3_bind_int64(stmt, 1, patient_id) != SQLITE_OK ||
         sqlite3_step(stmt) != SQLITE_ROW) {
         printf("Patient not found!\n");
         sqlite3_finalize(stmt);
@@ -700,42 +2537,23 @@ void delete_patient() {
     }
     
     const unsigned char *patient_name = sqlite3_column_text(stmt, 0);
+    printf("\nPatient: %s (ID: %lld)\n", patient_name ? (const char*)patient_name : "Unknown", patient_id);
     sqlite3_finalize(stmt);
     
-    printf("\nPatient: %s (ID: %d)\n", patient_name ? (const char*)patient_name : "Unknown", patient_id);
     printf("WARNING: This will delete the patient and all associated bills!\n");
-    printf("Are you sure? (y/n): ");
-    
-    char confirm;
-    scanf(" %c", &confirm);
-    getchar();
     
-    if (confirm != 'y' && confirm != 'Y') {
+    if (!get_confirmation("Are you sure? (y/n): ")) {
         printf("Deletion cancelled.\n");
         printf("\nPress Enter to continue...");
         getchar();
         return;
     }
     
-    // Delete patient using parameterized query
-    sql = "DELETE FROM patients WHERE id = ?";
-    
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        printf("Database error: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-    
-    sqlite3_bind_int(stmt, 1, patient_id);
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    
-    if (rc != SQLITE_DONE) {
-        printf("\n❌ Error deleting patient: %s\n", sqlite3_errmsg(db));
-    } else {
-        printf("\n✅ Patient deleted successfully!\n");
-    }
+    if (db_delete_patient(db, patient_id) != SQLITE_OK) {
+        printf("\n❌ Error deleting patient: %s\n", sqlite3_errmsg(db));
+    } else {
+        printf("\n✅ Patient deleted successfully!\n");
+    }
     
     printf("\nPress Enter to continue...");
     getchar();
@@ -750,13 +2568,14 @@ void generate_bill() {
     // Show patients
     view_patients();
     
-    int patient_id = get_integer("\nEnter Patient ID for billing: ", 1, 99999);
+    long long patient_id = get_id("\nEnter Patient ID for billing: ", 1);
     
     // Get patient name
     const char *sql = "SELECT name FROM patients WHERE id = ?";
     sqlite3_stmt *stmt;
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
+        sqlite3_bind_int64(stmt, 1, patient_id) != SQLITE_OK ||
         sqlite3_step(stmt) != SQLITE_ROW) {
         printf("Patient not found!\n");
         sqlite3_finalize(stmt);
@@ -765,21 +2584,85 @@ void generate_bill() {
         return;
     }
     
-    const unsigned char *patient_name = sqlite3_column_text(stmt, 0);
+    // Copy the name out before finalizing; column text is owned by the statement
+    char patient_name[100];
+    const unsigned char *name_text = sqlite3_column_text(stmt, 0);
+    snprintf(patient_name, sizeof(patient_name), "%s", name_text ? (const char*)name_text : "Unknown");
     sqlite3_finalize(stmt);
     
-    printf("\nGenerating bill for: %s (ID: %d)\n", patient_name ? (const char*)patient_name : "Unknown", patient_id);
+    printf("\nGenerating bill for: %s (ID: %lld)\n", patient_name, patient_id);
     printf("════════════════════════════════════════════════════\n");
     
-    float room_charges = get_float("Room charges: $", 0, 10000);
-    float doctor_fees = get_float("Doctor fees: $", 0, 10000);
-    float medicine_charges = get_float("Medicine charges: $", 0, 10000);
-    float lab_charges = get_float("Lab charges: $", 0, 10000);
-    float other_charges = get_float("Other charges: $", 0, 10000);
+    // Pick up catalog changes made since the last bill
+    refresh_charge_master(db);
+    
+    // Capture itemized charge lines until the operator leaves the code blank
+    BillItemList items;
+    bill_items_init(&items);
+    
+    printf("Enter charge lines (leave the code empty to finish).\n");
+    while (1) {
+        BillItem item;
+        memset(&item, 0, sizeof(item));
+        
+        printf("\nLine %d\n", items.count + 1);
+        get_string("  Item code: ", item.code, sizeof(item.code));
+        if (strlen(item.code) == 0) {
+            break;
+        }
+        
+        // Catalog codes are priced automatically; anything else is entered by hand
+        const ChargeEntry *entry = lookup_charge(item.code);
+        if (entry) {
+            strcpy(item.description, entry->description);
+            item.category = entry->category;
+            item.unit_price = entry->price;
+            printf("  %s [%s] @ $%.2f\n", entry->description,
+                   charge_categories[entry->category], entry->price);
+            item.quantity = get_integer("  Quantity: ", 1, 10000);
+        } else {
+            printf("  Code not in charge master, enter details manually.\n");
+            get_string("  Description: ", item.description, sizeof(item.description));
+            
+            printf("  Category: ");
+            for (int i = 0; i < CATEGORY_COUNT; i++) {
+                printf("%d. %s  ", i + 1, charge_categories[i]);
+            }
+            item.category = get_choice(1, CATEGORY_COUNT) - 1;
+            if (item.category < 0) {
+                item.category = CATEGORY_COUNT - 1;
+            }
+            
+            item.quantity = get_integer("  Quantity: ", 1, 10000);
+            item.unit_price = get_double("  Unit price: $", 0, 10000);
+        }
+        
+        if (!bill_items_add(&items, &item)) {
+            printf("❌ Out of memory while adding charge line!\n");
+            break;
+        }
+        printf("  Line total: $%.2f | Running total: $%.2f\n",
+               item.quantity * item.unit_price, bill_items_total(&items, NULL));
+    }
+    
+    if (items.count == 0) {
+        printf("\nNo charge lines entered. Bill not generated.\n");
+        bill_items_free(&items);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
     
-    float total_amount = room_charges + doctor_fees + medicine_charges + lab_charges + other_charges;
+    double subtotals[CATEGORY_COUNT];
+    double total_amount = bill_items_total(&items, subtotals);
     
-    printf("\nTotal Amount: $%.2f\n", total_amount);
+    printf("\n");
+    for (int i = 0; i < CATEGORY_COUNT; i++) {
+        if (subtotals[i] > 0) {
+            printf("%-10s subtotal: $%.2f\n", charge_categories[i], subtotals[i]);
+        }
+    }
+    printf("Total Amount: $%.2f (%d lines)\n", total_amount, items.count);
     
     printf("\nPayment Status:\n");
     printf("1. Paid\n");
@@ -788,7 +2671,7 @@ void generate_bill() {
     printf("Enter choice: ");
     
     int status_choice = get_choice(1, 3);
-    float amount_paid = 0;
+    double amount_paid = 0;
     char payment_status[20];
     char payment_method[20] = "Cash";
     
@@ -797,7 +2680,7 @@ void generate_bill() {
         amount_paid = total_amount;
     } else if (status_choice == 3) {
         strcpy(payment_status, "Partial");
-        amount_paid = get_float("Amount paid now: $", 0, total_amount);
+        amount_paid = get_double("Amount paid now: $", 0, total_amount);
     } else {
         strcpy(payment_status, "Pending");
     }
@@ -819,881 +2702,7767 @@ void generate_bill() {
         }
     }
     
-    float balance_due = total_amount - amount_paid;
-    
-    // Insert bill using parameterized query
-    sql = "INSERT INTO bills (patient_id, patient_name, room_charges, doctor_fees, "
-          "medicine_charges, lab_charges, other_charges, total_amount, amount_paid, "
-          "balance_due, payment_status, payment_method) "
-          "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
-    
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        printf("Database error: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-    
-    sqlite3_bind_int(stmt, 1, patient_id);
-    sqlite3_bind_text(stmt, 2, patient_name ? (const char*)patient_name : "Unknown", -1, SQLITE_STATIC);
-    sqlite3_bind_double(stmt, 3, room_charges);
-    sqlite3_bind_double(stmt, 4, doctor_fees);
-    sqlite3_bind_double(stmt, 5, medicine_charges);
-    sqlite3_bind_double(stmt, 6, lab_charges);
-    sqlite3_bind_double(stmt, 7, other_charges);
-    sqlite3_bind_double(stmt, 8, total_amount);
-    sqlite3_bind_double(stmt, 9, amount_paid);
-    sqlite3_bind_double(stmt, 10, balance_due);
-    sqlite3_bind_text(stmt, 11, payment_status, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 12, payment_method, -1, SQLITE_STATIC);
+    double balance_due = total_amount - amount_paid;
     
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    long long bill_no;
+    int rc = db_create_bill(db, patient_id, patient_name, &items, amount_paid,
+                            payment_status, payment_method, &bill_no);
     
-    if (rc != SQLITE_DONE) {
+    if (rc != SQLITE_OK) {
         printf("\n❌ Error generating bill: %s\n", sqlite3_errmsg(db));
     } else {
-        long long bill_no = sqlite3_last_insert_rowid(db);
         printf("\n✅ Bill generated successfully!\n");
         printf("   Bill Number: %lld\n", bill_no);
-        printf("   Patient: %s\n", patient_name ? (const char*)patient_name : "Unknown");
+        printf("   Patient: %s\n", patient_name);
+        printf("   Charge Lines: %d\n", items.count);
         printf("   Total Amount: $%.2f\n", total_amount);
         printf("   Amount Paid: $%.2f\n", amount_paid);
         printf("   Balance Due: $%.2f\n", balance_due);
         printf("   Status: %s\n", payment_status);
-        
-        // Record payment if any
-        if (amount_paid > 0) {
-            sql = "INSERT INTO payments (bill_no, amount, payment_method) VALUES (?, ?, ?)";
-            if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-                sqlite3_bind_int64(stmt, 1, bill_no);
-                sqlite3_bind_double(stmt, 2, amount_paid);
-                sqlite3_bind_text(stmt, 3, payment_method, -1, SQLITE_STATIC);
-                sqlite3_step(stmt);
-                sqlite3_finalize(stmt);
-            }
-        }
     }
     
+    bill_items_free(&items);
+    
     printf("\nPress Enter to continue...");
     getchar();
 }
 
-void view_bills() {
-    clear_screen();
-    print_header("ALL BILLS");
-    
-    const char *sql = "SELECT bill_no, patient_name, total_amount, amount_paid, "
-                     "balance_due, payment_status, bill_date FROM bills ORDER BY bill_no DESC";
+// ==================== BILLING CORE ====================
+
+int db_add_patient(sqlite3 *conn, const char *name, int age, const char *gender,
+                   const char *contact, const char *address, const char *disease,
+                   long long admission_day, long long *patient_id) {
+    // Use parameterized query to prevent SQL injection and handle UTF-8
+    const char *sql = "INSERT INTO patients (name, age, gender, contact, address, disease, admission_date) "
+                      "VALUES (?, ?, ?, ?, ?, ?, ?)";
     sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        printf("Error fetching bills: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    if (rc != SQLITE_OK) {
+        return rc;
     }
     
-    printf("Bill No  Patient Name               Total      Paid       Balance    Status     Date\n");
-    printf("════════════════════════════════════════════════════════════════════════════════════\n");
-    
-    int count = 0;
-    float total_billed = 0, total_paid = 0, total_outstanding = 0;
-    
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        count++;
-        int bill_no = sqlite3_column_int(stmt, 0);
-        const unsigned char *patient_name = sqlite3_column_text(stmt, 1);
-        float total_amount = sqlite3_column_double(stmt, 2);
-        float amount_paid = sqlite3_column_double(stmt, 3);
-        float balance_due = sqlite3_column_double(stmt, 4);
-        const unsigned char *payment_status = sqlite3_column_text(stmt, 5);
-        const unsigned char *bill_date = sqlite3_column_text(stmt, 6);
-        
-        printf("%-8d %-25s $%-9.2f $%-9.2f $%-9.2f %-10s %s\n", 
-               bill_no, 
-               patient_name ? (const char*)patient_name : "Unknown",
-               total_amount, 
-               amount_paid, 
-               balance_due,
-               payment_status ? (const char*)payment_status : "Unknown",
-               bill_date ? (const char*)bill_date : "Unknown");
-        
-        total_billed += total_amount;
-        total_paid += amount_paid;
-        total_outstanding += balance_due;
-    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, age);
+    sqlite3_bind_text(stmt, 3, gender, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, contact, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, address, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 6, disease, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 7, admission_day);
     
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
     
-    if (count == 0) {
-        printf("No bills found.\n");
-    } else {
-        printf("\nSummary:\n");
-        printf("  Total Bills:        %d\n", count);
-        printf("  Total Billed:       $%.2f\n", total_billed);
-        printf("  Total Paid:         $%.2f\n", total_paid);
-        printf("  Total Outstanding:  $%.2f\n", total_outstanding);
+    if (rc != SQLITE_DONE) {
+        return rc;
     }
-    
-    printf("\nPress Enter to continue...");
-    getchar();
+    *patient_id = sqlite3_last_insert_rowid(conn);
+    return SQLITE_OK;
 }
 
-void search_bill() {
-    clear_screen();
-    print_header("SEARCH BILL");
-    
-    int bill_no = get_integer("Enter Bill Number: ", 1, 999999);
-    
-    const char *sql = "SELECT * FROM bills WHERE bill_no = ?";
+// Bills, items and payments go with the patient through ON DELETE CASCADE
+int db_delete_patient(sqlite3 *conn, long long patient_id) {
+    const char *sql = "DELETE FROM patients WHERE id = ?";
     sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
-        sqlite3_step(stmt) != SQLITE_ROW) {
-        printf("Bill not found!\n");
-        sqlite3_finalize(stmt);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    if (rc != SQLITE_OK) {
+        return rc;
     }
     
-    int patient_id = sqlite3_column_int(stmt, 1);
-    const unsigned char *patient_name = sqlite3_column_text(stmt, 2);
-    const unsigned char *bill_date = sqlite3_column_text(stmt, 3);
-    float room_charges = sqlite3_column_double(stmt, 4);
-    float doctor_fees = sqlite3_column_double(stmt, 5);
-    float medicine_charges = sqlite3_column_double(stmt, 6);
-    float lab_charges = sqlite3_column_double(stmt, 7);
-    float other_charges = sqlite3_column_double(stmt, 8);
-    float total_amount = sqlite3_column_double(stmt, 9);
-    float amount_paid = sqlite3_column_double(stmt, 10);
-    float balance_due = sqlite3_column_double(stmt, 11);
-    const unsigned char *payment_status = sqlite3_column_text(stmt, 12);
-    const unsigned char *payment_method = sqlite3_column_text(stmt, 13);
-    
+    sqlite3_bind_int64(stmt, 1, patient_id);
+    rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
     
-    printf("\nBill Details:\n");
-    printf("════════════════════════════════════════════════════\n");
-    printf("Bill No: %d | Date: %s\n", bill_no, bill_date ? (const char*)bill_date : "Unknown");
-    printf("Patient: %s (ID: %d)\n", patient_name ? (const char*)patient_name : "Unknown", patient_id);
-    printf("════════════════════════════════════════════════════\n");
-    printf("Room Charges:        $%10.2f\n", room_charges);
-    printf("Doctor Fees:         $%10.2f\n", doctor_fees);
-    printf("Medicine Charges:    $%10.2f\n", medicine_charges);
-    printf("Lab Charges:         $%10.2f\n", lab_charges);
-    printf("Other Charges:       $%10.2f\n", other_charges);
-    printf("════════════════════════════════════════════════════\n");
-    printf("TOTAL AMOUNT:        $%10.2f\n", total_amount);
-    printf("Amount Paid:         $%10.2f\n", amount_paid);
-    printf("Balance Due:         $%10.2f\n", balance_due);
-    printf("════════════════════════════════════════════════════\n");
-    printf("Payment Status:      %s\n", payment_status ? (const char*)payment_status : "Unknown");
-    printf("Payment Method:      %s\n", payment_method ? (const char*)payment_method : "Unknown");
-    
-    printf("\nPress Enter to continue...");
-    getchar();
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
 }
 
-void make_payment() {
-    clear_screen();
-    print_header("MAKE PAYMENT");
-    
-    // Show pending bills
-    const char *sql = "SELECT bill_no, patient_name, total_amount, amount_paid, "
-                     "balance_due FROM bills WHERE balance_due > 0 ORDER BY bill_no";
-    sqlite3_stmt *stmt;
-    
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        printf("Error fetching bills: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+// The bill header, its charge lines and the initial payment are written in
+// one IMMEDIATE transaction, so a bill never exists without its lines and a
+// competing writer fails up front rather than halfway through.
+int db_create_bill(sqlite3 *conn, long long patient_id, const char *patient_name,
+                   const BillItemList *items, double amount_paid,
+                   const char *payment_status, const char *payment_method,
+                   long long *bill_no) {
+    int rc = sqlite3_exec(conn, "BEGIN IMMEDIATE;", 0, 0, 0);
+    if (rc != SQLITE_OK) {
+        return rc;
     }
     
-    printf("Pending Bills:\n");
-    printf("Bill No  Patient Name               Total      Paid       Balance\n");
-    printf("═════════════════════════════════════════════════════════════════\n");
-    
-    int bills[100];
-    float balances[100];
-    int bill_count = 0;
+    const char *sql = "INSERT INTO bills (patient_id, patient_name, amount_paid, "
+                      "payment_status, payment_method) VALUES (?, ?, ?, ?, ?)";
+    sqlite3_stmt *stmt;
     
-    while (sqlite3_step(stmt) == SQLITE_ROW && bill_count < 100) {
-        int bill_no = sqlite3_column_int(stmt, 0);
-        const unsigned char *patient_name = sqlite3_column_text(stmt, 1);
-        float total_amount = sqlite3_column_double(stmt, 2);
-        float amount_paid = sqlite3_column_double(stmt, 3);
-        float balance_due = sqlite3_column_double(stmt, 4);
-        
-        printf("%-8d %-25s $%-9.2f $%-9.2f $%-9.2f\n", 
-               bill_no, 
-               patient_name ? (const char*)patient_name : "Unknown",
-               total_amount, 
-               amount_paid, 
-               balance_due);
+    rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, patient_id);
+        sqlite3_bind_text(stmt, 2, patient_name, -1, SQLITE_STATIC);
+        sqlite3_bind_double(stmt, 3, amount_paid);
+        sqlite3_bind_text(stmt, 4, payment_status, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 5, payment_method, -1, SQLITE_STATIC);
         
-        bills[bill_count] = bill_no;
-        balances[bill_count] = balance_due;
-        bill_count++;
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
     }
     
-    sqlite3_finalize(stmt);
+    *bill_no = sqlite3_last_insert_rowid(conn);
     
-    if (bill_count == 0) {
-        printf("No pending bills found.\n");
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    if (rc == SQLITE_OK && (!insert_bill_items(conn, *bill_no, items) ||
+                            !sync_bill_totals(conn, *bill_no))) {
+        rc = sqlite3_errcode(conn);
+        rc = rc == SQLITE_OK ? SQLITE_ERROR : rc;
     }
     
-    int bill_no = get_integer("\nEnter Bill Number to pay: ", 1, 999999);
-    
-    // Find the bill
-    int found = 0;
-    float max_payment = 0;
-    for (int i = 0; i < bill_count; i++) {
-        if (bills[i] == bill_no) {
-            found = 1;
-            max_payment = balances[i];
-            break;
+    // Record payment if any
+    if (rc == SQLITE_OK && amount_paid > 0) {
+        sql = "INSERT INTO payments (bill_no, amount, payment_method) VALUES (?, ?, ?)";
+        rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, *bill_no);
+            sqlite3_bind_double(stmt, 2, amount_paid);
+            sqlite3_bind_text(stmt, 3, payment_method, -1, SQLITE_STATIC);
+            rc = sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+            rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
         }
     }
     
-    if (!found) {
-        printf("Bill not found or already paid!\n");
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-    
-    printf("Maximum payment allowed: $%.2f\n", max_payment);
-    float payment_amount = get_float("Enter payment amount: $", 0.01, max_payment);
-    
-    printf("\nPayment Method:\n");
-    printf("1. Cash\n");
-    printf("2. Credit Card\n");
-    printf("3. Debit Card\n");
-    printf("4. Online Transfer\n");
-    printf("Enter choice: ");
-    
-    int method_choice = get_choice(1, 4);
-    char payment_method[20];
-    
-    switch(method_choice) {
-        case 1: strcpy(payment_method, "Cash"); break;
-        case 2: strcpy(payment_method, "Credit Card"); break;
-        case 3: strcpy(payment_method, "Debit Card"); break;
-        case 4: strcpy(payment_method, "Online Transfer"); break;
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(conn, "COMMIT;", 0, 0, 0);
     }
-    
-    // Update bill using parameterized query
-    sql = "UPDATE bills SET amount_paid = amount_paid + ?, "
-          "balance_due = balance_due - ? WHERE bill_no = ?";
-    
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        printf("Database error: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    if (rc != SQLITE_OK) {
+        sqlite3_exec(conn, "ROLLBACK;", 0, 0, 0);
     }
-    
-    sqlite3_bind_double(stmt, 1, payment_amount);
-    sqlite3_bind_double(stmt, 2, payment_amount);
-    sqlite3_bind_int(stmt, 3, bill_no);
-    
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    
-    if (rc != SQLITE_DONE) {
-        printf("Payment failed: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    return rc;
+}
+
+// Apply ?1 to bill ?2 only if it does not exceed the balance due, and
+// record it; shared by db_post_payment() and the remittance importer
+static const char payment_apply_sql[] =
+    "UPDATE bills SET amount_paid = amount_paid + ?1, "
+    "balance_due = balance_due - ?1, "
+    "payment_status = CASE WHEN balance_due - ?1 <= 0.005 THEN 'Paid' "
+    "ELSE 'Partial' END "
+    "WHERE bill_no = ?2 AND balance_due >= ?1 - 0.005";
+static const char payment_record_sql[] =
+    "INSERT INTO payments (bill_no, amount, payment_method) VALUES (?, ?, ?)";
+
+// Apply a payment to a bill: balance, status and the payments row change
+// together in one transaction. The balance update only matches while the
+// bill still owes at least the amount, so two terminals paying the same bill
+// cannot overpay it; that case returns SQLITE_NOTFOUND.
+int db_post_payment(sqlite3 *conn, long long bill_no, double amount, const char *payment_method) {
+    int rc = sqlite3_exec(conn, "BEGIN IMMEDIATE;", 0, 0, 0);
+    if (rc != SQLITE_OK) {
+        return rc;
     }
     
-    // Update status if fully paid
-    sql = "UPDATE bills SET payment_status = CASE "
-          "WHEN balance_due <= 0 THEN 'Paid' "
-          "ELSE 'Partial' END WHERE bill_no = ?";
-    
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_int(stmt, 1, bill_no);
-        sqlite3_step(stmt);
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(conn, payment_apply_sql, -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_double(stmt, 1, amount);
+        sqlite3_bind_int64(stmt, 2, bill_no);
+        rc = sqlite3_step(stmt);
         sqlite3_finalize(stmt);
+        
+        if (rc == SQLITE_DONE) {
+            rc = sqlite3_changes(conn) == 1 ? SQLITE_OK : SQLITE_NOTFOUND;
+        }
     }
     
     // Record payment
-    sql = "INSERT INTO payments (bill_no, amount, payment_method) VALUES (?, ?, ?)";
-    
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
-        sqlite3_bind_int(stmt, 1, bill_no);
-        sqlite3_bind_double(stmt, 2, payment_amount);
-        sqlite3_bind_text(stmt, 3, payment_method, -1, SQLITE_STATIC);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(conn, payment_record_sql, -1, &stmt, 0);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, bill_no);
+            sqlite3_bind_double(stmt, 2, amount);
+            sqlite3_bind_text(stmt, 3, payment_method, -1, SQLITE_STATIC);
+            rc = sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+            rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+        }
     }
     
-    printf("\n✅ Payment of $%.2f recorded successfully!\n", payment_amount);
-    
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-void view_payment_history() {
-    clear_screen();
-    print_header("PAYMENT HISTORY");
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(conn, "COMMIT;", 0, 0, 0);
+    }
+    if (rc != SQLITE_OK) {
+        sqlite3_exec(conn, "ROLLBACK;", 0, 0, 0);
+    }
+    return rc;
+}
+
+// ==================== ITEMIZED CHARGES ====================
+
+void bill_items_init(BillItemList *list) {
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void bill_items_free(BillItemList *list) {
+    free(list->items);
+    bill_items_init(list);
+}
+
+// Append a copy of item, growing the array geometrically. Returns 0 on OOM.
+int bill_items_add(BillItemList *list, const BillItem *item) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 16;
+        BillItem *grown = realloc(list->items, new_capacity * sizeof(BillItem));
+        if (!grown) {
+            return 0;
+        }
+        list->items = grown;
+        list->capacity = new_capacity;
+    }
+    list->items[list->count++] = *item;
+    return 1;
+}
+
+// Sum all lines in a single pass. If subtotals is non-NULL it receives the
+// per-category totals in charge_categories order.
+double bill_items_total(const BillItemList *list, double subtotals[CATEGORY_COUNT]) {
+    double sums[CATEGORY_COUNT] = {0};
+    double total = 0;
+    
+    for (int i = 0; i < list->count; i++) {
+        const BillItem *item = &list->items[i];
+        double line_total = item->quantity * item->unit_price;
+        sums[item->category] += line_total;
+        total += line_total;
+    }
     
-    int bill_no = get_integer("Enter Bill Number (0 for all payments): ", 0, 999999);
+    if (subtotals) {
+        memcpy(subtotals, sums, sizeof(sums));
+    }
+    return total;
+}
+
+static const char bill_item_insert_sql[] =
+    "INSERT INTO bill_items (bill_no, code, description, category, "
+    "quantity, unit_price, line_total) VALUES (?, ?, ?, ?, ?, ?, ?)";
+
+// Insert all lines of a bill through stmt (prepared from
+// bill_item_insert_sql), reset and rebound per row, so batch callers can
+// keep one statement for many bills. The caller owns the transaction.
+static int insert_bill_items_with(sqlite3_stmt *stmt, long long bill_no, const BillItemList *list) {
+    sqlite3_bind_int64(stmt, 1, bill_no);
+    
+    for (int i = 0; i < list->count; i++) {
+        const BillItem *item = &list->items[i];
+        sqlite3_bind_text(stmt, 2, item->code, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, item->description, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 4, charge_categories[item->category], -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 5, item->quantity);
+        sqlite3_bind_double(stmt, 6, item->unit_price);
+        sqlite3_bind_double(stmt, 7, item->quantity * item->unit_price);
+        
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Insert all lines of a bill. The caller owns the surrounding transaction.
+int insert_bill_items(sqlite3 *conn, long long bill_no, const BillItemList *list) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(conn, bill_item_insert_sql, -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
+    }
+    int ok = insert_bill_items_with(stmt, bill_no, list);
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+// Recompute the denormalized totals on a bill from its charge lines. The
+// legacy per-category columns are kept as a rollup so existing readers
+// (search, receipts, the GUI) still see consistent figures.
+int sync_bill_totals(sqlite3 *conn, long long bill_no) {
+    const char *sql =
+        "UPDATE bills SET "
+        "    room_charges = t.room, doctor_fees = t.doctor, "
+        "    medicine_charges = t.medicine, lab_charges = t.lab, "
+        "    other_charges = t.other, total_amount = t.total, "
+        "    balance_due = t.total - bills.amount_paid "
+        "FROM (SELECT "
+        "    COALESCE(SUM(CASE WHEN category = 'Room' THEN line_total END), 0) AS room, "
+        "    COALESCE(SUM(CASE WHEN category = 'Doctor' THEN line_total END), 0) AS doctor, "
+        "    COALESCE(SUM(CASE WHEN category = 'Medicine' THEN line_total END), 0) AS medicine, "
+        "    COALESCE(SUM(CASE WHEN category = 'Lab' THEN line_total END), 0) AS lab, "
+        "    COALESCE(SUM(CASE WHEN category = 'Other' THEN line_total END), 0) AS other, "
+        "    COALESCE(SUM(line_total), 0) AS total "
+        "    FROM bill_items WHERE bill_no = ?1) AS t "
+        "WHERE bills.bill_no = ?1";
+    sqlite3_stmt *stmt;
     
-    const char *sql;
-    if (bill_no == 0) {
-        sql = "SELECT p.payment_id, p.bill_no, b.patient_name, p.amount, "
-              "p.payment_method, p.payment_date "
-              "FROM payments p JOIN bills b ON p.bill_no = b.bill_no "
-              "ORDER BY p.payment_date DESC";
-    } else {
-        sql = "SELECT p.payment_id, p.bill_no, b.patient_name, p.amount, "
-              "p.payment_method, p.payment_date "
-              "FROM payments p JOIN bills b ON p.bill_no = b.bill_no "
-              "WHERE p.bill_no = ? ORDER BY p.payment_date DESC";
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
     }
     
+    sqlite3_bind_int64(stmt, 1, bill_no);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    
+    return rc == SQLITE_DONE;
+}
+
+// Print the charge lines of a bill. Returns the number of lines printed so
+// callers can fall back to the category columns for bills without lines.
+int print_bill_items(long long bill_no) {
+    const char *sql = "SELECT code, description, quantity, unit_price, line_total "
+                      "FROM bill_items WHERE bill_no = ? ORDER BY item_id";
     sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-        printf("Error fetching payment history: %s\n", sqlite3_errmsg(db));
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
     
-    if (bill_no != 0) {
-        sqlite3_bind_int(stmt, 1, bill_no);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
     }
+    sqlite3_bind_int64(stmt, 1, bill_no);
     
-    printf("Payment ID  Bill No  Patient Name               Amount     Method        Date\n");
-    printf("══════════════════════════════════════════════════════════════════════════════\n");
+    static const TableColumn columns[] = {
+        {"Code", 12, 0}, {"Description", 30, 0}, {"Qty", 0, 1},
+        {"Unit Price", 0, 1}, {"Line Total", 0, 1}
+    };
+    TableRenderer table;
+    table_begin(&table, columns, 5);
     
     int count = 0;
-    float total_amount = 0;
-    
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         count++;
-        int payment_id = sqlite3_column_int(stmt, 0);
-        int bill_no = sqlite3_column_int(stmt, 1);
-        const unsigned char *patient_name = sqlite3_column_text(stmt, 2);
-        float amount = sqlite3_column_double(stmt, 3);
-        const unsigned char *payment_method = sqlite3_column_text(stmt, 4);
-        const unsigned char *payment_date = sqlite3_column_text(stmt, 5);
-        
-        printf("%-10d %-8d %-25s $%-9.2f %-12s %s\n", 
-               payment_id, bill_no, 
-               patient_name ? (const char*)patient_name : "Unknown",
-               amount,
-               payment_method ? (const char*)payment_method : "Unknown",
-               payment_date ? (const char*)payment_date : "Unknown");
+        char unit_price[32], line_total[32];
+        snprintf(unit_price, sizeof(unit_price), "$%.2f", sqlite3_column_double(stmt, 3));
+        snprintf(line_total, sizeof(line_total), "$%.2f", sqlite3_column_double(stmt, 4));
         
-        total_amount += amount;
+        const char *cells[5];
+        cells[0] = (const char*)sqlite3_column_text(stmt, 0);
+        cells[1] = (const char*)sqlite3_column_text(stmt, 1);
+        cells[2] = (const char*)sqlite3_column_text(stmt, 2);
+        cells[3] = unit_price;
+        cells[4] = line_total;
+        table_row(&table, cells);
     }
+    table_end(&table);
     
     sqlite3_finalize(stmt);
-    
-    if (count == 0) {
-        printf("No payment records found.\n");
-    } else {
-        printf("\nSummary:\n");
-        printf("  Total Payments: %d\n", count);
-        printf("  Total Amount:   $%.2f\n", total_amount);
+    return count;
+}
+
+// Map a category name to its charge_categories index (case-insensitive).
+// Unknown names fall back to "Other".
+int category_index(const char *name) {
+    if (name) {
+        for (int i = 0; i < CATEGORY_COUNT; i++) {
+            if (strcasecmp(name, charge_categories[i]) == 0) {
+                return i;
+            }
+        }
     }
-    
-    printf("\nPress Enter to continue...");
-    getchar();
+    return CATEGORY_COUNT - 1;
 }
 
-void print_receipt() {
-    clear_screen();
-    print_header("PRINT RECEIPT");
-    
-    int bill_no = get_integer("Enter Bill Number: ", 1, 999999);
-    
-    const char *sql = "SELECT * FROM bills WHERE bill_no = ?";
-    sqlite3_stmt *stmt;
-    
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
-        sqlite3_step(stmt) != SQLITE_ROW) {
-        printf("Bill not found!\n");
-        sqlite3_finalize(stmt);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+// ==================== CSV READER ====================
+
+// Each buffer load is classified in one vectorized pass into a bitmask of
+// quotes, commas and newlines (64 bytes per word). Splitting a record then
+// jumps between set bits with a count-trailing-zeros instead of looking at
+// every byte, and never modifies the buffer, so a record cut off by the end
+// of a read is simply rescanned after a refill. Only once a record is known
+// to be complete are its fields unescaped and NUL-terminated in place.
+
+static void csv_classify_scalar(const char *data, size_t length, uint64_t *masks) {
+    for (size_t block = 0; block < length / 64; block++) {
+        const char *p = data + block * 64;
+        uint64_t bits = 0;
+        for (int i = 0; i < 64; i++) {
+            if (p[i] == '"' || p[i] == ',' || p[i] == '\n') bits |= 1ULL << i;
+        }
+        masks[block] = bits;
     }
-    
-    int patient_id = sqlite3_column_int(stmt, 1);
-    const unsigned char *patient_name = sqlite3_column_text(stmt, 2);
-    const unsigned char *bill_date = sqlite3_column_text(stmt, 3);
-    float room_charges = sqlite3_column_double(stmt, 4);
-    float doctor_fees = sqlite3_column_double(stmt, 5);
-    float medicine_charges = sqlite3_column_double(stmt, 6);
-    float lab_charges = sqlite3_column_double(stmt, 7);
-    float other_charges = sqlite3_column_double(stmt, 8);
-    float total_amount = sqlite3_column_double(stmt, 9);
-    float amount_paid = sqlite3_column_double(stmt, 10);
-    float balance_due = sqlite3_column_double(stmt, 11);
-    const unsigned char *payment_status = sqlite3_column_text(stmt, 12);
-    const unsigned char *payment_method = sqlite3_column_text(stmt, 13);
-    
-    sqlite3_finalize(stmt);
-    
-    // Print receipt
-    printf("\n");
-    printf("╔══════════════════════════════════════════════════════════════╗\n");
-    printf("║                    OFFICIAL RECEIPT                          ║\n");
-    printf("╠══════════════════════════════════════════════════════════════╣\n");
-    printf("║ City General Hospital                                        ║\n");
-    printf("╠══════════════════════════════════════════════════════════════╣\n");
-    printf("║  Receipt No: %-45d ║\n", bill_no);
-    printf("║  Date:       %-45s ║\n", bill_date ? (const char*)bill_date : "Unknown");
-    printf("╠══════════════════════════════════════════════════════════════╣\n");
-    printf("║  Patient: %-50s ║\n", patient_name ? (const char*)patient_name : "Unknown");
-    printf("║  Patient ID: %-48d ║\n", patient_id);
-    printf("╠══════════════════════════════════════════════════════════════╣\n");
-    printf("║                                                              ║\n");
-    printf("║  Room Charges ................................ $%10.2f  ║\n", room_charges);
-    printf("║  Doctor Fees ................................. $%10.2f  ║\n", doctor_fees);
-    printf("║  Medicine Charges ........................... $%10.2f  ║\n", medicine_charges);
-    printf("║  Lab Charges ................................ $%10.2f  ║\n", lab_charges);
-    printf("║  Other Charges .............................. $%10.2f  ║\n", other_charges);
-    printf("║                                                              ║\n");
-    printf("║  TOTAL AMOUNT ............................... $%10.2f  ║\n", total_amount);
-    printf("║  AMOUNT PAID ............................... $%10.2f  ║\n", amount_paid);
-    printf("║  BALANCE DUE ............................... $%10.2f  ║\n", balance_due);
-    printf("║                                                              ║\n");
-    printf("║  Payment Status: %-10s                                 ║\n", payment_status ? (const char*)payment_status : "Unknown");
-    printf("║  Payment Method: %-10s                                 ║\n", payment_method ? (const char*)payment_method : "Unknown");
-    printf("║                                                              ║\n");
-    printf("╠══════════════════════════════════════════════════════════════╣\n");
-    printf("║  Thank you for choosing our hospital!                        ║\n");
-    printf("╚══════════════════════════════════════════════════════════════╝\n");
-    
-    printf("\nOptions:\n");
-    printf("1. Save to file\n");
-    printf("2. Print another receipt\n");
-    printf("3. Return to menu\n");
-    printf("Enter choice: ");
-    
-    int choice = get_choice(1, 3);
-    
-    if (choice == 1) {
-        char filename[100];
-        snprintf(filename, sizeof(filename), "receipt_%d.txt", bill_no);
-        FILE *file = fopen(filename, "w");
-        if (file) {
-            // Save receipt with UTF-8 encoding
-            fprintf(file, "Receipt No: %d\n", bill_no);
-            fprintf(file, "Date: %s\n", bill_date ? (const char*)bill_date : "Unknown");
-            fprintf(file, "Patient: %s (ID: %d)\n", patient_name ? (const char*)patient_name : "Unknown", patient_id);
-            fprintf(file, "Total Amount: $%.2f\n", total_amount);
-            fprintf(file, "Amount Paid: $%.2f\n", amount_paid);
-            fprintf(file, "Balance Due: $%.2f\n", balance_due);
-            fprintf(file, "Status: %s\n", payment_status ? (const char*)payment_status : "Unknown");
-            fclose(file);
-            printf("\n✅ Receipt saved to: %s\n", filename);
-        } else {
-            printf("\n❌ Error saving receipt!\n");
+}
+
+#if defined(__SSE2__)
+static void csv_classify_sse2(const char *data, size_t length, uint64_t *masks) {
+    const __m128i quote = _mm_set1_epi8('"'), comma = _mm_set1_epi8(','), newline = _mm_set1_epi8('\n');
+    for (size_t block = 0; block < length / 64; block++) {
+        uint64_t bits = 0;
+        for (int i = 0; i < 4; i++) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(data + block * 64 + i * 16));
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, comma)),
+                                        _mm_cmpeq_epi8(chunk, newline));
+            bits |= (uint64_t)(unsigned int)_mm_movemask_epi8(hits) << (i * 16);
         }
-        printf("\nPress Enter to continue...");
-        getchar();
-    } else if (choice == 2) {
-        print_receipt();
+        masks[block] = bits;
     }
 }
 
-// ==================== REPORT FUNCTIONS ====================
+__attribute__((target("avx2")))
+static void csv_classify_avx2(const char *data, size_t length, uint64_t *masks) {
+    const __m256i quote = _mm256_set1_epi8('"'), comma = _mm256_set1_epi8(','), newline = _mm256_set1_epi8('\n');
+    for (size_t block = 0; block < length / 64; block++) {
+        __m256i low = _mm256_loadu_si256((const __m256i*)(data + block * 64));
+        __m256i high = _mm256_loadu_si256((const __m256i*)(data + block * 64 + 32));
+        __m256i low_hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(low, quote),
+                                                           _mm256_cmpeq_epi8(low, comma)),
+                                           _mm256_cmpeq_epi8(low, newline));
+        __m256i high_hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(high, quote),
+                                                            _mm256_cmpeq_epi8(high, comma)),
+                                            _mm256_cmpeq_epi8(high, newline));
+        masks[block] = (uint64_t)(unsigned int)_mm256_movemask_epi8(low_hits) |
+                       (uint64_t)(unsigned int)_mm256_movemask_epi8(high_hits) << 32;
+    }
+}
+#endif
 
-void generate_report() {
-    clear_screen();
-    print_header("FINANCIAL REPORT");
-    
-    printf("Select Report Type:\n");
-    printf("1. Summary Report\n");
-    printf("2. Outstanding Payments\n");
-    printf("Enter choice: ");
+// Classifiers in order of preference. SSE2 is part of every build that
+// compiles it; AVX2 is checked on the running CPU.
+static const struct {
+    const char *name;
+    CsvClassifyFn classify;
+    int needs_avx2;
+} csv_classifiers[] = {
+#if defined(__SSE2__)
+    {"avx2", csv_classify_avx2, 1},
+    {"sse2", csv_classify_sse2, 0},
+#endif
+    {"scalar", csv_classify_scalar, 0}
+};
+
+#define CSV_CLASSIFIER_COUNT ((int)(sizeof(csv_classifiers) / sizeof(csv_classifiers[0])))
+
+static int csv_classifier_available(int i) {
+#if defined(__SSE2__)
+    if (csv_classifiers[i].needs_avx2) return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+// Open path for reading with the fastest classifier this CPU supports.
+// Returns 0 (with errno set) on failure.
+int csv_open(CsvReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0) return 0;
+    reader->capacity = CSV_BUFFER_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    reader->masks = malloc(reader->capacity / 64 * sizeof(uint64_t));
+    if (!reader->buffer || !reader->masks) {
+        csv_close(reader);
+        errno = ENOMEM;
+        return 0;
+    }
+    reader->next_line = 1;
+    for (int i = 0; i < CSV_CLASSIFIER_COUNT; i++) {
+        if (csv_classifier_available(i)) {
+            reader->classify = csv_classifiers[i].classify;
+            break;
+        }
+    }
+    return 1;
+}
+
+void csv_close(CsvReader *reader) {
+    if (reader->fd >= 0) close(reader->fd);
+    free(reader->buffer);
+    free(reader->masks);
+    reader->fd = -1;
+    reader->buffer = NULL;
+    reader->masks = NULL;
+}
+
+// Classify buffer[0, end): whole 64-byte blocks with the selected
+// classifier, the final partial block byte by byte
+static void csv_index(CsvReader *reader) {
+    size_t whole = reader->end / 64 * 64;
+    reader->classify(reader->buffer, whole, reader->masks);
+    if (whole < reader->end) {
+        uint64_t bits = 0;
+        for (size_t i = whole; i < reader->end; i++) {
+            char c = reader->buffer[i];
+            if (c == '"' || c == ',' || c == '\n') bits |= 1ULL << (i - whole);
+        }
+        reader->masks[whole / 64] = bits;
+    }
+}
+
+// Move the unconsumed tail to the front, growing the buffer when a single
+// record fills it, read more and reclassify. Returns CSV_RECORD when data
+// was read (or end of file reached), CSV_TOO_LONG when the buffer would
+// have to grow past CSV_MAX_RECORD, CSV_ERROR on a read or allocation
+// failure.
+static int csv_fill(CsvReader *reader) {
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    // One byte is kept free for the terminator of a final unterminated field
+    if (reader->end + 1 >= reader->capacity) {
+        size_t needed = reader->capacity * 2;
+        if (needed > CSV_MAX_RECORD) return CSV_TOO_LONG;
+        char *grown = realloc(reader->buffer, needed);
+        if (!grown) return CSV_ERROR;
+        reader->buffer = grown;
+        uint64_t *masks = realloc(reader->masks, needed / 64 * sizeof(uint64_t));
+        if (!masks) return CSV_ERROR;
+        reader->masks = masks;
+        reader->capacity = needed;
+    }
     
-    int choice = get_choice(1, 2);
+    ssize_t n;
+    do {
+        n = read(reader->fd, reader->buffer + reader->end, reader->capacity - 1 - reader->end);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return CSV_ERROR;
+    if (n == 0) reader->eof = 1;
+    
+    // Skip a UTF-8 BOM at the very start of the file
+    if (reader->bytes == 0 && reader->end == 0 && n >= 3 &&
+        memcmp(reader->buffer, "\xEF\xBB\xBF", 3) == 0) {
+        reader->start = 3;
+        reader->bytes = 3;
+    }
+    reader->end += n;
+    csv_index(reader);
+    return CSV_RECORD;
+}
+
+// Drop the oversized record at reader->start through the next newline
+// (quotes are not honoured). Returns CSV_TOO_LONG or CSV_ERROR.
+static int csv_skip_record(CsvReader *reader) {
+    reader->line_no = reader->next_line++;
+    while (1) {
+        const char *newline = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+        if (newline) {
+            size_t next = newline + 1 - reader->buffer;
+            reader->bytes += next - reader->start;
+            reader->start = next;
+            return CSV_TOO_LONG;
+        }
+        reader->bytes += reader->end - reader->start;
+        reader->start = reader->end = 0;
+        if (reader->eof) return CSV_TOO_LONG;
+        if (csv_fill(reader) != CSV_RECORD) return CSV_ERROR;
+    }
+}
+
+// Offset of the first quote, comma or newline at or after pos, or end
+static size_t csv_next_special(const CsvReader *reader, size_t pos) {
+    if (pos >= reader->end) return reader->end;
+    size_t block = pos / 64, blocks = (reader->end + 63) / 64;
+    uint64_t bits = reader->masks[block] & (~0ULL << (pos % 64));
+    while (!bits) {
+        if (++block == blocks) return reader->end;
+        bits = reader->masks[block];
+    }
+    return block * 64 + __builtin_ctzll(bits);
+}
+
+typedef struct {
+    size_t begin, end;      // content, excluding quotes
+    int quoted;
+    int escaped;            // contains "" pairs to collapse
+} CsvSpan;
+
+// Locate the fields of the record at reader->start without modifying the
+// buffer. Returns 1 with *next at the following record and *lines set to
+// the newlines consumed, or 0 if the record runs past the buffered data.
+static int csv_split(CsvReader *reader, CsvSpan *spans, size_t *next, long long *lines) {
+    const char *base = reader->buffer;
+    size_t end = reader->end;
+    size_t p = reader->start;
+    int count = 0;
+    *lines = 0;
     
-    if (choice == 2) {
-        // Outstanding payments
-        const char *sql = "SELECT bill_no, patient_name, total_amount, amount_paid, "
-                         "balance_due, bill_date FROM bills WHERE balance_due > 0 "
-                         "ORDER BY balance_due DESC";
-        
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
-            printf("Error generating report: %s\n", sqlite3_errmsg(db));
-            printf("\nPress Enter to continue...");
-            getchar();
-            return;
+    while (1) {
+        CsvSpan span = {p, p, 0, 0};
+        if (p < end && base[p] == '"') {
+            // Quoted: runs to a quote not followed by another; "" is a literal quote
+            size_t q = p + 1;
+            while (1) {
+                q = csv_next_special(reader, q);
+                if (q == end) {
+                    if (!reader->eof) return 0;
+                    break;      // unterminated quote: take the rest of the file
+                }
+                if (base[q] != '"') {
+                    if (base[q] == '\n') (*lines)++;
+                    q++;
+                    continue;
+                }
+                if (q + 1 == end && !reader->eof) return 0;
+                if (q + 1 < end && base[q + 1] == '"') {
+                    span.escaped = 1;
+                    q += 2;
+                    continue;
+                }
+                break;
+            }
+            span.begin = p + 1;
+            span.end = q;
+            span.quoted = 1;
+            // Anything between the closing quote and the delimiter is dropped
+            p = q;
+            if (p < end) {
+                do {
+                    p = csv_next_special(reader, p + 1);
+                } while (p < end && base[p] == '"');
+            }
+        } else {
+            // Unquoted: a quote inside the field is an ordinary character
+            p = csv_next_special(reader, p);
+            while (p < end && base[p] == '"') p = csv_next_special(reader, p + 1);
+            span.end = p;
         }
         
-        printf("\nOUTSTANDING PAYMENTS REPORT\n");
-        printf("════════════════════════════════════════════════════\n");
-        printf("Bill No  Patient Name               Total      Paid       Balance    Date\n");
-        printf("══════════════════════════════════════════════════════════════════════════\n");
-        
-        float total_outstanding = 0;
-        int count = 0;
+        if (p == end && !reader->eof) return 0;
+        if (count < CSV_MAX_FIELDS) spans[count] = span;
+        count++;
         
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            count++;
-            int bill_no = sqlite3_column_int(stmt, 0);
-            const unsigned char *patient_name = sqlite3_column_text(stmt, 1);
-            float total_amount = sqlite3_column_double(stmt, 2);
-            float amount_paid = sqlite3_column_double(stmt, 3);
-            float balance_due = sqlite3_column_double(stmt, 4);
-            const unsigned char *bill_date = sqlite3_column_text(stmt, 5);
-            
-            printf("%-8d %-25s $%-9.2f $%-9.2f $%-9.2f %s\n", 
-                   bill_no, 
-                   patient_name ? (const char*)patient_name : "Unknown",
-                   total_amount, 
-                   amount_paid, 
-                   balance_due,
-                   bill_date ? (const char*)bill_date : "Unknown");
-            
-            total_outstanding += balance_due;
+        if (p < end && base[p] == ',') {
+            p++;
+            continue;
         }
-        
-        sqlite3_finalize(stmt);
-        
-        printf("\nSummary:\n");
-        printf("  Total Outstanding Bills: %d\n", count);
-        printf("  Total Outstanding Amount: $%.2f\n", total_outstanding);
-        
-    } else {
-        // Summary report
-        const char *sql = "SELECT COUNT(*), SUM(total_amount), SUM(amount_paid), "
-                         "SUM(balance_due) FROM bills";
-        
-        sqlite3_stmt *stmt;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
-            sqlite3_step(stmt) != SQLITE_ROW) {
-            printf("Error generating report: %s\n", sqlite3_errmsg(db));
-            sqlite3_finalize(stmt);
-            printf("\nPress Enter to continue...");
-            getchar();
-            return;
+        // End of record: drop the \r of a CRLF line ending
+        if (count <= CSV_MAX_FIELDS) {
+            CsvSpan *last = &spans[count - 1];
+            if (!last->quoted && last->end > last->begin && base[last->end - 1] == '\r') {
+                last->end--;
+            }
+        }
+        if (p < end) {
+            (*lines)++;
+            p++;
+        }
+        reader->field_count = count;
+        *next = p;
+        return 1;
+    }
+}
+
+// Read the next non-blank record into reader->fields. Returns CSV_RECORD,
+// CSV_END, CSV_ERROR (read failure) or CSV_TOO_LONG; after CSV_TOO_LONG
+// the oversized record has been skipped and reading can continue.
+int csv_next(CsvReader *reader) {
+    CsvSpan spans[CSV_MAX_FIELDS];
+    while (1) {
+        size_t next;
+        long long lines;
+        if (reader->start == reader->end || !csv_split(reader, spans, &next, &lines)) {
+            if (reader->eof) return CSV_END;
+            int rc = csv_fill(reader);
+            if (rc == CSV_TOO_LONG) return csv_skip_record(reader);
+            if (rc != CSV_RECORD) return CSV_ERROR;
+            continue;
         }
         
-        int total_bills = sqlite3_column_int(stmt, 0);
-        float total_billed = sqlite3_column_double(stmt, 1);
-        float total_paid = sqlite3_column_double(stmt, 2);
-        float total_outstanding = sqlite3_column_double(stmt, 3);
+        reader->line_no = reader->next_line;
+        reader->next_line += lines > 0 ? lines : 1;
+        reader->bytes += next - reader->start;
+        reader->start = next;
         
-        sqlite3_finalize(stmt);
+        // Skip blank lines
+        if (reader->field_count == 1 && !spans[0].quoted && spans[0].end == spans[0].begin) {
+            continue;
+        }
         
-        printf("\nFINANCIAL SUMMARY REPORT\n");
-        printf("════════════════════════════════════════════════════\n");
-        printf("\nSummary Statistics:\n");
-        printf("  Total Bills Generated:      %d\n", total_bills);
-        printf("  Total Amount Billed:        $%.2f\n", total_billed);
-        printf("  Total Amount Collected:     $%.2f\n", total_paid);
-        printf("  Total Outstanding:          $%.2f\n", total_outstanding);
-        printf("  Collection Rate:            %.1f%%\n", 
-               total_billed > 0 ? (total_paid / total_billed * 100) : 0);
+        int kept = reader->field_count < CSV_MAX_FIELDS ? reader->field_count : CSV_MAX_FIELDS;
+        for (int i = 0; i < kept; i++) {
+            char *text = reader->buffer + spans[i].begin;
+            size_t length = spans[i].end - spans[i].begin;
+            if (spans[i].escaped) {
+                size_t out = 0;
+                for (size_t in = 0; in < length; in++) {
+                    text[out++] = text[in];
+                    if (text[in] == '"') in++;
+                }
+                length = out;
+            }
+            text[length] = '\0';
+            reader->fields[i].text = text;
+            reader->fields[i].length = length;
+        }
+        return CSV_RECORD;
     }
-    
-    printf("\nPress Enter to continue...");
-    getchar();
 }
 
-void view_statistics() {
-    clear_screen();
-    print_header("SYSTEM STATISTICS");
-    
-    printf("\nOverall Statistics:\n");
-    printf("════════════════════════════════════════════════════\n");
-    
-    // Patient statistics
-    const char *sql = "SELECT COUNT(*), "
-                     "COUNT(CASE WHEN gender = 'M' THEN 1 END), "
-                     "COUNT(CASE WHEN gender = 'F' THEN 1 END), "
-                     "AVG(age) FROM patients";
+// Field i of the current record, or "" when the record is shorter
+const char *csv_field(const CsvReader *reader, int i) {
+    return i < reader->field_count && i < CSV_MAX_FIELDS ? reader->fields[i].text : "";
+}
+
+// Write the current record back out as one CSV line (quoting only where
+// needed) for error reports
+void csv_record_text(const CsvReader *reader, char *buffer, size_t size) {
+    size_t used = 0;
+    int kept = reader->field_count < CSV_MAX_FIELDS ? reader->field_count : CSV_MAX_FIELDS;
+    buffer[0] = '\0';
+    for (int i = 0; i < kept && used + 1 < size; i++) {
+        const char *text = reader->fields[i].text;
+        int quote = strpbrk(text, ",\"\r\n") != NULL;
+        if (i > 0) buffer[used++] = ',';
+        if (quote && used + 1 < size) buffer[used++] = '"';
+        for (const char *p = text; *p && used + 2 < size; p++) {
+            if (*p == '"') buffer[used++] = '"';
+            buffer[used++] = *p;
+        }
+        if (quote && used + 1 < size) buffer[used++] = '"';
+        buffer[used] = '\0';
+    }
+}
+
+// Tokenize path with every classifier the CPU supports and report
+// throughput; each makes passes over the file for at least a second and
+// must produce the same record and field counts.
+int run_csv_bench(const char *path) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    printf("CSV tokenizer benchmark: %s (%.1f MB)\n", path, info.st_size / 1e6);
+    printf("%-8s %12s %12s %10s %8s\n", "Scanner", "Records", "Fields", "MB/s", "Passes");
+    
+    long long expected_records = -1, expected_fields = -1;
+    const char *reference = NULL;
+    for (int i = 0; i < CSV_CLASSIFIER_COUNT; i++) {
+        if (!csv_classifier_available(i)) {
+            printf("%-8s %12s\n", csv_classifiers[i].name, "unsupported");
+            continue;
+        }
+        long long records = 0, fields = 0, bytes = 0;
+        int passes = 0;
+        double started = now_seconds(), elapsed;
+        do {
+            CsvReader reader;
+            if (!csv_open(&reader, path)) {
+                fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+                return 1;
+            }
+            reader.classify = csv_classifiers[i].classify;
+            records = fields = 0;
+            int rc;
+            while ((rc = csv_next(&reader)) != CSV_END) {
+                if (rc == CSV_ERROR) {
+                    fprintf(stderr, "Read error in %s\n", path);
+                    csv_close(&reader);
+                    return 1;
+                }
+                if (rc == CSV_RECORD) {
+                    records++;
+                    fields += reader.field_count;
+                }
+            }
+            bytes += reader.bytes;
+            csv_close(&reader);
+            passes++;
+            elapsed = now_seconds() - started;
+        } while (elapsed < 1.0 && passes < 1000);
+        
+        printf("%-8s %12lld %12lld %10.1f %8d\n", csv_classifiers[i].name, records, fields,
+               bytes / 1e6 / elapsed, passes);
+        if (reference && (records != expected_records || fields != expected_fields)) {
+            fprintf(stderr, "Scanner %s disagrees with %s\n", csv_classifiers[i].name, reference);
+            return 1;
+        }
+        reference = csv_classifiers[i].name;
+        expected_records = records;
+        expected_fields = fields;
+    }
+    return 0;
+}
+
+// ==================== CHARGE MASTER ====================
+
+// FNV-1a over the service code
+static unsigned int hash_code(const char *code) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char*)code; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void free_charge_master() {
+    free(charge_master.entries);
+    free(charge_master.slots);
+    charge_master.entries = NULL;
+    charge_master.slots = NULL;
+    charge_master.count = 0;
+    charge_master.slot_count = 0;
+    charge_master.revision = -1;
+}
+
+static long long charge_master_revision(sqlite3 *conn) {
+    sqlite3_stmt *stmt;
+    long long revision = 0;
     
+    if (sqlite3_prepare_v2(conn, "SELECT revision FROM charge_master_meta WHERE id = 1",
+                           -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            revision = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return revision;
+}
+
+// Rebuild the in-memory catalog from the charge_master table. The hash index
+// is sized to keep the load factor at or below 0.5 so probes stay short.
+// Returns the number of codes loaded, or -1 on error (old table is kept).
+int load_charge_master(sqlite3 *conn) {
     sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK && 
-        sqlite3_step(stmt) == SQLITE_ROW) {
-        int total_patients = sqlite3_column_int(stmt, 0);
-        int male_patients = sqlite3_column_int(stmt, 1);
-        int female_patients = sqlite3_column_int(stmt, 2);
-        float avg_age = sqlite3_column_double(stmt, 3);
+    int count = 0;
+    
+    if (sqlite3_prepare_v2(conn, "SELECT COUNT(*) FROM charge_master", -1, &stmt, 0) != SQLITE_OK) {
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        count = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    
+    int slot_count = 16;
+    while (slot_count < count * 2) {
+        slot_count *= 2;
+    }
+    
+    ChargeEntry *entries = malloc((count > 0 ? count : 1) * sizeof(ChargeEntry));
+    int *slots = malloc(slot_count * sizeof(int));
+    if (!entries || !slots) {
+        free(entries);
+        free(slots);
+        return -1;
+    }
+    memset(slots, -1, slot_count * sizeof(int));
+    
+    const char *sql = "SELECT code, description, price, category FROM charge_master";
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, 0) != SQLITE_OK) {
+        free(entries);
+        free(slots);
+        return -1;
+    }
+    
+    int loaded = 0;
+    while (loaded < count && sqlite3_step(stmt) == SQLITE_ROW) {
+        ChargeEntry *entry = &entries[loaded];
+        const unsigned char *code = sqlite3_column_text(stmt, 0);
+        const unsigned char *description = sqlite3_column_text(stmt, 1);
+        
+        snprintf(entry->code, sizeof(entry->code), "%s", code ? (const char*)code : "");
+        snprintf(entry->description, sizeof(entry->description), "%s",
+                 description ? (const char*)description : "");
+        entry->price = sqlite3_column_double(stmt, 2);
+        entry->category = category_index((const char*)sqlite3_column_text(stmt, 3));
         
-        printf("PATIENTS:\n");
-        printf("  Total Patients:        %d\n", total_patients);
-        printf("  Male Patients:         %d\n", male_patients);
-        printf("  Female Patients:       %d\n", female_patients);
-        printf("  Average Age:           %.1f years\n", avg_age);
+        unsigned int slot = hash_code(entry->code) & (slot_count - 1);
+        while (slots[slot] != -1) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = loaded++;
     }
     sqlite3_finalize(stmt);
     
-    // Bill statistics
-    sql = "SELECT COUNT(*), SUM(total_amount), SUM(amount_paid), "
-          "SUM(balance_due), AVG(total_amount) FROM bills";
+    free_charge_master();
+    charge_master.entries = entries;
+    charge_master.count = loaded;
+    charge_master.slots = slots;
+    charge_master.slot_count = slot_count;
+    charge_master.revision = charge_master_revision(conn);
     
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK && 
-        sqlite3_step(stmt) == SQLITE_ROW) {
-        int total_bills = sqlite3_column_int(stmt, 0);
-        float total_billed = sqlite3_column_double(stmt, 1);
-        float total_paid = sqlite3_column_double(stmt, 2);
-        float total_outstanding = sqlite3_column_double(stmt, 3);
-        float avg_bill = sqlite3_column_double(stmt, 4);
-        
-        printf("\nBILLING:\n");
-        printf("  Total Bills:           %d\n", total_bills);
-        printf("  Total Amount Billed:   $%.2f\n", total_billed);
-        printf("  Total Amount Paid:     $%.2f\n", total_paid);
-        printf("  Total Outstanding:     $%.2f\n", total_outstanding);
-        printf("  Average Bill Amount:   $%.2f\n", avg_bill);
-        printf("  Collection Rate:       %.1f%%\n", 
-               total_billed > 0 ? (total_paid / total_billed * 100) : 0);
+    return loaded;
+}
+
+// Rebuild the catalog only if charge_master changed since it was loaded
+void refresh_charge_master(sqlite3 *conn) {
+    if (!charge_master_frozen && charge_master_revision(conn) != charge_master.revision) {
+        load_charge_master(conn);
+    }
+}
+
+const ChargeEntry *lookup_charge(const char *code) {
+    if (charge_master.slot_count == 0) {
+        return NULL;
+    }
+    
+    unsigned int slot = hash_code(code) & (charge_master.slot_count - 1);
+    while (charge_master.slots[slot] != -1) {
+        const ChargeEntry *entry = &charge_master.entries[charge_master.slots[slot]];
+        if (strcmp(entry->code, code) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (charge_master.slot_count - 1);
+    }
+    return NULL;
+}
+
+// Bulk-load a catalog file (code,description,price,category per line) into
+// charge_master. All rows go in one transaction through one reused statement;
+// existing codes are replaced with the new price.
+void import_charge_master() {
+    clear_screen();
+    print_header("LOAD CHARGE MASTER");
+    
+    char filename[200];
+    get_string("Catalog CSV file (code,description,price,category): ", filename, sizeof(filename));
+    
+    CsvReader reader;
+    if (!csv_open(&reader, filename)) {
+        printf("❌ Cannot open file: %s\n", filename);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    const char *sql = "INSERT OR REPLACE INTO charge_master (code, description, price, category) "
+                      "VALUES (?, ?, ?, ?)";
+    sqlite3_stmt *stmt;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        printf("Database error: %s\n", sqlite3_errmsg(db));
+        csv_close(&reader);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    double start = now_seconds();
+    sqlite3_exec(db, "BEGIN TRANSACTION;", 0, 0, 0);
+    
+    int loaded = 0, skipped = 0, rc;
+    
+    while ((rc = csv_next(&reader)) != CSV_END && rc != CSV_ERROR) {
+        if (rc == CSV_TOO_LONG) {
+            skipped++;
+            continue;
+        }
+        
+        const char *code = csv_field(&reader, 0);
+        const char *price_text = csv_field(&reader, 2);
+        char *end = NULL;
+        double price = reader.field_count >= 3 ? strtod(price_text, &end) : 0;
+        
+        if (reader.field_count < 3 || end == price_text || price < 0 || code[0] == '\0') {
+            // A header line or malformed row
+            skipped++;
+            continue;
+        }
+        
+        // Field views stay valid until the next record, so bind without copying
+        sqlite3_bind_text(stmt, 1, code, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, csv_field(&reader, 1), -1, SQLITE_STATIC);
+        sqlite3_bind_double(stmt, 3, price);
+        int category = category_index(reader.field_count >= 4 ? csv_field(&reader, 3) : NULL);
+        sqlite3_bind_text(stmt, 4, charge_categories[category], -1, SQLITE_STATIC);
+        
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            loaded++;
+        } else {
+            skipped++;
+        }
+        sqlite3_reset(stmt);
     }
+    
     sqlite3_finalize(stmt);
+    csv_close(&reader);
+    
+    if (rc == CSV_ERROR) {
+        printf("\n❌ Error reading %s; catalog not changed\n", filename);
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    } else if (sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK) {
+        printf("\n❌ Error saving catalog: %s\n", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    } else {
+        int total = load_charge_master(db);
+        double seconds = now_seconds() - start;
+        
+        printf("\n✅ Loaded %d catalog codes (%d lines skipped)\n", loaded, skipped);
+        printf("   Charge master now holds %d codes\n", total);
+        printf("   Time: %.2f s (%.0f codes/sec)\n", seconds,
+               seconds > 0 ? loaded / seconds : (double)loaded);
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== REMITTANCE IMPORT ====================
+
+#define REMITTANCE_BATCH_SIZE 500
+#define REMITTANCE_DEFAULT_METHOD "Bank Lockbox"
+
+typedef struct {
+    sqlite3_stmt *apply;        // payment_apply_sql
+    sqlite3_stmt *record;       // payment_record_sql
+    sqlite3_stmt *balance;      // balance lookup to explain a rejected line
+} RemittanceStatements;
+
+// Rejected lines of an import, written to path as line,reason,record with
+// the original text quoted. Lines are held in memory until the transaction
+// they belong to commits, so a batch that is rolled back leaves none of its
+// lines in the file.
+typedef struct {
+    const char *path;
+    FILE *file;                 // opened when the first line is written
+    OutputBuffer pending;       // lines of the uncommitted batch
+    long long pending_count;
+    long long written;
+} ImportExceptions;
+
+// Start a fresh exceptions file for an import (any old one is removed)
+static void import_exceptions_init(ImportExceptions *exceptions, const char *path) {
+    exceptions->path = path;
+    exceptions->file = NULL;
+    output_init(&exceptions->pending, -1);
+    exceptions->pending_count = exceptions->written = 0;
+    remove(path);
+}
+
+// Hold one rejected line with the batch in progress
+static void import_exception(ImportExceptions *exceptions, long long line_no,
+                             const char *reason, const char *record) {
+    OutputBuffer *out = &exceptions->pending;
+    char prefix[160];
+    int length = snprintf(prefix, sizeof(prefix), "%lld,\"%s\",\"", line_no, reason);
+    output_append(out, prefix, length < (int)sizeof(prefix) ? (size_t)length : sizeof(prefix) - 1);
+    for (const char *p = record; *p; ) {
+        size_t span = strcspn(p, "\"");
+        output_append(out, p, span);
+        p += span;
+        if (*p == '"') {
+            output_append(out, "\"\"", 2);
+            p++;
+        }
+    }
+    output_append(out, "\"\n", 2);
+    exceptions->pending_count++;
+}
+
+// The batch committed: write its lines out
+static void import_exceptions_commit(ImportExceptions *exceptions) {
+    if (exceptions->pending_count > 0 && !exceptions->file) {
+        exceptions->file = fopen(exceptions->path, "w");
+        if (exceptions->file) fprintf(exceptions->file, "line,reason,record\n");
+    }
+    if (exceptions->file && exceptions->pending.length > 0) {
+        fwrite(exceptions->pending.data, 1, exceptions->pending.length, exceptions->file);
+    }
+    exceptions->written += exceptions->pending_count;
+    exceptions->pending.length = 0;
+    exceptions->pending_count = 0;
+}
+
+// Close the file; lines of a batch that never committed are dropped
+static void import_exceptions_close(ImportExceptions *exceptions) {
+    if (exceptions->file) fclose(exceptions->file);
+    exceptions->file = NULL;
+    output_free(&exceptions->pending);
+    exceptions->pending_count = 0;
+}
+
+// Apply one remittance inside the caller's transaction. Returns SQLITE_OK
+// when posted, SQLITE_NOTFOUND with *reason set when the line belongs in
+// the exceptions file, or another SQLite error code.
+static int post_remittance(sqlite3 *conn, RemittanceStatements *stmts, long long bill_no,
+                           double amount, const char *method, char *reason, size_t reason_size) {
+    sqlite3_bind_double(stmts->apply, 1, amount);
+    sqlite3_bind_int64(stmts->apply, 2, bill_no);
+    int rc = sqlite3_step(stmts->apply);
+    sqlite3_reset(stmts->apply);
+    if (rc != SQLITE_DONE) return rc;
+    
+    if (sqlite3_changes(conn) == 1) {
+        sqlite3_bind_int64(stmts->record, 1, bill_no);
+        sqlite3_bind_double(stmts->record, 2, amount);
+        sqlite3_bind_text(stmts->record, 3, method, -1, SQLITE_TRANSIENT);
+        rc = sqlite3_step(stmts->record);
+        sqlite3_reset(stmts->record);
+        return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+    
+    // Not applied: either no such bill or the amount exceeds the balance
+    sqlite3_bind_int64(stmts->balance, 1, bill_no);
+    rc = sqlite3_step(stmts->balance);
+    if (rc == SQLITE_ROW) {
+        double balance = sqlite3_column_double(stmts->balance, 0);
+        if (balance <= 0.005) {
+            snprintf(reason, reason_size, "bill already paid");
+        } else {
+            snprintf(reason, reason_size, "overpayment (balance due $%.2f)", balance);
+        }
+        rc = SQLITE_NOTFOUND;
+    } else if (rc == SQLITE_DONE) {
+        snprintf(reason, reason_size, "no such bill");
+        rc = SQLITE_NOTFOUND;
+    }
+    sqlite3_reset(stmts->balance);
+    return rc;
+}
+
+// Post a bank lockbox file (bill_no,amount[,payment_method] per line) in
+// transactions of REMITTANCE_BATCH_SIZE lines through one set of prepared
+// statements. Lines that do not parse, name no bill or exceed the balance
+// due are copied to FILE.exceptions.csv with the reason instead.
+void import_remittances() {
+    clear_screen();
+    print_header("IMPORT BANK REMITTANCES");
+    
+    char filename[200];
+    get_string("Remittance file (bill_no,amount[,payment_method]): ", filename, sizeof(filename));
+    
+    CsvReader reader;
+    if (!csv_open(&reader, filename)) {
+        printf("❌ Cannot open file: %s\n", filename);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    char exceptions_path[220];
+    snprintf(exceptions_path, sizeof(exceptions_path), "%s.exceptions.csv", filename);
+    ImportExceptions exceptions;
+    import_exceptions_init(&exceptions, exceptions_path);
+    
+    RemittanceStatements stmts = {NULL, NULL, NULL};
+    if (sqlite3_prepare_v2(db, payment_apply_sql, -1, &stmts.apply, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, payment_record_sql, -1, &stmts.record, 0) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT balance_due FROM bills WHERE bill_no = ?", -1, &stmts.balance, 0) != SQLITE_OK) {
+        printf("Database error: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(stmts.apply);
+        sqlite3_finalize(stmts.record);
+        csv_close(&reader);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    double start = now_seconds();
+    char record[1024], reason[64];
+    int in_batch = 0, status = CSV_END;
+    long long batch_first_line = 1;
+    long long posted = 0, batch_posted = 0;
+    int64_t posted_cents = 0, batch_cents = 0;
+    int rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0);
+    
+    while (rc == SQLITE_OK && (status = csv_next(&reader)) != CSV_END && status != CSV_ERROR) {
+        if (status == CSV_TOO_LONG) {
+            import_exception(&exceptions, reader.line_no, "line too long", "");
+            continue;
+        }
+        
+        int n = reader.field_count;
+        const char *bill_text = csv_field(&reader, 0), *amount_text = csv_field(&reader, 1);
+        char *bill_end = NULL, *amount_end = NULL;
+        long long bill_no = strtoll(bill_text, &bill_end, 10);
+        double amount = n >= 2 ? strtod(amount_text, &amount_end) : 0;
+        int valid = n >= 2 && bill_end != bill_text && *bill_end == '\0' && bill_no > 0 &&
+                    amount_end != amount_text && *amount_end == '\0' && amount >= 0.01 && isfinite(amount);
+        
+        if (!valid) {
+            if (reader.line_no == 1 && bill_end == bill_text) {
+                continue;       // header line
+            }
+            csv_record_text(&reader, record, sizeof(record));
+            import_exception(&exceptions, reader.line_no, "malformed line", record);
+        } else {
+            amount = round(amount * 100.0) / 100.0;
+            const char *method = n >= 3 && csv_field(&reader, 2)[0] ? csv_field(&reader, 2) : REMITTANCE_DEFAULT_METHOD;
+            rc = post_remittance(db, &stmts, bill_no, amount, method, reason, sizeof(reason));
+            if (rc == SQLITE_OK) {
+                batch_posted++;
+                batch_cents += llround(amount * 100.0);
+            } else if (rc == SQLITE_NOTFOUND) {
+                csv_record_text(&reader, record, sizeof(record));
+                import_exception(&exceptions, reader.line_no, reason, record);
+                rc = SQLITE_OK;
+            } else {
+                break;
+            }
+        }
+        
+        if (++in_batch == REMITTANCE_BATCH_SIZE) {
+            rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+            if (rc != SQLITE_OK) break;
+            import_exceptions_commit(&exceptions);
+            posted += batch_posted;
+            posted_cents += batch_cents;
+            batch_posted = batch_cents = 0;
+            in_batch = 0;
+            batch_first_line = reader.next_line;
+            rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0);
+        }
+    }
+    
+    if (rc == SQLITE_OK && status != CSV_ERROR) {
+        rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+        if (rc == SQLITE_OK) {
+            import_exceptions_commit(&exceptions);
+            posted += batch_posted;
+            posted_cents += batch_cents;
+        }
+    }
+    if (rc != SQLITE_OK || status == CSV_ERROR) {
+        printf("\n❌ Import stopped at line %lld: %s\n", reader.line_no,
+               status == CSV_ERROR ? "read error" : sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+        printf("   Lines before %lld were posted; re-import from that line on.\n", batch_first_line);
+    }
+    
+    sqlite3_finalize(stmts.apply);
+    sqlite3_finalize(stmts.record);
+    sqlite3_finalize(stmts.balance);
+    csv_close(&reader);
+    import_exceptions_close(&exceptions);
+    
+    double seconds = now_seconds() - start;
+    if (rc == SQLITE_OK && status != CSV_ERROR) {
+        printf("\n✅ Remittance file processed (%lld lines)\n", reader.next_line - 1);
+    }
+    printf("   Posted:     %lld payments, $%.2f\n", posted, posted_cents / 100.0);
+    printf("   Exceptions: %lld", exceptions.written);
+    if (exceptions.written > 0) printf(" (written to %s)", exceptions_path);
+    printf("\n   Time:       %.2f s (%.0f postings/sec)\n", seconds,
+           seconds > 0 ? posted / seconds : (double)posted);
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== BATCH BILLING ====================
+
+#define BATCH_DEPOSIT_CODE "DEPOSIT"
+
+// Charges gathered for one patient during a batch billing run
+typedef struct {
+    long long patient_id;
+    long long first_line;   // feed line that introduced the patient
+    BillItemList items;
+    double deposit;         // payments already collected, posted with the bill
+    char deposit_method[20];
+} BatchAccount;
+
+// Accounts in feed order plus an open-addressing index on patient_id
+// (power-of-two size, -1 = empty), rebuilt when it passes half full
+typedef struct {
+    BatchAccount *accounts;
+    int count;
+    int capacity;
+    int *slots;
+    int slot_count;
+} BatchAccounts;
+
+static unsigned int batch_slot(long long patient_id, int slot_count) {
+    // Fibonacci hashing spreads consecutive ids across the table
+    return (unsigned int)(((uint64_t)patient_id * 0x9E3779B97F4A7C15ULL) >> 32) & (slot_count - 1);
+}
+
+static int batch_rehash(BatchAccounts *map, int slot_count) {
+    int *slots = malloc(slot_count * sizeof(int));
+    if (!slots) return 0;
+    memset(slots, -1, slot_count * sizeof(int));
+    for (int i = 0; i < map->count; i++) {
+        unsigned int slot = batch_slot(map->accounts[i].patient_id, slot_count);
+        while (slots[slot] != -1) slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = i;
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->slot_count = slot_count;
+    return 1;
+}
+
+// The account for patient_id, created on first sight. NULL on OOM.
+static BatchAccount *batch_account(BatchAccounts *map, long long patient_id, long long line_no) {
+    if ((map->count + 1) * 2 > map->slot_count && !batch_rehash(map, map->slot_count ? map->slot_count * 2 : 1024)) {
+        return NULL;
+    }
+    unsigned int slot = batch_slot(patient_id, map->slot_count);
+    while (map->slots[slot] != -1) {
+        BatchAccount *account = &map->accounts[map->slots[slot]];
+        if (account->patient_id == patient_id) return account;
+        slot = (slot + 1) & (map->slot_count - 1);
+    }
+    
+    if (map->count == map->capacity) {
+        int capacity = map->capacity ? map->capacity * 2 : 1024;
+        BatchAccount *grown = realloc(map->accounts, capacity * sizeof(BatchAccount));
+        if (!grown) return NULL;
+        map->accounts = grown;
+        map->capacity = capacity;
+    }
+    BatchAccount *account = &map->accounts[map->count];
+    memset(account, 0, sizeof(*account));
+    account->patient_id = patient_id;
+    account->first_line = line_no;
+    bill_items_init(&account->items);
+    map->slots[slot] = map->count++;
+    return account;
+}
+
+static void batch_accounts_free(BatchAccounts *map) {
+    for (int i = 0; i < map->count; i++) {
+        bill_items_free(&map->accounts[i].items);
+    }
+    free(map->accounts);
+    free(map->slots);
+}
+
+// Add quantity of a charge to the account, folding repeats of the same
+// code at the same price into one line. Returns 0 on OOM.
+static int batch_add_charge(BatchAccount *account, const BillItem *item) {
+    for (int i = 0; i < account->items.count; i++) {
+        BillItem *line = &account->items.items[i];
+        if (strcmp(line->code, item->code) == 0 && line->unit_price == item->unit_price) {
+            line->quantity += item->quantity;
+            return 1;
+        }
+    }
+    return bill_items_add(&account->items, item);
+}
+
+typedef struct {
+    sqlite3_stmt *patient;
+    sqlite3_stmt *bill;
+    sqlite3_stmt *items;
+    sqlite3_stmt *payment;
+} BatchStatements;
+
+// Insert the bill, its lines and any deposit for one account inside the
+// caller's transaction. Totals are computed here rather than re-read with
+// sync_bill_totals(). Returns SQLITE_NOTFOUND with *reason set when the
+// account belongs in the exceptions file.
+static int insert_batch_bill(sqlite3 *conn, BatchStatements *stmts, const BatchAccount *account,
+                             double *billed, char *reason, size_t reason_size) {
+    sqlite3_bind_int64(stmts->patient, 1, account->patient_id);
+    int rc = sqlite3_step(stmts->patient);
+    if (rc != SQLITE_ROW) {
+        sqlite3_reset(stmts->patient);
+        if (rc != SQLITE_DONE) return rc;
+        snprintf(reason, reason_size, "no such patient");
+        return SQLITE_NOTFOUND;
+    }
+    if (account->items.count == 0) {
+        sqlite3_reset(stmts->patient);
+        snprintf(reason, reason_size, "deposit without charges");
+        return SQLITE_NOTFOUND;
+    }
+    
+    double subtotals[CATEGORY_COUNT];
+    double total = bill_items_total(&account->items, subtotals);
+    if (account->deposit > total + 0.005) {
+        sqlite3_reset(stmts->patient);
+        snprintf(reason, reason_size, "deposit $%.2f exceeds charges $%.2f", account->deposit, total);
+        return SQLITE_NOTFOUND;
+    }
+    double balance = total - account->deposit;
+    const char *status = balance <= 0.005 ? "Paid" : account->deposit > 0 ? "Partial" : "Pending";
+    
+    // The name is copied when bound, so the patient statement can be reset
+    // before the insert; resetting it afterwards would clear the insert's
+    // error message
+    sqlite3_bind_int64(stmts->bill, 1, account->patient_id);
+    sqlite3_bind_text(stmts->bill, 2, (const char*)sqlite3_column_text(stmts->patient, 0), -1, SQLITE_TRANSIENT);
+    for (int i = 0; i < CATEGORY_COUNT; i++) {
+        sqlite3_bind_double(stmts->bill, 3 + i, subtotals[i]);
+    }
+    sqlite3_bind_double(stmts->bill, 8, total);
+    sqlite3_bind_double(stmts->bill, 9, account->deposit);
+    sqlite3_bind_double(stmts->bill, 10, balance);
+    sqlite3_bind_text(stmts->bill, 11, status, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmts->bill, 12, account->deposit_method[0] ? account->deposit_method : "Cash",
+                      -1, SQLITE_STATIC);
+    sqlite3_reset(stmts->patient);
+    rc = sqlite3_step(stmts->bill);
+    sqlite3_reset(stmts->bill);
+    if (rc != SQLITE_DONE) return rc;
+    long long bill_no = sqlite3_last_insert_rowid(conn);
+    
+    if (!insert_bill_items_with(stmts->items, bill_no, &account->items)) {
+        rc = sqlite3_errcode(conn);
+        return rc == SQLITE_OK ? SQLITE_ERROR : rc;
+    }
+    
+    if (account->deposit > 0) {
+        sqlite3_bind_int64(stmts->payment, 1, bill_no);
+        sqlite3_bind_double(stmts->payment, 2, account->deposit);
+        sqlite3_bind_text(stmts->payment, 3, account->deposit_method, -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmts->payment);
+        sqlite3_reset(stmts->payment);
+        if (rc != SQLITE_DONE) return rc;
+    }
+    *billed = total;
+    return SQLITE_OK;
+}
+
+// Month-end billing from a charge-capture feed with one charge per line:
+//     patient_id,code,quantity[,unit_price]
+// Catalog codes take their description, category and (unless given) price
+// from the charge master; other codes need a price and bill as Other. A
+// DEPOSIT line (patient_id,DEPOSIT,amount[,payment_method]) records money
+// already collected, posted as the bill's initial payment. The feed is read
+// once into a hash map of per-patient charges, then one bill per patient is
+// inserted in a single transaction through reused statements, so a failed
+// run bills nobody and can simply be repeated.
+void batch_billing_run() {
+    clear_screen();
+    print_header("BATCH BILLING RUN");
+    
+    char filename[200];
+    get_string("Charge feed file (patient_id,code,quantity[,unit_price]): ", filename, sizeof(filename));
+    
+    CsvReader reader;
+    if (!csv_open(&reader, filename)) {
+        printf("❌ Cannot open file: %s\n", filename);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    char exceptions_path[220];
+    snprintf(exceptions_path, sizeof(exceptions_path), "%s.exceptions.csv", filename);
+    ImportExceptions exceptions;
+    import_exceptions_init(&exceptions, exceptions_path);
+    
+    refresh_charge_master(db);
+    double start = now_seconds();
+    
+    BatchAccounts map = {NULL, 0, 0, NULL, 0};
+    char record[1024];
+    long long charge_lines = 0;
+    int out_of_memory = 0, status;
+    
+    while ((status = csv_next(&reader)) != CSV_END && status != CSV_ERROR) {
+        if (status == CSV_TOO_LONG) {
+            import_exception(&exceptions, reader.line_no, "line too long", "");
+            continue;
+        }
+        
+        int n = reader.field_count;
+        const char *id_text = csv_field(&reader, 0), *code = csv_field(&reader, 1);
+        const char *amount_text = csv_field(&reader, 2), *extra = csv_field(&reader, 3);
+        char *id_end = NULL, *quantity_end = NULL, *price_end = NULL;
+        long long patient_id = strtoll(id_text, &id_end, 10);
+        if (id_end == id_text || *id_end != '\0' || patient_id <= 0 || n < 3 || code[0] == '\0') {
+            if (reader.line_no > 1 || (id_end != id_text && *id_end == '\0')) {
+                csv_record_text(&reader, record, sizeof(record));
+                import_exception(&exceptions, reader.line_no, "malformed line", record);
+            }
+            continue;       // otherwise a header line
+        }
+        
+        const char *reason = NULL;
+        BillItem item;
+        memset(&item, 0, sizeof(item));
+        if (strcasecmp(code, BATCH_DEPOSIT_CODE) == 0) {
+            double amount = strtod(amount_text, &price_end);
+            if (price_end == amount_text || *price_end != '\0' || !(amount >= 0.01 && amount <= 1e9)) {
+                reason = "invalid deposit amount";
+            } else {
+                BatchAccount *account = batch_account(&map, patient_id, reader.line_no);
+                if (!account) {
+                    out_of_memory = 1;
+                    break;
+                }
+                // The deposits become one payments row, so they must share a method
+                char method[sizeof(account->deposit_method)];
+                snprintf(method, sizeof(method), "%s", n >= 4 && extra[0] ? extra : "Cash");
+                if (account->deposit > 0 && strcmp(method, account->deposit_method) != 0) {
+                    reason = "deposit method differs from an earlier deposit";
+                } else {
+                    account->deposit += round(amount * 100.0) / 100.0;
+                    memcpy(account->deposit_method, method, sizeof(method));
+                }
+            }
+        } else {
+            long quantity = strtol(amount_text, &quantity_end, 10);
+            const ChargeEntry *entry = lookup_charge(code);
+            double price = entry ? entry->price : -1;
+            if (n >= 4 && extra[0]) {
+                price = strtod(extra, &price_end);
+                if (price_end == extra || *price_end != '\0' || !(price >= 0 && price <= 1e7)) {
+                    price = -2;
+                }
+            }
+            
+            if (quantity_end == amount_text || *quantity_end != '\0' || quantity < 1 || quantity > 10000) {
+                reason = "invalid quantity";
+            } else if (price == -1) {
+                reason = "code not in charge master and no price";
+            } else if (price < 0) {
+                reason = "invalid unit price";
+            } else {
+                snprintf(item.code, sizeof(item.code), "%s", code);
+                snprintf(item.description, sizeof(item.description), "%s",
+                         entry ? entry->description : code);
+                item.category = entry ? entry->category : CATEGORY_COUNT - 1;
+                item.quantity = (int)quantity;
+                item.unit_price = price;
+                BatchAccount *account = batch_account(&map, patient_id, reader.line_no);
+                if (!account || !batch_add_charge(account, &item)) {
+                    out_of_memory = 1;
+                    break;
+                }
+                charge_lines++;
+            }
+        }
+        if (reason) {
+            csv_record_text(&reader, record, sizeof(record));
+            import_exception(&exceptions, reader.line_no, reason, record);
+        }
+    }
+    csv_close(&reader);
+    double aggregated = now_seconds();
+    
+    if (out_of_memory || status == CSV_ERROR) {
+        printf("❌ %s at line %lld. No bills were created.\n",
+               out_of_memory ? "Out of memory reading the feed" : "Read error", reader.line_no);
+        batch_accounts_free(&map);
+        import_exceptions_close(&exceptions);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    BatchStatements stmts = {NULL, NULL, NULL, NULL};
+    int rc = sqlite3_prepare_v2(db, "SELECT name FROM patients WHERE id = ?", -1, &stmts.patient, 0);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(db,
+            "INSERT INTO bills (patient_id, patient_name, room_charges, doctor_fees, "
+            "medicine_charges, lab_charges, other_charges, total_amount, amount_paid, "
+            "balance_due, payment_status, payment_method) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", -1, &stmts.bill, 0);
+    }
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, bill_item_insert_sql, -1, &stmts.items, 0);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, payment_record_sql, -1, &stmts.payment, 0);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0);
+    
+    long long bills = 0;
+    double billed_total = 0, deposit_total = 0;
+    for (int i = 0; rc == SQLITE_OK && i < map.count; i++) {
+        const BatchAccount *account = &map.accounts[i];
+        char reason[80], patient_text[64];
+        double billed = 0;
+        rc = insert_batch_bill(db, &stmts, account, &billed, reason, sizeof(reason));
+        if (rc == SQLITE_OK) {
+            bills++;
+            billed_total += billed;
+            deposit_total += account->deposit;
+        } else if (rc == SQLITE_NOTFOUND) {
+            snprintf(patient_text, sizeof(patient_text), "patient %lld", account->patient_id);
+            import_exception(&exceptions, account->first_line, reason, patient_text);
+            rc = SQLITE_OK;
+        }
+    }
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+    if (rc == SQLITE_OK) import_exceptions_commit(&exceptions);
+    if (rc != SQLITE_OK) {
+        printf("\n❌ Batch billing failed: %s\n", sqlite3_errmsg(db));
+        printf("   No bills were created; the run can be repeated.\n");
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    }
+    
+    sqlite3_finalize(stmts.patient);
+    sqlite3_finalize(stmts.bill);
+    sqlite3_finalize(stmts.items);
+    sqlite3_finalize(stmts.payment);
+    import_exceptions_close(&exceptions);
+    double finished = now_seconds();
+    
+    if (rc == SQLITE_OK) {
+        printf("\n✅ Batch billing complete (%lld feed lines, %lld charge lines, %d patients)\n",
+               reader.next_line - 1, charge_lines, map.count);
+        printf("   Bills created: %lld, billed $%.2f, deposits $%.2f\n", bills, billed_total, deposit_total);
+        printf("   Exceptions:    %lld", exceptions.written);
+        if (exceptions.written > 0) printf(" (written to %s)", exceptions_path);
+        printf("\n   Time:          %.2f s (read %.2f s, insert %.2f s, %.0f bills/sec)\n",
+               finished - start, aggregated - start, finished - aggregated,
+               finished > aggregated ? bills / (finished - aggregated) : (double)bills);
+    }
+    batch_accounts_free(&map);
     
     printf("\nPress Enter to continue...");
     getchar();
 }
 
-// ==================== SYSTEM FUNCTIONS ====================
+void view_bills() {
+    clear_screen();
+    print_header("ALL BILLS");
+    
+    long long first_day, last_day;
+    int ranged = get_date_range(&first_day, &last_day);
+    const char *sql = ranged
+        ? "SELECT bill_no, patient_name, total_amount, amount_paid, "
+          "balance_due, payment_status, bill_date FROM bills "
+          "WHERE bill_date BETWEEN ? AND ? ORDER BY bill_no DESC"
+        : "SELECT bill_no, patient_name, total_amount, amount_paid, "
+          "balance_due, payment_status, bill_date FROM bills ORDER BY bill_no DESC";
+    sqlite3_stmt *stmt;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        printf("Error fetching bills: %s\n", sqlite3_errmsg(db));
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    if (ranged) {
+        sqlite3_bind_int64(stmt, 1, first_day);
+        sqlite3_bind_int64(stmt, 2, last_day);
+    }
+    
+    static const TableColumn columns[] = {
+        {"Bill No", 0, 1}, {"Patient Name", 25, 0}, {"Total", 0, 1}, {"Paid", 0, 1},
+        {"Balance", 0, 1}, {"Status", 10, 0}, {"Date", 12, 0}
+    };
+    TableRenderer table;
+    table_begin(&table, columns, 7);
+    
+    int count = 0;
+    float total_billed = 0, total_paid = 0, total_outstanding = 0;
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        count++;
+        const unsigned char *patient_name = sqlite3_column_text(stmt, 1);
+        float total_amount = sqlite3_column_double(stmt, 2);
+        float amount_paid = sqlite3_column_double(stmt, 3);
+        float balance_due = sqlite3_column_double(stmt, 4);
+        const unsigned char *payment_status = sqlite3_column_text(stmt, 5);
+        char bill_date[16] = "Unknown";
+        if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
+            format_date(sqlite3_column_int64(stmt, 6), bill_date, sizeof(bill_date));
+        }
+        
+        char total_text[32], paid_text[32], balance_text[32];
+        snprintf(total_text, sizeof(total_text), "$%.2f", total_amount);
+        snprintf(paid_text, sizeof(paid_text), "$%.2f", amount_paid);
+        snprintf(balance_text, sizeof(balance_text), "$%.2f", balance_due);
+        
+        const char *cells[7];
+        cells[0] = (const char*)sqlite3_column_text(stmt, 0);
+        cells[1] = patient_name ? (const char*)patient_name : "Unknown";
+        cells[2] = total_text;
+        cells[3] = paid_text;
+        cells[4] = balance_text;
+        cells[5] = payment_status ? (const char*)payment_status : "Unknown";
+        cells[6] = bill_date;
+        table_row(&table, cells);
+        
+        total_billed += total_amount;
+        total_paid += amount_paid;
+        total_outstanding += balance_due;
+    }
+    table_end(&table);
+    
+    sqlite3_finalize(stmt);
+    
+    if (count == 0) {
+        printf("No bills found.\n");
+    } else {
+        printf("\nSummary:\n");
+        printf("  Total Bills:        %d\n", count);
+        printf("  Total Billed:       $%.2f\n", total_billed);
+        printf("  Total Paid:         $%.2f\n", total_paid);
+        printf("  Total Outstanding:  $%.2f\n", total_outstanding);
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+void search_bill() {
+    clear_screen();
+    print_header("SEARCH BILL");
+    
+    long long bill_no = get_id("Enter Bill Number: ", 1);
+    
+    const char *sql = "SELECT * FROM bills WHERE bill_no = ?";
+    sqlite3_stmt *stmt;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
+        sqlite3_bind_int64(stmt, 1, bill_no) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_ROW) {
+        printf("Bill not found!\n");
+        sqlite3_finalize(stmt);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    long long patient_id = sqlite3_column_int64(stmt, 1);
+    const unsigned char *patient_name = sqlite3_column_text(stmt, 2);
+    char bill_date[16] = "Unknown";
+    if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+        format_date(sqlite3_column_int64(stmt, 3), bill_date, sizeof(bill_date));
+    }
+    float room_charges = sqlite3_column_double(stmt, 4);
+    float doctor_fees = sqlite3_column_double(stmt, 5);
+    float medicine_charges = sqlite3_column_double(stmt, 6);
+    float lab_charges = sqlite3_column_double(stmt, 7);
+    float other_charges = sqlite3_column_double(stmt, 8);
+    float total_amount = sqlite3_column_double(stmt, 9);
+    float amount_paid = sqlite3_column_double(stmt, 10);
+    float balance_due = sqlite3_column_double(stmt, 11);
+    const unsigned char *payment_status = sqlite3_column_text(stmt, 12);
+    const unsigned char *payment_method = sqlite3_column_text(stmt, 13);
+    
+    printf("\nBill Details:\n");
+    printf("════════════════════════════════════════════════════\n");
+    printf("Bill No: %lld | Date: %s\n", bill_no, bill_date);
+    printf("Patient: %s (ID: %lld)\n", patient_name ? (const char*)patient_name : "Unknown", patient_id);
+    printf("════════════════════════════════════════════════════\n");
+    if (print_bill_items(bill_no) > 0) {
+        printf("────────────────────────────────────────────────────\n");
+    }
+    printf("Room Charges:        $%10.2f\n", room_charges);
+    printf("Doctor Fees:         $%10.2f\n", doctor_fees);
+    printf("Medicine Charges:    $%10.2f\n", medicine_charges);
+    printf("Lab Charges:         $%10.2f\n", lab_charges);
+    printf("Other Charges:       $%10.2f\n", other_charges);
+    printf("════════════════════════════════════════════════════\n");
+    printf("TOTAL AMOUNT:        $%10.2f\n", total_amount);
+    printf("Amount Paid:         $%10.2f\n", amount_paid);
+    printf("Balance Due:         $%10.2f\n", balance_due);
+    printf("════════════════════════════════════════════════════\n");
+    printf("Payment Status:      %s\n", payment_status ? (const char*)payment_status : "Unknown");
+    printf("Payment Method:      %s\n", payment_method ? (const char*)payment_method : "Unknown");
+    
+    // Column text stays valid until the statement is finalized
+    sqlite3_finalize(stmt);
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+void make_payment() {
+    clear_screen();
+    print_header("MAKE PAYMENT");
+    
+    // Show pending bills
+    const char *sql = "SELECT bill_no, patient_name, total_amount, amount_paid, "
+                     "balance_due FROM bills WHERE balance_due > 0 ORDER BY bill_no";
+    sqlite3_stmt *stmt;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK) {
+        printf("Error fetching bills: %s\n", sqlite3_errmsg(db));
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    printf("Pending Bills:\n");
+    
+    static const TableColumn columns[] = {
+        {"Bill No", 0, 1}, {"Patient Name", 25, 0}, {"Total", 0, 1},
+        {"Paid", 0, 1}, {"Balance", 0, 1}
+    };
+    TableRenderer table;
+    table_begin(&table, columns, 5);
+    
+    int bill_count = 0;
+    
+    // Stop stepping once the user quits the pager
+    while (!table.stopped && sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *patient_name = sqlite3_column_text(stmt, 1);
+        char total_text[32], paid_text[32], balance_text[32];
+        snprintf(total_text, sizeof(total_text), "$%.2f", sqlite3_column_double(stmt, 2));
+        snprintf(paid_text, sizeof(paid_text), "$%.2f", sqlite3_column_double(stmt, 3));
+        snprintf(balance_text, sizeof(balance_text), "$%.2f", sqlite3_column_double(stmt, 4));
+        
+        const char *cells[5];
+        cells[0] = (const char*)sqlite3_column_text(stmt, 0);
+        cells[1] = patient_name ? (const char*)patient_name : "Unknown";
+        cells[2] = total_text;
+        cells[3] = paid_text;
+        cells[4] = balance_text;
+        table_row(&table, cells);
+        
+        bill_count++;
+    }
+    table_end(&table);
+    
+    sqlite3_finalize(stmt);
+    
+    if (bill_count == 0) {
+        printf("No pending bills found.\n");
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    long long bill_no = get_id("\nEnter Bill Number to pay: ", 1);
+    
+    // Look up the current balance; the list above only shows the first bills
+    sql = "SELECT balance_due FROM bills WHERE bill_no = ? AND balance_due > 0";
+    int found = 0;
+    double max_payment = 0;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, bill_no);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            found = 1;
+            max_payment = sqlite3_column_double(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    if (!found) {
+        printf("Bill not found or already paid!\n");
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    printf("Maximum payment allowed: $%.2f\n", max_payment);
+    double payment_amount = get_double("Enter payment amount: $", 0.01, max_payment);
+    
+    printf("\nPayment Method:\n");
+    printf("1. Cash\n");
+    printf("2. Credit Card\n");
+    printf("3. Debit Card\n");
+    printf("4. Online Transfer\n");
+    printf("Enter choice: ");
+    
+    int method_choice = get_choice(1, 4);
+    char payment_method[20];
+    
+    switch(method_choice) {
+        case 1: strcpy(payment_method, "Cash"); break;
+        case 2: strcpy(payment_method, "Credit Card"); break;
+        case 3: strcpy(payment_method, "Debit Card"); break;
+        case 4: strcpy(payment_method, "Online Transfer"); break;
+    }
+    
+    int rc = db_post_payment(db, bill_no, payment_amount, payment_method);
+    
+    if (rc == SQLITE_NOTFOUND) {
+        printf("Payment failed: bill is already paid or the balance changed.\n");
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    } else if (rc != SQLITE_OK) {
+        printf("Payment failed: %s\n", sqlite3_errmsg(db));
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    printf("\n✅ Payment of $%.2f recorded successfully!\n", payment_amount);
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+void view_payment_history() {
+    clear_screen();
+    print_header("PAYMENT HISTORY");
+    
+    long long bill_no = get_id("Enter Bill Number (0 for all payments): ", 0);
+    long long first_day, last_day;
+    int ranged = get_date_range(&first_day, &last_day);
+    
+    // Day bounds become a half-open range of Unix seconds on payment_date
+    char sql[512];
+    QueryParam params[3];
+    int param_count = 0;
+    int length = snprintf(sql, sizeof(sql),
+        "SELECT p.payment_id, p.bill_no, b.patient_name, p.amount, "
+        "p.payment_method, p.payment_date "
+        "FROM payments p JOIN bills b ON p.bill_no = b.bill_no");
+    if (bill_no != 0) {
+        length += snprintf(sql + length, sizeof(sql) - length, " WHERE p.bill_no = ?");
+        params[param_count++] = (QueryParam){0, bill_no, NULL};
+    }
+    if (ranged) {
+        length += snprintf(sql + length, sizeof(sql) - length, "%s p.payment_date >= ? AND p.payment_date < ?",
+                           bill_no != 0 ? " AND" : " WHERE");
+        params[param_count++] = (QueryParam){0, (first_day - JULIAN_DAY_UNIX_EPOCH) * SECONDS_PER_DAY, NULL};
+        params[param_count++] = (QueryParam){0, (last_day + 1 - JULIAN_DAY_UNIX_EPOCH) * SECONDS_PER_DAY, NULL};
+    }
+    snprintf(sql + length, sizeof(sql) - length, " ORDER BY p.payment_date DESC");
+    
+    CachedCursor rows;
+    if (cached_query(db, sql, params, param_count, &rows) != SQLITE_OK) {
+        printf("Error fetching payment history: %s\n", sqlite3_errmsg(db));
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    static const TableColumn columns[] = {
+        {"Payment ID", 0, 1}, {"Bill No", 0, 1}, {"Patient Name", 25, 0},
+        {"Amount", 0, 1}, {"Method", 15, 0}, {"Date", 19, 0}
+    };
+    TableRenderer table;
+    table_begin(&table, columns, 6);
+    
+    int count = 0;
+    float total_amount = 0;
+    
+    while (cursor_step(&rows)) {
+        count++;
+        const char *patient_name = cursor_text(&rows, 2);
+        float amount = cursor_double(&rows, 3);
+        const char *payment_method = cursor_text(&rows, 4);
+        char payment_date[24] = "Unknown";
+        if (cursor_text(&rows, 5)) {
+            format_timestamp(cursor_int64(&rows, 5), payment_date, sizeof(payment_date));
+        }
+        
+        char amount_text[32];
+        snprintf(amount_text, sizeof(amount_text), "$%.2f", amount);
+        
+        const char *cells[6];
+        cells[0] = cursor_text(&rows, 0);
+        cells[1] = cursor_text(&rows, 1);
+        cells[2] = patient_name ? patient_name : "Unknown";
+        cells[3] = amount_text;
+        cells[4] = payment_method ? payment_method : "Unknown";
+        cells[5] = payment_date;
+        table_row(&table, cells);
+        
+        total_amount += amount;
+    }
+    table_end(&table);
+    
+    cursor_close(&rows);
+    
+    if (count == 0) {
+        printf("No payment records found.\n");
+    } else {
+        printf("\nSummary:\n");
+        printf("  Total Payments: %d\n", count);
+        printf("  Total Amount:   $%.2f\n", total_amount);
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Show one receipt and offer to save it. Returns 1 if the user asked to
+// print another.
+static int show_receipt() {
+    clear_screen();
+    print_header("PRINT RECEIPT");
+    
+    long long bill_no = get_id("Enter Bill Number: ", 1);
+    
+    const char *sql = "SELECT * FROM bills WHERE bill_no = ?";
+    sqlite3_stmt *stmt;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK || 
+        sqlite3_bind_int64(stmt, 1, bill_no) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_ROW) {
+        printf("Bill not found!\n");
+        sqlite3_finalize(stmt);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return 0;
+    }
+    
+    // Copy the text columns out; they are owned by the statement
+    long long patient_id = sqlite3_column_int64(stmt, 1);
+    char patient_name[100], payment_status[20], payment_method[50];
+    const unsigned char *text = sqlite3_column_text(stmt, 2);
+    snprintf(patient_name, sizeof(patient_name), "%s", text ? (const char*)text : "Unknown");
+    char bill_date[16] = "Unknown";
+    if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+        format_date(sqlite3_column_int64(stmt, 3), bill_date, sizeof(bill_date));
+    }
+    float room_charges = sqlite3_column_double(stmt, 4);
+    float doctor_fees = sqlite3_column_double(stmt, 5);
+    float medicine_charges = sqlite3_column_double(stmt, 6);
+    float lab_charges = sqlite3_column_double(stmt, 7);
+    float other_charges = sqlite3_column_double(stmt, 8);
+    float total_amount = sqlite3_column_double(stmt, 9);
+    float amount_paid = sqlite3_column_double(stmt, 10);
+    float balance_due = sqlite3_column_double(stmt, 11);
+    text = sqlite3_column_text(stmt, 12);
+    snprintf(payment_status, sizeof(payment_status), "%s", text ? (const char*)text : "Unknown");
+    text = sqlite3_column_text(stmt, 13);
+    snprintf(payment_method, sizeof(payment_method), "%s", text ? (const char*)text : "Unknown");
+    
+    sqlite3_finalize(stmt);
+    
+    // Print receipt
+    printf("\n");
+    printf("╔══════════════════════════════════════════════════════════════╗\n");
+    printf("║                    OFFICIAL RECEIPT                          ║\n");
+    printf("╠══════════════════════════════════════════════════════════════╣\n");
+    printf("║ City General Hospital                                        ║\n");
+    printf("╠══════════════════════════════════════════════════════════════╣\n");
+    printf("║  Receipt No: %-45lld ║\n", bill_no);
+    printf("║  Date:       %-45s ║\n", bill_date);
+    printf("╠══════════════════════════════════════════════════════════════╣\n");
+    printf("║  Patient: %-50s ║\n", patient_name);
+    printf("║  Patient ID: %-48lld ║\n", patient_id);
+    printf("╠══════════════════════════════════════════════════════════════╣\n");
+    printf("║                                                              ║\n");
+    printf("║  Room Charges ................................ $%10.2f  ║\n", room_charges);
+    printf("║  Doctor Fees ................................. $%10.2f  ║\n", doctor_fees);
+    printf("║  Medicine Charges ........................... $%10.2f  ║\n", medicine_charges);
+    printf("║  Lab Charges ................................ $%10.2f  ║\n", lab_charges);
+    printf("║  Other Charges .............................. $%10.2f  ║\n", other_charges);
+    printf("║                                                              ║\n");
+    printf("║  TOTAL AMOUNT ............................... $%10.2f  ║\n", total_amount);
+    printf("║  AMOUNT PAID ............................... $%10.2f  ║\n", amount_paid);
+    printf("║  BALANCE DUE ............................... $%10.2f  ║\n", balance_due);
+    printf("║                                                              ║\n");
+    printf("║  Payment Status: %-10s                                 ║\n", payment_status);
+    printf("║  Payment Method: %-10s                                 ║\n", payment_method);
+    printf("║                                                              ║\n");
+    printf("╠══════════════════════════════════════════════════════════════╣\n");
+    printf("║  Thank you for choosing our hospital!                        ║\n");
+    printf("╚══════════════════════════════════════════════════════════════╝\n");
+    
+    printf("\nOptions:\n");
+    printf("1. Save to file\n");
+    printf("2. Print another receipt\n");
+    printf("3. Return to menu\n");
+    printf("Enter choice: ");
+    
+    int choice = get_choice(1, 3);
+    
+    if (choice == 1) {
+        char filename[100];
+        snprintf(filename, sizeof(filename), "receipt_%lld.txt", bill_no);
+        if (save_receipt(db, bill_no, filename)) {
+            printf("\n✅ Receipt saved to: %s\n", filename);
+        } else {
+            printf("\n❌ Error saving receipt!\n");
+        }
+        printf("\nPress Enter to continue...");
+        getchar();
+    }
+    return choice == 2;
+}
+
+void print_receipt() {
+    while (show_receipt()) {
+    }
+}
+
+// ==================== MEMORY BUDGET ====================
+
+// Record the budget and derive the limits from it; 0 leaves everything at
+// SQLite's defaults. Takes effect with memory_budget_apply().
+void memory_budget_set(long long megabytes) {
+    MemoryBudget *budget = &memory_budget;
+    budget->bytes = megabytes * 1024 * 1024;
+    if (budget->bytes <= 0) {
+        budget->bytes = budget->hard_limit = budget->soft_limit = budget->cache_kib = 0;
+        budget->query_cache_bytes = QUERY_CACHE_MAX_BYTES;
+        return;
+    }
+    budget->hard_limit = budget->bytes / 4 * 3;
+    budget->soft_limit = budget->bytes / 2;
+    budget->cache_kib = budget->soft_limit / 4 / 1024;
+    budget->query_cache_bytes = budget->bytes / 16 < QUERY_CACHE_MAX_BYTES ?
+        (size_t)(budget->bytes / 16) : QUERY_CACHE_MAX_BYTES;
+}
+
+// Install the heap limits. This initializes SQLite, so anything passed to
+// sqlite3_config() has to happen first.
+void memory_budget_apply() {
+    if (memory_budget.bytes <= 0) {
+        return;
+    }
+    sqlite3_hard_heap_limit64(memory_budget.hard_limit);
+    sqlite3_soft_heap_limit64(memory_budget.soft_limit);
+}
+
+// Size a newly opened connection's page cache and lookaside to the budget.
+// Lookaside can only be resized before the connection first uses it; if it
+// already has, the default stays.
+void memory_budget_connection(sqlite3 *conn) {
+    if (memory_budget.bytes <= 0 || !conn) {
+        return;
+    }
+    sqlite3_db_config(conn, SQLITE_DBCONFIG_LOOKASIDE, NULL,
+                      BUDGET_LOOKASIDE_SLOT, BUDGET_LOOKASIDE_SLOTS);
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = -%lld", memory_budget.cache_kib);
+    sqlite3_exec(conn, pragma, 0, 0, 0);
+}
+
+// The report replica keeps the whole database on SQLite's heap, so under a
+// budget it is only allowed while the database takes at most a quarter of it
+static int memory_budget_fits_replica(sqlite3 *source) {
+    if (memory_budget.bytes <= 0) {
+        return 1;
+    }
+    sqlite3_stmt *stmt;
+    long long size = 0;
+    if (sqlite3_prepare_v2(source, "SELECT page_count * page_size FROM pragma_page_count, pragma_page_size",
+                           -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) size = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return size > 0 && size <= memory_budget.bytes / 4;
+}
+
+// Current and peak resident set size from /proc, in kB (0 if unavailable)
+static void process_rss(long long *current_kb, long long *peak_kb) {
+    *current_kb = *peak_kb = 0;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (!status) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), status)) {
+        sscanf(line, "VmRSS: %lld", current_kb);
+        sscanf(line, "VmHWM: %lld", peak_kb);
+    }
+    fclose(status);
+}
+
+static void print_megabytes(FILE *out, const char *label, long long current, long long highwater) {
+    fprintf(out, "  %-22s %9.2f MB (peak %.2f MB)\n", label,
+            current / 1048576.0, highwater / 1048576.0);
+}
+
+static void print_connection_stats(FILE *out, const char *title, sqlite3 *conn) {
+    int current, highwater;
+    int hits, misses, writes, spills;
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_CACHE_HIT, &hits, &highwater, 0);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_CACHE_MISS, &misses, &highwater, 0);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_CACHE_WRITE, &writes, &highwater, 0);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_CACHE_SPILL, &spills, &highwater, 0);
+    
+    fprintf(out, "\n%s:\n", title);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_CACHE_USED, &current, &highwater, 0);
+    fprintf(out, "  %-22s %9.2f MB\n", "Page cache:", current / 1048576.0);
+    fprintf(out, "  %-22s %d / %d (%.1f%% hit rate)\n", "Cache hits / misses:", hits, misses,
+            hits + misses > 0 ? hits * 100.0 / (hits + misses) : 0);
+    fprintf(out, "  %-22s %d / %d\n", "Pages written / spilled:", writes, spills);
+    
+    int hit, miss_size, miss_full;
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_HIT, &highwater, &hit, 0);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &highwater, &miss_size, 0);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &highwater, &miss_full, 0);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_LOOKASIDE_USED, &current, &highwater, 0);
+    fprintf(out, "  %-22s %d slots (peak %d)\n", "Lookaside in use:", current, highwater);
+    fprintf(out, "  %-22s %d hits, %d too large, %d when full\n", "Lookaside requests:",
+            hit, miss_size, miss_full);
+    
+    int schema, statements;
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_SCHEMA_USED, &schema, &highwater, 0);
+    sqlite3_db_status(conn, SQLITE_DBSTATUS_STMT_USED, &statements, &highwater, 0);
+    fprintf(out, "  %-22s %.1f KB / %.1f KB\n", "Schema / statements:",
+            schema / 1024.0, statements / 1024.0);
+}
+
+// SQLite heap counters, the budget in force and the state of this
+// program's own caches. conn (and the report replica, if open) adds
+// per-connection page cache and lookaside figures.
+void print_memory_stats(FILE *out, sqlite3 *conn) {
+    const MemoryBudget *budget = &memory_budget;
+    fprintf(out, "MEMORY BUDGET:\n");
+    if (budget->bytes > 0) {
+        fprintf(out, "  %-22s %lld MB\n", "Budget:", budget->bytes / 1048576);
+        fprintf(out, "  %-22s %.1f MB hard, %.1f MB soft\n", "SQLite heap limit:",
+                sqlite3_hard_heap_limit64(-1) / 1048576.0, sqlite3_soft_heap_limit64(-1) / 1048576.0);
+        fprintf(out, "  %-22s %lld KB per connection\n", "Page cache size:", budget->cache_kib);
+    } else {
+        fprintf(out, "  %-22s unlimited (start with --memory-budget MB)\n", "Budget:");
+    }
+    
+    sqlite3_int64 current, highwater;
+    fprintf(out, "\nSQLITE HEAP:\n");
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &current, &highwater, 0);
+    print_megabytes(out, "Memory used:", current, highwater);
+    sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &current, &highwater, 0);
+    fprintf(out, "  %-22s %lld (peak %lld)\n", "Allocations:", (long long)current, (long long)highwater);
+    sqlite3_status64(SQLITE_STATUS_MALLOC_SIZE, &current, &highwater, 0);
+    fprintf(out, "  %-22s %.1f KB\n", "Largest allocation:", highwater / 1024.0);
+    sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &current, &highwater, 0);
+    print_megabytes(out, "Page cache (heap):", current, highwater);
+    
+    if (conn) {
+        print_connection_stats(out, "LIVE CONNECTION", conn);
+    }
+    if (report_replica.conn) {
+        print_connection_stats(out, "REPORT REPLICA", report_replica.conn);
+    }
+    
+    fprintf(out, "\nPROGRAM CACHES:\n");
+    fprintf(out, "  %-22s %d results, %.1f KB of %.0f KB\n", "Report cache:", query_cache.entries,
+            query_cache.bytes / 1024.0, budget->query_cache_bytes / 1024.0);
+    fprintf(out, "  %-22s %d codes\n", "Charge master:", charge_master.count);
+    
+    long long rss_kb, peak_kb;
+    process_rss(&rss_kb, &peak_kb);
+    if (rss_kb > 0) {
+        fprintf(out, "  %-22s %.1f MB (peak %.1f MB)\n", "Process RSS:", rss_kb / 1024.0, peak_kb / 1024.0);
+    }
+}
+
+void memory_statistics() {
+    clear_screen();
+    print_header("MEMORY STATISTICS");
+    print_memory_stats(stdout, db);
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== REPORT REPLICA ====================
+
+// Called from the update hook for every row written on the live connection
+static void replica_note_change(const char *table, sqlite3_int64 rowid) {
+    ReportReplica *replica = &report_replica;
+    if (!replica->conn || replica->reload || strlen(table) >= sizeof(replica->changes[0].table)) {
+        return;
+    }
+    if (replica->change_count == replica->change_capacity) {
+        int capacity = replica->change_capacity ? replica->change_capacity * 2 : 64;
+        ReplicaChange *grown = capacity <= REPLICA_MAX_CHANGES ?
+            realloc(replica->changes, capacity * sizeof(ReplicaChange)) : NULL;
+        if (!grown) {
+            replica->reload = 1;
+            return;
+        }
+        replica->changes = grown;
+        replica->change_capacity = capacity;
+    }
+    ReplicaChange *change = &replica->changes[replica->change_count++];
+    strcpy(change->table, table);
+    change->rowid = rowid;
+}
+
+static long long data_version(sqlite3 *conn) {
+    sqlite3_stmt *stmt;
+    long long version = -1;
+    if (sqlite3_prepare_v2(conn, "PRAGMA data_version", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
+
+// Copy the whole live database into the replica
+static int replica_full_load(ReportReplica *replica) {
+    sqlite3_backup *backup = sqlite3_backup_init(replica->conn, "main", replica->source, "main");
+    if (!backup) {
+        return 0;
+    }
+    sqlite3_backup_step(backup, -1);
+    int rc = sqlite3_backup_finish(backup);
+    if (rc != SQLITE_OK) {
+        return 0;
+    }
+    replica->data_version = data_version(replica->source);
+    replica->change_count = 0;
+    replica->reload = 0;
+    replica->full_loads++;
+    return 1;
+}
+
+// Bring one changed row across: re-read it from the live database and
+// replace the replica's copy, or delete the copy if the row is gone (which
+// also covers changes that were rolled back)
+static int replica_apply_change(ReportReplica *replica, const ReplicaChange *change) {
+    char *sql = sqlite3_mprintf("SELECT rowid, * FROM \"%w\" WHERE rowid = ?", change->table);
+    sqlite3_stmt *select;
+    int rc = sqlite3_prepare_v2(replica->source, sql, -1, &select, 0);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_int64(select, 1, change->rowid);
+    
+    sqlite3_stmt *write;
+    rc = sqlite3_step(select);
+    if (rc == SQLITE_ROW) {
+        int columns = sqlite3_column_count(select);
+        char *names = sqlite3_mprintf("rowid");
+        char *values = sqlite3_mprintf("?");
+        for (int i = 1; i < columns && names && values; i++) {
+            char *more_names = sqlite3_mprintf("%s, \"%w\"", names, sqlite3_column_name(select, i));
+            char *more_values = sqlite3_mprintf("%s, ?", values);
+            sqlite3_free(names);
+            sqlite3_free(values);
+            names = more_names;
+            values = more_values;
+        }
+        sql = names && values ? sqlite3_mprintf("INSERT OR REPLACE INTO \"%w\" (%s) VALUES (%s)",
+                                                change->table, names, values) : NULL;
+        sqlite3_free(names);
+        sqlite3_free(values);
+        rc = sql ? sqlite3_prepare_v2(replica->conn, sql, -1, &write, 0) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc == SQLITE_OK) {
+            for (int i = 0; i < columns; i++) {
+                sqlite3_bind_value(write, i + 1, sqlite3_column_value(select, i));
+            }
+        }
+    } else if (rc == SQLITE_DONE) {
+        sql = sqlite3_mprintf("DELETE FROM \"%w\" WHERE rowid = ?", change->table);
+        rc = sqlite3_prepare_v2(replica->conn, sql, -1, &write, 0);
+        sqlite3_free(sql);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int64(write, 1, change->rowid);
+        }
+    }
+    
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(write) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+        sqlite3_finalize(write);
+    }
+    sqlite3_finalize(select);
+    return rc == SQLITE_OK;
+}
+
+// Start (or re-target after a restore) the report replica for source.
+// Returns 0 if the in-memory database could not be created or loaded.
+int replica_open(sqlite3 *source) {
+    ReportReplica *replica = &report_replica;
+    if (!memory_budget_fits_replica(source)) {
+        replica_close();
+        return 0;
+    }
+    if (!replica->conn && sqlite3_open(":memory:", &replica->conn) != SQLITE_OK) {
+        sqlite3_close(replica->conn);
+        replica->conn = NULL;
+        return 0;
+    }
+    replica->source = source;
+    replica->reload = 1;
+    if (!replica_full_load(replica)) {
+        replica_close();
+        return 0;
+    }
+    return 1;
+}
+
+void replica_close() {
+    ReportReplica *replica = &report_replica;
+    if (replica->conn) {
+        sqlite3_close(replica->conn);
+    }
+    free(replica->changes);
+    memset(replica, 0, sizeof(*replica));
+    replica->reload = 1;
+}
+
+// Connection read-only report queries should use: the replica, synced with
+// everything committed so far, or the live database when there is no
+// replica (or on threads other than the one that owns it)
+sqlite3 *report_connection() {
+    ReportReplica *replica = &report_replica;
+    if (!replica->conn || replica->source != db) {
+        return db;
+    }
+    
+    if (replica->reload || data_version(db) != replica->data_version) {
+        return replica_full_load(replica) ? replica->conn : db;
+    }
+    if (replica->change_count == 0) {
+        return replica->conn;
+    }
+    
+    int ok = sqlite3_exec(replica->conn, "BEGIN", 0, 0, 0) == SQLITE_OK;
+    for (int i = 0; ok && i < replica->change_count; i++) {
+        ok = replica_apply_change(replica, &replica->changes[i]);
+    }
+    if (ok && sqlite3_exec(replica->conn, "COMMIT", 0, 0, 0) == SQLITE_OK) {
+        replica->rows_applied += replica->change_count;
+        replica->change_count = 0;
+        return replica->conn;
+    }
+    sqlite3_exec(replica->conn, "ROLLBACK", 0, 0, 0);
+    return replica_full_load(replica) ? replica->conn : db;
+}
+
+// ==================== QUERY CACHE ====================
+
+static void cache_unlink(QueryCache *cache, CachedResult *entry) {
+    if (entry->prev) entry->prev->next = entry->next; else cache->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else cache->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void cache_push_front(QueryCache *cache, CachedResult *entry) {
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) cache->head->prev = entry; else cache->tail = entry;
+    cache->head = entry;
+}
+
+static void free_cached_result(CachedResult *entry) {
+    for (int i = 0; i < entry->row_count * entry->column_count; i++) {
+        free(entry->values[i].text);
+    }
+    free(entry->values);
+    free(entry->key);
+    free(entry);
+}
+
+static void cache_remove(QueryCache *cache, CachedResult *entry) {
+    cache_unlink(cache, entry);
+    cache->entries--;
+    cache->bytes -= entry->bytes;
+    free_cached_result(entry);
+}
+
+// Drop every entry that reads any of the tables in mask
+static void cache_invalidate(QueryCache *cache, unsigned int mask) {
+    CachedResult *entry = cache->head;
+    while (entry) {
+        CachedResult *next = entry->next;
+        if (entry->tables & mask) {
+            cache_remove(cache, entry);
+            cache->invalidations++;
+        }
+        entry = next;
+    }
+}
+
+// Bit assigned to a table name; tables past the first 32 seen share the top
+// bit, which only makes invalidation coarser
+static unsigned int cache_table_bit(QueryCache *cache, const char *table) {
+    for (int i = 0; i < cache->table_count; i++) {
+        if (strcmp(cache->table_names[i], table) == 0) {
+            return 1u << i;
+        }
+    }
+    if (cache->table_count == QUERY_CACHE_MAX_TABLES) {
+        return 1u << (QUERY_CACHE_MAX_TABLES - 1);
+    }
+    char *name = strdup(table);
+    if (!name) {
+        return 1u << (QUERY_CACHE_MAX_TABLES - 1);
+    }
+    cache->table_names[cache->table_count] = name;
+    return 1u << cache->table_count++;
+}
+
+static void live_update_hook(void *arg, int op, const char *database, const char *table, sqlite3_int64 rowid) {
+    (void)op;
+    if (arg != query_cache.source || strcmp(database, "main") != 0) {
+        return;
+    }
+    replica_note_change(table, rowid);
+    cache_invalidate(&query_cache, cache_table_bit(&query_cache, table));
+}
+
+// Install the update hook that keeps the report replica and the query cache
+// current on conn, the main program's connection. Connections opened by
+// replay and stress workers are not watched, so they bypass both.
+void watch_database_changes(sqlite3 *conn) {
+    cache_invalidate(&query_cache, ~0u);
+    query_cache.source = conn;
+    query_cache.data_version = data_version(conn);
+    sqlite3_update_hook(conn, live_update_hook, conn);
+}
+
+// Authorizer used while preparing a query to note every table it reads
+static int collect_read_tables(void *arg, int action, const char *table, const char *column,
+                               const char *database, const char *trigger) {
+    (void)column;
+    (void)database;
+    (void)trigger;
+    if (action == SQLITE_READ && table) {
+        *(unsigned int*)arg |= cache_table_bit(&query_cache, table);
+    }
+    return SQLITE_OK;
+}
+
+static char *cache_key(const char *sql, const QueryParam *params, int param_count) {
+    size_t length = strlen(sql) + 1;
+    for (int i = 0; i < param_count; i++) {
+        length += 24 + (params[i].is_text && params[i].text ? strlen(params[i].text) : 0);
+    }
+    char *key = malloc(length);
+    if (!key) return NULL;
+    size_t used = snprintf(key, length, "%s", sql);
+    for (int i = 0; i < param_count; i++) {
+        if (params[i].is_text) {
+            used += snprintf(key + used, length - used, "\x1fs%s", params[i].text ? params[i].text : "");
+        } else {
+            used += snprintf(key + used, length - used, "\x1fi%lld", (long long)params[i].integer);
+        }
+    }
+    return key;
+}
+
+// Run sql and capture its rows until they take limit bytes (0 captures
+// nothing). Returns an SQLite result code. If the limit is reached first,
+// *live is left holding the statement, positioned after the last captured
+// row, for the caller to finish; otherwise it is NULL.
+static int run_into_result(sqlite3 *conn, const char *sql, const QueryParam *params, int param_count,
+                           size_t limit, CachedResult *result, sqlite3_stmt **live) {
+    sqlite3_stmt *stmt;
+    *live = NULL;
+    if (limit > 0) {
+        sqlite3_set_authorizer(conn, collect_read_tables, &result->tables);
+    }
+    int rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
+    sqlite3_set_authorizer(conn, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    for (int i = 0; i < param_count; i++) {
+        if (params[i].is_text) {
+            sqlite3_bind_text(stmt, i + 1, params[i].text, -1, SQLITE_TRANSIENT);
+        } else {
+            sqlite3_bind_int64(stmt, i + 1, params[i].integer);
+        }
+    }
+    
+    result->column_count = sqlite3_column_count(stmt);
+    int capacity = 0;
+    rc = SQLITE_ROW;
+    while (result->bytes < limit && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (result->row_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            CachedValue *grown = realloc(result->values, (size_t)capacity * result->column_count * sizeof(CachedValue));
+            if (!grown) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            result->values = grown;
+        }
+        query_watch_row();
+        CachedValue *row = &result->values[result->row_count * result->column_count];
+        for (int i = 0; i < result->column_count; i++) {
+            row[i].number = sqlite3_column_double(stmt, i);
+            row[i].integer = sqlite3_column_int64(stmt, i);
+            const char *text = (const char*)sqlite3_column_text(stmt, i);
+            row[i].text = text ? strdup(text) : NULL;
+            result->bytes += sizeof(CachedValue) + (text ? strlen(text) + 1 : 0);
+        }
+        result->row_count++;
+    }
+    if (rc == SQLITE_ROW) {
+        *live = stmt;
+        return SQLITE_OK;
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Run a read-only report query through the cache. On a hit the stored rows
+// are returned without touching the database. Only results that fit the
+// per-entry bound are held in memory; a bigger one, or any query that
+// cannot be cached (another thread's connection), is streamed from its
+// statement. Returns an SQLite result code; on success walk the rows with
+// cursor_step and release them with cursor_close.
+int cached_query(sqlite3 *conn, const char *sql, const QueryParam *params, int param_count, CachedCursor *cursor) {
+    QueryCache *cache = &query_cache;
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->row = -1;
+    
+    int cacheable = db == cache->source;
+    char *key = cacheable ? cache_key(sql, params, param_count) : NULL;
+    unsigned int hash = key ? hash_code(key) : 0;
+    if (key) {
+        long long version = data_version(db);
+        if (version != cache->data_version) {
+            cache_invalidate(cache, ~0u);
+            cache->data_version = version;
+        }
+        for (CachedResult *entry = cache->head; entry; entry = entry->next) {
+            if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+                cache->hits++;
+                cache_unlink(cache, entry);
+                cache_push_front(cache, entry);
+                cursor->result = entry;
+                free(key);
+                return SQLITE_OK;
+            }
+        }
+        cache->misses++;
+    }
+    
+    CachedResult *result = calloc(1, sizeof(CachedResult));
+    if (!result) {
+        free(key);
+        return SQLITE_NOMEM;
+    }
+    size_t limit = key ? memory_budget.query_cache_bytes / 4 : 0;
+    sqlite3_stmt *live;
+    int rc = run_into_result(conn, sql, params, param_count, limit, result, &live);
+    if (rc != SQLITE_OK) {
+        free(key);
+        free_cached_result(result);
+        return rc;
+    }
+    
+    result->key = key;
+    result->hash = hash;
+    result->bytes += sizeof(CachedResult) + (key ? strlen(key) + 1 : 0);
+    cursor->result = result;
+    if (live || result->bytes > limit) {
+        cursor->owned = 1;
+        cursor->stmt = live;
+        return SQLITE_OK;
+    }
+    
+    while (cache->tail && cache->bytes + result->bytes > memory_budget.query_cache_bytes) {
+        cache_remove(cache, cache->tail);
+    }
+    cache_push_front(cache, result);
+    cache->entries++;
+    cache->bytes += result->bytes;
+    return SQLITE_OK;
+}
+
+int cursor_step(CachedCursor *cursor) {
+    if (cursor->row + 1 < cursor->result->row_count) {
+        cursor->row++;
+        return 1;
+    }
+    cursor->row = cursor->result->row_count;
+    if (!cursor->stmt) {
+        return 0;
+    }
+    if (sqlite3_step(cursor->stmt) == SQLITE_ROW) {
+        query_watch_row();
+        return 1;
+    }
+    sqlite3_finalize(cursor->stmt);
+    cursor->stmt = NULL;
+    return 0;
+}
+
+// The statement, once the captured rows have all been returned
+static sqlite3_stmt *cursor_live(const CachedCursor *cursor) {
+    return cursor->row >= cursor->result->row_count ? cursor->stmt : NULL;
+}
+
+static const CachedValue *cursor_value(const CachedCursor *cursor, int column) {
+    return &cursor->result->values[cursor->row * cursor->result->column_count + column];
+}
+
+// Streamed text is valid until the next cursor_step, cached text until
+// cursor_close
+const char *cursor_text(const CachedCursor *cursor, int column) {
+    sqlite3_stmt *stmt = cursor_live(cursor);
+    return stmt ? (const char*)sqlite3_column_text(stmt, column) : cursor_value(cursor, column)->text;
+}
+
+double cursor_double(const CachedCursor *cursor, int column) {
+    sqlite3_stmt *stmt = cursor_live(cursor);
+    return stmt ? sqlite3_column_double(stmt, column) : cursor_value(cursor, column)->number;
+}
+
+sqlite3_int64 cursor_int64(const CachedCursor *cursor, int column) {
+    sqlite3_stmt *stmt = cursor_live(cursor);
+    return stmt ? sqlite3_column_int64(stmt, column) : cursor_value(cursor, column)->integer;
+}
+
+void cursor_close(CachedCursor *cursor) {
+    sqlite3_finalize(cursor->stmt);
+    if (cursor->owned && cursor->result) {
+        free_cached_result(cursor->result);
+    }
+    memset(cursor, 0, sizeof(*cursor));
+}
+
+// ==================== STREAMING SKETCHES ====================
+
+// Approximate distributions for the statistics screen, kept in the
+// stat_sketches table and brought up to date incrementally: each refresh
+// folds in only the bills and patients added since the ids recorded in
+// stat_watermarks, so the cost follows new rows rather than table size.
+// Sketches only grow; deleted rows stay counted.
+
+#define TDIGEST_COMPRESSION 100.0
+#define TDIGEST_MAX_CENTROIDS 256
+#define TDIGEST_BUFFER 1024
+#define TDIGEST_MAGIC 0x54444731u           // "TDG1"
+
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)  // 4 KB, about 1.6% standard error
+
+typedef struct {
+    double mean;
+    double weight;
+} Centroid;
+
+// Merging t-digest: centroids[0..merged) are sorted and compressed, the
+// next `buffered` entries are raw points waiting for the next merge
+typedef struct {
+    Centroid centroids[TDIGEST_MAX_CENTROIDS + TDIGEST_BUFFER];
+    int merged;
+    int buffered;
+    double min;
+    double max;
+} TDigest;
+
+typedef struct {
+    uint8_t registers[HLL_REGISTERS];
+} HyperLogLog;
+
+// Distinct patients billed in one calendar month
+typedef struct {
+    char month[8];          // "YYYY-MM"
+    int dirty;
+    HyperLogLog hll;
+} MonthSketch;
+
+typedef struct {
+    TDigest bill_amount;
+    TDigest patient_age;
+    HyperLogLog patients_all;
+    MonthSketch *months;
+    int month_count;
+    int month_capacity;
+    long long new_bills;
+    long long new_patients;
+} StatSketches;
+
+static void tdigest_init(TDigest *digest) {
+    digest->merged = 0;
+    digest->buffered = 0;
+    digest->min = INFINITY;
+    digest->max = -INFINITY;
+}
+
+static int compare_centroids(const void *a, const void *b) {
+    double x = ((const Centroid*)a)->mean, y = ((const Centroid*)b)->mean;
+    return (x > y) - (x < y);
+}
+
+// k1 scale function; a centroid may span at most one unit of k, which
+// keeps centroids small near the tails where p99 is read and bounds their
+// number by about TDIGEST_COMPRESSION
+static double tdigest_scale(double q) {
+    return TDIGEST_COMPRESSION / (2 * M_PI) * asin(2 * q - 1);
+}
+
+// Sort merged centroids and buffered points together and combine
+// neighbours while each result stays within one unit of the scale
+static void tdigest_compress(TDigest *digest) {
+    int count = digest->merged + digest->buffered;
+    if (digest->buffered == 0 || count == 0) return;
+    Centroid *c = digest->centroids;
+    qsort(c, count, sizeof(Centroid), compare_centroids);
+    
+    double total = 0;
+    for (int i = 0; i < count; i++) total += c[i].weight;
+    
+    int out = 0;
+    double before = 0;      // weight of centroids already emitted
+    double k_left = tdigest_scale(0);
+    for (int i = 1; i < count; i++) {
+        double combined = c[out].weight + c[i].weight;
+        double q_right = fmin(1.0, (before + combined) / total);
+        if (tdigest_scale(q_right) - k_left <= 1 || out == TDIGEST_MAX_CENTROIDS - 1) {
+            c[out].mean += (c[i].mean - c[out].mean) * c[i].weight / combined;
+            c[out].weight = combined;
+        } else {
+            before += c[out].weight;
+            k_left = tdigest_scale(before / total);
+            c[++out] = c[i];
+        }
+    }
+    digest->merged = out + 1;
+    digest->buffered = 0;
+}
+
+static void tdigest_add(TDigest *digest, double value, double weight) {
+    if (digest->merged + digest->buffered == TDIGEST_MAX_CENTROIDS + TDIGEST_BUFFER) {
+        tdigest_compress(digest);
+    }
+    digest->centroids[digest->merged + digest->buffered++] = (Centroid){value, weight};
+    if (value < digest->min) digest->min = value;
+    if (value > digest->max) digest->max = value;
+}
+
+// Value at quantile q (0..1), interpolating between centroid centres and
+// out to the exact min/max at the ends. NAN when empty.
+static double tdigest_quantile(TDigest *digest, double q) {
+    tdigest_compress(digest);
+    const Centroid *c = digest->centroids;
+    int count = digest->merged;
+    if (count == 0) return NAN;
+    if (count == 1) return c[0].mean;
+    
+    double total = 0;
+    for (int i = 0; i < count; i++) total += c[i].weight;
+    double target = q * total;
+    
+    double centre = c[0].weight / 2;
+    if (target <= centre) {
+        return digest->min + (c[0].mean - digest->min) * (centre > 0 ? target / centre : 0);
+    }
+    for (int i = 0; i < count - 1; i++) {
+        double next = centre + (c[i].weight + c[i + 1].weight) / 2;
+        if (target <= next) {
+            return c[i].mean + (c[i + 1].mean - c[i].mean) * (target - centre) / (next - centre);
+        }
+        centre = next;
+    }
+    double tail = total - centre;
+    return c[count - 1].mean + (digest->max - c[count - 1].mean) * (tail > 0 ? (target - centre) / tail : 1);
+}
+
+// Stored as magic, centroid count, min, max, then the centroids
+static void *tdigest_serialize(TDigest *digest, size_t *size) {
+    tdigest_compress(digest);
+    *size = 2 * sizeof(uint32_t) + 2 * sizeof(double) + digest->merged * sizeof(Centroid);
+    unsigned char *blob = malloc(*size);
+    if (!blob) return NULL;
+    uint32_t header[2] = {TDIGEST_MAGIC, (uint32_t)digest->merged};
+    memcpy(blob, header, sizeof(header));
+    memcpy(blob + sizeof(header), &digest->min, sizeof(double));
+    memcpy(blob + sizeof(header) + sizeof(double), &digest->max, sizeof(double));
+    memcpy(blob + sizeof(header) + 2 * sizeof(double), digest->centroids, digest->merged * sizeof(Centroid));
+    return blob;
+}
+
+static int tdigest_deserialize(TDigest *digest, const unsigned char *blob, size_t size) {
+    uint32_t header[2];
+    size_t fixed = sizeof(header) + 2 * sizeof(double);
+    if (size < fixed) return 0;
+    memcpy(header, blob, sizeof(header));
+    if (header[0] != TDIGEST_MAGIC || header[1] > TDIGEST_MAX_CENTROIDS ||
+        size != fixed + header[1] * sizeof(Centroid)) {
+        return 0;
+    }
+    memcpy(&digest->min, blob + sizeof(header), sizeof(double));
+    memcpy(&digest->max, blob + sizeof(header) + sizeof(double), sizeof(double));
+    memcpy(digest->centroids, blob + fixed, header[1] * sizeof(Centroid));
+    digest->merged = (int)header[1];
+    digest->buffered = 0;
+    return 1;
+}
+
+// splitmix64 finalizer: spreads sequential ids over all 64 bits
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void hll_add(HyperLogLog *hll, uint64_t value) {
+    uint64_t hash = mix64(value);
+    uint32_t index = (uint32_t)(hash >> (64 - HLL_PRECISION));
+    uint64_t rest = (hash << HLL_PRECISION) | (1ULL << (HLL_PRECISION - 1));
+    uint8_t rank = (uint8_t)(__builtin_clzll(rest) + 1);
+    if (rank > hll->registers[index]) hll->registers[index] = rank;
+}
+
+static void hll_merge(HyperLogLog *into, const HyperLogLog *from) {
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        if (from->registers[i] > into->registers[i]) into->registers[i] = from->registers[i];
+    }
+}
+
+static double hll_estimate(const HyperLogLog *hll) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -hll->registers[i]);
+        zeros += hll->registers[i] == 0;
+    }
+    double m = HLL_REGISTERS;
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * log(m / zeros);     // linear counting for small sets
+    }
+    return estimate;
+}
+
+// Copy the named sketch into buffer. Returns its size, 0 if there is none.
+static size_t sketch_load(sqlite3 *conn, const char *name, void *buffer, size_t size) {
+    sqlite3_stmt *stmt;
+    size_t length = 0;
+    if (sqlite3_prepare_v2(conn, "SELECT data FROM stat_sketches WHERE name = ?", -1, &stmt, 0) != SQLITE_OK) {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        length = sqlite3_column_bytes(stmt, 0);
+        if (length <= size) {
+            memcpy(buffer, sqlite3_column_blob(stmt, 0), length);
+        } else {
+            length = 0;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return length;
+}
+
+static int sketch_store(sqlite3 *conn, const char *name, const void *data, size_t size) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn, "INSERT OR REPLACE INTO stat_sketches (name, data) VALUES (?, ?)", -1, &stmt, 0);
+    if (rc != SQLITE_OK) return rc;
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, data, (int)size, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int load_tdigest(sqlite3 *conn, const char *name, TDigest *digest) {
+    static __thread unsigned char blob[2 * sizeof(uint32_t) + 2 * sizeof(double) + TDIGEST_MAX_CENTROIDS * sizeof(Centroid)];
+    tdigest_init(digest);
+    size_t size = sketch_load(conn, name, blob, sizeof(blob));
+    return size > 0 && tdigest_deserialize(digest, blob, size);
+}
+
+static int store_tdigest(sqlite3 *conn, const char *name, TDigest *digest) {
+    size_t size;
+    void *blob = tdigest_serialize(digest, &size);
+    if (!blob) return SQLITE_NOMEM;
+    int rc = sketch_store(conn, name, blob, size);
+    free(blob);
+    return rc;
+}
+
+static int load_hll(sqlite3 *conn, const char *name, HyperLogLog *hll) {
+    if (sketch_load(conn, name, hll->registers, HLL_REGISTERS) != HLL_REGISTERS) {
+        memset(hll->registers, 0, HLL_REGISTERS);
+        return 0;
+    }
+    return 1;
+}
+
+// The month sketch for key ("YYYY-MM"), loaded on first use
+static MonthSketch *month_sketch(sqlite3 *conn, StatSketches *sketches, const char *key) {
+    for (int i = sketches->month_count - 1; i >= 0; i--) {
+        if (strcmp(sketches->months[i].month, key) == 0) return &sketches->months[i];
+    }
+    if (sketches->month_count == sketches->month_capacity) {
+        int capacity = sketches->month_capacity ? sketches->month_capacity * 2 : 16;
+        MonthSketch *months = realloc(sketches->months, capacity * sizeof(MonthSketch));
+        if (!months) return NULL;
+        sketches->months = months;
+        sketches->month_capacity = capacity;
+    }
+    MonthSketch *month = &sketches->months[sketches->month_count++];
+    snprintf(month->month, sizeof(month->month), "%s", key);
+    month->dirty = 0;
+    char name[32];
+    snprintf(name, sizeof(name), "patients:%s", key);
+    load_hll(conn, name, &month->hll);
+    return month;
+}
+
+static long long sketch_watermark(sqlite3 *conn, const char *source) {
+    sqlite3_stmt *stmt;
+    long long last_id = 0;
+    if (sqlite3_prepare_v2(conn, "SELECT last_id FROM stat_watermarks WHERE source = ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, source, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) last_id = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return last_id;
+}
+
+static int set_sketch_watermark(sqlite3 *conn, const char *source, long long last_id) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn, "INSERT OR REPLACE INTO stat_watermarks (source, last_id) VALUES (?, ?)", -1, &stmt, 0);
+    if (rc != SQLITE_OK) return rc;
+    sqlite3_bind_text(stmt, 1, source, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, last_id);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void free_stat_sketches(StatSketches *sketches) {
+    free(sketches->months);
+    free(sketches);
+}
+
+// Load the persisted sketches, fold in rows added since the last refresh
+// and write them back in the same transaction. When the write lock is not
+// available the new rows are still folded into the returned copy, just not
+// saved. Returns NULL on error.
+static StatSketches *refresh_stat_sketches(sqlite3 *conn) {
+    StatSketches *sketches = calloc(1, sizeof(StatSketches));
+    if (!sketches) return NULL;
+    
+    int writable = sqlite3_exec(conn, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK;
+    if (!writable && sqlite3_exec(conn, "BEGIN", 0, 0, 0) != SQLITE_OK) {
+        free(sketches);
+        return NULL;
+    }
+    
+    load_tdigest(conn, "bill_amount", &sketches->bill_amount);
+    load_tdigest(conn, "patient_age", &sketches->patient_age);
+    load_hll(conn, "patients:all", &sketches->patients_all);
+    long long last_bill = sketch_watermark(conn, "bills");
+    long long last_patient = sketch_watermark(conn, "patients");
+    
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn,
+        "SELECT bill_no, patient_id, bill_date, total_amount FROM bills WHERE bill_no > ? ORDER BY bill_no",
+        -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, last_bill);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            last_bill = sqlite3_column_int64(stmt, 0);
+            uint64_t patient_id = (uint64_t)sqlite3_column_int64(stmt, 1);
+            tdigest_add(&sketches->bill_amount, sqlite3_column_double(stmt, 3), 1);
+            hll_add(&sketches->patients_all, patient_id);
+            if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+                char key[16];
+                format_date(sqlite3_column_int64(stmt, 2), key, sizeof(key));
+                key[7] = '\0';
+                MonthSketch *month = month_sketch(conn, sketches, key);
+                if (month) {
+                    hll_add(&month->hll, patient_id);
+                    month->dirty = 1;
+                }
+            }
+            sketches->new_bills++;
+        }
+        sqlite3_finalize(stmt);
+        rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+    
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(conn, "SELECT id, age FROM patients WHERE id > ? ORDER BY id", -1, &stmt, 0);
+    }
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, last_patient);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            last_patient = sqlite3_column_int64(stmt, 0);
+            if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+                tdigest_add(&sketches->patient_age, sqlite3_column_double(stmt, 1), 1);
+            }
+            sketches->new_patients++;
+        }
+        sqlite3_finalize(stmt);
+        rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+    
+    if (rc == SQLITE_OK && writable && (sketches->new_bills > 0 || sketches->new_patients > 0)) {
+        rc = store_tdigest(conn, "bill_amount", &sketches->bill_amount);
+        if (rc == SQLITE_OK) rc = store_tdigest(conn, "patient_age", &sketches->patient_age);
+        if (rc == SQLITE_OK) rc = sketch_store(conn, "patients:all", sketches->patients_all.registers, HLL_REGISTERS);
+        for (int i = 0; rc == SQLITE_OK && i < sketches->month_count; i++) {
+            if (!sketches->months[i].dirty) continue;
+            char name[32];
+            snprintf(name, sizeof(name), "patients:%s", sketches->months[i].month);
+            rc = sketch_store(conn, name, sketches->months[i].hll.registers, HLL_REGISTERS);
+        }
+        if (rc == SQLITE_OK) rc = set_sketch_watermark(conn, "bills", last_bill);
+        if (rc == SQLITE_OK) rc = set_sketch_watermark(conn, "patients", last_patient);
+    }
+    
+    if (rc != SQLITE_OK) {
+        sqlite3_exec(conn, "ROLLBACK", 0, 0, 0);
+        free_stat_sketches(sketches);
+        return NULL;
+    }
+    sqlite3_exec(conn, "COMMIT", 0, 0, 0);
+    return sketches;
+}
+
+// Distinct patients billed in the `months` calendar months ending with the
+// one containing the Julian day `day`, by merging the monthly sketches
+static double distinct_patients_billed(sqlite3 *conn, StatSketches *sketches, long long day, int months) {
+    HyperLogLog merged;
+    memset(&merged, 0, sizeof(merged));
+    int year, month, mday;
+    civil_from_days(day - JULIAN_DAY_UNIX_EPOCH, &year, &month, &mday);
+    for (int i = 0; i < months; i++) {
+        char key[8];
+        snprintf(key, sizeof(key), "%04d-%02d", year, month);
+        MonthSketch *sketch = month_sketch(conn, sketches, key);
+        if (sketch) hll_merge(&merged, &sketch->hll);
+        if (--month == 0) {
+            month = 12;
+            year--;
+        }
+    }
+    return hll_estimate(&merged);
+}
+
+// ==================== REPORT FUNCTIONS ====================
+
+// Open balances by age, per patient (and overall when patient_id is 0)
+#define AGING_BUCKETS 4
+static const char *aging_labels[AGING_BUCKETS] = {"0-30", "31-60", "61-90", "90+"};
+
+typedef struct {
+    long long patient_id;
+    long long bills;
+    int64_t cents[AGING_BUCKETS];
+    int64_t total;          // cents over all buckets
+} AgingAccount;
+
+// Bucket for a bill that is age_days old. Bills without a date count as
+// the oldest so they are chased rather than hidden.
+static int aging_bucket(long long age_days, int has_date) {
+    if (!has_date || age_days > 90) return 3;
+    if (age_days > 60) return 2;
+    if (age_days > 30) return 1;
+    return 0;
+}
+
+// Min-heap on total, so the root is the smallest of the current top N
+static void aging_sift_down(AgingAccount *heap, int count, int i) {
+    while (1) {
+        int smallest = i, left = 2 * i + 1, right = left + 1;
+        if (left < count && heap[left].total < heap[smallest].total) smallest = left;
+        if (right < count && heap[right].total < heap[smallest].total) smallest = right;
+        if (smallest == i) return;
+        AgingAccount swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+static void aging_offer(AgingAccount *heap, int *count, int capacity, const AgingAccount *account) {
+    if (*count < capacity) {
+        int i = (*count)++;
+        heap[i] = *account;
+        while (i > 0 && heap[(i - 1) / 2].total > heap[i].total) {
+            AgingAccount swap = heap[i];
+            heap[i] = heap[(i - 1) / 2];
+            heap[(i - 1) / 2] = swap;
+            i = (i - 1) / 2;
+        }
+    } else if (capacity > 0 && account->total > heap[0].total) {
+        heap[0] = *account;
+        aging_sift_down(heap, *count, 0);
+    }
+}
+
+static int compare_aging_desc(const void *a, const void *b) {
+    int64_t x = ((const AgingAccount*)a)->total, y = ((const AgingAccount*)b)->total;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Age every open bill as of the Julian day as_of in one pass. The partial
+// index on open bills covers the query and returns them grouped by
+// patient, so each account is complete when the patient changes and only
+// the top `capacity` accounts are kept (largest first in top[]). Returns an
+// SQLite result code.
+static int compute_aging(sqlite3 *conn, long long as_of, AgingAccount *overall,
+                         AgingAccount *top, int capacity, int *top_count, long long *accounts) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn,
+        "SELECT patient_id, bill_date, balance_due FROM bills "
+        "WHERE balance_due > 0 ORDER BY patient_id", -1, &stmt, 0);
+    if (rc != SQLITE_OK) return rc;
+    
+    memset(overall, 0, sizeof(*overall));
+    *top_count = 0;
+    *accounts = 0;
+    AgingAccount current;
+    memset(&current, 0, sizeof(current));
+    int have_current = 0;
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        long long patient_id = sqlite3_column_int64(stmt, 0);
+        if (!have_current || patient_id != current.patient_id) {
+            if (have_current) aging_offer(top, top_count, capacity, &current);
+            memset(&current, 0, sizeof(current));
+            current.patient_id = patient_id;
+            have_current = 1;
+            (*accounts)++;
+        }
+        int has_date = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+        int bucket = aging_bucket(as_of - sqlite3_column_int64(stmt, 1), has_date);
+        int64_t cents = llround(sqlite3_column_double(stmt, 2) * 100.0);
+        current.cents[bucket] += cents;
+        current.total += cents;
+        current.bills++;
+        overall->cents[bucket] += cents;
+        overall->total += cents;
+        overall->bills++;
+    }
+    if (have_current) aging_offer(top, top_count, capacity, &current);
+    sqlite3_finalize(stmt);
+    
+    qsort(top, *top_count, sizeof(AgingAccount), compare_aging_desc);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void format_cents(char *buffer, size_t size, int64_t cents) {
+    int64_t magnitude = cents < 0 ? -cents : cents;
+    snprintf(buffer, size, "%s$%lld.%02lld", cents < 0 ? "-" : "",
+             (long long)(magnitude / 100), (long long)(magnitude % 100));
+}
+
+static void aging_report(FILE *out, sqlite3 *conn, int capacity) {
+    AgingAccount *top = malloc(capacity * sizeof(AgingAccount));
+    if (!top) {
+        fprintf(out, "Out of memory.\n");
+        return;
+    }
+    
+    AgingAccount overall;
+    int top_count;
+    long long accounts;
+    long long as_of = today_julian_day();
+    double started = now_seconds();
+    if (compute_aging(conn, as_of, &overall, top, capacity, &top_count, &accounts) != SQLITE_OK) {
+        fprintf(out, "Error generating report: %s\n", sqlite3_errmsg(conn));
+        free(top);
+        return;
+    }
+    double elapsed = now_seconds() - started;
+    
+    char as_of_text[16];
+    format_date(as_of, as_of_text, sizeof(as_of_text));
+    fprintf(out, "\nACCOUNTS RECEIVABLE AGING (as of %s, days since bill date)\n", as_of_text);
+    fprintf(out, "════════════════════════════════════════════════════\n");
+    for (int b = 0; b < AGING_BUCKETS; b++) {
+        char amount[32];
+        format_cents(amount, sizeof(amount), overall.cents[b]);
+        fprintf(out, "  %-6s days:  %16s  %5.1f%%\n", aging_labels[b], amount,
+                overall.total > 0 ? 100.0 * overall.cents[b] / overall.total : 0.0);
+    }
+    char total_text[32];
+    format_cents(total_text, sizeof(total_text), overall.total);
+    fprintf(out, "  Total:        %16s  (%lld open bills, %lld patients)\n", total_text, overall.bills, accounts);
+    
+    if (top_count > 0) {
+        fprintf(out, "\nTOP %d DEBTORS\n", top_count);
+        static const TableColumn columns[] = {
+            {"Patient ID", 0, 1}, {"Name", 25, 0}, {"Bills", 0, 1}, {"0-30", 0, 1},
+            {"31-60", 0, 1}, {"61-90", 0, 1}, {"90+", 0, 1}, {"Total", 0, 1}
+        };
+        TableRenderer table;
+        table_begin_file(&table, columns, 8, out);
+        
+        sqlite3_stmt *name_stmt = NULL;
+        sqlite3_prepare_v2(conn, "SELECT name FROM patients WHERE id = ?", -1, &name_stmt, 0);
+        for (int i = 0; i < top_count; i++) {
+            char id_text[24], bills_text[24], amounts[AGING_BUCKETS + 1][32], name[100] = "Unknown";
+            snprintf(id_text, sizeof(id_text), "%lld", top[i].patient_id);
+            snprintf(bills_text, sizeof(bills_text), "%lld", top[i].bills);
+            for (int b = 0; b < AGING_BUCKETS; b++) {
+                format_cents(amounts[b], sizeof(amounts[b]), top[i].cents[b]);
+            }
+            format_cents(amounts[AGING_BUCKETS], sizeof(amounts[AGING_BUCKETS]), top[i].total);
+            if (name_stmt) {
+                sqlite3_bind_int64(name_stmt, 1, top[i].patient_id);
+                if (sqlite3_step(name_stmt) == SQLITE_ROW && sqlite3_column_text(name_stmt, 0)) {
+                    snprintf(name, sizeof(name), "%s", (const char*)sqlite3_column_text(name_stmt, 0));
+                }
+                sqlite3_reset(name_stmt);
+            }
+            
+            const char *cells[8] = {id_text, name, bills_text, amounts[0], amounts[1],
+                                    amounts[2], amounts[3], amounts[4]};
+            table_row(&table, cells);
+        }
+        table_end(&table);
+        sqlite3_finalize(name_stmt);
+    }
+    
+    fprintf(out, "\nComputed in %.1f ms\n", elapsed * 1000.0);
+    free(top);
+}
+
+// Patients in house at midnight on each day of [first_day, last_day]: a
+// patient counts from the admission day up to the day before discharge
+// (or indefinitely while discharge_date is NULL). One range query returns
+// every stay overlapping the window; each contributes +1/-1 events to a
+// per-day delta array and a running sum turns the deltas into the census,
+// so the cost is O(stays + days) however long the range. Admissions and
+// discharges falling inside the window are counted per day as well.
+#define CENSUS_MAX_DAYS 36525
+
+typedef struct {
+    long long first_day;
+    int days;
+    int *in_house;
+    int *admitted;
+    int *discharged;
+} Census;
+
+static void free_census(Census *census) {
+    free(census->in_house);
+    free(census->admitted);
+    free(census->discharged);
+}
+
+static int compute_census(sqlite3 *conn, long long first_day, long long last_day, Census *census) {
+    census->first_day = first_day;
+    census->days = (int)(last_day - first_day + 1);
+    census->in_house = calloc(census->days + 1, sizeof(int));
+    census->admitted = calloc(census->days, sizeof(int));
+    census->discharged = calloc(census->days, sizeof(int));
+    if (!census->in_house || !census->admitted || !census->discharged) {
+        free_census(census);
+        return SQLITE_NOMEM;
+    }
+    
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn,
+        "SELECT admission_date, discharge_date FROM patients "
+        "WHERE admission_date <= ? AND (discharge_date IS NULL OR discharge_date >= ?)",
+        -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        free_census(census);
+        return rc;
+    }
+    sqlite3_bind_int64(stmt, 1, last_day);
+    sqlite3_bind_int64(stmt, 2, first_day);
+    
+    int *delta = census->in_house;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        long long admitted = sqlite3_column_int64(stmt, 0);
+        int open = sqlite3_column_type(stmt, 1) == SQLITE_NULL;
+        long long discharged = open ? last_day + 1 : sqlite3_column_int64(stmt, 1);
+        
+        if (admitted >= first_day) census->admitted[admitted - first_day]++;
+        if (!open && discharged <= last_day) census->discharged[discharged - first_day]++;
+        
+        long long start = admitted > first_day ? admitted : first_day;
+        long long end = discharged <= last_day ? discharged : last_day + 1;     // exclusive
+        if (start < end) {
+            delta[start - first_day]++;
+            delta[end - first_day]--;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        free_census(census);
+        return rc;
+    }
+    
+    for (int i = 1; i < census->days; i++) {
+        delta[i] += delta[i - 1];
+    }
+    return SQLITE_OK;
+}
+
+// Ask for the census date range; returns 0 (after saying why) if it is unusable
+static int get_census_range(long long *first_day, long long *last_day) {
+    char text[16];
+    *last_day = today_julian_day();
+    *first_day = *last_day - 29;
+    while (1) {
+        get_string("From date (YYYY-MM-DD, enter for 30 days ago): ", text, sizeof(text));
+        if (text[0] == '\0' || parse_date(text, first_day)) break;
+        printf("Invalid date! Please use YYYY-MM-DD.\n");
+    }
+    while (1) {
+        get_string("To date (YYYY-MM-DD, enter for today): ", text, sizeof(text));
+        if (text[0] == '\0' || parse_date(text, last_day)) break;
+        printf("Invalid date! Please use YYYY-MM-DD.\n");
+    }
+    if (*last_day < *first_day || *last_day - *first_day >= CENSUS_MAX_DAYS) {
+        printf("Date range must run forwards and cover at most %d days.\n", CENSUS_MAX_DAYS);
+        return 0;
+    }
+    return 1;
+}
+
+static void census_report(FILE *out, sqlite3 *conn, long long first_day, long long last_day) {
+    Census census;
+    double started = now_seconds();
+    if (compute_census(conn, first_day, last_day, &census) != SQLITE_OK) {
+        fprintf(out, "Error generating report: %s\n", sqlite3_errmsg(conn));
+        return;
+    }
+    double elapsed = now_seconds() - started;
+    
+    // Daily rows for up to a quarter, monthly average/peak beyond that
+    int monthly = census.days > 92;
+    static const TableColumn daily_columns[] = {
+        {"Date", 0, 0}, {"In House", 0, 1}, {"Admitted", 0, 1}, {"Discharged", 0, 1}
+    };
+    static const TableColumn monthly_columns[] = {
+        {"Month", 0, 0}, {"Avg Census", 0, 1}, {"Peak", 0, 1}, {"Admitted", 0, 1}, {"Discharged", 0, 1}
+    };
+    TableRenderer table;
+    table_begin_file(&table, monthly ? monthly_columns : daily_columns, monthly ? 5 : 4, out);
+    
+    long long patient_days = 0;
+    int peak = 0, peak_day = 0;
+    long long group_sum = 0, group_admitted = 0, group_discharged = 0;
+    int group_days = 0, group_peak = 0;
+    for (int i = 0; i < census.days; i++) {
+        char date[16];
+        format_date(census.first_day + i, date, sizeof(date));
+        patient_days += census.in_house[i];
+        if (census.in_house[i] > peak) {
+            peak = census.in_house[i];
+            peak_day = i;
+        }
+        
+        if (!monthly) {
+            char in_house[16], admitted[16], discharged[16];
+            snprintf(in_house, sizeof(in_house), "%d", census.in_house[i]);
+            snprintf(admitted, sizeof(admitted), "%d", census.admitted[i]);
+            snprintf(discharged, sizeof(discharged), "%d", census.discharged[i]);
+            const char *cells[4] = {date, in_house, admitted, discharged};
+            table_row(&table, cells);
+            continue;
+        }
+        
+        group_sum += census.in_house[i];
+        group_admitted += census.admitted[i];
+        group_discharged += census.discharged[i];
+        if (census.in_house[i] > group_peak) group_peak = census.in_house[i];
+        group_days++;
+        
+        char next[16] = "";
+        if (i + 1 < census.days) format_date(census.first_day + i + 1, next, sizeof(next));
+        if (strncmp(date, next, 7) != 0) {
+            char average[24], peak_text[16], admitted[24], discharged[24];
+            date[7] = '\0';
+            snprintf(average, sizeof(average), "%.1f", (double)group_sum / group_days);
+            snprintf(peak_text, sizeof(peak_text), "%d", group_peak);
+            snprintf(admitted, sizeof(admitted), "%lld", group_admitted);
+            snprintf(discharged, sizeof(discharged), "%lld", group_discharged);
+            const char *cells[5] = {date, average, peak_text, admitted, discharged};
+            table_row(&table, cells);
+            group_sum = group_admitted = group_discharged = 0;
+            group_days = group_peak = 0;
+        }
+    }
+    table_end(&table);
+    
+    char peak_date[16];
+    format_date(census.first_day + peak_day, peak_date, sizeof(peak_date));
+    fprintf(out, "\n%d days, %lld patient-days, average daily census %.1f, peak %d on %s\n",
+            census.days, patient_days, (double)patient_days / census.days, peak, peak_date);
+    fprintf(out, "Computed in %.1f ms\n", elapsed * 1000.0);
+    free_census(&census);
+}
+
+static void write_statistics(FILE *out, sqlite3 *conn);
+
+// Write the report described by request to out, reading through conn.
+// Used for the screen (out = stdout) and by background jobs.
+void write_report(FILE *out, sqlite3 *conn, const ReportRequest *request) {
+    if (request->type == REPORT_CENSUS) {
+        census_report(out, conn, request->first_day, request->last_day);
+    } else if (request->type == REPORT_AGING) {
+        aging_report(out, conn, request->top_n);
+    } else if (request->type == REPORT_STATISTICS) {
+        write_statistics(out, conn);
+    } else if (request->type == REPORT_OUTSTANDING) {
+        // Outstanding payments
+        const char *sql = "SELECT bill_no, patient_name, total_amount, amount_paid, "
+                         "balance_due, bill_date FROM bills WHERE balance_due > 0 "
+                         "ORDER BY balance_due DESC";
+        
+        CachedCursor rows;
+        if (cached_query(conn, sql, NULL, 0, &rows) != SQLITE_OK) {
+            fprintf(out, "Error generating report: %s\n", sqlite3_errmsg(conn));
+            return;
+        }
+        
+        fprintf(out, "\nOUTSTANDING PAYMENTS REPORT\n");
+        fprintf(out, "════════════════════════════════════════════════════\n");
+        static const TableColumn columns[] = {
+            {"Bill No", 0, 1}, {"Patient Name", 25, 0}, {"Total", 0, 1},
+            {"Paid", 0, 1}, {"Balance", 0, 1}, {"Date", 12, 0}
+        };
+        TableRenderer table;
+        table_begin_file(&table, columns, 6, out);
+        
+        float total_outstanding = 0;
+        int count = 0;
+        
+        while (cursor_step(&rows)) {
+            count++;
+            const char *patient_name = cursor_text(&rows, 1);
+            float balance_due = cursor_double(&rows, 4);
+            char bill_date[16] = "Unknown";
+            if (cursor_text(&rows, 5)) {
+                format_date(cursor_int64(&rows, 5), bill_date, sizeof(bill_date));
+            }
+            
+            char total_text[32], paid_text[32], balance_text[32];
+            snprintf(total_text, sizeof(total_text), "$%.2f", cursor_double(&rows, 2));
+            snprintf(paid_text, sizeof(paid_text), "$%.2f", cursor_double(&rows, 3));
+            snprintf(balance_text, sizeof(balance_text), "$%.2f", balance_due);
+            
+            const char *cells[6];
+            cells[0] = cursor_text(&rows, 0);
+            cells[1] = patient_name ? patient_name : "Unknown";
+            cells[2] = total_text;
+            cells[3] = paid_text;
+            cells[4] = balance_text;
+            cells[5] = bill_date;
+            table_row(&table, cells);
+            
+            total_outstanding += balance_due;
+        }
+        table_end(&table);
+        
+        cursor_close(&rows);
+        
+        fprintf(out, "\nSummary:\n");
+        fprintf(out, "  Total Outstanding Bills: %d\n", count);
+        fprintf(out, "  Total Outstanding Amount: $%.2f\n", total_outstanding);
+    } else {
+        // Summary report
+        const char *sql = "SELECT COUNT(*), SUM(total_amount), SUM(amount_paid), "
+                         "SUM(balance_due) FROM bills";
+        
+        CachedCursor rows;
+        if (cached_query(conn, sql, NULL, 0, &rows) != SQLITE_OK) {
+            fprintf(out, "Error generating report: %s\n", sqlite3_errmsg(conn));
+            return;
+        }
+        cursor_step(&rows);
+        
+        int total_bills = cursor_int64(&rows, 0);
+        float total_billed = cursor_double(&rows, 1);
+        float total_paid = cursor_double(&rows, 2);
+        float total_outstanding = cursor_double(&rows, 3);
+        
+        cursor_close(&rows);
+        
+        fprintf(out, "\nFINANCIAL SUMMARY REPORT\n");
+        fprintf(out, "════════════════════════════════════════════════════\n");
+        fprintf(out, "\nSummary Statistics:\n");
+        fprintf(out, "  Total Bills Generated:      %d\n", total_bills);
+        fprintf(out, "  Total Amount Billed:        $%.2f\n", total_billed);
+        fprintf(out, "  Total Amount Collected:     $%.2f\n", total_paid);
+        fprintf(out, "  Total Outstanding:          $%.2f\n", total_outstanding);
+        fprintf(out, "  Collection Rate:            %.1f%%\n", 
+                total_billed > 0 ? (total_paid / total_billed * 100) : 0);
+    }
+}
+
+// Offer to run a report as a background job. Returns 1 if it was queued
+// (or could not be), 0 if it should run on screen now.
+static int offer_background(const char *title, const ReportRequest *request) {
+    if (!confirm_background()) {
+        return 0;
+    }
+    Job job;
+    memset(&job, 0, sizeof(job));
+    job.kind = JOB_REPORT;
+    snprintf(job.title, sizeof(job.title), "%s", title);
+    job.report = *request;
+    int id = job_submit(&job);
+    if (id > 0) {
+        printf("\nQueued as job #%d. Option 24 (Background Jobs) shows its progress and output.\n", id);
+    } else {
+        printf("\n❌ Could not start the background worker; run the report in the foreground.\n");
+    }
+    return 1;
+}
+
+void generate_report() {
+    clear_screen();
+    print_header("FINANCIAL REPORT");
+    
+    printf("Select Report Type:\n");
+    printf("1. Summary Report\n");
+    printf("2. Outstanding Payments\n");
+    printf("3. Accounts Receivable Aging\n");
+    printf("4. Daily Census\n");
+    printf("Enter choice: ");
+    
+    ReportRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = get_choice(1, 4);
+    if (request.type == REPORT_AGING) {
+        request.top_n = get_integer("Number of top debtors to list (1-1000): ", 1, 1000);
+    }
+    if (request.type != REPORT_CENSUS || get_census_range(&request.first_day, &request.last_day)) {
+        if (!offer_background(report_titles[request.type], &request)) {
+            write_report(stdout, report_connection(), &request);
+        }
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Statistics screen body. The report cache figures describe the cache on
+// the interactive connection, so they are left out elsewhere.
+static void write_statistics(FILE *out, sqlite3 *conn) {
+    // Patient statistics
+    const char *sql = "SELECT COUNT(*), "
+                     "COUNT(CASE WHEN gender = 'M' THEN 1 END), "
+                     "COUNT(CASE WHEN gender = 'F' THEN 1 END), "
+                     "AVG(age) FROM patients";
+    
+    CachedCursor rows;
+    if (cached_query(conn, sql, NULL, 0, &rows) == SQLITE_OK && cursor_step(&rows)) {
+        int total_patients = cursor_int64(&rows, 0);
+        int male_patients = cursor_int64(&rows, 1);
+        int female_patients = cursor_int64(&rows, 2);
+        float avg_age = cursor_double(&rows, 3);
+        
+        fprintf(out, "PATIENTS:\n");
+        fprintf(out, "  Total Patients:        %d\n", total_patients);
+        fprintf(out, "  Male Patients:         %d\n", male_patients);
+        fprintf(out, "  Female Patients:       %d\n", female_patients);
+        fprintf(out, "  Average Age:           %.1f years\n", avg_age);
+    }
+    cursor_close(&rows);
+    
+    // Bill statistics
+    sql = "SELECT COUNT(*), SUM(total_amount), SUM(amount_paid), "
+          "SUM(balance_due), AVG(total_amount) FROM bills";
+    
+    if (cached_query(conn, sql, NULL, 0, &rows) == SQLITE_OK && cursor_step(&rows)) {
+        int total_bills = cursor_int64(&rows, 0);
+        float total_billed = cursor_double(&rows, 1);
+        float total_paid = cursor_double(&rows, 2);
+        float total_outstanding = cursor_double(&rows, 3);
+        float avg_bill = cursor_double(&rows, 4);
+        
+        fprintf(out, "\nBILLING:\n");
+        fprintf(out, "  Total Bills:           %d\n", total_bills);
+        fprintf(out, "  Total Amount Billed:   $%.2f\n", total_billed);
+        fprintf(out, "  Total Amount Paid:     $%.2f\n", total_paid);
+        fprintf(out, "  Total Outstanding:     $%.2f\n", total_outstanding);
+        fprintf(out, "  Average Bill Amount:   $%.2f\n", avg_bill);
+        fprintf(out, "  Collection Rate:       %.1f%%\n", 
+                total_billed > 0 ? (total_paid / total_billed * 100) : 0);
+    }
+    cursor_close(&rows);
+    
+    // Percentiles and distinct counts come from the persisted sketches, so
+    // they cost only the rows added since the last visit to this screen
+    double started = now_seconds();
+    StatSketches *sketches = refresh_stat_sketches(db);
+    if (sketches) {
+        double elapsed_ms = (now_seconds() - started) * 1000;
+        long long today = today_julian_day();
+        int year, month, day;
+        civil_from_days(today - JULIAN_DAY_UNIX_EPOCH, &year, &month, &day);
+        long long last_month = today - day;     // last day of the previous month
+        
+        fprintf(out, "\nDISTRIBUTIONS (approximate):\n");
+        if (sketches->bill_amount.merged + sketches->bill_amount.buffered > 0) {
+            fprintf(out, "  Bill Amount p50/p90/p99: $%.2f / $%.2f / $%.2f\n",
+                    tdigest_quantile(&sketches->bill_amount, 0.50),
+                    tdigest_quantile(&sketches->bill_amount, 0.90),
+                    tdigest_quantile(&sketches->bill_amount, 0.99));
+        }
+        if (sketches->patient_age.merged + sketches->patient_age.buffered > 0) {
+            fprintf(out, "  Patient Age p50/p90/p99: %.0f / %.0f / %.0f years\n",
+                    tdigest_quantile(&sketches->patient_age, 0.50),
+                    tdigest_quantile(&sketches->patient_age, 0.90),
+                    tdigest_quantile(&sketches->patient_age, 0.99));
+        }
+        fprintf(out, "  Patients Billed:       %.0f this month, %.0f last month\n",
+                distinct_patients_billed(db, sketches, today, 1),
+                distinct_patients_billed(db, sketches, last_month, 1));
+        fprintf(out, "                         %.0f in 12 months, %.0f all time\n",
+                distinct_patients_billed(db, sketches, today, 12),
+                hll_estimate(&sketches->patients_all));
+        fprintf(out, "  Refreshed:             %lld new bills, %lld new patients in %.1f ms\n",
+                sketches->new_bills, sketches->new_patients, elapsed_ms);
+        free_stat_sketches(sketches);
+    }
+    
+    if (db != query_cache.source) {
+        return;
+    }
+    
+    long long lookups = query_cache.hits + query_cache.misses;
+    fprintf(out, "\nREPORT CACHE:\n");
+    fprintf(out, "  Hits / Misses:         %lld / %lld (%.1f%% hit rate)\n", query_cache.hits,
+            query_cache.misses, lookups > 0 ? query_cache.hits * 100.0 / lookups : 0);
+    fprintf(out, "  Cached Results:        %d (%.1f KB of %d KB)\n", query_cache.entries,
+            query_cache.bytes / 1024.0, (int)(memory_budget.query_cache_bytes / 1024));
+    fprintf(out, "  Invalidations:         %lld\n", query_cache.invalidations);
+}
+
+void view_statistics() {
+    clear_screen();
+    print_header("SYSTEM STATISTICS");
+    
+    ReportRequest request;
+    memset(&request, 0, sizeof(request));
+    request.type = REPORT_STATISTICS;
+    if (!offer_background(report_titles[REPORT_STATISTICS], &request)) {
+        printf("\nOverall Statistics:\n");
+        printf("════════════════════════════════════════════════════\n");
+        write_statistics(stdout, report_connection());
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== SYSTEM FUNCTIONS ====================
+
+// Pages copied per backup step between progress checks
+#define BACKUP_STEP_PAGES 1024
+// Pause before retrying a step that found the database locked by a writer
+#define BACKUP_RETRY_MS 10
+
+void backup_database() {
+    clear_screen();
+    print_header("BACKUP DATABASE");
+    
+    if (confirm_background()) {
+        Job job;
+        memset(&job, 0, sizeof(job));
+        job.kind = JOB_BACKUP;
+        snprintf(job.title, sizeof(job.title), "Database backup");
+        int id = job_submit(&job);
+        if (id > 0) {
+            printf("\nQueued as job #%d; the backup will be saved in backups/.\n", id);
+        } else {
+            printf("\n❌ Could not start the background worker.\n");
+        }
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    // localtime_r: a background job may be formatting a time concurrently
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char backup_name[100];
+    strftime(backup_name, sizeof(backup_name), "backup_%Y%m%d_%H%M%S.db", &tm);
+    
+    printf("Creating backup: %s\n", backup_name);
+    
+    sqlite3 *backup_db;
+    sqlite3_backup *backup;
+    
+    int rc = sqlite3_open(backup_name, &backup_db);
+    if (rc != SQLITE_OK) {
+        printf("Cannot create backup file: %s\n", sqlite3_errmsg(backup_db));
+        sqlite3_close(backup_db);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    // Copy a slice of pages at a time so the copy shows progress and can be
+    // cancelled with Ctrl-C; a cancelled backup file is removed
+    int cancelled = 0;
+    backup = sqlite3_backup_init(backup_db, "main", db, "main");
+    if (backup) {
+        query_watch.unit = "pages";
+        do {
+            rc = sqlite3_backup_step(backup, BACKUP_STEP_PAGES);
+            query_watch.rows = sqlite3_backup_pagecount(backup) - sqlite3_backup_remaining(backup);
+            if (rc != SQLITE_DONE && query_watch_poll()) {
+                cancelled = 1;
+                break;
+            }
+            if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+                sqlite3_sleep(BACKUP_RETRY_MS);
+            }
+        } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+        query_watch_clear_line();
+        sqlite3_backup_finish(backup);
+    }
+    
+    rc = sqlite3_errcode(backup_db);
+    sqlite3_close(backup_db);
+    
+    if (cancelled) {
+        unlink(backup_name);
+        printf("\nBackup cancelled; no backup file was kept.\n");
+    } else if (rc == SQLITE_OK) {
+        printf("\n✅ Database backed up successfully!\n");
+        
+        // Create backups directory
+        system("mkdir -p backups 2>/dev/null");
+        
+        // Move to backups
+        char command[200];
+        snprintf(command, sizeof(command), "mv %s backups/ 2>/dev/null", backup_name);
+        system(command);
+        
+        printf("Backup saved in: backups/%s\n", backup_name);
+        
+        // List recent backups
+        printf("\nRecent backups:\n");
+        system("ls -la backups/*.db 2>/dev/null | tail -5");
+    } else {
+        printf("\n❌ Backup failed: %s\n", sqlite3_errstr(rc));
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+void restore_database() {
+    clear_screen();
+    print_header("RESTORE DATABASE");
+    
+    if (jobs_pending() > 0) {
+        printf("Background jobs are still reading the database (see option 24).\n");
+        printf("Restore once they have finished.\n");
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    printf("WARNING: This will overwrite current database!\n");
+    printf("Available backups:\n");
+    system("ls -la backups/*.db 2>/dev/null || echo 'No backup files found'");
+    
+    char backup_name[100];
+    get_string("\nEnter backup filename (from backups/ directory): ", backup_name, sizeof(backup_name));
+    
+    if (strlen(backup_name) == 0) {
+        printf("No backup file specified.\n");
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    // Check if file exists
+    char full_path[200];
+    snprintf(full_path, sizeof(full_path), "backups/%s", backup_name);
+    FILE *file = fopen(full_path, "rb");
+    if (!file) {
+        printf("Backup file '%s' not found!\n", backup_name);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    fclose(file);
+    
+    printf("Are you sure you want to restore from '%s'? ", backup_name);
+    
+    if (!get_confirmation("(y/n): ")) {
+        printf("Restore cancelled.\n");
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    // Close current database
+    query_watch_attach(NULL);
+    sqlite3_close(db);
+    
+    // Copy the backup next to the database and rename it into place, so a
+    // failed copy, or one cancelled with Ctrl-C (which stops cp), leaves the
+    // current database as it was
+    char temp_path[300];
+    snprintf(temp_path, sizeof(temp_path), "%s.restore", db_path);
+    char command[512];
+    snprintf(command, sizeof(command), "cp \"backups/%s\" \"%s\"", backup_name, temp_path);
+    int result = system(command);
+    if (result == 0 && rename(temp_path, db_path) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temp_path);
+    }
+    
+    // Reopen database
+    int rc = sqlite3_open(db_path, &db);
+    if (rc != SQLITE_OK) {
+        printf("Failed to restore database: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    memory_budget_connection(db);
+    query_watch_attach(db);
+    
+    // Set UTF-8 encoding for restored database
+    sqlite3_exec(db, "PRAGMA encoding = 'UTF-8';", 0, 0, 0);
+    sqlite3_exec(db, "PRAGMA foreign_keys = ON;", 0, 0, 0);
+    
+    // An older backup may predate the current schema
+    run_migrations(db, "console");
+    
+    // Point the report replica, query cache and WAL archive at the new connection
+    watch_database_changes(db);
+    wal_archive_reattach(db);
+    if (report_replica.conn) {
+        replica_open(db);
+    }
+    
+    if (result != 0) {
+        printf("Restore failed or was cancelled; the database was not changed.\n");
+    } else {
+        printf("✅ Database restored successfully from: %s\n", backup_name);
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== WAL ARCHIVE ====================
+
+// Segment record header; the WAL frames (24-byte frame header plus a page
+// each, exactly as SQLite wrote them) follow it
+typedef struct {
+    char magic[4];          // "HBWR"
+    uint32_t page_size;
+    uint32_t frame_count;
+    uint32_t reserved;
+    int64_t commit_time;    // Unix time in microseconds when it was archived
+} WalRecordHeader;
+
+#define WAL_HEADER_BYTES 32
+#define WAL_FRAME_HEADER_BYTES 24
+
+static uint32_t read_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static long long unix_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        length -= n;
+    }
+    return 1;
+}
+
+static void wal_archive_disable(sqlite3 *conn, const char *reason) {
+    printf("\n⚠️  WAL archiving stopped: %s\n", reason);
+    wal_archive.active = 0;
+    if (wal_archive.segment_fd >= 0) close(wal_archive.segment_fd);
+    if (wal_archive.wal_fd >= 0) close(wal_archive.wal_fd);
+    wal_archive.segment_fd = wal_archive.wal_fd = -1;
+    // Hand checkpointing back to SQLite (this replaces the archive hook)
+    sqlite3_wal_autocheckpoint(conn, WAL_ARCHIVE_CHECKPOINT_PAGES);
+}
+
+static int wal_archive_open_segment() {
+    char path[300];
+    if (wal_archive.segment_fd >= 0) close(wal_archive.segment_fd);
+    wal_archive.segment_number++;
+    snprintf(path, sizeof(path), "%s/%06d.seg", wal_archive.generation, wal_archive.segment_number);
+    wal_archive.segment_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    wal_archive.segment_bytes = 0;
+    return wal_archive.segment_fd >= 0;
+}
+
+// Begin a new generation: a base backup taken through a separate
+// connection, then archiving from the first frame of the current WAL.
+// Frames already contained in the backup are archived again; replaying
+// page images in order is idempotent, so recovery to any time after the
+// backup is still exact.
+static int wal_archive_new_generation() {
+    long long now = unix_micros();
+    time_t seconds = now / 1000000;
+    struct tm tm;
+    char name[32];
+    gmtime_r(&seconds, &tm);
+    strftime(name, sizeof(name), "%Y%m%d_%H%M%S", &tm);
+    snprintf(wal_archive.generation, sizeof(wal_archive.generation), "%s/%s_%06lld",
+             wal_archive.dir, name, now % 1000000);
+    if (mkdir(wal_archive.generation, 0755) != 0) {
+        return 0;
+    }
+    
+    char path[300];
+    snprintf(path, sizeof(path), "%s/base.db", wal_archive.generation);
+    sqlite3 *source, *dest;
+    int rc = sqlite3_open_v2(db_path, &source, SQLITE_OPEN_READONLY, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_busy_timeout(source, 5000);
+        rc = sqlite3_open(path, &dest);
+        if (rc == SQLITE_OK) {
+            sqlite3_backup *backup = sqlite3_backup_init(dest, "main", source, "main");
+            if (backup) {
+                sqlite3_backup_step(backup, -1);
+                sqlite3_backup_finish(backup);
+            }
+            rc = sqlite3_errcode(dest);
+        }
+        sqlite3_close(dest);
+    }
+    sqlite3_close(source);
+    if (rc != SQLITE_OK) {
+        return 0;
+    }
+    
+    // Recovery targets must not precede the end of the base backup
+    snprintf(path, sizeof(path), "%s/base.time", wal_archive.generation);
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return 0;
+    }
+    fprintf(file, "%lld\n", unix_micros());
+    if (fclose(file) != 0) {
+        return 0;
+    }
+    
+    wal_archive.offset = 0;
+    wal_archive.salts_known = 0;
+    wal_archive.restart_due = 0;
+    wal_archive.segment_number = 0;
+    return wal_archive_open_segment();
+}
+
+// Append WAL bytes [offset, end) as one record. end always falls on a
+// commit boundary because it comes from the WAL hook.
+static int wal_archive_copy(long long end) {
+    size_t frame_bytes = WAL_FRAME_HEADER_BYTES + wal_archive.page_size;
+    size_t length = end - wal_archive.offset;
+    if (length == 0) {
+        return 1;
+    }
+    if (length > wal_archive.capacity) {
+        unsigned char *grown = realloc(wal_archive.buffer, length);
+        if (!grown) return 0;
+        wal_archive.buffer = grown;
+        wal_archive.capacity = length;
+    }
+    for (size_t done = 0; done < length; ) {
+        ssize_t n = pread(wal_archive.wal_fd, wal_archive.buffer + done, length - done, wal_archive.offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        done += n;
+    }
+    // Every frame must belong to the WAL generation the salts describe
+    for (size_t at = 0; at < length; at += frame_bytes) {
+        if (read_be32(wal_archive.buffer + at + 8) != wal_archive.salt1 ||
+            read_be32(wal_archive.buffer + at + 12) != wal_archive.salt2) {
+            return 0;
+        }
+    }
+    
+    WalRecordHeader header;
+    memcpy(header.magic, "HBWR", 4);
+    header.page_size = wal_archive.page_size;
+    header.frame_count = length / frame_bytes;
+    header.reserved = 0;
+    header.commit_time = unix_micros();
+    if (wal_archive.segment_bytes >= WAL_ARCHIVE_SEGMENT_BYTES && !wal_archive_open_segment()) {
+        return 0;
+    }
+    if (!write_all(wal_archive.segment_fd, &header, sizeof(header)) ||
+        !write_all(wal_archive.segment_fd, wal_archive.buffer, length) ||
+        fdatasync(wal_archive.segment_fd) != 0) {
+        return 0;
+    }
+    wal_archive.segment_bytes += sizeof(header) + length;
+    wal_archive.offset = end;
+    wal_archive.records++;
+    wal_archive.frames += header.frame_count;
+    return 1;
+}
+
+// Called by SQLite after every commit on the live connection with the
+// number of frames now in the WAL. Archives the new frames, then
+// checkpoints and truncates the WAL once it is large; only this hook
+// checkpoints, so no frame is absorbed into the database unarchived.
+static int wal_archive_hook(void *arg, sqlite3 *conn, const char *name, int frames) {
+    (void)arg;
+    if (!wal_archive.active || strcmp(name, "main") != 0) {
+        return SQLITE_OK;
+    }
+    if (wal_archive.wal_fd < 0) {
+        // SQLite creates the WAL file on first use, so it is opened here
+        char wal_path[300];
+        snprintf(wal_path, sizeof(wal_path), "%s-wal", db_path);
+        wal_archive.wal_fd = open(wal_path, O_RDONLY);
+    }
+    unsigned char header[WAL_HEADER_BYTES];
+    if (wal_archive.wal_fd < 0 || pread(wal_archive.wal_fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        wal_archive_disable(conn, "cannot read the WAL file");
+        return SQLITE_OK;
+    }
+    // SQLite adds one to salt1 each time the WAL restarts. After our own
+    // truncation the next WAL must be exactly one restart later. So may it
+    // be after a checkpoint that absorbed the whole WAL but was kept from
+    // truncating by a reader, if no other connection has committed since
+    // (the data version moved by this commit alone). Otherwise the salts
+    // must not have changed. Anything else means another program
+    // checkpointed frames away unarchived: start over from a new base.
+    uint32_t salt1 = read_be32(header + 16), salt2 = read_be32(header + 20);
+    if (wal_archive.restart_due) {
+        unsigned int version = 0;
+        sqlite3_file_control(conn, name, SQLITE_FCNTL_DATA_VERSION, &version);
+        if (salt1 == wal_archive.salt1 + 1 && version == wal_archive.data_version + 1) {
+            wal_archive.offset = 0;
+        }
+        wal_archive.restart_due = 0;
+    }
+    int continuous = !wal_archive.salts_known ||
+        (wal_archive.offset == 0 ? salt1 == wal_archive.salt1 + 1
+                                 : salt1 == wal_archive.salt1 && salt2 == wal_archive.salt2);
+    if (!continuous) {
+        if (!wal_archive_new_generation()) {
+            wal_archive_disable(conn, "cannot start a new archive generation");
+            return SQLITE_OK;
+        }
+        printf("\nWAL restarted by another connection; new archive generation %s\n", wal_archive.generation);
+    }
+    if (wal_archive.offset == 0) {
+        wal_archive.salts_known = 1;
+        wal_archive.salt1 = salt1;
+        wal_archive.salt2 = salt2;
+        wal_archive.page_size = read_be32(header + 8);
+        wal_archive.offset = WAL_HEADER_BYTES;
+    }
+    
+    long long frame_bytes = WAL_FRAME_HEADER_BYTES + wal_archive.page_size;
+    long long end = WAL_HEADER_BYTES + (long long)frames * frame_bytes;
+    if (!wal_archive_copy(end)) {
+        wal_archive_disable(conn, strerror(errno ? errno : EIO));
+        return SQLITE_OK;
+    }
+    
+    // RESTART holds the write lock while it copies, so log is exactly the
+    // frames it absorbed. Frames other connections committed since the
+    // hook read the WAL are archived now, before a restart overwrites them.
+    if (frames >= WAL_ARCHIVE_CHECKPOINT_PAGES) {
+        int log = 0, checkpointed = 0;
+        int rc = sqlite3_wal_checkpoint_v2(conn, name, SQLITE_CHECKPOINT_RESTART, &log, &checkpointed);
+        if ((rc == SQLITE_OK || rc == SQLITE_BUSY) && log > 0) {
+            long long absorbed = WAL_HEADER_BYTES + (long long)log * frame_bytes;
+            if (absorbed > wal_archive.offset && !wal_archive_copy(absorbed)) {
+                if (!wal_archive_new_generation()) {
+                    wal_archive_disable(conn, "cannot start a new archive generation");
+                    return SQLITE_OK;
+                }
+                printf("\nWAL frames checkpointed before they were archived; new archive generation %s\n",
+                       wal_archive.generation);
+                return SQLITE_OK;
+            }
+            // Even when a reader kept the checkpoint from finishing, a WAL
+            // absorbed in full may be restarted by the next writer
+            wal_archive.restart_due = checkpointed == log && absorbed == wal_archive.offset;
+            sqlite3_file_control(conn, name, SQLITE_FCNTL_DATA_VERSION, &wal_archive.data_version);
+            // With no reader left, truncate it; a commit slipping in
+            // between the two checkpoints shows up in the salts
+            if (rc == SQLITE_OK && wal_archive.restart_due &&
+                sqlite3_wal_checkpoint_v2(conn, name, SQLITE_CHECKPOINT_TRUNCATE, &log, &checkpointed) == SQLITE_OK &&
+                log == 0) {
+                wal_archive.offset = 0;
+                wal_archive.restart_due = 0;
+            }
+        }
+    }
+    return SQLITE_OK;
+}
+
+// Start archiving conn's database to dir: switch it to WAL mode, take a
+// base backup and install the commit hook. Returns 1 on success.
+int wal_archive_start(sqlite3 *conn, const char *dir) {
+    if (dir != wal_archive.dir) {
+        snprintf(wal_archive.dir, sizeof(wal_archive.dir), "%s", dir);
+    }
+    if (mkdir(wal_archive.dir, 0755) != 0 && errno != EEXIST) {
+        printf("Cannot create archive directory %s: %s\n", wal_archive.dir, strerror(errno));
+        return 0;
+    }
+    
+    sqlite3_stmt *stmt;
+    int wal = 0;
+    if (sqlite3_prepare_v2(conn, "PRAGMA journal_mode = WAL", -1, &stmt, 0) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        wal = strcmp((const char*)sqlite3_column_text(stmt, 0), "wal") == 0;
+    }
+    sqlite3_finalize(stmt);
+    if (!wal) {
+        printf("Cannot switch %s to WAL mode: %s\n", db_path, sqlite3_errmsg(conn));
+        return 0;
+    }
+    
+    // A restore replaces the WAL file too; the hook reopens it
+    if (wal_archive.wal_fd >= 0) close(wal_archive.wal_fd);
+    if (wal_archive.segment_fd >= 0) close(wal_archive.segment_fd);
+    wal_archive.wal_fd = wal_archive.segment_fd = -1;
+    if (!wal_archive_new_generation()) {
+        printf("Cannot start WAL archive in %s: %s\n", wal_archive.dir, strerror(errno));
+        return 0;
+    }
+    wal_archive.active = 1;
+    sqlite3_wal_hook(conn, wal_archive_hook, NULL);
+    return 1;
+}
+
+// After the database file was replaced (restore), archive it afresh
+void wal_archive_reattach(sqlite3 *conn) {
+    if (wal_archive.active) {
+        wal_archive.active = 0;
+        if (wal_archive_start(conn, wal_archive.dir)) {
+            printf("WAL archiving continues in %s\n", wal_archive.generation);
+        }
+    }
+}
+
+void wal_archive_stop() {
+    if (wal_archive.segment_fd >= 0) close(wal_archive.segment_fd);
+    if (wal_archive.wal_fd >= 0) close(wal_archive.wal_fd);
+    wal_archive.segment_fd = wal_archive.wal_fd = -1;
+    wal_archive.active = 0;
+    free(wal_archive.buffer);
+    wal_archive.buffer = NULL;
+    wal_archive.capacity = 0;
+}
+
+// Parse "YYYY-MM-DD[ HH:MM[:SS]]" (UTC) into Unix microseconds
+static int parse_recovery_time(const char *text, long long *micros) {
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    char extra;
+    int n = sscanf(text, "%d-%d-%d %d:%d:%d%c", &year, &month, &day, &hour, &minute, &second, &extra);
+    if ((n != 3 && n != 5 && n != 6) || month < 1 || month > 12 || day < 1 || day > 31 ||
+        hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60) {
+        return 0;
+    }
+    *micros = ((days_from_civil(year, month, day) * SECONDS_PER_DAY) + hour * 3600 + minute * 60 + second)
+              * 1000000LL;
+    return 1;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void format_micros(long long micros, char *buffer, size_t size) {
+    format_timestamp(micros / 1000000, buffer, size);
+}
+
+// Copy a file in large blocks; output must not exist yet
+static int copy_file(const char *from, const char *to, long long *bytes) {
+    int in = open(from, O_RDONLY);
+    if (in < 0) return 0;
+    int out = open(to, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) {
+        close(in);
+        return 0;
+    }
+    char *block = malloc(1 << 20);
+    int ok = block != NULL;
+    *bytes = 0;
+    ssize_t n;
+    while (ok && (n = read(in, block, 1 << 20)) != 0) {
+        if (n < 0) {
+            ok = errno == EINTR;
+            continue;
+        }
+        ok = write_all(out, block, n);
+        *bytes += n;
+    }
+    free(block);
+    close(in);
+    return close(out) == 0 && ok;
+}
+
+// Rebuild the database as of until (NULL = the last archived commit) into
+// output: copy the newest base backup taken before that time, then apply
+// every archived commit up to it in order
+int run_recovery(const char *dir, const char *until, const char *output) {
+    long long target = 0x7fffffffffffffffLL;
+    if (until && !parse_recovery_time(until, &target)) {
+        fprintf(stderr, "Invalid time '%s': use YYYY-MM-DD[ HH:MM[:SS]] (UTC)\n", until);
+        return 1;
+    }
+    
+    // Generation directories sort by their start time
+    DIR *root = opendir(dir);
+    if (!root) {
+        fprintf(stderr, "Cannot open archive %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    char **names = NULL;
+    int count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(root)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **grown = realloc(names, capacity * sizeof(char*));
+            if (!grown) break;
+            names = grown;
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(root);
+    qsort(names, count, sizeof(char*), compare_strings);
+    
+    char generation[300] = "";
+    long long base_time = 0;
+    for (int i = 0; i < count; i++) {
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s/base.time", dir, names[i]);
+        FILE *file = fopen(path, "r");
+        long long started;
+        if (file && fscanf(file, "%lld", &started) == 1 && started <= target) {
+            snprintf(generation, sizeof(generation), "%s/%s", dir, names[i]);
+            base_time = started;
+        }
+        if (file) fclose(file);
+        free(names[i]);
+    }
+    free(names);
+    if (!generation[0]) {
+        fprintf(stderr, "No base backup in %s was taken before the requested time\n", dir);
+        return 1;
+    }
+    
+    double start = now_seconds();
+    char path[400];
+    long long base_bytes;
+    snprintf(path, sizeof(path), "%s/base.db", generation);
+    if (!copy_file(path, output, &base_bytes)) {
+        fprintf(stderr, "Cannot copy %s to %s: %s\n", path, output, strerror(errno));
+        return 1;
+    }
+    int fd = open(output, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    
+    long long records = 0, frames = 0, bytes = 0, last_commit = base_time;
+    unsigned char *buffer = NULL;
+    size_t buffer_size = 0;
+    int done = 0, ok = 1;
+    for (int segment = 1; !done && ok; segment++) {
+        snprintf(path, sizeof(path), "%s/%06d.seg", generation, segment);
+        FILE *file = fopen(path, "rb");
+        if (!file) break;
+        WalRecordHeader header;
+        while (fread(&header, sizeof(header), 1, file) == 1) {
+            if (memcmp(header.magic, "HBWR", 4) != 0) {
+                fprintf(stderr, "Corrupt record in %s; stopping there\n", path);
+                done = 1;
+                break;
+            }
+            if (header.commit_time > target) {
+                done = 1;
+                break;
+            }
+            size_t frame_bytes = WAL_FRAME_HEADER_BYTES + header.page_size;
+            size_t length = (size_t)header.frame_count * frame_bytes;
+            if (length > buffer_size) {
+                unsigned char *grown = realloc(buffer, length);
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                buffer = grown;
+                buffer_size = length;
+            }
+            if (fread(buffer, 1, length, file) != length) {
+                // A record cut short by a crash while archiving was never complete
+                fprintf(stderr, "Incomplete record at the end of %s; stopping there\n", path);
+                done = 1;
+                break;
+            }
+            uint32_t pages = 0;
+            for (size_t at = 0; at < length && ok; at += frame_bytes) {
+                uint32_t page = read_be32(buffer + at);
+                uint32_t commit_pages = read_be32(buffer + at + 4);
+                ok = pwrite(fd, buffer + at + WAL_FRAME_HEADER_BYTES, header.page_size,
+                            (off_t)(page - 1) * header.page_size) == (ssize_t)header.page_size;
+                if (commit_pages) pages = commit_pages;
+            }
+            // The last commit frame gives the database size after the commit
+            if (ok && pages && ftruncate(fd, (off_t)pages * header.page_size) != 0) ok = 0;
+            records++;
+            frames += header.frame_count;
+            bytes += length;
+            last_commit = header.commit_time;
+        }
+        fclose(file);
+    }
+    free(buffer);
+    if (ok && fsync(fd) != 0) ok = 0;
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "Recovery failed writing %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    double elapsed = now_seconds() - start;
+    
+    // Check the result is a sound database
+    sqlite3 *conn;
+    char verdict[100] = "cannot open";
+    if (sqlite3_open_v2(output, &conn, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(conn, "PRAGMA quick_check", -1, &stmt, 0) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+            snprintf(verdict, sizeof(verdict), "%s", (const char*)sqlite3_column_text(stmt, 0));
+        } else {
+            snprintf(verdict, sizeof(verdict), "%s", sqlite3_errmsg(conn));
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(conn);
+    
+    char base_text[24], commit_text[24];
+    format_micros(base_time, base_text, sizeof(base_text));
+    format_micros(last_commit, commit_text, sizeof(commit_text));
+    printf("Recovered %s from %s\n", output, generation);
+    printf("  Base backup:   %s UTC (%.1f MB)\n", base_text, base_bytes / 1e6);
+    printf("  Replayed:      %lld commits, %lld frames (%.1f MB)\n", records, frames, bytes / 1e6);
+    printf("  Recovered to:  %s UTC\n", commit_text);
+    printf("  Time:          %.2f s (%.1f MB/s, %.0f commits/sec)\n", elapsed,
+           elapsed > 0 ? (base_bytes + bytes) / 1e6 / elapsed : 0.0, elapsed > 0 ? records / elapsed : 0.0);
+    printf("  Quick check:   %s\n", verdict);
+    return strcmp(verdict, "ok") == 0 ? 0 : 1;
+}
+
+// ==================== DATA EXPORT ====================
+
+static const ExportField patient_fields[] = {
+    {"id", FIELD_INTEGER}, {"name", FIELD_TEXT}, {"age", FIELD_INTEGER},
+    {"gender", FIELD_TEXT}, {"contact", FIELD_TEXT}, {"address", FIELD_TEXT},
+    {"disease", FIELD_TEXT}, {"admission_date", FIELD_DATE}, {"created_at", FIELD_TIMESTAMP},
+    {"discharge_date", FIELD_DATE}
+};
+
+static const ExportField bill_fields[] = {
+    {"bill_no", FIELD_INTEGER}, {"patient_id", FIELD_INTEGER}, {"patient_name", FIELD_TEXT},
+    {"bill_date", FIELD_DATE}, {"room_charges", FIELD_MONEY}, {"doctor_fees", FIELD_MONEY},
+    {"medicine_charges", FIELD_MONEY}, {"lab_charges", FIELD_MONEY}, {"other_charges", FIELD_MONEY},
+    {"total_amount", FIELD_MONEY}, {"amount_paid", FIELD_MONEY}, {"balance_due", FIELD_MONEY},
+    {"payment_status", FIELD_TEXT}, {"payment_method", FIELD_TEXT}
+};
+
+static const ExportField payment_fields[] = {
+    {"payment_id", FIELD_INTEGER}, {"bill_no", FIELD_INTEGER}, {"amount", FIELD_MONEY},
+    {"payment_date", FIELD_TIMESTAMP}, {"payment_method", FIELD_TEXT}
+};
+
+static const ExportTable export_tables[] = {
+    {"patients", patient_fields, sizeof(patient_fields) / sizeof(patient_fields[0])},
+    {"bills", bill_fields, sizeof(bill_fields) / sizeof(bill_fields[0])},
+    {"payments", payment_fields, sizeof(payment_fields) / sizeof(payment_fields[0])}
+};
+
+#define EXPORT_TABLE_COUNT 3
+
+const ExportTable *find_export_table(const char *name) {
+    for (int i = 0; i < EXPORT_TABLE_COUNT; i++) {
+        if (strcmp(export_tables[i].name, name) == 0) {
+            return &export_tables[i];
+        }
+    }
+    return NULL;
+}
+
+static const char *export_extensions[] = {"csv", "ndjson", "json"};
+
+static int parse_export_format(const char *name) {
+    for (int i = 0; i < 3; i++) {
+        if (strcasecmp(export_extensions[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Write value in decimal at dest, two digits per step. dest needs 20 bytes
+// of room; returns the number of characters written.
+static int format_unsigned(char *dest, unsigned long long value) {
+    char digits[20];
+    int pos = sizeof(digits);
+    while (value >= 100) {
+        int pair = (int)(value % 100) * 2;
+        value /= 100;
+        digits[--pos] = digit_pairs[pair + 1];
+        digits[--pos] = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        digits[--pos] = digit_pairs[value * 2 + 1];
+        digits[--pos] = digit_pairs[value * 2];
+    } else {
+        digits[--pos] = (char)('0' + value);
+    }
+    int length = sizeof(digits) - pos;
+    memcpy(dest, digits + pos, length);
+    return length;
+}
+
+static void export_integer(OutputBuffer *out, long long value) {
+    char *dest = output_reserve(out, 21);
+    if (!dest) return;
+    int length = 0;
+    unsigned long long magnitude = (unsigned long long)value;
+    if (value < 0) {
+        dest[length++] = '-';
+        magnitude = 0 - magnitude;
+    }
+    out->length += length + format_unsigned(dest + length, magnitude);
+}
+
+// Amounts are stored as REAL; round to whole cents and print them exactly,
+// so 0.1 + 0.2 comes out as 0.30 rather than 0.30000000000000004
+static void export_money(OutputBuffer *out, double amount) {
+    char *dest = output_reserve(out, 24);
+    if (!dest) return;
+    long long cents = llround(amount * 100.0);
+    int length = 0;
+    unsigned long long magnitude = (unsigned long long)cents;
+    if (cents < 0) {
+        dest[length++] = '-';
+        magnitude = 0 - magnitude;
+    }
+    length += format_unsigned(dest + length, magnitude / 100);
+    dest[length++] = '.';
+    dest[length++] = digit_pairs[(magnitude % 100) * 2];
+    dest[length++] = digit_pairs[(magnitude % 100) * 2 + 1];
+    out->length += length;
+}
+
+// Append text as a quoted JSON string. Runs of plain bytes are copied in one
+// go; quotes, backslashes and control characters are escaped. UTF-8 passes
+// through unchanged.
+static void export_json_string(OutputBuffer *out, const char *text, int length) {
+    output_append(out, "\"", 1);
+    int run = 0;
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        output_append(out, text + run, i - run);
+        run = i + 1;
+        char escape[8];
+        switch (c) {
+            case '"':  output_append(out, "\\\"", 2); break;
+            case '\\': output_append(out, "\\\\", 2); break;
+            case '\n': output_append(out, "\\n", 2); break;
+            case '\r': output_append(out, "\\r", 2); break;
+            case '\t': output_append(out, "\\t", 2); break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                output_append(out, escape, 6);
+        }
+    }
+    output_append(out, text + run, length - run);
+    output_append(out, "\"", 1);
+}
+
+// Dates and timestamps are stored as integers; write them into buffer as
+// "YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS". Returns the length, or 0 when the
+// column is not a stored date.
+static int export_date_text(sqlite3_stmt *stmt, int column, FieldKind kind, char *buffer, size_t size) {
+    if ((kind != FIELD_DATE && kind != FIELD_TIMESTAMP) || sqlite3_column_type(stmt, column) != SQLITE_INTEGER) {
+        return 0;
+    }
+    if (kind == FIELD_DATE) {
+        format_date(sqlite3_column_int64(stmt, column), buffer, size);
+    } else {
+        format_timestamp(sqlite3_column_int64(stmt, column), buffer, size);
+    }
+    return (int)strlen(buffer);
+}
+
+static void export_json_value(OutputBuffer *out, sqlite3_stmt *stmt, int column, FieldKind kind) {
+    int type = sqlite3_column_type(stmt, column);
+    if (type == SQLITE_NULL) {
+        output_append(out, "null", 4);
+        return;
+    }
+    if (kind == FIELD_INTEGER && type == SQLITE_INTEGER) {
+        export_integer(out, sqlite3_column_int64(stmt, column));
+        return;
+    }
+    if (kind == FIELD_MONEY && (type == SQLITE_INTEGER || type == SQLITE_FLOAT)) {
+        export_money(out, sqlite3_column_double(stmt, column));
+        return;
+    }
+    
+    // Text, dates, and anything stored with an unexpected type go out as
+    // strings so no value is lost
+    char date[24];
+    const char *text = date;
+    int length = export_date_text(stmt, column, kind, date, sizeof(date));
+    if (length == 0) {
+        text = (const char*)sqlite3_column_text(stmt, column);
+        length = sqlite3_column_bytes(stmt, column);
+    }
+    if (kind == FIELD_TIMESTAMP && length == 19 && text[10] == ' ') {
+        char iso[21];
+        memcpy(iso, text, 19);
+        iso[10] = 'T';
+        iso[19] = 'Z';
+        export_json_string(out, iso, 20);
+        return;
+    }
+    export_json_string(out, text, length);
+}
+
+// Same quoting as the original CSV export: every field quoted, embedded
+// quotes doubled, line breaks flattened to spaces
+static void export_csv_value(OutputBuffer *out, const char *text, int length) {
+    output_append(out, "\"", 1);
+    int run = 0;
+    for (int i = 0; i < length; i++) {
+        char c = text[i];
+        if (c != '"' && c != '\n' && c != '\r') {
+            continue;
+        }
+        output_append(out, text + run, i - run);
+        run = i + 1;
+        output_append(out, c == '"' ? "\"\"" : " ", c == '"' ? 2 : 1);
+    }
+    output_append(out, text + run, length - run);
+    output_append(out, "\"", 1);
+}
+
+// Stream every row of table to out. Rows are formatted into the buffer and
+// written whenever it passes OUTPUT_FLUSH_BYTES, so memory use does not grow
+// with the table. Returns an SQLite result code; *rows gets the row count.
+int export_table(sqlite3 *conn, const ExportTable *table, ExportFormat format, OutputBuffer *out, long long *rows) {
+    char sql[512];
+    int length = snprintf(sql, sizeof(sql), "SELECT ");
+    for (int i = 0; i < table->field_count; i++) {
+        length += snprintf(sql + length, sizeof(sql) - length, "%s%s",
+                           i > 0 ? ", " : "", table->fields[i].name);
+    }
+    snprintf(sql + length, sizeof(sql) - length, " FROM %s", table->name);
+    
+    *rows = 0;
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    
+    if (format == EXPORT_CSV) {
+        for (int i = 0; i < table->field_count; i++) {
+            if (i > 0) output_append(out, ",", 1);
+            export_csv_value(out, table->fields[i].name, strlen(table->fields[i].name));
+        }
+        output_append(out, "\n", 1);
+    } else if (format == EXPORT_JSON) {
+        output_append(out, "[", 1);
+    }
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && !out->failed) {
+        if (format == EXPORT_CSV) {
+            for (int i = 0; i < table->field_count; i++) {
+                if (i > 0) output_append(out, ",", 1);
+                char date[24];
+                int length = export_date_text(stmt, i, table->fields[i].kind, date, sizeof(date));
+                const char *text = length > 0 ? date : (const char*)sqlite3_column_text(stmt, i);
+                if (length == 0 && text) length = sqlite3_column_bytes(stmt, i);
+                export_csv_value(out, text ? text : "", length);
+            }
+        } else {
+            if (format == EXPORT_JSON) {
+                output_append(out, *rows > 0 ? ",\n" : "\n", *rows > 0 ? 2 : 1);
+            }
+            output_append(out, "{", 1);
+            for (int i = 0; i < table->field_count; i++) {
+                const char *name = table->fields[i].name;
+                output_append(out, i > 0 ? ",\"" : "\"", i > 0 ? 2 : 1);
+                output_append(out, name, strlen(name));
+                output_append(out, "\":", 2);
+                export_json_value(out, stmt, i, table->fields[i].kind);
+            }
+            output_append(out, "}", 1);
+        }
+        if (format != EXPORT_JSON) {
+            output_append(out, "\n", 1);
+        }
+        (*rows)++;
+        
+        if (out->length >= OUTPUT_FLUSH_BYTES) {
+            output_flush(out);
+        }
+    }
+    sqlite3_finalize(stmt);
+    
+    if (format == EXPORT_JSON) {
+        output_append(out, *rows > 0 ? "\n]\n" : "]\n", *rows > 0 ? 3 : 2);
+    }
+    output_flush(out);
+    
+    if (rc == SQLITE_ROW || rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+    }
+    return out->failed ? SQLITE_IOERR : rc;
+}
+
+static void export_queued(int id) {
+    if (id > 0) {
+        printf("\nQueued as job #%d. Option 24 (Background Jobs) shows when it is done.\n", id);
+    } else {
+        printf("\n❌ Could not start the background worker.\n");
+    }
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+void export_data() {
+    clear_screen();
+    print_header("EXPORT DATA");
+    
+    printf("Select data to export:\n");
+    printf("1. Patients\n");
+    printf("2. Bills\n");
+    printf("3. Payments\n");
+    printf("4. Analytics snapshot (bills + payments, columnar)\n");
+    printf("Enter choice: ");
+    
+    int data_choice = get_choice(1, EXPORT_TABLE_COUNT + 1);
+    if (data_choice == EXPORT_TABLE_COUNT + 1) {
+        char filename[256];
+        get_string("Output file [analytics.hbsnap]: ", filename, sizeof(filename));
+        if (filename[0] == '\0') {
+            strcpy(filename, "analytics.hbsnap");
+        }
+        if (confirm_background()) {
+            Job job;
+            memset(&job, 0, sizeof(job));
+            job.kind = JOB_SNAPSHOT;
+            snprintf(job.title, sizeof(job.title), "Analytics snapshot");
+            snprintf(job.output, sizeof(job.output), "%s", filename);
+            export_queued(job_submit(&job));
+            return;
+        }
+        long long bill_rows, payment_rows;
+        int rc = write_snapshot(db, filename, &bill_rows, &payment_rows);
+        if (rc != SQLITE_OK) {
+            printf("❌ Error writing snapshot: %s\n", rc == SQLITE_IOERR ? "write failed" : sqlite3_errmsg(db));
+        } else {
+            printf("✅ Wrote %lld bills and %lld payments to %s\n", bill_rows, payment_rows, filename);
+            printf("   Summarize it with: hospital_billing --snapshot-report %s\n", filename);
+        }
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    const ExportTable *table = &export_tables[data_choice - 1];
+    
+    printf("\nSelect format:\n");
+    printf("1. CSV (Excel)\n");
+    printf("2. NDJSON (one JSON object per line)\n");
+    printf("3. JSON array\n");
+    printf("Enter choice: ");
+    
+    ExportFormat format = (ExportFormat)(get_choice(1, 3) - 1);
+    
+    char default_name[64];
+    snprintf(default_name, sizeof(default_name), "%s.%s", table->name, export_extensions[format]);
+    
+    char prompt[128];
+    char filename[256];
+    snprintf(prompt, sizeof(prompt), "Output file [%s, - for screen]: ", default_name);
+    get_string(prompt, filename, sizeof(filename));
+    if (filename[0] == '\0') {
+        strcpy(filename, default_name);
+    }
+    
+    int to_screen = strcmp(filename, "-") == 0;
+    if (!to_screen && confirm_background()) {
+        Job job;
+        memset(&job, 0, sizeof(job));
+        job.kind = JOB_EXPORT;
+        snprintf(job.title, sizeof(job.title), "Export %s (%s)", table->name, export_extensions[format]);
+        job.table = table;
+        job.format = format;
+        snprintf(job.output, sizeof(job.output), "%s", filename);
+        export_queued(job_submit(&job));
+        return;
+    }
+    int fd = to_screen ? STDOUT_FILENO : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("❌ Error creating file: %s\n", filename);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    OutputBuffer out;
+    output_init(&out, fd);
+    
+    // Add UTF-8 BOM for Excel compatibility
+    if (format == EXPORT_CSV && !to_screen) {
+        output_append(&out, "\xEF\xBB\xBF", 3);
+    }
+    
+    fflush(stdout);
+    long long row_count;
+    int rc = export_table(db, table, format, &out, &row_count);
+    output_free(&out);
+    if (!to_screen) {
+        close(fd);
+    }
+    
+    if (rc != SQLITE_OK) {
+        printf("❌ Error exporting data: %s\n", rc == SQLITE_IOERR ? "write failed" : sqlite3_errmsg(db));
+    } else {
+        printf("\n✅ Exported %lld rows to %s\n", row_count, to_screen ? "screen" : filename);
+        if (format == EXPORT_CSV && !to_screen) {
+            printf("   File encoded in UTF-8 with BOM for Excel compatibility.\n");
+        }
+    }
+    
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// Non-interactive export for scripts: --export TABLE [--format F] [--output FILE].
+// Writes to stdout unless an output file is given; messages go to stderr.
+int run_export(const char *table_name, const char *format_name, const char *output_path) {
+    const ExportTable *table = find_export_table(table_name);
+    int format = parse_export_format(format_name);
+    if (!table || format < 0) {
+        fprintf(stderr, "Unknown export table or format: %s / %s\n", table_name, format_name);
+        return 1;
+    }
+    
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open database %s: %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 1;
+    }
+    memory_budget_connection(db);
+    
+    int to_stdout = strcmp(output_path, "-") == 0;
+    int fd = to_stdout ? STDOUT_FILENO : open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s\n", output_path);
+        sqlite3_close(db);
+        return 1;
+    }
+    
+    OutputBuffer out;
+    output_init(&out, fd);
+    long long rows;
+    double started = now_seconds();
+    int rc = export_table(db, table, (ExportFormat)format, &out, &rows);
+    double elapsed = now_seconds() - started;
+    output_free(&out);
+    if (!to_stdout) {
+        close(fd);
+    }
+    
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Export failed: %s\n", rc == SQLITE_IOERR ? "write error" : sqlite3_errmsg(db));
+    } else {
+        fprintf(stderr, "Exported %lld %s rows in %.2f s\n", rows, table->name, elapsed);
+    }
+    sqlite3_close(db);
+    db = NULL;
+    return rc == SQLITE_OK ? 0 : 1;
+}
+
+// ==================== BATCH RECEIPTS ====================
+
+// Receipt text is produced from a template compiled once into literal runs
+// and {field} references, so rendering a receipt is a walk over the parts
+// with no format-string parsing. The standard template is the layout
+// print_receipt has always saved.
+static const char receipt_standard_template[] =
+    "Receipt No: {bill_no}\n"
+    "Date: {bill_date}\n"
+    "Patient: {patient_name} (ID: {patient_id})\n"
+    "Total Amount: ${total_amount}\n"
+    "Amount Paid: ${amount_paid}\n"
+    "Balance Due: ${balance_due}\n"
+    "Status: {payment_status}\n";
+
+// Columns available to templates, in the order receipt_select_sql reads them
+static const ExportField receipt_fields[] = {
+    {"bill_no", FIELD_INTEGER}, {"patient_id", FIELD_INTEGER}, {"patient_name", FIELD_TEXT},
+    {"bill_date", FIELD_DATE}, {"room_charges", FIELD_MONEY}, {"doctor_fees", FIELD_MONEY},
+    {"medicine_charges", FIELD_MONEY}, {"lab_charges", FIELD_MONEY}, {"other_charges", FIELD_MONEY},
+    {"total_amount", FIELD_MONEY}, {"amount_paid", FIELD_MONEY}, {"balance_due", FIELD_MONEY},
+    {"payment_status", FIELD_TEXT}, {"payment_method", FIELD_TEXT}
+};
+
+#define RECEIPT_FIELD_COUNT ((int)(sizeof(receipt_fields) / sizeof(receipt_fields[0])))
+#define RECEIPT_MAX_TEMPLATE (64 * 1024)
+#define RECEIPT_CHUNK 64        // bills claimed by a worker at a time
+
+static const char receipt_select_sql[] =
+    "SELECT bill_no, patient_id, patient_name, bill_date, room_charges, doctor_fees, "
+    "medicine_charges, lab_charges, other_charges, total_amount, amount_paid, "
+    "balance_due, payment_status, payment_method FROM bills";
+
+typedef struct {
+    const char *text;       // literal run, or NULL for a field
+    size_t length;
+    int field;              // index into receipt_fields
+} ReceiptPart;
+
+typedef struct {
+    ReceiptPart *parts;
+    int count;
+    char *source;           // literal runs point into this copy
+} ReceiptTemplate;
+
+static void receipt_template_free(ReceiptTemplate *tmpl) {
+    free(tmpl->parts);
+    free(tmpl->source);
+    memset(tmpl, 0, sizeof(*tmpl));
+}
+
+// Split text into literal runs and {field} references. A '{' that does not
+// start a known field name closed by '}' is an error, reported in error.
+static int receipt_template_compile(ReceiptTemplate *tmpl, const char *text, char *error, size_t error_size) {
+    memset(tmpl, 0, sizeof(*tmpl));
+    size_t length = strlen(text);
+    tmpl->source = malloc(length + 1);
+    // At most one literal and one field per '{', plus the trailing literal
+    int capacity = 1;
+    for (const char *p = text; *p; p++) {
+        if (*p == '{') capacity += 2;
+    }
+    tmpl->parts = malloc(capacity * sizeof(ReceiptPart));
+    if (!tmpl->source || !tmpl->parts) {
+        snprintf(error, error_size, "out of memory");
+        receipt_template_free(tmpl);
+        return 0;
+    }
+    memcpy(tmpl->source, text, length + 1);
+    
+    const char *p = tmpl->source, *literal = p;
+    while (*p) {
+        if (*p != '{') {
+            p++;
+            continue;
+        }
+        const char *close = strchr(p, '}');
+        int field = -1;
+        for (int i = 0; close && i < RECEIPT_FIELD_COUNT; i++) {
+            if ((size_t)(close - p - 1) == strlen(receipt_fields[i].name) &&
+                strncmp(p + 1, receipt_fields[i].name, close - p - 1) == 0) {
+                field = i;
+                break;
+            }
+        }
+        if (field < 0) {
+            int shown = close && close - p < 40 ? (int)(close - p + 1) : 20;
+            snprintf(error, error_size, "unknown field %.*s", shown, p);
+            receipt_template_free(tmpl);
+            return 0;
+        }
+        if (p > literal) {
+            tmpl->parts[tmpl->count++] = (ReceiptPart){literal, p - literal, -1};
+        }
+        tmpl->parts[tmpl->count++] = (ReceiptPart){NULL, 0, field};
+        p = literal = close + 1;
+    }
+    if (p > literal) {
+        tmpl->parts[tmpl->count++] = (ReceiptPart){literal, p - literal, -1};
+    }
+    return 1;
+}
+
+// Append the receipt for the current row of a receipt_select_sql statement
+static void receipt_render(const ReceiptTemplate *tmpl, sqlite3_stmt *stmt, OutputBuffer *out) {
+    for (int i = 0; i < tmpl->count; i++) {
+        const ReceiptPart *part = &tmpl->parts[i];
+        if (part->text) {
+            output_append(out, part->text, part->length);
+            continue;
+        }
+        int column = part->field;
+        if (sqlite3_column_type(stmt, column) == SQLITE_NULL) {
+            output_append(out, "Unknown", 7);
+            continue;
+        }
+        switch (receipt_fields[column].kind) {
+            case FIELD_INTEGER:
+                export_integer(out, sqlite3_column_int64(stmt, column));
+                break;
+            case FIELD_MONEY:
+                export_money(out, sqlite3_column_double(stmt, column));
+                break;
+            case FIELD_DATE: {
+                char date[16];
+                format_date(sqlite3_column_int64(stmt, column), date, sizeof(date));
+                output_append(out, date, strlen(date));
+                break;
+            }
+            default:
+                output_append(out, (const char*)sqlite3_column_text(stmt, column),
+                              sqlite3_column_bytes(stmt, column));
+                break;
+        }
+    }
+}
+
+// Replace path with the contents of out, normally in a single write(), and
+// empty the buffer. Returns 1 on success.
+static int write_output_file(const char *path, OutputBuffer *out) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        out->length = 0;
+        return 0;
+    }
+    out->fd = fd;
+    out->failed = 0;
+    output_flush(out);
+    if (close(fd) != 0) {
+        out->failed = 1;
+    }
+    return !out->failed;
+}
+
+// Render the current row into out and write it to path. Returns 1 on success.
+static int write_receipt_file(const ReceiptTemplate *tmpl, sqlite3_stmt *stmt, const char *path, OutputBuffer *out) {
+    out->length = 0;
+    receipt_render(tmpl, stmt, out);
+    return write_output_file(path, out);
+}
+
+// Save the standard receipt for one bill. Returns 1 on success, 0 if the
+// bill does not exist or the file cannot be written.
+int save_receipt(sqlite3 *conn, long long bill_no, const char *path) {
+    ReceiptTemplate tmpl;
+    char error[100];
+    if (!receipt_template_compile(&tmpl, receipt_standard_template, error, sizeof(error))) {
+        return 0;
+    }
+    char sql[sizeof(receipt_select_sql) + 32];
+    snprintf(sql, sizeof(sql), "%s WHERE bill_no = ?", receipt_select_sql);
+    sqlite3_stmt *stmt;
+    int saved = 0;
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, bill_no);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            OutputBuffer out;
+            output_init(&out, -1);
+            saved = write_receipt_file(&tmpl, stmt, path, &out);
+            output_free(&out);
+        }
+    }
+    sqlite3_finalize(stmt);
+    receipt_template_free(&tmpl);
+    return saved;
+}
+
+// A batch run: the selected bill numbers in ascending order, handed out to
+// the workers RECEIPT_CHUNK at a time
+typedef struct {
+    const ReceiptTemplate *tmpl;
+    const char *directory;
+    const char *sql;        // receipt_select_sql plus the run's filter
+    int ranged;             // the filter includes bill dates
+    long long first_day, last_day;
+    const long long *bill_nos;
+    long long count;
+    long long next;         // index of the next unclaimed bill
+} ReceiptRun;
+
+typedef struct {
+    ReceiptRun *run;
+    long long written;
+    long long failed;
+    int open_failed;
+} ReceiptWorker;
+
+// Each worker reads through its own read-only connection. A claimed chunk
+// is fetched with one range query over the bill_no primary key, and every
+// receipt goes to disk in a single write.
+static void *receipt_worker(void *arg) {
+    ReceiptWorker *worker = arg;
+    ReceiptRun *run = worker->run;
+    sqlite3 *conn;
+    sqlite3_stmt *stmt = NULL;
+    
+    if (sqlite3_open_v2(db_path, &conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(conn, run->sql, -1, &stmt, 0) != SQLITE_OK) {
+        worker->open_failed = 1;
+        sqlite3_close(conn);
+        return NULL;
+    }
+    sqlite3_busy_timeout(conn, 5000);
+    memory_budget_connection(conn);
+    query_watch_connection(conn);
+    if (run->ranged) {
+        sqlite3_bind_int64(stmt, 3, run->first_day);
+        sqlite3_bind_int64(stmt, 4, run->last_day);
+    }
+    
+    OutputBuffer out;
+    output_init(&out, -1);
+    char path[300];
+    while (1) {
+        long long first = __sync_fetch_and_add(&run->next, RECEIPT_CHUNK);
+        if (first >= run->count) {
+            break;
+        }
+        long long last = first + RECEIPT_CHUNK - 1 < run->count ? first + RECEIPT_CHUNK - 1 : run->count - 1;
+        sqlite3_bind_int64(stmt, 1, run->bill_nos[first]);
+        sqlite3_bind_int64(stmt, 2, run->bill_nos[last]);
+        long long rendered = 0;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            snprintf(path, sizeof(path), "%s/receipt_%lld.txt", run->directory, sqlite3_column_int64(stmt, 0));
+            if (write_receipt_file(run->tmpl, stmt, path, &out)) {
+                worker->written++;
+            } else {
+                worker->failed++;
+            }
+            rendered++;
+        }
+        // Bills the query did not return (e.g. a read error) count as failed
+        if (rendered < last - first + 1) {
+            worker->failed += last - first + 1 - rendered;
+        }
+        sqlite3_reset(stmt);
+    }
+    
+    output_free(&out);
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
+    return NULL;
+}
+
+// Read a custom template file into a NUL-terminated string (NULL on error)
+static char *read_template_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+    char *text = malloc(RECEIPT_MAX_TEMPLATE + 1);
+    size_t length = text ? fread(text, 1, RECEIPT_MAX_TEMPLATE, file) : 0;
+    fclose(file);
+    if (text) {
+        text[length] = '\0';
+    }
+    return text;
+}
+
+void batch_print_receipts() {
+    clear_screen();
+    print_header("BATCH PRINT RECEIPTS");
+    
+    long long first_bill = get_id("First Bill Number: ", 1);
+    long long last_bill = get_id("Last Bill Number: ", first_bill);
+    printf("Bills to include:\n");
+    printf("1. All\n");
+    printf("2. With a balance due\n");
+    printf("3. Fully paid\n");
+    printf("Enter choice: ");
+    int which = get_choice(1, 3);
+    long long first_day = 0, last_day = 0;
+    int ranged = get_date_range(&first_day, &last_day);
+    
+    char template_path[200], directory[200];
+    get_string("Template file (Enter for the standard receipt): ", template_path, sizeof(template_path));
+    get_string("Output directory (Enter for receipts): ", directory, sizeof(directory));
+    if (directory[0] == '\0') {
+        strcpy(directory, "receipts");
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "Worker threads (1-64, %ld CPUs): ", cpus > 0 ? cpus : 1);
+    int threads = get_integer(prompt, 1, 64);
+    
+    char *custom = NULL;
+    if (template_path[0] && !(custom = read_template_file(template_path))) {
+        printf("❌ Cannot read template: %s\n", template_path);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    ReceiptTemplate tmpl;
+    char error[100];
+    int compiled = receipt_template_compile(&tmpl, custom ? custom : receipt_standard_template, error, sizeof(error));
+    free(custom);
+    if (!compiled) {
+        printf("❌ Invalid template: %s\n", error);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        printf("❌ Cannot create directory %s: %s\n", directory, strerror(errno));
+        receipt_template_free(&tmpl);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    // ?1/?2 bound the bill numbers, ?3/?4 the bill dates
+    static const char *filters[] = {"", " AND balance_due > 0", " AND balance_due <= 0"};
+    char filter[200];
+    snprintf(filter, sizeof(filter), " WHERE bill_no BETWEEN ?1 AND ?2%s%s ORDER BY bill_no",
+             filters[which - 1], ranged ? " AND bill_date BETWEEN ?3 AND ?4" : "");
+    char sql[sizeof(receipt_select_sql) + sizeof(filter)], select_ids[sizeof(filter) + 40];
+    snprintf(sql, sizeof(sql), "%s%s", receipt_select_sql, filter);
+    snprintf(select_ids, sizeof(select_ids), "SELECT bill_no FROM bills%s", filter);
+    
+    double start = now_seconds();
+    
+    // Collect the selected bill numbers so work can be split evenly however
+    // sparse the numbering is
+    long long *bill_nos = NULL, count = 0, capacity = 0;
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, select_ids, -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, first_bill);
+        sqlite3_bind_int64(stmt, 2, last_bill);
+        if (ranged) {
+            sqlite3_bind_int64(stmt, 3, first_day);
+            sqlite3_bind_int64(stmt, 4, last_day);
+        }
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                long long *grown = realloc(bill_nos, capacity * sizeof(long long));
+                if (!grown) {
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+                bill_nos = grown;
+            }
+            bill_nos[count++] = sqlite3_column_int64(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        printf("Error selecting bills: %s\n", rc == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(db));
+        free(bill_nos);
+        receipt_template_free(&tmpl);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    ReceiptRun run = {&tmpl, directory, sql, ranged, first_day, last_day, bill_nos, count, 0};
+    if (threads > (count + RECEIPT_CHUNK - 1) / RECEIPT_CHUNK) {
+        threads = count > 0 ? (int)((count + RECEIPT_CHUNK - 1) / RECEIPT_CHUNK) : 1;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    ReceiptWorker *workers = calloc(threads, sizeof(ReceiptWorker));
+    int started = 0;
+    for (int i = 0; tids && workers && i < threads; i++) {
+        workers[i].run = &run;
+        if (pthread_create(&tids[i], NULL, receipt_worker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    
+    long long written = 0, failed = 0;
+    int open_failures = 0;
+    for (int i = 0; i < started; i++) {
+        written += workers[i].written;
+        failed += workers[i].failed;
+        open_failures += workers[i].open_failed;
+    }
+    // Anything no worker claimed (no thread could start or connect) failed too
+    if (run.next < count) {
+        failed += count - run.next;
+    }
+    
+    if (count == 0) {
+        printf("\nNo bills match.\n");
+    } else {
+        printf("\n✅ %lld receipts written to %s/", written, directory);
+        if (failed > 0) printf(" (%lld failed)", failed);
+        printf("\n   Threads: %d%s\n", started, open_failures ? " (some could not open the database)" : "");
+        printf("   Time:    %.2f s (%.0f receipts/sec)\n", elapsed, elapsed > 0 ? written / elapsed : (double)written);
+    }
+    
+    free(tids);
+    free(workers);
+    free(bill_nos);
+    receipt_template_free(&tmpl);
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== PATIENT STATEMENTS ====================
+
+// Statement rows for a patient range, oldest first per patient: bills
+// (kind 0) and the payments on them (kind 1), each with its Julian day.
+// Both halves are read through the patient index, and everything before
+// the period only feeds the opening balance. NULL dates sort first.
+static const char statement_scan_sql[] =
+    "SELECT b.patient_id, b.bill_date AS day, 0 AS kind, b.bill_no, b.total_amount, "
+    "       b.patient_name, NULL "
+    "FROM bills b WHERE b.patient_id BETWEEN ?1 AND ?2 "
+    "    AND (b.bill_date <= ?3 OR b.bill_date IS NULL) "
+    "UNION ALL "
+    "SELECT b.patient_id, p.payment_date / 86400 + 2440588, 1, p.bill_no, p.amount, "
+    "       b.patient_name, p.payment_method "
+    "FROM bills b JOIN payments p ON p.bill_no = b.bill_no "
+    "WHERE b.patient_id BETWEEN ?1 AND ?2 "
+    "    AND (p.payment_date < ?4 OR p.payment_date IS NULL) "
+    "ORDER BY 1, 2, 3";
+
+// Patients with a bill or payment inside the period, in id order
+static const char statement_patients_sql[] =
+    "SELECT patient_id FROM bills WHERE bill_date BETWEEN ?1 AND ?2 AND patient_id IS NOT NULL "
+    "UNION "
+    "SELECT b.patient_id FROM payments p JOIN bills b ON b.bill_no = p.bill_no "
+    "WHERE p.payment_date >= ?3 AND p.payment_date < ?4 AND b.patient_id IS NOT NULL "
+    "ORDER BY 1";
+
+// One thread's share of a statement run: a contiguous patient id range
+typedef struct {
+    long long first_patient, last_patient;
+    long long first_day, last_day;
+    const char *directory;
+    const char *period;     // "YYYY-MM", used in file names
+    long long statements;
+    long long failed;
+    int64_t charges;        // cents billed in the period over all statements
+    int64_t payments;
+    int error;              // SQLite result code if the scan failed
+} StatementWorker;
+
+// A patient's statement as the scan reaches it
+typedef struct {
+    long long patient_id;
+    char name[100];
+    int64_t opening;        // cents owed before the period
+    int64_t charges;
+    int64_t payments;
+    int started;            // header written; the patient has activity
+} StatementAccount;
+
+static void statement_append(OutputBuffer *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length > 0) {
+        output_append(out, line, length < (int)sizeof(line) ? (size_t)length : sizeof(line) - 1);
+    }
+}
+
+static void statement_begin(const StatementWorker *worker, StatementAccount *account, OutputBuffer *out) {
+    char from[16], to[16], opening[32];
+    format_date(worker->first_day, from, sizeof(from));
+    format_date(worker->last_day, to, sizeof(to));
+    format_cents(opening, sizeof(opening), account->opening);
+    out->length = 0;
+    statement_append(out, "City General Hospital - Patient Statement\n");
+    statement_append(out, "Period:  %s to %s\n", from, to);
+    statement_append(out, "Patient: %s (ID: %lld)\n\n", account->name, account->patient_id);
+    statement_append(out, "%-52s %14s\n", "Opening balance", opening);
+    account->started = 1;
+}
+
+// Write the closing lines and the file; the account is then done
+static void statement_finish(StatementWorker *worker, StatementAccount *account, OutputBuffer *out) {
+    char charges[32], payments[32], closing[32], path[300];
+    format_cents(charges, sizeof(charges), account->charges);
+    format_cents(payments, sizeof(payments), -account->payments);
+    format_cents(closing, sizeof(closing), account->opening + account->charges - account->payments);
+    statement_append(out, "\n%-52s %14s\n", "Charges this period", charges);
+    statement_append(out, "%-52s %14s\n", "Payments this period", payments);
+    statement_append(out, "%-52s %14s\n", "Closing balance", closing);
+    
+    snprintf(path, sizeof(path), "%s/statement_%s_%lld.txt", worker->directory, worker->period, account->patient_id);
+    if (write_output_file(path, out)) {
+        worker->statements++;
+    } else {
+        worker->failed++;
+    }
+    worker->charges += account->charges;
+    worker->payments += account->payments;
+}
+
+// Walk the worker's patient range in one ordered scan, folding earlier
+// history into each opening balance and writing a statement for every
+// patient with a bill or payment in the period
+static void *statement_worker(void *arg) {
+    StatementWorker *worker = arg;
+    sqlite3 *conn;
+    sqlite3_stmt *stmt = NULL;
+    
+    if (sqlite3_open_v2(db_path, &conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        (worker->error = sqlite3_prepare_v2(conn, statement_scan_sql, -1, &stmt, 0)) != SQLITE_OK) {
+        if (worker->error == SQLITE_OK) worker->error = SQLITE_CANTOPEN;
+        sqlite3_close(conn);
+        return NULL;
+    }
+    sqlite3_busy_timeout(conn, 5000);
+    memory_budget_connection(conn);
+    query_watch_connection(conn);
+    sqlite3_bind_int64(stmt, 1, worker->first_patient);
+    sqlite3_bind_int64(stmt, 2, worker->last_patient);
+    sqlite3_bind_int64(stmt, 3, worker->last_day);
+    sqlite3_bind_int64(stmt, 4, (worker->last_day + 1 - JULIAN_DAY_UNIX_EPOCH) * SECONDS_PER_DAY);
+    
+    OutputBuffer out;
+    output_init(&out, -1);
+    StatementAccount account;
+    memset(&account, 0, sizeof(account));
+    int have_account = 0;
+    int rc;
+    
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        long long patient_id = sqlite3_column_int64(stmt, 0);
+        if (!have_account || patient_id != account.patient_id) {
+            if (have_account && account.started) statement_finish(worker, &account, &out);
+            memset(&account, 0, sizeof(account));
+            account.patient_id = patient_id;
+            snprintf(account.name, sizeof(account.name), "Unknown");
+            have_account = 1;
+        }
+        if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
+            snprintf(account.name, sizeof(account.name), "%s", (const char*)sqlite3_column_text(stmt, 5));
+        }
+        
+        int dated = sqlite3_column_type(stmt, 1) != SQLITE_NULL;
+        long long day = sqlite3_column_int64(stmt, 1);
+        int payment = sqlite3_column_int(stmt, 2);
+        int64_t cents = llround(sqlite3_column_double(stmt, 4) * 100.0);
+        if (!dated || day < worker->first_day) {
+            account.opening += payment ? -cents : cents;
+            continue;
+        }
+        
+        if (!account.started) statement_begin(worker, &account, &out);
+        char date[16], description[64], amount[32];
+        format_date(day, date, sizeof(date));
+        if (payment) {
+            const unsigned char *method = sqlite3_column_text(stmt, 6);
+            snprintf(description, sizeof(description), "Payment on bill %lld (%s)",
+                     sqlite3_column_int64(stmt, 3), method ? (const char*)method : "Unknown");
+            format_cents(amount, sizeof(amount), -cents);
+            account.payments += cents;
+        } else {
+            snprintf(description, sizeof(description), "Bill %lld", sqlite3_column_int64(stmt, 3));
+            format_cents(amount, sizeof(amount), cents);
+            account.charges += cents;
+        }
+        statement_append(&out, "%-10s  %-40s %14s\n", date, description, amount);
+    }
+    if (have_account && account.started) statement_finish(worker, &account, &out);
+    worker->error = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    
+    output_free(&out);
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
+    return NULL;
+}
+
+void statement_run() {
+    clear_screen();
+    print_header("MONTHLY PATIENT STATEMENTS");
+    
+    char text[16];
+    int year, month;
+    while (1) {
+        get_string("Statement month (YYYY-MM): ", text, sizeof(text));
+        char extra;
+        if (sscanf(text, "%4d-%2d%c", &year, &month, &extra) == 2 &&
+            year >= 1 && year <= 9999 && month >= 1 && month <= 12) break;
+        printf("Invalid month! Please use YYYY-MM.\n");
+    }
+    char directory[200];
+    get_string("Output directory (Enter for statements): ", directory, sizeof(directory));
+    if (directory[0] == '\0') {
+        strcpy(directory, "statements");
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "Worker threads (1-64, %ld CPUs): ", cpus > 0 ? cpus : 1);
+    int threads = get_integer(prompt, 1, 64);
+    
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        printf("❌ Cannot create directory %s: %s\n", directory, strerror(errno));
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    char period[16];
+    snprintf(period, sizeof(period), "%04d-%02d", year, month);
+    long long first_day = days_from_civil(year, month, 1) + JULIAN_DAY_UNIX_EPOCH;
+    long long last_day = (month == 12 ? days_from_civil(year + 1, 1, 1) : days_from_civil(year, month + 1, 1))
+                         + JULIAN_DAY_UNIX_EPOCH - 1;
+    double start = now_seconds();
+    
+    // The active patients only decide how the id range is split, so every
+    // thread gets about the same number of statements
+    long long *patients = NULL, count = 0, capacity = 0;
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, statement_patients_sql, -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, first_day);
+        sqlite3_bind_int64(stmt, 2, last_day);
+        sqlite3_bind_int64(stmt, 3, (first_day - JULIAN_DAY_UNIX_EPOCH) * SECONDS_PER_DAY);
+        sqlite3_bind_int64(stmt, 4, (last_day + 1 - JULIAN_DAY_UNIX_EPOCH) * SECONDS_PER_DAY);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 1024;
+                long long *grown = realloc(patients, capacity * sizeof(long long));
+                if (!grown) {
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+                patients = grown;
+            }
+            patients[count++] = sqlite3_column_int64(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        printf("Error selecting patients: %s\n", rc == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(db));
+        free(patients);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    if (count == 0) {
+        printf("\nNo patient activity in %s.\n", period);
+        free(patients);
+        printf("\nPress Enter to continue...");
+        getchar();
+        return;
+    }
+    
+    if (threads > count) {
+        threads = (int)count;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    StatementWorker *workers = calloc(threads, sizeof(StatementWorker));
+    int started = 0;
+    for (int i = 0; tids && workers && i < threads; i++) {
+        StatementWorker *worker = &workers[i];
+        worker->first_patient = patients[count * i / threads];
+        worker->last_patient = patients[count * (i + 1) / threads - 1];
+        worker->first_day = first_day;
+        worker->last_day = last_day;
+        worker->directory = directory;
+        worker->period = period;
+        if (pthread_create(&tids[i], NULL, statement_worker, worker) != 0) {
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    
+    long long statements = 0, failed = 0;
+    int64_t charges = 0, payments = 0;
+    int errors = started < threads;
+    for (int i = 0; i < started; i++) {
+        statements += workers[i].statements;
+        failed += workers[i].failed;
+        charges += workers[i].charges;
+        payments += workers[i].payments;
+        if (workers[i].error != SQLITE_OK) {
+            printf("❌ Patients %lld-%lld: %s\n", workers[i].first_patient, workers[i].last_patient,
+                   sqlite3_errstr(workers[i].error));
+            errors = 1;
+        }
+    }
+    
+    char charges_text[32], payments_text[32];
+    format_cents(charges_text, sizeof(charges_text), charges);
+    format_cents(payments_text, sizeof(payments_text), payments);
+    printf("\n%s %lld statements for %s written to %s/", errors ? "⚠️ " : "✅", statements, period, directory);
+    if (failed > 0) printf(" (%lld could not be written)", failed);
+    printf("\n   Patients active: %lld | Threads: %d\n", count, started);
+    printf("   Charges %s, payments %s in the period\n", charges_text, payments_text);
+    printf("   Time: %.2f s (%.0f statements/sec)\n", elapsed, elapsed > 0 ? statements / elapsed : (double)statements);
+    
+    free(tids);
+    free(workers);
+    free(patients);
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== LEDGER RECONCILIATION ====================
+
+// bills.amount_paid, balance_due and payment_status are maintained next to
+// the payments table and can drift from it (a crash between the two
+// writes, a hand edit). The reconciler checks every bill against
+// SUM(payments) from several reader threads, each claiming bill_no ranges,
+// and can write or apply repairs.
+
+#define RECONCILE_CHUNKS_PER_THREAD 16
+#define RECONCILE_BATCH_SIZE 1000
+#define RECONCILE_EXAMPLES 20
+
+static const char reconcile_scan_sql[] =
+    "SELECT b.bill_no, b.total_amount, b.amount_paid, b.balance_due, b.payment_status, "
+    "       (SELECT COALESCE(SUM(p.amount), 0) FROM payments p WHERE p.bill_no = b.bill_no) "
+    "FROM bills b WHERE b.bill_no BETWEEN ?1 AND ?2";
+
+// Recomputes a bill's ledger columns from its payments at the time it
+// runs, so applying it after a cashier has posted another payment is still
+// correct. The status rule is the one check_ledger_invariants enforces:
+// 'Paid' exactly when nothing is left to pay.
+#define RECONCILE_REPAIR_SQL(bill) \
+    "UPDATE bills SET amount_paid = t.paid, balance_due = bills.total_amount - t.paid, " \
+    "payment_status = CASE WHEN bills.total_amount - t.paid <= 0.005 THEN 'Paid' " \
+    "WHEN bills.payment_status IN ('Pending', 'Partial') THEN bills.payment_status " \
+    "WHEN t.paid > 0.005 THEN 'Partial' ELSE 'Pending' END " \
+    "FROM (SELECT COALESCE(SUM(amount), 0) AS paid FROM payments WHERE bill_no = " bill ") AS t " \
+    "WHERE bills.bill_no = " bill
+
+// What was wrong with a bill
+enum {
+    LEDGER_PAID = 1,        // amount_paid != SUM(payments)
+    LEDGER_BALANCE = 2,     // balance_due != total_amount - SUM(payments)
+    LEDGER_STATUS = 4       // payment_status disagrees with the balance
+};
+
+typedef struct {
+    long long bill_no;
+    int problems;           // LEDGER_* bits
+    double total, paid, balance, payments;
+    char status[12];
+    char expected_status[12];
+} LedgerDiscrepancy;
+
+typedef struct {
+    long long first_bill;
+    long long chunk_width;
+    int chunk_count;
+    int next_chunk;
+} ReconcileRun;
+
+typedef struct {
+    ReconcileRun *run;
+    LedgerDiscrepancy *found;
+    long long found_count;
+    long long found_capacity;
+    long long bills;
+    int error;
+} ReconcileWorker;
+
+// The status a bill should have: 'Paid' when settled; otherwise its
+// current Pending/Partial, or one derived from the payments if it claims
+// to be paid
+static const char *ledger_status(const char *status, double balance, double payments) {
+    if (balance <= 0.005) return "Paid";
+    if (strcmp(status, "Pending") == 0 || strcmp(status, "Partial") == 0) return status;
+    return payments > 0.005 ? "Partial" : "Pending";
+}
+
+static void *reconcile_worker(void *arg) {
+    ReconcileWorker *worker = arg;
+    ReconcileRun *run = worker->run;
+    sqlite3 *conn;
+    sqlite3_stmt *stmt = NULL;
+    
+    if (sqlite3_open_v2(db_path, &conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        (worker->error = sqlite3_prepare_v2(conn, reconcile_scan_sql, -1, &stmt, 0)) != SQLITE_OK) {
+        if (worker->error == SQLITE_OK) worker->error = SQLITE_CANTOPEN;
+        sqlite3_close(conn);
+        return NULL;
+    }
+    sqlite3_busy_timeout(conn, 5000);
+    memory_budget_connection(conn);
+    query_watch_connection(conn);
+    
+    while (!worker->error) {
+        int chunk = __sync_fetch_and_add(&run->next_chunk, 1);
+        if (chunk >= run->chunk_count) {
+            break;
+        }
+        long long first = run->first_bill + chunk * run->chunk_width;
+        sqlite3_bind_int64(stmt, 1, first);
+        sqlite3_bind_int64(stmt, 2, first + run->chunk_width - 1);
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            worker->bills++;
+            double total = sqlite3_column_double(stmt, 1);
+            double paid = sqlite3_column_double(stmt, 2);
+            double balance = sqlite3_column_double(stmt, 3);
+            const unsigned char *text = sqlite3_column_text(stmt, 4);
+            const char *status = text ? (const char*)text : "";
+            double payments = sqlite3_column_double(stmt, 5);
+            
+            const char *expected = ledger_status(status, total - payments, payments);
+            int problems = 0;
+            if (fabs(paid - payments) > 0.005) problems |= LEDGER_PAID;
+            if (fabs(balance - (total - payments)) > 0.005) problems |= LEDGER_BALANCE;
+            if (strcmp(status, expected) != 0) problems |= LEDGER_STATUS;
+            if (!problems) {
+                continue;
+            }
+            
+            if (worker->found_count == worker->found_capacity) {
+                long long capacity = worker->found_capacity ? worker->found_capacity * 2 : 256;
+                LedgerDiscrepancy *grown = realloc(worker->found, capacity * sizeof(LedgerDiscrepancy));
+                if (!grown) {
+                    rc = SQLITE_NOMEM;
+                    break;
+                }
+                worker->found = grown;
+                worker->found_capacity = capacity;
+            }
+            LedgerDiscrepancy *d = &worker->found[worker->found_count++];
+            d->bill_no = sqlite3_column_int64(stmt, 0);
+            d->problems = problems;
+            d->total = total;
+            d->paid = paid;
+            d->balance = balance;
+            d->payments = payments;
+            snprintf(d->status, sizeof(d->status), "%s", text ? status : "NULL");
+            snprintf(d->expected_status, sizeof(d->expected_status), "%s", expected);
+        }
+        if (rc != SQLITE_DONE) {
+            worker->error = rc;
+        }
+        sqlite3_reset(stmt);
+    }
+    
+    sqlite3_finalize(stmt);
+    sqlite3_close(conn);
+    return NULL;
+}
+
+static int compare_discrepancies(const void *a, const void *b) {
+    long long x = ((const LedgerDiscrepancy*)a)->bill_no, y = ((const LedgerDiscrepancy*)b)->bill_no;
+    return (x > y) - (x < y);
+}
+
+// Write a SQL script that repairs the given bills, in transactions of
+// RECONCILE_BATCH_SIZE, with the values found as comments
+static int write_repair_script(const char *path, const LedgerDiscrepancy *found, long long count) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return 0;
+    }
+    fprintf(file, "-- Ledger repairs: %lld bills. Each statement recomputes the bill from its payments.\n", count);
+    for (long long i = 0; i < count; i++) {
+        const LedgerDiscrepancy *d = &found[i];
+        if (i % RECONCILE_BATCH_SIZE == 0) {
+            fprintf(file, "%sBEGIN;\n", i > 0 ? "COMMIT;\n" : "");
+        }
+        fprintf(file, "-- bill %lld: total %.2f, paid %.2f, balance %.2f, status %s; payments %.2f\n",
+                d->bill_no, d->total, d->paid, d->balance, d->status, d->payments);
+        fprintf(file, RECONCILE_REPAIR_SQL("%1$lld") ";\n", d->bill_no);
+    }
+    if (count > 0) {
+        fprintf(file, "COMMIT;\n");
+    }
+    return fclose(file) == 0;
+}
+
+// Apply the repairs through conn in transactions of RECONCILE_BATCH_SIZE.
+// Returns an SQLite result code; *repaired counts bills updated.
+static int apply_repairs(sqlite3 *conn, const LedgerDiscrepancy *found, long long count, long long *repaired) {
+    sqlite3_stmt *stmt;
+    *repaired = 0;
+    int rc = sqlite3_prepare_v2(conn, RECONCILE_REPAIR_SQL("?1"), -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    for (long long i = 0; i < count && rc == SQLITE_OK; i += RECONCILE_BATCH_SIZE) {
+        rc = sqlite3_exec(conn, "BEGIN IMMEDIATE;", 0, 0, 0);
+        long long batch = 0;
+        for (long long j = i; j < count && j < i + RECONCILE_BATCH_SIZE && rc == SQLITE_OK; j++) {
+            sqlite3_bind_int64(stmt, 1, found[j].bill_no);
+            rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(conn);
+            batch += sqlite3_changes(conn);
+            sqlite3_reset(stmt);
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(conn, "COMMIT;", 0, 0, 0);
+        }
+        if (rc == SQLITE_OK) {
+            *repaired += batch;
+        } else {
+            sqlite3_exec(conn, "ROLLBACK;", 0, 0, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+// Check every bill in db_path against its payments with the given number
+// of reader threads, print a report, and optionally write a repair script
+// (repair_path) and/or apply the repairs through conn. Returns the number
+// of discrepancies left unrepaired, or -1 if the check itself failed.
+long long reconcile_ledger_run(sqlite3 *conn, int threads, const char *repair_path, int apply) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    double start = now_seconds();
+    
+    sqlite3_stmt *stmt;
+    long long first_bill = 0, last_bill = -1;
+    if (sqlite3_prepare_v2(conn, "SELECT MIN(bill_no), MAX(bill_no) FROM bills", -1, &stmt, 0) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        first_bill = sqlite3_column_int64(stmt, 0);
+        last_bill = sqlite3_column_int64(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+    
+    // Fixed-width bill_no ranges, several per thread so a thread that draws
+    // a dense range does not hold up the others
+    ReconcileRun run;
+    run.first_bill = first_bill;
+    run.chunk_count = last_bill >= first_bill ? threads * RECONCILE_CHUNKS_PER_THREAD : 0;
+    run.chunk_width = run.chunk_count ? (last_bill - first_bill) / run.chunk_count + 1 : 1;
+    run.next_chunk = 0;
+    
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    ReconcileWorker *workers = calloc(threads, sizeof(ReconcileWorker));
+    int started = 0;
+    for (int i = 0; tids && workers && i < threads; i++) {
+        workers[i].run = &run;
+        if (pthread_create(&tids[i], NULL, reconcile_worker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    
+    long long bills = 0, count = 0;
+    int error = started == 0 ? SQLITE_NOMEM : SQLITE_OK;
+    for (int i = 0; i < started; i++) {
+        bills += workers[i].bills;
+        count += workers[i].found_count;
+        if (workers[i].error != SQLITE_OK) error = workers[i].error;
+    }
+    LedgerDiscrepancy *found = count > 0 ? malloc(count * sizeof(LedgerDiscrepancy)) : NULL;
+    if (count > 0 && !found) error = SQLITE_NOMEM;
+    long long merged = 0;
+    for (int i = 0; i < started; i++) {
+        if (found) {
+            memcpy(found + merged, workers[i].found, workers[i].found_count * sizeof(LedgerDiscrepancy));
+            merged += workers[i].found_count;
+        }
+        free(workers[i].found);
+    }
+    free(tids);
+    free(workers);
+    double checked = now_seconds() - start;
+    
+    if (error != SQLITE_OK) {
+        printf("❌ Reconciliation failed: %s\n", sqlite3_errstr(error));
+        free(found);
+        return -1;
+    }
+    qsort(found, count, sizeof(LedgerDiscrepancy), compare_discrepancies);
+    
+    long long by_kind[3] = {0, 0, 0};
+    for (long long i = 0; i < count; i++) {
+        for (int k = 0; k < 3; k++) {
+            if (found[i].problems & (1 << k)) by_kind[k]++;
+        }
+    }
+    printf("Checked %lld bills with %d threads in %.2f s (%.0f bills/sec)\n", bills, started, checked,
+           checked > 0 ? bills / checked : (double)bills);
+    printf("  %-36s %lld\n", "amount_paid != SUM(payments)", by_kind[0]);
+    printf("  %-36s %lld\n", "balance_due != total - SUM(payments)", by_kind[1]);
+    printf("  %-36s %lld\n", "status does not match balance", by_kind[2]);
+    printf("  %-36s %lld\n", "bills needing repair", count);
+    for (long long i = 0; i < count && i < RECONCILE_EXAMPLES; i++) {
+        const LedgerDiscrepancy *d = &found[i];
+        printf("    #%lld total=%.2f paid=%.2f balance=%.2f status=%s payments=%.2f -> balance=%.2f status=%s\n",
+               d->bill_no, d->total, d->paid, d->balance, d->status, d->payments,
+               d->total - d->payments, d->expected_status);
+    }
+    if (count > RECONCILE_EXAMPLES) {
+        printf("    ... %lld more\n", count - RECONCILE_EXAMPLES);
+    }
+    
+    long long remaining = count;
+    if (repair_path && count > 0) {
+        if (write_repair_script(repair_path, found, count)) {
+            printf("Repair statements written to %s\n", repair_path);
+        } else {
+            printf("❌ Cannot write %s\n", repair_path);
+        }
+    }
+    if (apply && count > 0) {
+        long long repaired;
+        double apply_start = now_seconds();
+        int rc = apply_repairs(conn, found, count, &repaired);
+        printf("Repaired %lld bills in %.2f s%s%s\n", repaired, now_seconds() - apply_start,
+               rc == SQLITE_OK ? "" : "; stopped: ", rc == SQLITE_OK ? "" : sqlite3_errmsg(conn));
+        remaining = count - repaired;
+    }
+    printf("Total time %.2f s\n", now_seconds() - start);
+    free(found);
+    return remaining;
+}
+
+void reconcile_ledger() {
+    clear_screen();
+    print_header("LEDGER RECONCILIATION");
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "Worker threads (1-64, %ld CPUs): ", cpus > 0 ? cpus : 1);
+    int threads = get_integer(prompt, 1, 64);
+    printf("\n1. Report only\n");
+    printf("2. Report and write repair statements to a file\n");
+    printf("3. Report and apply repairs\n");
+    printf("Enter choice: ");
+    int mode = get_choice(1, 3);
+    
+    char repair_path[200] = "";
+    if (mode == 2) {
+        get_string("Repair SQL file (Enter for ledger_repairs.sql): ", repair_path, sizeof(repair_path));
+        if (repair_path[0] == '\0') {
+            strcpy(repair_path, "ledger_repairs.sql");
+        }
+    }
+    if (mode == 3 && !get_confirmation("Bills found out of balance will be rewritten from their payments. Continue? (y/n): ")) {
+        return;
+    }
+    
+    printf("\n");
+    reconcile_ledger_run(db, threads, mode == 2 ? repair_path : NULL, mode == 3);
+    printf("\nPress Enter to continue...");
+    getchar();
+}
+
+// ==================== ANALYTICS SNAPSHOT ====================
+
+enum {
+    SNAP_BILL_NO, SNAP_BILL_PATIENT, SNAP_BILL_DATE, SNAP_BILL_TOTAL, SNAP_BILL_PAID,
+    SNAP_BILL_BALANCE, SNAP_BILL_STATUS, SNAP_BILL_NAME,
+    SNAP_PAYMENT_ID, SNAP_PAYMENT_BILL, SNAP_PAYMENT_AMOUNT, SNAP_PAYMENT_DATE, SNAP_PAYMENT_METHOD,
+    SNAPSHOT_COLUMN_COUNT
+};
+
+static const struct {
+    const char *name;
+    uint32_t table;
+    ColumnType type;
+} snapshot_layout[SNAPSHOT_COLUMN_COUNT] = {
+    {"bill_no", 0, COLUMN_INT64}, {"patient_id", 0, COLUMN_INT64}, {"bill_date", 0, COLUMN_DAYS},
+    {"total_cents", 0, COLUMN_INT64}, {"paid_cents", 0, COLUMN_INT64},
+    {"balance_cents", 0, COLUMN_INT64}, {"payment_status", 0, COLUMN_STRING},
+    {"patient_name", 0, COLUMN_STRING},
+    {"payment_id", 1, COLUMN_INT64}, {"bill_no", 1, COLUMN_INT64}, {"amount_cents", 1, COLUMN_INT64},
+    {"payment_date", 1, COLUMN_DAYS}, {"payment_method", 1, COLUMN_STRING}
+};
+
+static size_t column_width(ColumnType type) {
+    return type == COLUMN_INT64 ? sizeof(int64_t) : sizeof(uint32_t);
+}
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc32_table[i] = c;
+    }
+}
+
+// Standard CRC-32 (as used by zip and PNG). Pass 0 to start a new checksum.
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc32_once, crc32_init);
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Distinct strings collected while writing a snapshot, with an
+// open-addressing index (power-of-two size, -1 = empty) like the charge
+// master's
+typedef struct {
+    char **strings;
+    uint32_t count;
+    uint32_t capacity;
+    int *slots;
+    uint32_t slot_count;
+    uint64_t text_bytes;
+} StringDictionary;
+
+static int dictionary_grow_index(StringDictionary *dict) {
+    uint32_t slot_count = dict->slot_count ? dict->slot_count * 2 : 1024;
+    int *slots = malloc(slot_count * sizeof(int));
+    if (!slots) return 0;
+    memset(slots, -1, slot_count * sizeof(int));
+    for (uint32_t i = 0; i < dict->count; i++) {
+        uint32_t slot = hash_code(dict->strings[i]) & (slot_count - 1);
+        while (slots[slot] >= 0) slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = i;
+    }
+    free(dict->slots);
+    dict->slots = slots;
+    dict->slot_count = slot_count;
+    return 1;
+}
+
+// Return the id of text, adding it on first sight. NULL maps to
+// SNAPSHOT_NULL_STRING, as does running out of memory.
+static uint32_t dictionary_intern(StringDictionary *dict, const char *text) {
+    if (!text) return SNAPSHOT_NULL_STRING;
+    if ((dict->count + 1) * 2 > dict->slot_count && !dictionary_grow_index(dict)) {
+        return SNAPSHOT_NULL_STRING;
+    }
+    uint32_t slot = hash_code(text) & (dict->slot_count - 1);
+    while (dict->slots[slot] >= 0) {
+        if (strcmp(dict->strings[dict->slots[slot]], text) == 0) {
+            return dict->slots[slot];
+        }
+        slot = (slot + 1) & (dict->slot_count - 1);
+    }
+    if (dict->count == dict->capacity) {
+        uint32_t capacity = dict->capacity ? dict->capacity * 2 : 256;
+        char **grown = realloc(dict->strings, capacity * sizeof(char*));
+        if (!grown) return SNAPSHOT_NULL_STRING;
+        dict->strings = grown;
+        dict->capacity = capacity;
+    }
+    char *copy = strdup(text);
+    if (!copy) return SNAPSHOT_NULL_STRING;
+    dict->strings[dict->count] = copy;
+    dict->slots[slot] = dict->count;
+    dict->text_bytes += strlen(text);
+    return dict->count++;
+}
+
+static void dictionary_free(StringDictionary *dict) {
+    for (uint32_t i = 0; i < dict->count; i++) free(dict->strings[i]);
+    free(dict->strings);
+    free(dict->slots);
+    memset(dict, 0, sizeof(*dict));
+}
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+static int write_padding(FILE *file, uint64_t from, uint64_t to) {
+    static const char zeros[SNAPSHOT_ALIGN];
+    return to == from || fwrite(zeros, 1, to - from, file) == to - from;
+}
+
+static long long count_rows(sqlite3 *conn, const char *sql) {
+    sqlite3_stmt *stmt;
+    long long count = -1;
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return count;
+}
+
+static int64_t to_cents(sqlite3_stmt *stmt, int column) {
+    return llround(sqlite3_column_double(stmt, column) * 100.0);
+}
+
+static int32_t to_days(sqlite3_stmt *stmt, int column) {
+    return sqlite3_column_type(stmt, column) == SQLITE_NULL ? SNAPSHOT_NO_DATE
+                                                            : sqlite3_column_int(stmt, column);
+}
+
+// Write bills and payments to path as a columnar snapshot. Both tables are
+// read inside one transaction so they agree with each other, and the file
+// is written beside path and renamed into place so readers never map a
+// partial file. Returns an SQLite result code (SQLITE_IOERR for file errors).
+int write_snapshot(sqlite3 *conn, const char *path, long long *bill_rows, long long *payment_rows) {
+    void *columns[SNAPSHOT_COLUMN_COUNT] = {0};
+    StringDictionary dict;
+    memset(&dict, 0, sizeof(dict));
+    int rc = sqlite3_exec(conn, "BEGIN", 0, 0, 0);
+    if (rc != SQLITE_OK) return rc;
+    
+    *bill_rows = count_rows(conn, "SELECT COUNT(*) FROM bills");
+    *payment_rows = count_rows(conn, "SELECT COUNT(*) FROM payments");
+    if (*bill_rows < 0 || *payment_rows < 0) {
+        rc = sqlite3_errcode(conn);
+        goto done;
+    }
+    for (int c = 0; c < SNAPSHOT_COLUMN_COUNT; c++) {
+        long long rows = snapshot_layout[c].table == 0 ? *bill_rows : *payment_rows;
+        columns[c] = malloc((rows ? rows : 1) * column_width(snapshot_layout[c].type));
+        if (!columns[c]) {
+            rc = SQLITE_NOMEM;
+            goto done;
+        }
+    }
+    
+    // Dates become whole days since the Unix epoch: Julian day numbers are
+    // shifted, Unix-second timestamps divided down
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(conn,
+        "SELECT bill_no, patient_id, bill_date - 2440588, "
+        "total_amount, amount_paid, balance_due, payment_status, patient_name "
+        "FROM bills ORDER BY bill_no", -1, &stmt, 0);
+    if (rc != SQLITE_OK) goto done;
+    long long row = 0;
+    while (row < *bill_rows && sqlite3_step(stmt) == SQLITE_ROW) {
+        ((int64_t*)columns[SNAP_BILL_NO])[row] = sqlite3_column_int64(stmt, 0);
+        ((int64_t*)columns[SNAP_BILL_PATIENT])[row] = sqlite3_column_int64(stmt, 1);
+        ((int32_t*)columns[SNAP_BILL_DATE])[row] = to_days(stmt, 2);
+        ((int64_t*)columns[SNAP_BILL_TOTAL])[row] = to_cents(stmt, 3);
+        ((int64_t*)columns[SNAP_BILL_PAID])[row] = to_cents(stmt, 4);
+        ((int64_t*)columns[SNAP_BILL_BALANCE])[row] = to_cents(stmt, 5);
+        ((uint32_t*)columns[SNAP_BILL_STATUS])[row] = dictionary_intern(&dict, (const char*)sqlite3_column_text(stmt, 6));
+        ((uint32_t*)columns[SNAP_BILL_NAME])[row] = dictionary_intern(&dict, (const char*)sqlite3_column_text(stmt, 7));
+        row++;
+    }
+    sqlite3_finalize(stmt);
+    
+    rc = sqlite3_prepare_v2(conn,
+        "SELECT payment_id, bill_no, amount, "
+        "payment_date / 86400, payment_method "
+        "FROM payments ORDER BY payment_id", -1, &stmt, 0);
+    if (rc != SQLITE_OK) goto done;
+    row = 0;
+    while (row < *payment_rows && sqlite3_step(stmt) == SQLITE_ROW) {
+        ((int64_t*)columns[SNAP_PAYMENT_ID])[row] = sqlite3_column_int64(stmt, 0);
+        ((int64_t*)columns[SNAP_PAYMENT_BILL])[row] = sqlite3_column_int64(stmt, 1);
+        ((int64_t*)columns[SNAP_PAYMENT_AMOUNT])[row] = to_cents(stmt, 2);
+        ((int32_t*)columns[SNAP_PAYMENT_DATE])[row] = to_days(stmt, 3);
+        ((uint32_t*)columns[SNAP_PAYMENT_METHOD])[row] = dictionary_intern(&dict, (const char*)sqlite3_column_text(stmt, 4));
+        row++;
+    }
+    sqlite3_finalize(stmt);
+    
+    // Lay out the file and checksum every section before writing anything
+    SnapshotHeader header;
+    SnapshotColumn directory[SNAPSHOT_COLUMN_COUNT];
+    memset(&header, 0, sizeof(header));
+    memset(directory, 0, sizeof(directory));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.endian_mark = SNAPSHOT_ENDIAN_MARK;
+    header.created_at = (int64_t)time(NULL);
+    header.bill_rows = *bill_rows;
+    header.payment_rows = *payment_rows;
+    header.column_count = SNAPSHOT_COLUMN_COUNT;
+    
+    uint64_t offset = sizeof(header) + sizeof(directory);
+    for (int c = 0; c < SNAPSHOT_COLUMN_COUNT; c++) {
+        uint64_t rows = snapshot_layout[c].table == 0 ? header.bill_rows : header.payment_rows;
+        snprintf(directory[c].name, sizeof(directory[c].name), "%s", snapshot_layout[c].name);
+        directory[c].table = snapshot_layout[c].table;
+        directory[c].type = snapshot_layout[c].type;
+        directory[c].offset = align_offset(offset);
+        directory[c].length = rows * column_width(snapshot_layout[c].type);
+        directory[c].checksum = crc32_update(0, columns[c], directory[c].length);
+        offset = directory[c].offset + directory[c].length;
+    }
+    
+    uint32_t *text_offsets = malloc((dict.count + 1) * sizeof(uint32_t));
+    if (!text_offsets) {
+        rc = SQLITE_NOMEM;
+        goto done;
+    }
+    uint32_t text_offset = 0;
+    for (uint32_t i = 0; i < dict.count; i++) {
+        text_offsets[i] = text_offset;
+        text_offset += strlen(dict.strings[i]);
+    }
+    text_offsets[dict.count] = text_offset;
+    
+    header.dictionary_count = dict.count;
+    header.dictionary_offset = align_offset(offset);
+    header.dictionary_length = (dict.count + 1) * sizeof(uint32_t) + dict.text_bytes;
+    header.dictionary_checksum = crc32_update(0, text_offsets, (dict.count + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < dict.count; i++) {
+        header.dictionary_checksum = crc32_update(header.dictionary_checksum, dict.strings[i], strlen(dict.strings[i]));
+    }
+    header.header_checksum = crc32_update(crc32_update(0, &header, sizeof(header)), directory, sizeof(directory));
+    
+    char temp_path[512];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *file = fopen(temp_path, "wb");
+    int ok = file != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(directory, sizeof(directory), 1, file) == 1;
+        offset = sizeof(header) + sizeof(directory);
+        for (int c = 0; ok && c < SNAPSHOT_COLUMN_COUNT; c++) {
+            ok = write_padding(file, offset, directory[c].offset) &&
+                 fwrite(columns[c], 1, directory[c].length, file) == directory[c].length;
+            offset = directory[c].offset + directory[c].length;
+        }
+        ok = ok && write_padding(file, offset, header.dictionary_offset) &&
+             fwrite(text_offsets, sizeof(uint32_t), dict.count + 1, file) == dict.count + 1;
+        for (uint32_t i = 0; ok && i < dict.count; i++) {
+            size_t length = strlen(dict.strings[i]);
+            ok = fwrite(dict.strings[i], 1, length, file) == length;
+        }
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(temp_path, path) == 0;
+        if (!ok) remove(temp_path);
+    }
+    free(text_offsets);
+    rc = ok ? SQLITE_OK : SQLITE_IOERR;
+    
+done:
+    sqlite3_exec(conn, "COMMIT", 0, 0, 0);
+    for (int c = 0; c < SNAPSHOT_COLUMN_COUNT; c++) free(columns[c]);
+    dictionary_free(&dict);
+    return rc;
+}
+
+// Map a snapshot and check its header, directory bounds and every checksum.
+// Returns 1 on success; on failure describes the problem in error.
+int snapshot_open(SnapshotReader *reader, const char *path, char *error, size_t error_size) {
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        snprintf(error, error_size, "cannot open %s", path);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    if ((size_t)st.st_size < sizeof(SnapshotHeader)) {
+        snprintf(error, error_size, "file too small");
+        close(fd);
+        return 0;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        snprintf(error, error_size, "mmap failed");
+        return 0;
+    }
+    reader->base = base;
+    reader->size = st.st_size;
+    reader->header = base;
+    
+    const SnapshotHeader *header = reader->header;
+    const char *problem = NULL;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        problem = "not a snapshot file";
+    } else if (header->endian_mark != SNAPSHOT_ENDIAN_MARK) {
+        problem = "written on a machine with different byte order";
+    } else if (header->version != SNAPSHOT_VERSION) {
+        problem = "unsupported snapshot version";
+    } else if (header->column_count > 1024 ||
+               sizeof(SnapshotHeader) + header->column_count * sizeof(SnapshotColumn) > reader->size) {
+        problem = "truncated column directory";
+    }
+    
+    if (!problem) {
+        reader->columns = (const SnapshotColumn*)(reader->base + sizeof(SnapshotHeader));
+        SnapshotHeader copy = *header;
+        copy.header_checksum = 0;
+        uint32_t crc = crc32_update(crc32_update(0, &copy, sizeof(copy)), reader->columns,
+                                    header->column_count * sizeof(SnapshotColumn));
+        if (crc != header->header_checksum) problem = "header checksum mismatch";
+    }
+    for (uint32_t c = 0; !problem && c < header->column_count; c++) {
+        const SnapshotColumn *column = &reader->columns[c];
+        uint64_t rows = column->table == 0 ? header->bill_rows : header->payment_rows;
+        if (column->type > COLUMN_STRING || column->offset % SNAPSHOT_ALIGN != 0 ||
+            column->length != rows * column_width(column->type) ||
+            column->offset > reader->size || column->length > reader->size - column->offset) {
+            problem = "column out of bounds";
+        } else if (crc32_update(0, reader->base + column->offset, column->length) != column->checksum) {
+            problem = "column checksum mismatch";
+        }
+    }
+    if (!problem) {
+        uint64_t index_bytes = ((uint64_t)header->dictionary_count + 1) * sizeof(uint32_t);
+        if (header->dictionary_offset % sizeof(uint32_t) != 0 || header->dictionary_offset > reader->size ||
+            header->dictionary_length > reader->size - header->dictionary_offset ||
+            index_bytes > header->dictionary_length) {
+            problem = "dictionary out of bounds";
+        } else if (crc32_update(0, reader->base + header->dictionary_offset, header->dictionary_length) !=
+                   header->dictionary_checksum) {
+            problem = "dictionary checksum mismatch";
+        } else {
+            reader->dictionary_offsets = (const uint32_t*)(reader->base + header->dictionary_offset);
+            reader->dictionary_text = (const char*)(reader->base + header->dictionary_offset + index_bytes);
+            uint64_t text_bytes = header->dictionary_length - index_bytes;
+            for (uint32_t i = 0; i < header->dictionary_count; i++) {
+                if (reader->dictionary_offsets[i] > reader->dictionary_offsets[i + 1] ||
+                    reader->dictionary_offsets[i + 1] > text_bytes) {
+                    problem = "corrupt dictionary index";
+                    break;
+                }
+            }
+        }
+    }
+    
+    if (problem) {
+        snprintf(error, error_size, "%s", problem);
+        snapshot_close(reader);
+        return 0;
+    }
+    return 1;
+}
+
+void snapshot_close(SnapshotReader *reader) {
+    if (reader->base) {
+        munmap((void*)reader->base, reader->size);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+// Find a column by table and name, checking its type
+static const void *snapshot_column(const SnapshotReader *reader, uint32_t table, const char *name, ColumnType type) {
+    for (uint32_t c = 0; c < reader->header->column_count; c++) {
+        const SnapshotColumn *column = &reader->columns[c];
+        if (column->table == table && column->type == (uint32_t)type &&
+            strncmp(column->name, name, sizeof(column->name)) == 0) {
+            return reader->base + column->offset;
+        }
+    }
+    return NULL;
+}
+
+static void snapshot_string(const SnapshotReader *reader, uint32_t id, const char **text, int *length) {
+    if (id >= reader->header->dictionary_count) {
+        *text = "(none)";
+        *length = 6;
+        return;
+    }
+    *text = reader->dictionary_text + reader->dictionary_offsets[id];
+    *length = reader->dictionary_offsets[id + 1] - reader->dictionary_offsets[id];
+}
+
+// The aggregate loops below are written with independent accumulators and
+// no branches in the body so the compiler can vectorize them.
+static int64_t sum_int64(const int64_t *restrict values, uint64_t count) {
+    int64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        a0 += values[i];
+        a1 += values[i + 1];
+        a2 += values[i + 2];
+        a3 += values[i + 3];
+    }
+    for (; i < count; i++) a0 += values[i];
+    return a0 + a1 + a2 + a3;
+}
+
+static uint64_t count_positive(const int64_t *restrict values, uint64_t count) {
+    uint64_t n0 = 0, n1 = 0, n2 = 0, n3 = 0;
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        n0 += values[i] > 0;
+        n1 += values[i + 1] > 0;
+        n2 += values[i + 2] > 0;
+        n3 += values[i + 3] > 0;
+    }
+    for (; i < count; i++) n0 += values[i] > 0;
+    return n0 + n1 + n2 + n3;
+}
+
+// Sum values grouped by dictionary id into sums/counts (dictionary_count + 1
+// slots, the last one collecting missing strings)
+static void sum_by_string(const uint32_t *restrict ids, const int64_t *restrict values, uint64_t count,
+                          uint32_t dictionary_count, int64_t *sums, uint64_t *counts) {
+    for (uint64_t i = 0; i < count; i++) {
+        uint32_t id = ids[i] < dictionary_count ? ids[i] : dictionary_count;
+        sums[id] += values[i];
+        counts[id]++;
+    }
+}
+
+static void print_cents(const char *label, int64_t cents) {
+    int64_t magnitude = cents < 0 ? -cents : cents;
+    printf("  %-22s %s$%lld.%02lld\n", label, cents < 0 ? "-" : "",
+           (long long)(magnitude / 100), (long long)(magnitude % 100));
+}
+
+static void print_group(const SnapshotReader *reader, const char *title, const int64_t *sums,
+                        const uint64_t *counts, uint32_t dictionary_count) {
+    printf("\n%s\n", title);
+    for (uint32_t id = 0; id <= dictionary_count; id++) {
+        if (counts[id] == 0) continue;
+        const char *text;
+        int length;
+        snapshot_string(reader, id, &text, &length);
+        char label[64];
+        snprintf(label, sizeof(label), "%.*s (%llu)", length > 40 ? 40 : length, text,
+                 (unsigned long long)counts[id]);
+        print_cents(label, sums[id]);
+    }
+}
+
+// Summarize a snapshot straight from the mapped columns: billed, collected
+// and outstanding totals, balances by status, collections by method and by
+// month. Nothing is parsed or copied.
+int run_snapshot_report(const char *path) {
+    SnapshotReader reader;
+    char error[128];
+    if (!snapshot_open(&reader, path, error, sizeof(error))) {
+        fprintf(stderr, "Cannot read snapshot %s: %s\n", path, error);
+        return 1;
+    }
+    const SnapshotHeader *header = reader.header;
+    const int64_t *totals = snapshot_column(&reader, 0, "total_cents", COLUMN_INT64);
+    const int64_t *paid = snapshot_column(&reader, 0, "paid_cents", COLUMN_INT64);
+    const int64_t *balances = snapshot_column(&reader, 0, "balance_cents", COLUMN_INT64);
+    const uint32_t *statuses = snapshot_column(&reader, 0, "payment_status", COLUMN_STRING);
+    const int64_t *amounts = snapshot_column(&reader, 1, "amount_cents", COLUMN_INT64);
+    const int32_t *payment_days = snapshot_column(&reader, 1, "payment_date", COLUMN_DAYS);
+    const uint32_t *methods = snapshot_column(&reader, 1, "payment_method", COLUMN_STRING);
+    if (!totals || !paid || !balances || !statuses || !amounts || !payment_days || !methods) {
+        fprintf(stderr, "Snapshot %s is missing required columns\n", path);
+        snapshot_close(&reader);
+        return 1;
+    }
+    
+    double started = now_seconds();
+    uint32_t groups = header->dictionary_count + 1;
+    int64_t *sums = calloc(groups, sizeof(int64_t));
+    uint64_t *counts = calloc(groups, sizeof(uint64_t));
+    if (!sums || !counts) {
+        fprintf(stderr, "Out of memory\n");
+        free(sums);
+        free(counts);
+        snapshot_close(&reader);
+        return 1;
+    }
+    
+    time_t created = (time_t)header->created_at;
+    char created_text[32];
+    strftime(created_text, sizeof(created_text), "%Y-%m-%d %H:%M:%S", localtime(&created));
+    printf("Snapshot %s taken %s\n", path, created_text);
+    printf("  %llu bills, %llu payments, %u distinct strings\n",
+           (unsigned long long)header->bill_rows, (unsigned long long)header->payment_rows,
+           header->dictionary_count);
+    
+    printf("\nTotals\n");
+    print_cents("Billed", sum_int64(totals, header->bill_rows));
+    print_cents("Paid on bills", sum_int64(paid, header->bill_rows));
+    print_cents("Outstanding", sum_int64(balances, header->bill_rows));
+    print_cents("Payments received", sum_int64(amounts, header->payment_rows));
+    printf("  %-22s %llu\n", "Bills with a balance", (unsigned long long)count_positive(balances, header->bill_rows));
+    
+    sum_by_string(statuses, balances, header->bill_rows, header->dictionary_count, sums, counts);
+    print_group(&reader, "Outstanding by status (bills)", sums, counts, header->dictionary_count);
+    
+    memset(sums, 0, groups * sizeof(int64_t));
+    memset(counts, 0, groups * sizeof(uint64_t));
+    sum_by_string(methods, amounts, header->payment_rows, header->dictionary_count, sums, counts);
+    print_group(&reader, "Collections by method (payments)", sums, counts, header->dictionary_count);
+    
+    // Collections per month: find the day range, then bucket by year*12+month
+    int32_t first_day = INT32_MAX, last_day = INT32_MIN;
+    for (uint64_t i = 0; i < header->payment_rows; i++) {
+        int32_t d = payment_days[i];
+        if (d == SNAPSHOT_NO_DATE) continue;
+        first_day = d < first_day ? d : first_day;
+        last_day = d > last_day ? d : last_day;
+    }
+    if (first_day <= last_day) {
+        int year, month, day;
+        civil_from_days(first_day, &year, &month, &day);
+        int first_month = year * 12 + month - 1;
+        civil_from_days(last_day, &year, &month, &day);
+        int month_count = year * 12 + month - first_month;
+        int64_t *monthly = calloc(month_count, sizeof(int64_t));
+        if (monthly) {
+            for (uint64_t i = 0; i < header->payment_rows; i++) {
+                if (payment_days[i] == SNAPSHOT_NO_DATE) continue;
+                civil_from_days(payment_days[i], &year, &month, &day);
+                monthly[year * 12 + month - 1 - first_month] += amounts[i];
+            }
+            printf("\nCollections by month\n");
+            for (int m = 0; m < month_count; m++) {
+                if (monthly[m] == 0) continue;
+                char label[16];
+                snprintf(label, sizeof(label), "%04d-%02d", (first_month + m) / 12, (first_month + m) % 12 + 1);
+                print_cents(label, monthly[m]);
+            }
+            free(monthly);
+        }
+    }
+    
+    printf("\nComputed in %.3f ms\n", (now_seconds() - started) * 1000.0);
+    free(sums);
+    free(counts);
+    snapshot_close(&reader);
+    return 0;
+}
+
+// ==================== BACKGROUND JOBS ====================
+
+// Runs on the worker thread. Writes the job's output and a one-line
+// result; returns 1 on success.
+static int run_job(Job *job, sqlite3 *conn, char *result, size_t size) {
+    if (job->kind == JOB_REPORT) {
+        mkdir("reports", 0755);
+        int fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        FILE *out = fd >= 0 ? fdopen(fd, "a") : NULL;
+        if (!out) {
+            if (fd >= 0) close(fd);
+            snprintf(result, size, "Cannot create %s", job->output);
+            return 0;
+        }
+        time_t now = time(NULL);
+        struct tm tm;
+        char generated[32];
+        localtime_r(&now, &tm);
+        strftime(generated, sizeof(generated), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(out, "%s\nGenerated %s\n", job->title, generated);
+        write_report(out, conn, &job->report);
+        int failed = fclose(out) != 0;
+        if (job->cancel || failed) {
+            unlink(job->output);
+            snprintf(result, size, "%s", failed ? "Write failed" : "Cancelled");
+            return 0;
+        }
+        snprintf(result, size, "Report in %s", job->output);
+        return 1;
+    }
+    
+    if (job->kind == JOB_EXPORT) {
+        int fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            snprintf(result, size, "Cannot create %s", job->output);
+            return 0;
+        }
+        OutputBuffer out;
+        output_init(&out, fd);
+        if (job->format == EXPORT_CSV) {
+            output_append(&out, "\xEF\xBB\xBF", 3);
+        }
+        long long rows;
+        int rc = export_table(conn, job->table, job->format, &out, &rows);
+        output_free(&out);
+        close(fd);
+        if (job->cancel) {
+            unlink(job->output);
+            snprintf(result, size, "Cancelled");
+            return 0;
+        }
+        if (rc != SQLITE_OK) {
+            snprintf(result, size, "%s", rc == SQLITE_IOERR ? "Write failed" : sqlite3_errmsg(conn));
+            return 0;
+        }
+        snprintf(result, size, "%lld rows to %s", rows, job->output);
+        return 1;
+    }
+    
+    if (job->kind == JOB_SNAPSHOT) {
+        long long bill_rows, payment_rows;
+        int rc = write_snapshot(conn, job->output, &bill_rows, &payment_rows);
+        if (job->cancel) {
+            unlink(job->output);
+            snprintf(result, size, "Cancelled");
+            return 0;
+        }
+        if (rc != SQLITE_OK) {
+            snprintf(result, size, "%s", rc == SQLITE_IOERR ? "Write failed" : sqlite3_errmsg(conn));
+            return 0;
+        }
+        snprintf(result, size, "%lld bills, %lld payments to %s", bill_rows, payment_rows, job->output);
+        return 1;
+    }
+    
+    // Backup. The copy runs inside one read transaction, so it is a
+    // consistent snapshot however much is committed meanwhile, and it is
+    // copied in slices so a cancel takes effect between them.
+    mkdir("backups", 0755);
+    sqlite3 *dest;
+    int rc = sqlite3_open(job->output, &dest);
+    sqlite3_backup *backup = rc == SQLITE_OK ? sqlite3_backup_init(dest, "main", conn, "main") : NULL;
+    if (!backup) {
+        snprintf(result, size, "Cannot create %s: %s", job->output, sqlite3_errmsg(dest));
+        sqlite3_close(dest);
+        unlink(job->output);
+        return 0;
+    }
+    sqlite3_exec(conn, "BEGIN; SELECT COUNT(*) FROM sqlite_master", 0, 0, 0);
+    do {
+        rc = sqlite3_backup_step(backup, BACKUP_STEP_PAGES);
+        if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+            sqlite3_sleep(BACKUP_RETRY_MS);
+        }
+    } while ((rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) && !job->cancel);
+    int pages = sqlite3_backup_pagecount(backup);
+    sqlite3_backup_finish(backup);
+    sqlite3_exec(conn, "COMMIT", 0, 0, 0);
+    rc = rc == SQLITE_DONE ? sqlite3_errcode(dest) : rc;
+    sqlite3_close(dest);
+    if (rc != SQLITE_OK || job->cancel) {
+        unlink(job->output);
+        snprintf(result, size, "%s", job->cancel ? "Cancelled" : sqlite3_errstr(rc));
+        return 0;
+    }
+    snprintf(result, size, "%d pages to %s", pages, job->output);
+    return 1;
+}
+
+static Job *next_queued_job(JobQueue *queue) {
+    for (Job *job = queue->head; job; job = job->next) {
+        if (job->state == JOB_QUEUED) return job;
+    }
+    return NULL;
+}
+
+static void *job_worker(void *arg) {
+    JobQueue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        Job *job = next_queued_job(queue);
+        if (!job) {
+            // Close as soon as the queue drains, in the same locked section
+            // that finished the last job: once jobs_pending() is 0 nothing
+            // holds the old file or its WAL open, which restore relies on
+            if (queue->conn) {
+                sqlite3_close(queue->conn);
+                queue->conn = NULL;
+            }
+            if (queue->stopping) break;
+            pthread_cond_wait(&queue->wake, &queue->lock);
+            continue;
+        }
+        job->state = JOB_RUNNING;
+        job->started_at = now_seconds();
+        
+        if (!queue->conn) {
+            if (sqlite3_open_v2(db_path, &queue->conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+                sqlite3_close(queue->conn);
+                queue->conn = NULL;
+            } else {
+                sqlite3_busy_timeout(queue->conn, 5000);
+                memory_budget_connection(queue->conn);
+            }
+        }
+        sqlite3 *conn = queue->conn;
+        pthread_mutex_unlock(&queue->lock);
+        
+        // Report code reads the thread's connection through db
+        db = conn;
+        char result[sizeof(job->result)];
+        int ok = 0;
+        if (conn) {
+            ok = run_job(job, conn, result, sizeof(result));
+        } else {
+            snprintf(result, sizeof(result), "Cannot open %s", db_path);
+        }
+        
+        pthread_mutex_lock(&queue->lock);
+        job->state = ok ? JOB_DONE : job->cancel ? JOB_CANCELLED : JOB_FAILED;
+        snprintf(job->result, sizeof(job->result), "%s", result);
+        job->finished_at = now_seconds();
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// Queue a copy of request. The first job starts the worker and puts the
+// database in WAL mode, where the worker's reads and the menu's writes do
+// not block each other. Returns the job id, or 0 if it could not be queued.
+int job_submit(const Job *request) {
+    JobQueue *queue = &job_queue;
+    Job *job = malloc(sizeof(Job));
+    if (!job) {
+        return 0;
+    }
+    *job = *request;
+    job->state = JOB_QUEUED;
+    job->queued_at = now_seconds();
+    job->next = NULL;
+    
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->started) {
+        sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0);
+        queue->stopping = 0;
+        if (pthread_create(&queue->thread, NULL, job_worker, queue) != 0) {
+            pthread_mutex_unlock(&queue->lock);
+            free(job);
+            return 0;
+        }
+        queue->started = 1;
+    }
+    job->id = ++queue->next_id;
+    if (job->kind == JOB_REPORT) {
+        snprintf(job->output, sizeof(job->output), "reports/job%d_%s.txt", job->id,
+                 job->report.type == REPORT_STATISTICS ? "statistics" : "report");
+    } else if (job->kind == JOB_BACKUP) {
+        time_t t = time(NULL);
+        struct tm tm;
+        char stamp[32];
+        localtime_r(&t, &tm);
+        strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+        snprintf(job->output, sizeof(job->output), "backups/backup_%s_job%d.db", stamp, job->id);
+    }
+    if (queue->tail) queue->tail->next = job; else queue->head = job;
+    queue->tail = job;
+    pthread_cond_signal(&queue->wake);
+    int id = job->id;
+    pthread_mutex_unlock(&queue->lock);
+    return id;
+}
+
+// Jobs queued or running
+int jobs_pending() {
+    JobQueue *queue = &job_queue;
+    int count = 0;
+    pthread_mutex_lock(&queue->lock);
+    for (Job *job = queue->head; job; job = job->next) {
+        count += job->state == JOB_QUEUED || job->state == JOB_RUNNING;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+// Jobs finished since the jobs screen was last shown
+int jobs_unseen() {
+    JobQueue *queue = &job_queue;
+    int count = 0;
+    pthread_mutex_lock(&queue->lock);
+    for (Job *job = queue->head; job; job = job->next) {
+        count += job->state >= JOB_DONE && !job->seen;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+// Let queued and running jobs finish, then stop the worker
+void jobs_stop() {
+    JobQueue *queue = &job_queue;
+    if (!queue->started) {
+        return;
+    }
+    int pending = jobs_pending();
+    if (pending > 0) {
+        printf("Waiting for %d background job(s) to finish...\n", pending);
+        fflush(stdout);
+    }
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_join(queue->thread, NULL);
+    queue->started = 0;
+    
+    // The worker's read-only connection cannot remove the WAL files. A
+    // checkpoint here attaches the WAL to db, whose close then cleans up.
+    // Not while archiving: only the archiver checkpoints, or frames other
+    // programs committed since our last commit would be lost unarchived.
+    if (db && !wal_archive.active) {
+        sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+    }
+
+    while (queue->head) {
+        Job *next = queue->head->next;
+        free(queue->head);
+        queue->head = next;
+    }
+    queue->tail = NULL;
+}
+
+static void show_job_output(const Job *job) {
+    FILE *file = fopen(job->output, "r");
+    if (!file) {
+        printf("Cannot open %s\n", job->output);
+        return;
+    }
+    char buffer[64 * 1024];
+    size_t n;
+    fflush(stdout);
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        fwrite(buffer, 1, n, stdout);
+    }
+    fclose(file);
+}
+
+void background_jobs() {
+    JobQueue *queue = &job_queue;
+    while (1) {
+        clear_screen();
+        print_header("BACKGROUND JOBS");
+        
+        static const TableColumn columns[] = {
+            {"Job", 0, 1}, {"Task", 28, 0}, {"State", 0, 0}, {"Time", 0, 1}, {"Result", 50, 0}
+        };
+        TableRenderer table;
+        table_begin(&table, columns, 5);
+        // Copy the jobs under the lock and render without it: the pager
+        // waits on stdin, and the worker needs the lock to finish a job
+        pthread_mutex_lock(&queue->lock);
+        int count = 0;
+        for (Job *job = queue->head; job; job = job->next) count++;
+        Job *jobs = count > 0 ? malloc(count * sizeof(Job)) : NULL;
+        int copied = 0;
+        for (Job *job = queue->head; jobs && job; job = job->next) {
+            jobs[copied++] = *job;
+            if (job->state >= JOB_DONE) job->seen = 1;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        double now = now_seconds();
+        for (int i = 0; i < copied && !table.stopped; i++) {
+            const Job *job = &jobs[i];
+            char id[16], elapsed[24];
+            snprintf(id, sizeof(id), "%d", job->id);
+            double seconds = job->state == JOB_QUEUED ? now - job->queued_at :
+                             job->state == JOB_RUNNING ? now - job->started_at :
+                             job->finished_at - job->started_at;
+            snprintf(elapsed, sizeof(elapsed), "%.1f s", seconds);
+            const char *cells[5] = {id, job->title, job_state_names[job->state], elapsed,
+                                    job->state >= JOB_DONE ? job->result : job->output};
+            table_row(&table, cells);
+        }
+        free(jobs);
+        if (table.rows == 0) {
+            printf("No background jobs in this session. Reports, statistics, exports and\n");
+            printf("backups offer to run in the background when started from the menu.\n");
+        }
+        table_end(&table);
+        
+        printf("\n1. Refresh\n");
+        printf("2. Show a finished report\n");
+        printf("3. Cancel a job\n");
+        printf("Enter choice: ");
+        int choice = get_choice(1, 3);
+        if (choice == 0) {
+            return;
+        }
+        if (choice == 1) {
+            continue;
+        }
+        
+        int id = (int)get_id("Job number: ", 1);
+        pthread_mutex_lock(&queue->lock);
+        Job *job = queue->head;
+        while (job && job->id != id) job = job->next;
+        Job copy;
+        memset(&copy, 0, sizeof(copy));
+        if (job) {
+            if (choice == 3 && job->state == JOB_QUEUED) {
+                job->state = JOB_CANCELLED;
+                snprintf(job->result, sizeof(job->result), "Cancelled before it started");
+                job->finished_at = job->started_at = now_seconds();
+            } else if (choice == 3 && job->state == JOB_RUNNING) {
+                job->cancel = 1;
+                if (queue->conn) sqlite3_interrupt(queue->conn);
+            }
+            copy = *job;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        
+        if (!job) {
+            printf("No job #%d.\n", id);
+        } else if (choice == 3 && copy.state == JOB_RUNNING) {
+            printf("Stopping job #%d.\n", id);
+        } else if (choice == 3 && copy.state == JOB_CANCELLED) {
+            printf("Job #%d cancelled.\n", id);
+        } else if (choice == 3) {
+            printf("Job #%d has already finished.\n", id);
+        } else if (copy.kind != JOB_REPORT || copy.state != JOB_DONE) {
+            printf("Job #%d has no finished report to show.\n", id);
+        } else {
+            clear_screen();
+            show_job_output(&copy);
+        }
+        printf("\nPress Enter to continue...");
+        getchar();
+    }
+}
+
+// ==================== SESSION RECORDING AND REPLAY ====================
+
+// Recorder state (interactive session, main thread only)
+static FILE *trace_file = NULL;
+static double trace_start = 0;
+static int trace_choice = 0;
+static char trace_line[16384];
+static size_t trace_length = 0;
+
+// Replay state: the operation a worker thread is currently feeding to the
+// menu functions, and how far through its inputs it is
+static __thread const TraceOp *script_op = NULL;
+static __thread int script_position = 0;
+static long long script_divergences = 0;
+
+// SQLite errors observed while replaying, by primary result code
+static long long replay_busy_errors = 0;
+static long long replay_locked_errors = 0;
+static long long replay_other_errors = 0;
+
+static const char *replay_op_names[MENU_MAX_CHOICE + 1] = {
+    "", "add_patient", "view_patients", "search_patient", "update_patient",
+    "delete_patient", "generate_bill", "view_bills", "search_bill",
+    "make_payment", "view_payment_history", "print_receipt",
+    "generate_report", "view_statistics", "backup_database",
+    "restore_database", "export_data", "import_charge_master",
+    "import_remittances", "batch_billing_run", "batch_print_receipts",
+    "statement_run", "reconcile_ledger", "memory_statistics", "background_jobs"
+};
+
+int open_trace(const char *path) {
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        return 0;
+    }
+    fprintf(trace_file, "# hospital_billing session trace v1\n");
+    trace_start = now_seconds();
+    return 1;
+}
+
+void close_trace() {
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+void trace_begin(int choice) {
+    if (!trace_file) {
+        return;
+    }
+    trace_choice = choice;
+    trace_length = snprintf(trace_line, sizeof(trace_line), "%.3f\t%d",
+                            now_seconds() - trace_start, choice);
+}
+
+// Append one accepted input to the current operation. Tabs, newlines and
+// backslashes are escaped so every operation stays on a single line.
+void trace_input(char type, const char *value) {
+    if (!trace_file || !trace_choice) {
+        return;
+    }
+    
+    if (trace_length + 3 >= sizeof(trace_line)) {
+        return;
+    }
+    trace_line[trace_length++] = '\t';
+    trace_line[trace_length++] = type;
+    
+    for (const char *c = value; *c && trace_length + 2 < sizeof(trace_line); c++) {
+        switch (*c) {
+            case '\t': trace_line[trace_length++] = '\\'; trace_line[trace_length++] = 't'; break;
+            case '\n': trace_line[trace_length++] = '\\'; trace_line[trace_length++] = 'n'; break;
+            case '\\': trace_line[trace_length++] = '\\'; trace_line[trace_length++] = '\\'; break;
+            default:   trace_line[trace_length++] = *c; break;
+        }
+    }
+    trace_line[trace_length] = '\0';
+}
+
+void trace_end() {
+    if (!trace_file || !trace_choice) {
+        return;
+    }
+    fprintf(trace_file, "%s\n", trace_line);
+    fflush(trace_file);
+    trace_choice = 0;
+}
+
+// "Run in the background?" only decides where an operation runs, so the
+// answer is kept out of the trace and a replay always runs it in the
+// foreground; traces recorded before the question existed still line up
+int confirm_background() {
+    if (script_op) {
+        return 0;
+    }
+    int choice = trace_choice;
+    trace_choice = 0;
+    int answer = get_confirmation("Run in the background? (y/n): ");
+    trace_choice = choice;
+    return answer;
+}
+
+static int script_input(char type, const char **value) {
+    if (!script_op) {
+        return 0;
+    }
+    
+    *value = NULL;
+    if (script_position < script_op->input_count) {
+        const char *input = script_op->inputs[script_position];
+        if (input[0] == type) {
+            *value = input + 1;
+            script_position++;
+        } else {
+            __sync_fetch_and_add(&script_divergences, 1);
+        }
+    }
+    return 1;
+}
+
+// Undo the escaping done by trace_input, in place
+static void unescape_trace_field(char *field) {
+    char *out = field;
+    for (char *c = field; *c; c++) {
+        if (*c == '\\' && c[1]) {
+            c++;
+            *out++ = *c == 't' ? '\t' : *c == 'n' ? '\n' : *c;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+}
+
+// Operations that touch files or replace the database are not replayed
+// (print_receipt can save receipt_N.txt)
+static int replayable_choice(int choice) {
+    return choice >= 1 && choice <= 13 && choice != 11;
+}
+
+// Parse a trace file into ops. Returns the number of ops loaded, -1 on error.
+static int load_trace(const char *path, TraceOp **ops_out, int *skipped_out) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    
+    TraceOp *ops = NULL;
+    int count = 0, capacity = 0, skipped = 0;
+    char line[sizeof(trace_line) + 2];
+    
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        
+        char *fields[512];
+        int field_count = 0;
+        char *save = NULL;
+        for (char *tok = strtok_r(line, "\t", &save); tok && field_count < 512;
+             tok = strtok_r(NULL, "\t", &save)) {
+            fields[field_count++] = tok;
+        }
+        
+        if (field_count < 2 || !replayable_choice(atoi(fields[1]))) {
+            skipped++;
+            continue;
+        }
+        
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            TraceOp *grown = realloc(ops, capacity * sizeof(TraceOp));
+            if (!grown) {
+                break;
+            }
+            ops = grown;
+        }
+        
+        TraceOp *op = &ops[count++];
+        op->offset = atof(fields[0]);
+        op->choice = atoi(fields[1]);
+        op->input_count = field_count - 2;
+        op->inputs = malloc((op->input_count ? op->input_count : 1) * sizeof(char*));
+        for (int i = 0; i < op->input_count; i++) {
+            unescape_trace_field(fields[i + 2]);
+            op->inputs[i] = strdup(fields[i + 2]);
+        }
+    }
+    
+    fclose(file);
+    *ops_out = ops;
+    *skipped_out = skipped;
+    return count;
+}
+
+static void free_trace(TraceOp *ops, int count) {
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < ops[i].input_count; j++) {
+            free(ops[i].inputs[j]);
+        }
+        free(ops[i].inputs);
+    }
+    free(ops);
+}
+
+// Counts errors reported through SQLite's error log (SQLITE_CONFIG_LOG)
+static void replay_error_log(void *arg, int code, const char *message) {
+    (void)arg;
+    (void)message;
+    switch (code & 0xff) {
+        case SQLITE_OK:
+        case SQLITE_NOTICE:
+        case SQLITE_WARNING:
+        case SQLITE_ROW:
+        case SQLITE_DONE:
+            break;
+        case SQLITE_BUSY:
+            __sync_fetch_and_add(&replay_busy_errors, 1);
+            break;
+        case SQLITE_LOCKED:
+            __sync_fetch_and_add(&replay_locked_errors, 1);
+            break;
+        default:
+            __sync_fetch_and_add(&replay_other_errors, 1);
+            break;
+    }
+}
+
+typedef struct {
+    double latency_ms;
+    int choice;
+} LatencySample;
 
-void backup_database() {
-    clear_screen();
-    print_header("BACKUP DATABASE");
-    
-    time_t t = time(NULL);
-    struct tm *tm = localtime(&t);
-    char backup_name[100];
-    strftime(backup_name, sizeof(backup_name), "backup_%Y%m%d_%H%M%S.db", tm);
-    
-    printf("Creating backup: %s\n", backup_name);
-    
-    sqlite3 *backup_db;
-    sqlite3_backup *backup;
-    
-    int rc = sqlite3_open(backup_name, &backup_db);
-    if (rc != SQLITE_OK) {
-        printf("Cannot create backup file: %s\n", sqlite3_errmsg(backup_db));
-        sqlite3_close(backup_db);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+typedef struct {
+    const TraceOp *ops;
+    int op_count;
+    long long total_ops;
+    double rate;
+    double start;
+    double deadline;        // 0 = no time limit
+    long long next_op;      // shared ticket counter
+} ReplayPlan;
+
+typedef struct {
+    ReplayPlan *plan;
+    LatencySample *samples;
+    long long sample_count;
+    long long sample_capacity;
+    int open_failed;
+} ReplayWorker;
+
+static void sleep_until(double when) {
+    double delay = when - now_seconds();
+    if (delay > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)delay;
+        ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
     }
-    
-    backup = sqlite3_backup_init(backup_db, "main", db, "main");
-    if (backup) {
-        sqlite3_backup_step(backup, -1);
-        sqlite3_backup_finish(backup);
+}
+
+// Worker loop: claim the next op ticket, wait for its scheduled start
+// (open-loop pacing), run it through the menu dispatcher and record the
+// latency measured from the scheduled start so queueing delay is included.
+static void *replay_worker(void *arg) {
+    ReplayWorker *worker = arg;
+    ReplayPlan *plan = worker->plan;
+    
+    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
+        worker->open_failed = 1;
+        sqlite3_close(db);
+        db = NULL;
+        return NULL;
     }
+    memory_budget_connection(db);
+    sqlite3_busy_timeout(db, 5000);
+    sqlite3_exec(db, "PRAGMA foreign_keys = ON;", 0, 0, 0);
     
-    rc = sqlite3_errcode(backup_db);
-    sqlite3_close(backup_db);
-    
-    if (rc == SQLITE_OK) {
-        printf("\n✅ Database backed up successfully!\n");
-        
-        // Create backups directory
-        system("mkdir -p backups 2>/dev/null");
+    while (1) {
+        long long ticket = __sync_fetch_and_add(&plan->next_op, 1);
+        if (ticket >= plan->total_ops) {
+            break;
+        }
         
-        // Move to backups
-        char command[200];
-        snprintf(command, sizeof(command), "mv %s backups/ 2>/dev/null", backup_name);
-        system(command);
+        double scheduled = plan->rate > 0 ? plan->start + ticket / plan->rate : now_seconds();
+        if (plan->deadline > 0 && scheduled > plan->deadline) {
+            break;
+        }
+        sleep_until(scheduled);
         
-        printf("Backup saved in: backups/%s\n", backup_name);
+        const TraceOp *op = &plan->ops[ticket % plan->op_count];
+        script_op = op;
+        script_position = 0;
+        dispatch_menu_choice(op->choice);
+        script_op = NULL;
         
-        // List recent backups
-        printf("\nRecent backups:\n");
-        system("ls -la backups/*.db 2>/dev/null | tail -5");
-    } else {
-        printf("\n❌ Backup failed: %s\n", sqlite3_errstr(rc));
+        if (worker->sample_count == worker->sample_capacity) {
+            long long capacity = worker->sample_capacity ? worker->sample_capacity * 2 : 1024;
+            LatencySample *grown = realloc(worker->samples, capacity * sizeof(LatencySample));
+            if (!grown) {
+                break;
+            }
+            worker->samples = grown;
+            worker->sample_capacity = capacity;
+        }
+        worker->samples[worker->sample_count].latency_ms = (now_seconds() - scheduled) * 1000.0;
+        worker->samples[worker->sample_count].choice = op->choice;
+        worker->sample_count++;
     }
     
-    printf("\nPress Enter to continue...");
-    getchar();
+    sqlite3_close(db);
+    db = NULL;
+    return NULL;
 }
 
-void restore_database() {
-    clear_screen();
-    print_header("RESTORE DATABASE");
-    
-    printf("WARNING: This will overwrite current database!\n");
-    printf("Available backups:\n");
-    system("ls -la backups/*.db 2>/dev/null || echo 'No backup files found'");
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile of an ascending array (nearest rank)
+static double percentile(const double *sorted, long long count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    long long rank = (long long)(p / 100.0 * count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+// Replay a recorded trace against db_path from several threads. With a
+// positive rate, ops are scheduled open-loop at that many ops/sec in total;
+// otherwise every thread runs back to back.
+int run_replay(const char *trace_path, int threads, double rate, long long total_ops, double duration) {
+    TraceOp *ops = NULL;
+    int skipped = 0;
+    int op_count = load_trace(trace_path, &ops, &skipped);
+    
+    if (op_count <= 0) {
+        printf("No replayable operations in trace: %s\n", trace_path);
+        free_trace(ops, op_count > 0 ? op_count : 0);
+        return 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (total_ops <= 0) {
+        total_ops = duration > 0 ? 0x7fffffffffffffffLL : op_count;
+    }
     
-    char backup_name[100];
-    printf("\nEnter backup filename (from backups/ directory): ");
-    fgets(backup_name, sizeof(backup_name), stdin);
-    backup_name[strcspn(backup_name, "\n")] = 0;
+    // Must be configured before SQLite initializes
+    sqlite3_config(SQLITE_CONFIG_LOG, replay_error_log, NULL);
+    memory_budget_apply();
     
-    if (strlen(backup_name) == 0) {
-        printf("No backup file specified.\n");
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    // Create the schema and load the catalog once; workers share it read-only
+    init_database();
+    charge_master_frozen = 1;
+    
+    printf("Replaying %d operations from %s (%d not replayable)\n", op_count, trace_path, skipped);
+    printf("Threads: %d | Target rate: %s | Database: %s\n", threads,
+           rate > 0 ? "paced" : "unthrottled", db_path);
+    fflush(stdout);
+    
+    // The menu functions render to stdout and pause on stdin; point both at
+    // /dev/null for the run so only the database work and rendering cost remain
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stdin = dup(STDIN_FILENO);
+    int null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDIN_FILENO);
+    
+    ReplayPlan plan;
+    plan.ops = ops;
+    plan.op_count = op_count;
+    plan.total_ops = total_ops;
+    plan.rate = rate;
+    plan.start = now_seconds();
+    plan.deadline = duration > 0 ? plan.start + duration : 0;
+    plan.next_op = 0;
+    
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    ReplayWorker *workers = calloc(threads, sizeof(ReplayWorker));
+    int started = 0;
+    for (int i = 0; tids && workers && i < threads; i++) {
+        workers[i].plan = &plan;
+        if (pthread_create(&tids[i], NULL, replay_worker, &workers[i]) != 0) {
+            break;
+        }
+        started++;
     }
-    
-    // Check if file exists
-    char full_path[200];
-    snprintf(full_path, sizeof(full_path), "backups/%s", backup_name);
-    FILE *file = fopen(full_path, "rb");
-    if (!file) {
-        printf("Backup file '%s' not found!\n", backup_name);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    // Only the workers that started have results
+    threads = started;
+    double elapsed = now_seconds() - plan.start;
+    
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stdin, STDIN_FILENO);
+    close(saved_stdout);
+    close(saved_stdin);
+    close(null_fd);
+    clearerr(stdin);
+    
+    // Merge samples from all workers
+    long long completed = 0;
+    int open_failures = 0;
+    for (int i = 0; i < threads; i++) {
+        completed += workers[i].sample_count;
+        open_failures += workers[i].open_failed;
     }
-    fclose(file);
     
-    printf("Are you sure you want to restore from '%s'? (y/n): ", backup_name);
+    double *latencies = malloc((completed ? completed : 1) * sizeof(double));
     
-    char confirm;
-    scanf(" %c", &confirm);
-    getchar();
+    print_header("REPLAY REPORT");
+    printf("Completed ops:     %lld in %.2f s\n", completed, elapsed);
+    printf("Throughput:        %.1f ops/sec", elapsed > 0 ? completed / elapsed : 0);
+    if (rate > 0) {
+        printf(" (target %.1f)", rate);
+    }
+    printf("\n");
     
-    if (confirm != 'y' && confirm != 'Y') {
-        printf("Restore cancelled.\n");
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    printf("\nLatency from scheduled start (ms):\n");
+    printf("Operation              Count      p50      p90      p99    p99.9      max\n");
+    printf("════════════════════════════════════════════════════════════════════════\n");
+    
+    for (int choice = 0; choice <= MENU_MAX_CHOICE; choice++) {
+        long long n = 0;
+        for (int i = 0; i < threads; i++) {
+            for (long long j = 0; j < workers[i].sample_count; j++) {
+                if (choice == 0 || workers[i].samples[j].choice == choice) {
+                    latencies[n++] = workers[i].samples[j].latency_ms;
+                }
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        qsort(latencies, n, sizeof(double), compare_doubles);
+        printf("%-20s %7lld %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+               choice == 0 ? "ALL" : replay_op_names[choice], n,
+               percentile(latencies, n, 50), percentile(latencies, n, 90),
+               percentile(latencies, n, 99), percentile(latencies, n, 99.9),
+               latencies[n - 1]);
     }
     
-    // Close current database
-    sqlite3_close(db);
+    printf("\nSQLite errors:     busy=%lld locked=%lld other=%lld\n",
+           replay_busy_errors, replay_locked_errors, replay_other_errors);
+    if (script_divergences > 0) {
+        printf("Trace divergences: %lld (inputs that no longer matched the prompts)\n",
+               script_divergences);
+    }
+    if (open_failures > 0) {
+        printf("Workers that could not open the database: %d\n", open_failures);
+    }
     
-    // Copy backup file
-    char command[200];
-    snprintf(command, sizeof(command), "cp \"backups/%s\" hospital.db", backup_name);
-    int result = system(command);
+    free(latencies);
+    for (int i = 0; i < threads; i++) {
+        free(workers[i].samples);
+    }
+    free(workers);
+    free(tids);
+    free_trace(ops, op_count);
+    close_database();
     
-    if (result != 0) {
-        printf("Failed to restore database!\n");
-        exit(1);
+    return open_failures == threads ? 1 : 0;
+}
+
+// ==================== STRESS TESTING ====================
+
+// Latency histogram with log-spaced buckets (about 5% wide) so hours of
+// samples fit in a fixed amount of memory
+#define LATENCY_BUCKETS 420
+#define LATENCY_SCALE 20.0
+
+typedef struct {
+    long long buckets[LATENCY_BUCKETS];
+    long long count;
+    double max_ms;
+} LatencyHistogram;
+
+static void histogram_add(LatencyHistogram *h, double ms) {
+    int bucket = (int)(log(ms * 1000.0 + 1.0) * LATENCY_SCALE);
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    if (bucket < 0) bucket = 0;
+    h->buckets[bucket]++;
+    h->count++;
+    if (ms > h->max_ms) h->max_ms = ms;
+}
+
+static void histogram_merge(LatencyHistogram *into, const LatencyHistogram *from) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if (from->max_ms > into->max_ms) into->max_ms = from->max_ms;
+}
+
+// Upper bound of the bucket holding the p-th percentile, in ms
+static double histogram_percentile(const LatencyHistogram *h, double p) {
+    if (h->count == 0) {
+        return 0;
+    }
+    long long rank = (long long)(p / 100.0 * h->count + 0.5);
+    long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank && h->buckets[i] > 0) {
+            double upper = (exp((i + 1) / LATENCY_SCALE) - 1.0) / 1000.0;
+            return upper < h->max_ms ? upper : h->max_ms;
+        }
+    }
+    return h->max_ms;
+}
+
+enum { STRESS_BILL, STRESS_PAYMENT, STRESS_DELETE, STRESS_ADD_PATIENT, STRESS_OP_COUNT };
+static const char *stress_op_names[STRESS_OP_COUNT] = {
+    "generate_bill", "make_payment", "delete_patient", "add_patient"
+};
+
+typedef struct {
+    long long ops[STRESS_OP_COUNT];
+    long long busy;         // SQLITE_BUSY ("database is locked")
+    long long locked;       // SQLITE_LOCKED (shared-cache/table locks)
+    long long other;        // any other error
+    long long rejected;     // payment refused because the balance moved
+    LatencyHistogram latency;
+} StressStats;
+
+typedef struct {
+    unsigned int seed;
+    int busy_timeout;
+    int *stop;              // set atomically by run_stress
+    pthread_mutex_t lock;   // guards interval, read and reset by the reporter
+    StressStats interval;
+    int open_failed;
+} StressWorker;
+
+static void stress_stats_merge(StressStats *into, const StressStats *from) {
+    for (int i = 0; i < STRESS_OP_COUNT; i++) {
+        into->ops[i] += from->ops[i];
+    }
+    into->busy += from->busy;
+    into->locked += from->locked;
+    into->other += from->other;
+    into->rejected += from->rejected;
+    histogram_merge(&into->latency, &from->latency);
+}
+
+// Highest rowid in a table, used to draw random ids
+static long long stress_max_id(sqlite3 *conn, const char *sql) {
+    sqlite3_stmt *stmt;
+    long long max_id = 0;
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            max_id = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return max_id;
+}
+
+static long long stress_random_id(unsigned int *seed, long long max_id) {
+    if (max_id <= 0) {
+        return 1;
     }
+    long long r = ((long long)rand_r(seed) << 16) ^ rand_r(seed);
+    return 1 + r % max_id;
+}
+
+// Bill a random existing patient for a random set of charge lines, paying
+// nothing, everything or part of it up front like the cashier screen does
+static int stress_generate_bill(sqlite3 *conn, unsigned int *seed) {
+    long long target = stress_random_id(seed, stress_max_id(conn, "SELECT MAX(id) FROM patients"));
+    const char *sql = "SELECT id, name FROM patients WHERE id >= ? ORDER BY id LIMIT 1";
+    sqlite3_stmt *stmt;
     
-    // Reopen database
-    int rc = sqlite3_open("hospital.db", &db);
+    int rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
     if (rc != SQLITE_OK) {
-        printf("Failed to restore database: %s\n", sqlite3_errmsg(db));
-        exit(1);
+        return rc;
+    }
+    sqlite3_bind_int64(stmt, 1, target);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        sqlite3_finalize(stmt);
+        return rc == SQLITE_DONE ? SQLITE_NOTFOUND : rc;
     }
+    long long patient_id = sqlite3_column_int64(stmt, 0);
+    char patient_name[100];
+    snprintf(patient_name, sizeof(patient_name), "%s", (const char*)sqlite3_column_text(stmt, 1));
+    sqlite3_finalize(stmt);
     
-    // Set UTF-8 encoding for restored database
-    sqlite3_exec(db, "PRAGMA encoding = 'UTF-8';", 0, 0, 0);
-    sqlite3_exec(db, "PRAGMA foreign_keys = ON;", 0, 0, 0);
+    BillItemList items;
+    bill_items_init(&items);
+    int lines = 1 + rand_r(seed) % 20;
+    for (int i = 0; i < lines; i++) {
+        BillItem item;
+        memset(&item, 0, sizeof(item));
+        snprintf(item.code, sizeof(item.code), "STRESS%03d", rand_r(seed) % 500);
+        snprintf(item.description, sizeof(item.description), "Stress line %d", i + 1);
+        item.category = rand_r(seed) % CATEGORY_COUNT;
+        item.quantity = 1 + rand_r(seed) % 5;
+        item.unit_price = (rand_r(seed) % 50000) / 100.0;
+        bill_items_add(&items, &item);
+    }
     
-    printf("✅ Database restored successfully from: %s\n", backup_name);
+    double total = bill_items_total(&items, NULL);
+    double paid = 0;
+    const char *status = "Pending";
+    switch (rand_r(seed) % 3) {
+        case 0: paid = total; status = "Paid"; break;
+        case 1: paid = floor(total * (rand_r(seed) % 90 + 5)) / 100.0; status = "Partial"; break;
+    }
     
-    printf("\nPress Enter to continue...");
-    getchar();
+    long long bill_no;
+    rc = db_create_bill(conn, patient_id, patient_name, &items, paid, status, "Cash", &bill_no);
+    bill_items_free(&items);
+    return rc;
 }
 
-void export_data() {
-    clear_screen();
-    print_header("EXPORT DATA");
-    
-    printf("Select data to export:\n");
-    printf("1. Patients (CSV)\n");
-    printf("2. Bills (CSV)\n");
-    printf("3. Payments (CSV)\n");
-    printf("Enter choice: ");
-    
-    int choice = get_choice(1, 3);
-    
-    char *filename;
-    char *table_name;
+// Pay part or all of the balance of a random open bill. The balance is read
+// first and the payment posted afterwards, the same read-then-write window
+// the interactive make_payment screen has.
+static int stress_make_payment(sqlite3 *conn, unsigned int *seed) {
+    long long target = stress_random_id(seed, stress_max_id(conn, "SELECT MAX(bill_no) FROM bills"));
+    const char *sql = "SELECT bill_no, balance_due FROM bills WHERE bill_no >= ? AND balance_due > 0 "
+                      "ORDER BY bill_no LIMIT 1";
+    sqlite3_stmt *stmt;
     
-    switch(choice) {
-        case 1:
-            filename = "patients.csv";
-            table_name = "patients";
-            break;
-        case 2:
-            filename = "bills.csv";
-            table_name = "bills";
-            break;
-        case 3:
-            filename = "payments.csv";
-            table_name = "payments";
-            break;
-        default:
-            return;
+    int rc = sqlite3_prepare_v2(conn, sql, -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    sqlite3_bind_int64(stmt, 1, target);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        sqlite3_finalize(stmt);
+        return rc == SQLITE_DONE ? SQLITE_NOTFOUND : rc;
     }
+    long long bill_no = sqlite3_column_int64(stmt, 0);
+    double balance = sqlite3_column_double(stmt, 1);
+    sqlite3_finalize(stmt);
     
-    // Create CSV file with UTF-8 encoding
-    FILE *csv_file = fopen(filename, "w");
-    if (!csv_file) {
-        printf("❌ Error creating file: %s\n", filename);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    double amount = rand_r(seed) % 2 ? balance : floor(balance * (rand_r(seed) % 90 + 10)) / 100.0;
+    if (amount < 0.01) {
+        amount = balance;
+    }
+    return db_post_payment(conn, bill_no, amount, rand_r(seed) % 2 ? "Cash" : "Credit Card");
+}
+
+static int stress_delete_patient(sqlite3 *conn, unsigned int *seed) {
+    long long max_id = stress_max_id(conn, "SELECT MAX(id) FROM patients");
+    return db_delete_patient(conn, stress_random_id(seed, max_id));
+}
+
+static int stress_add_patient(sqlite3 *conn, unsigned int *seed) {
+    char name[40];
+    long long patient_id;
+    snprintf(name, sizeof(name), "Stress Patient %d", rand_r(seed) % 100000);
+    return db_add_patient(conn, name, 1 + rand_r(seed) % 99, rand_r(seed) % 2 ? "M" : "F",
+                          "0000000000", "Stress Ward", "Load test", today_julian_day(), &patient_id);
+}
+
+static void *stress_worker(void *arg) {
+    StressWorker *worker = arg;
+    sqlite3 *conn;
+    
+    if (sqlite3_open(db_path, &conn) != SQLITE_OK) {
+        worker->open_failed = 1;
+        sqlite3_close(conn);
+        return NULL;
     }
+    memory_budget_connection(conn);
+    if (worker->busy_timeout > 0) {
+        sqlite3_busy_timeout(conn, worker->busy_timeout);
+    }
+    sqlite3_exec(conn, "PRAGMA foreign_keys = ON;", 0, 0, 0);
     
-    // Add UTF-8 BOM for Excel compatibility
-    unsigned char bom[] = {0xEF, 0xBB, 0xBF};
-    fwrite(bom, 1, 3, csv_file);
+    while (!__atomic_load_n(worker->stop, __ATOMIC_RELAXED)) {
+        // Mix: 45% bills, 45% payments, 5% new patients, 5% deletions
+        int roll = rand_r(&worker->seed) % 100;
+        int op = roll < 45 ? STRESS_BILL : roll < 90 ? STRESS_PAYMENT :
+                 roll < 95 ? STRESS_ADD_PATIENT : STRESS_DELETE;
+        
+        double start = now_seconds();
+        int rc;
+        switch (op) {
+            case STRESS_BILL:    rc = stress_generate_bill(conn, &worker->seed); break;
+            case STRESS_PAYMENT: rc = stress_make_payment(conn, &worker->seed); break;
+            case STRESS_DELETE:  rc = stress_delete_patient(conn, &worker->seed); break;
+            default:             rc = stress_add_patient(conn, &worker->seed); break;
+        }
+        double ms = (now_seconds() - start) * 1000.0;
+        
+        pthread_mutex_lock(&worker->lock);
+        StressStats *stats = &worker->interval;
+        stats->ops[op]++;
+        switch (rc & 0xff) {
+            case SQLITE_OK:       break;
+            case SQLITE_NOTFOUND: stats->rejected++; break;
+            case SQLITE_BUSY:     stats->busy++; break;
+            case SQLITE_LOCKED:   stats->locked++; break;
+            default:              stats->other++; break;
+        }
+        histogram_add(&stats->latency, ms);
+        pthread_mutex_unlock(&worker->lock);
+    }
     
-    // Get data from database
-    char sql[200];
-    snprintf(sql, sizeof(sql), "SELECT * FROM %s", table_name);
+    sqlite3_close(conn);
+    return NULL;
+}
+
+// Check the ledger invariants over the whole database:
+//   - balance_due == total_amount - SUM(payments) and amount_paid == SUM(payments)
+//   - payment_status is 'Paid' exactly when nothing is left to pay
+//   - total_amount matches the charge lines for itemized bills
+//   - no payments or bills left behind by a deleted parent
+// Prints up to max_examples offending rows per check and returns the total
+// number of violations.
+long long check_ledger_invariants(sqlite3 *conn, int max_examples) {
+    static const struct {
+        const char *name;
+        const char *sql;
+    } checks[] = {
+        {"balance/payments mismatch",
+         "SELECT b.bill_no, 'total=' || b.total_amount || ' paid=' || b.amount_paid || "
+         "' balance=' || b.balance_due || ' payments=' || COALESCE(p.paid, 0) "
+         "FROM bills b LEFT JOIN (SELECT bill_no, SUM(amount) AS paid FROM payments "
+         "GROUP BY bill_no) p ON p.bill_no = b.bill_no "
+         "WHERE ABS(b.balance_due - (b.total_amount - COALESCE(p.paid, 0))) > 0.005 "
+         "   OR ABS(b.amount_paid - COALESCE(p.paid, 0)) > 0.005"},
+        {"status does not match balance",
+         "SELECT bill_no, 'status=' || COALESCE(payment_status, 'NULL') || ' balance=' || balance_due "
+         "FROM bills WHERE (balance_due <= 0.005) != (COALESCE(payment_status, '') = 'Paid')"},
+        {"total does not match charge lines",
+         "SELECT b.bill_no, 'total=' || b.total_amount || ' lines=' || i.line_sum "
+         "FROM bills b JOIN (SELECT bill_no, SUM(line_total) AS line_sum FROM bill_items "
+         "GROUP BY bill_no) i ON i.bill_no = b.bill_no "
+         "WHERE ABS(b.total_amount - i.line_sum) > 0.005"},
+        {"payment without bill",
+         "SELECT p.payment_id, 'bill_no=' || p.bill_no FROM payments p "
+         "WHERE NOT EXISTS (SELECT 1 FROM bills b WHERE b.bill_no = p.bill_no)"},
+        {"bill without patient",
+         "SELECT b.bill_no, 'patient_id=' || b.patient_id FROM bills b "
+         "WHERE NOT EXISTS (SELECT 1 FROM patients p WHERE p.id = b.patient_id)"},
+    };
+    
+    long long total = 0;
+    for (size_t c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(conn, checks[c].sql, -1, &stmt, 0) != SQLITE_OK) {
+            printf("  %-34s check failed: %s\n", checks[c].name, sqlite3_errmsg(conn));
+            total++;
+            continue;
+        }
+        
+        long long violations = 0;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (violations < max_examples) {
+                printf("    #%lld %s\n", sqlite3_column_int64(stmt, 0),
+                       (const char*)sqlite3_column_text(stmt, 1));
+            }
+            violations++;
+        }
+        sqlite3_finalize(stmt);
+        
+        printf("  %-34s %lld\n", checks[c].name, violations);
+        total += violations;
+    }
+    return total;
+}
+
+static void print_stress_row(const char *label, const StressStats *stats, double seconds) {
+    long long ops = 0;
+    for (int i = 0; i < STRESS_OP_COUNT; i++) {
+        ops += stats->ops[i];
+    }
+    long long errors = stats->busy + stats->locked + stats->other;
+    
+    printf("%-8s %9lld %8.1f %7lld %6lld %6lld %6.2f%% %8.2f %8.2f %8.2f\n",
+           label, ops, seconds > 0 ? ops / seconds : 0,
+           stats->busy, stats->locked, stats->other,
+           ops > 0 ? 100.0 * errors / ops : 0,
+           histogram_percentile(&stats->latency, 50),
+           histogram_percentile(&stats->latency, 99),
+           stats->latency.max_ms);
+}
+
+// Run concurrent writers against db_path for the given duration, printing
+// throughput, error rates and latency every interval seconds, then verify
+// the ledger invariants. Returns non-zero if any invariant is violated.
+int run_stress(int threads, double duration, double interval, int patients, int busy_timeout) {
+    if (threads < 1) threads = 1;
+    if (interval <= 0) interval = 10;
     
-    sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    init_database();
     
-    if (rc != SQLITE_OK) {
-        printf("❌ Error exporting data: %s\n", sqlite3_errmsg(db));
-        fclose(csv_file);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
+    // Seed enough patients for the workers to bill
+    long long existing = stress_max_id(db, "SELECT COUNT(*) FROM patients");
+    if (existing < patients) {
+        unsigned int seed = 1;
+        sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+        for (long long i = existing; i < patients; i++) {
+            stress_add_patient(db, &seed);
+        }
+        sqlite3_exec(db, "COMMIT;", 0, 0, 0);
     }
     
-    // Write CSV header
-    int column_count = sqlite3_column_count(stmt);
-    for (int i = 0; i < column_count; i++) {
-        if (i > 0) fprintf(csv_file, ",");
-        fprintf(csv_file, "\"%s\"", sqlite3_column_name(stmt, i));
+    print_header("STRESS TEST");
+    printf("Database: %s | Clients: %d | Duration: %.0f s | Busy timeout: %d ms\n",
+           db_path, threads, duration, busy_timeout);
+    printf("Mix: 45%% generate_bill, 45%% make_payment, 5%% add_patient, 5%% delete_patient\n\n");
+    printf("Time(s)        Ops    Ops/s    Busy Locked  Other  Errors   p50 ms   p99 ms   max ms\n");
+    printf("══════════════════════════════════════════════════════════════════════════════════════\n");
+    fflush(stdout);
+    
+    int stop = 0;
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    StressWorker *workers = calloc(threads, sizeof(StressWorker));
+    int started = 0;
+    for (int i = 0; tids && workers && i < threads; i++) {
+        workers[i].seed = (unsigned int)time(NULL) ^ (i * 2654435761u);
+        workers[i].busy_timeout = busy_timeout;
+        workers[i].stop = &stop;
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if (pthread_create(&tids[i], NULL, stress_worker, &workers[i]) != 0) {
+            pthread_mutex_destroy(&workers[i].lock);
+            break;
+        }
+        started++;
+    }
+    if (started < threads) {
+        printf("Only %d of %d clients could be started.\n", started, threads);
+        if (started == 0) {
+            free(workers);
+            free(tids);
+            close_database();
+            return 1;
+        }
+        threads = started;
     }
-    fprintf(csv_file, "\n");
     
-    // Write data rows
-    int row_count = 0;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        for (int i = 0; i < column_count; i++) {
-            if (i > 0) fprintf(csv_file, ",");
-            
-            const unsigned char *text = sqlite3_column_text(stmt, i);
-            if (text && sqlite3_column_type(stmt, i) != SQLITE_NULL) {
-                // Escape quotes in CSV
-                fprintf(csv_file, "\"");
-                for (const unsigned char *c = text; *c; c++) {
-                    if (*c == '"') fprintf(csv_file, "\"\"");
-                    else if (*c == '\n' || *c == '\r') fprintf(csv_file, " ");
-                    else fprintf(csv_file, "%c", *c);
-                }
-                fprintf(csv_file, "\"");
-            } else {
-                fprintf(csv_file, "\"\"");
-            }
+    StressStats totals;
+    memset(&totals, 0, sizeof(totals));
+    double start = now_seconds();
+    double next_report = start + interval;
+    double end = start + duration;
+    
+    while (1) {
+        double now = now_seconds();
+        double wake = next_report < end ? next_report : end;
+        sleep_until(wake);
+        now = now_seconds();
+        
+        StressStats window;
+        memset(&window, 0, sizeof(window));
+        for (int i = 0; i < threads; i++) {
+            pthread_mutex_lock(&workers[i].lock);
+            stress_stats_merge(&window, &workers[i].interval);
+            memset(&workers[i].interval, 0, sizeof(StressStats));
+            pthread_mutex_unlock(&workers[i].lock);
+        }
+        stress_stats_merge(&totals, &window);
+        
+        char label[20];
+        snprintf(label, sizeof(label), "%.0f", now - start);
+        print_stress_row(label, &window, now - (next_report - interval));
+        fflush(stdout);
+        
+        if (now >= end) {
+            break;
         }
-        fprintf(csv_file, "\n");
-        row_count++;
+        next_report += interval;
     }
     
-    sqlite3_finalize(stmt);
-    fclose(csv_file);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    int open_failures = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        open_failures += workers[i].open_failed;
+        // Fold in anything finished after the last report
+        stress_stats_merge(&totals, &workers[i].interval);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    double elapsed = now_seconds() - start;
     
-    printf("✅ Exported %d rows to %s\n", row_count, filename);
-    printf("   File encoded in UTF-8 with BOM for Excel compatibility.\n");
+    printf("──────────────────────────────────────────────────────────────────────────────────────\n");
+    print_stress_row("TOTAL", &totals, elapsed);
     
-    printf("\nPress Enter to continue...");
-    getchar();
-}
\ No newline at end of file
+    printf("\nOperations:\n");
+    for (int i = 0; i < STRESS_OP_COUNT; i++) {
+        printf("  %-16s %lld\n", stress_op_names[i], totals.ops[i]);
+    }
+    printf("  Payments rejected (balance changed concurrently): %lld\n", totals.rejected);
+    if (open_failures > 0) {
+        printf("  Clients that could not open the database: %d\n", open_failures);
+    }
+    
+    printf("\nLedger invariants:\n");
+    long long violations = check_ledger_invariants(db, 5);
+    printf("\n%s\n", violations == 0 ? "✅ All invariants hold." : "❌ Invariant violations found!");
+    
+    free(workers);
+    free(tids);
+    close_database();
+    return violations == 0 ? 0 : 1;
+}